@@ -9,10 +9,18 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
-    | CELL  # Cell
+    | FUNCTION '(' (arg (',' arg)*)? ')'  # Function
+    | SHEET? (CELL | REF)  # Cell
     | NUMBER  # Literal
     ;
 
+// ranges are only allowed as function arguments; an argument which is
+// only #REF! matches both alternatives and is taken as a deleted range
+arg
+    : SHEET? (CELL ':' CELL | REF)  # Range
+    | expr  # Argument
+    ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -27,4 +35,11 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+// a reference to deleted cells, as such references are printed
+REF: '#REF!' ;
+// the sheet of a reference to another sheet: Sheet1!A1, 'Other sheet'!A1,
+// with the quotes in a quoted name doubled
+SHEET: ([A-Za-z_] [A-Za-z0-9_.]* | '\'' ('\'\'' | ~'\'')+ '\'') '!' ;
+// a name without digits; names are checked when building the AST
+FUNCTION: [A-Z]+ ;
 WS: [ \t\n\r]+ -> skip ;
@@ -3,12 +3,26 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "formula_jit.h"
+#include "memory_usage.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <climits>
 #include <cmath>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+using namespace std::literals;
 
 namespace ASTImpl {
 
@@ -70,31 +84,73 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
 class Expr {
 public:
     virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(std::function<double(const Position*)> solver) const = 0;
 
-    // higher is tighter
-    virtual ExprPrecedence GetPrecedence() const = 0;
+    // appends the instructions computing this expression to the program
+    virtual void Compile(Program& program) const = 0;
+
+    // appends the instructions adding this expression as an argument to the
+    // accumulator of the enclosing function call
+    virtual void CompileArgument(Program& program) const {
+        Compile(program);
+        Instruction instruction;
+        instruction.op = Instruction::OpCode::Accumulate;
+        program.push_back(instruction);
+    }
+};
+
+namespace {
+
+constexpr std::pair<std::string_view, AggregateFunction> FUNCTIONS[] = {
+    {"SUM"sv, AggregateFunction::Sum},
+    {"AVERAGE"sv, AggregateFunction::Average},
+    {"MIN"sv, AggregateFunction::Min},
+    {"MAX"sv, AggregateFunction::Max},
+    {"COUNT"sv, AggregateFunction::Count},
+};
+
+Position Translate(Position offset, Position origin) {
+    return {offset.row + origin.row, offset.col + origin.col};
+}
+
+Range Translate(Range offset, Position origin) {
+    return {Translate(offset.first, origin), Translate(offset.last, origin)};
+}
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                      bool right_child = false) const {
-        auto precedence = GetPrecedence();
-        auto mask = right_child ? PR_RIGHT : PR_LEFT;
-        bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-        if (parens_needed) {
-            out << '(';
+std::string_view GetFunctionName(AggregateFunction function) {
+    for (const auto& [name, f] : FUNCTIONS) {
+        if (f == function) {
+            return name;
         }
+    }
+    assert(false);
+    return {};
+}
+
+bool IsSheetNameStart(char c) {
+    return ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || c == '_';
+}
 
-        DoPrintFormula(out, precedence);
+bool IsSheetNameChar(char c) {
+    return IsSheetNameStart(c) || ('0' <= c && c <= '9') || c == '.';
+}
 
-        if (parens_needed) {
-            out << ')';
+// the name of the sheet in a SHEET token, which ends with '!'
+std::string ParseSheetName(std::string_view token) {
+    assert(!token.empty() && token.back() == '!');
+    token.remove_suffix(1);
+    if (token.empty() || token.front() != '\'') {
+        return std::string(token);
+    }
+    std::string name;
+    for (std::size_t i = 1; i + 1 < token.size(); ++i) {
+        name += token[i];
+        if (token[i] == '\'') {
+            ++i;  // the second quote of a doubled one
         }
     }
-};
+    return name;
+}
 
-namespace {
 class BinaryOpExpr final : public Expr {
 public:
     enum Type : char {
@@ -111,54 +167,12 @@ public:
         , rhs_(std::move(rhs)) {
     }
 
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
-        out << ' ';
-        rhs_->Print(out);
-        out << ')';
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-    }
-
-    ExprPrecedence GetPrecedence() const override {
-        switch (type_) {
-        case Add:
-            return EP_ADD;
-        case Subtract:
-            return EP_SUB;
-        case Multiply:
-            return EP_MUL;
-        case Divide:
-            return EP_DIV;
-        default:
-            // have to do this because VC++ has a buggy warning
-            assert(false);
-            return static_cast<ExprPrecedence>(INT_MAX);
-        }
-    }
-
-    double Evaluate(std::function<double(const Position*)> solver) const override {
-        // Скопируйте ваше решение из предыдущих уроков.
-        const auto lhs_eval = lhs_->Evaluate(solver);
-        const auto rhs_eval = rhs_->Evaluate(solver);
-        switch (type_) {
-        case Add:
-            return lhs_eval + rhs_eval;
-        case Subtract:
-            return lhs_eval - rhs_eval;
-        case Multiply:
-            return lhs_eval * rhs_eval;
-        case Divide:
-            return lhs_eval / rhs_eval;
-        default:
-            assert(false);
-            return {};
-        }
+    void Compile(Program& program) const override {
+        lhs_->Compile(program);
+        rhs_->Compile(program);
+        Instruction instruction;
+        instruction.op = static_cast<Instruction::OpCode>(type_);
+        program.push_back(instruction);
     }
 
 private:
@@ -180,68 +194,87 @@ public:
         , operand_(std::move(operand)) {
     }
 
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
-        out << ')';
+    void Compile(Program& program) const override {
+        operand_->Compile(program);
+        Instruction instruction;
+        instruction.op = type_ == UnaryPlus ? Instruction::OpCode::UnaryPlus
+                                            : Instruction::OpCode::UnaryMinus;
+        program.push_back(instruction);
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
-    }
+private:
+    Type type_;
+    std::unique_ptr<Expr> operand_;
+};
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_UNARY;
+// an external cell is indexed in the references to other sheets
+class CellExpr final : public Expr {
+public:
+    explicit CellExpr(std::uint32_t index, bool external = false)
+        : index_(index)
+        , external_(external) {
     }
 
-    double Evaluate(std::function<double(const Position*)> solver) const override {
-        // Скопируйте ваше решение из предыдущих уроков.
-        switch (type_) {
-        case UnaryPlus:
-            return +operand_->Evaluate(solver);
-        case UnaryMinus:
-            return -operand_->Evaluate(solver);
-        default:
-            assert(false);
-            return {};
-        }
+    void Compile(Program& program) const override {
+        Instruction instruction;
+        instruction.op = external_ ? Instruction::OpCode::LoadExternalCell : Instruction::OpCode::LoadCell;
+        instruction.index = index_;
+        program.push_back(instruction);
     }
 
 private:
-    Type type_;
-    std::unique_ptr<Expr> operand_;
+    std::uint32_t index_;
+    bool external_;
 };
 
-class CellExpr final : public Expr {
+// A range can only be a function argument: it is added to the accumulator
+// of the call as a whole.
+class RangeExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* cell)
-        : cell_(cell) {
+    explicit RangeExpr(std::uint32_t index, bool external = false)
+        : index_(index)
+        , external_(external) {
     }
 
-    void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
-        } else {
-            out << cell_->ToString();
-        }
+    void Compile(Program& program) const override {
+        Instruction instruction;
+        instruction.op = external_ ? Instruction::OpCode::AccumulateExternalRange
+                                   : Instruction::OpCode::AccumulateRange;
+        instruction.index = index_;
+        program.push_back(instruction);
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    void CompileArgument(Program& program) const override {
+        Compile(program);
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+private:
+    std::uint32_t index_;
+    bool external_;
+};
+
+class FunctionExpr final : public Expr {
+public:
+    explicit FunctionExpr(AggregateFunction function, std::vector<std::unique_ptr<Expr>> args)
+        : function_(function)
+        , args_(std::move(args)) {
     }
 
-    double Evaluate(std::function<double(const Position*)> solver) const override {
-        // реализуйте метод.
-        return solver(cell_);
+    void Compile(Program& program) const override {
+        Instruction instruction;
+        instruction.op = Instruction::OpCode::BeginAggregate;
+        instruction.function = function_;
+        program.push_back(instruction);
+        for (const auto& arg : args_) {
+            arg->CompileArgument(program);
+        }
+        instruction.op = Instruction::OpCode::EndAggregate;
+        program.push_back(instruction);
     }
 
 private:
-    const Position* cell_;
+    AggregateFunction function_;
+    std::vector<std::unique_ptr<Expr>> args_;
 };
 
 class NumberExpr final : public Expr {
@@ -250,24 +283,208 @@ public:
         : value_(value) {
     }
 
-    void Print(std::ostream& out) const override {
-        out << value_;
+    void Compile(Program& program) const override {
+        Instruction instruction;
+        instruction.op = Instruction::OpCode::PushNumber;
+        instruction.number = value_;
+        program.push_back(instruction);
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
+private:
+    double value_;
+};
+
+// Decompiles a program back into text. The value stack holds the text of
+// every operand together with its precedence, which is all the expression
+// tree used to take into account when printing.
+class ProgramPrinter {
+public:
+    ProgramPrinter(const std::ostream& format, const std::vector<Position>& cells,
+                   const std::vector<Range>& ranges, const ExternalReferences& externals,
+                   Position origin)
+        : cells_(cells)
+        , ranges_(ranges)
+        , externals_(externals)
+        , origin_(origin) {
+        number_out_.copyfmt(format);
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+    // prints the formula as Lisp-like prefix expression, e.g. (+ A1 (* 2 B1))
+    std::string Print(const Program& program) {
+        for (const auto& instruction : program) {
+            switch (instruction.op) {
+            case Instruction::OpCode::PushNumber:
+            case Instruction::OpCode::LoadCell:
+            case Instruction::OpCode::AccumulateRange:
+            case Instruction::OpCode::LoadExternalCell:
+            case Instruction::OpCode::AccumulateExternalRange:
+                operands_.push_back({PrintAtom(instruction), EP_ATOM});
+                break;
+            case Instruction::OpCode::BeginAggregate:
+                calls_.push_back(operands_.size());
+                break;
+            case Instruction::OpCode::Accumulate:
+                break;
+            case Instruction::OpCode::EndAggregate: {
+                std::string text = "("s + std::string(GetFunctionName(instruction.function));
+                for (auto& arg : PopArguments()) {
+                    text += ' ' + arg.text;
+                }
+                operands_.push_back({text + ')', EP_ATOM});
+                break;
+            }
+            case Instruction::OpCode::UnaryPlus:
+            case Instruction::OpCode::UnaryMinus:
+                operands_.back().text = "("s + UnarySign(instruction.op) + ' ' + operands_.back().text + ')';
+                break;
+            default: {
+                auto rhs = Pop();
+                auto& lhs = operands_.back();
+                lhs.text = "("s + static_cast<char>(instruction.op) + ' ' + lhs.text + ' ' + rhs.text + ')';
+            }
+            }
+        }
+        return Pop().text;
     }
 
-    double Evaluate(std::function<double(const Position*)>) const override {
-        return value_;
+    // prints the formula in infix notation without redundant parentheses
+    std::string PrintFormula(const Program& program) {
+        for (const auto& instruction : program) {
+            switch (instruction.op) {
+            case Instruction::OpCode::PushNumber:
+            case Instruction::OpCode::LoadCell:
+            case Instruction::OpCode::AccumulateRange:
+            case Instruction::OpCode::LoadExternalCell:
+            case Instruction::OpCode::AccumulateExternalRange:
+                operands_.push_back({PrintAtom(instruction), EP_ATOM});
+                break;
+            case Instruction::OpCode::BeginAggregate:
+                calls_.push_back(operands_.size());
+                break;
+            case Instruction::OpCode::Accumulate:
+                break;
+            case Instruction::OpCode::EndAggregate: {
+                // arguments are complete expressions and need no parentheses
+                std::string text = std::string(GetFunctionName(instruction.function)) + '(';
+                bool first = true;
+                for (auto& arg : PopArguments()) {
+                    if (!first) {
+                        text += ',';
+                    }
+                    text += arg.text;
+                    first = false;
+                }
+                operands_.push_back({text + ')', EP_ATOM});
+                break;
+            }
+            case Instruction::OpCode::UnaryPlus:
+            case Instruction::OpCode::UnaryMinus: {
+                auto& operand = operands_.back();
+                operand.text = UnarySign(instruction.op) + Wrap(operand, EP_UNARY, PR_LEFT);
+                operand.precedence = EP_UNARY;
+                break;
+            }
+            default: {
+                auto rhs = Pop();
+                auto& lhs = operands_.back();
+                const auto precedence = GetPrecedence(instruction.op);
+                lhs.text = Wrap(lhs, precedence, PR_LEFT) + static_cast<char>(instruction.op) +
+                           Wrap(rhs, precedence, PR_RIGHT);
+                lhs.precedence = precedence;
+            }
+            }
+        }
+        return Pop().text;
     }
 
 private:
-    double value_;
+    struct Operand {
+        std::string text;
+        ExprPrecedence precedence;
+    };
+
+    static ExprPrecedence GetPrecedence(Instruction::OpCode op) {
+        switch (op) {
+        case Instruction::OpCode::Add:
+            return EP_ADD;
+        case Instruction::OpCode::Subtract:
+            return EP_SUB;
+        case Instruction::OpCode::Multiply:
+            return EP_MUL;
+        case Instruction::OpCode::Divide:
+            return EP_DIV;
+        default:
+            // have to do this because VC++ has a buggy warning
+            assert(false);
+            return static_cast<ExprPrecedence>(INT_MAX);
+        }
+    }
+
+    static char UnarySign(Instruction::OpCode op) {
+        return op == Instruction::OpCode::UnaryPlus ? '+' : '-';
+    }
+
+    static std::string Wrap(const Operand& operand, ExprPrecedence parent_precedence,
+                            PrecedenceRule mask) {
+        bool parens_needed = PRECEDENCE_RULES[parent_precedence][operand.precedence] & mask;
+        return parens_needed ? '(' + operand.text + ')' : operand.text;
+    }
+
+    // a reference to deleted cells is #REF!, which parses back as one
+    template <typename Reference>
+    static std::string PrintReference(Reference reference) {
+        if (!reference.IsValid()) {
+            return std::string(FormulaError(FormulaError::Category::Ref).ToString());
+        }
+        return reference.ToString();
+    }
+
+    std::string PrintAtom(const Instruction& instruction) {
+        if (instruction.op == Instruction::OpCode::AccumulateRange) {
+            return PrintReference(Translate(ranges_[instruction.index], origin_));
+        }
+        if (instruction.op == Instruction::OpCode::LoadCell) {
+            return PrintReference(Translate(cells_[instruction.index], origin_));
+        }
+        if (instruction.op == Instruction::OpCode::LoadExternalCell) {
+            const auto& ref = externals_.cells[instruction.index];
+            return FormatSheetReference(externals_.sheets[ref.sheet]) + PrintReference(Translate(ref.cell, origin_));
+        }
+        if (instruction.op == Instruction::OpCode::AccumulateExternalRange) {
+            const auto& ref = externals_.ranges[instruction.index];
+            return FormatSheetReference(externals_.sheets[ref.sheet]) + PrintReference(Translate(ref.range, origin_));
+        }
+        number_out_.str({});
+        number_out_ << instruction.number;
+        return number_out_.str();
+    }
+
+    Operand Pop() {
+        assert(!operands_.empty());
+        auto operand = std::move(operands_.back());
+        operands_.pop_back();
+        return operand;
+    }
+
+    // the arguments of the innermost function call, in order
+    std::vector<Operand> PopArguments() {
+        assert(!calls_.empty());
+        const auto first = operands_.begin() + calls_.back();
+        std::vector<Operand> args(std::make_move_iterator(first),
+                                  std::make_move_iterator(operands_.end()));
+        operands_.erase(first, operands_.end());
+        calls_.pop_back();
+        return args;
+    }
+
+    std::vector<Operand> operands_;
+    // positions in operands_ where the arguments of open calls begin
+    std::vector<std::size_t> calls_;
+    std::ostringstream number_out_;
+    const std::vector<Position>& cells_;
+    const std::vector<Range>& ranges_;
+    const ExternalReferences& externals_;
+    Position origin_;
 };
 
 class ParseASTListener final : public FormulaBaseListener {
@@ -280,10 +497,18 @@ public:
         return root;
     }
 
-    std::forward_list<Position> MoveCells() {
+    std::vector<Position> MoveCells() {
         return std::move(cells_);
     }
 
+    std::vector<Range> MoveRanges() {
+        return std::move(ranges_);
+    }
+
+    ExternalReferences MoveExternals() {
+        return std::move(externals_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
@@ -316,14 +541,66 @@ public:
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
-        auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
-        if (!value.IsValid()) {
-            throw FormulaException("Invalid position: " + value_str);
+        Position value = FormulaAST::DELETED_REFERENCE;
+        if (!ctx->REF()) {
+            auto value_str = ctx->CELL()->getSymbol()->getText();
+            value = Position::FromString(value_str);
+            if (!value.IsValid()) {
+                throw FormulaException("Invalid position: " + value_str);
+            }
+        }
+
+        if (auto* sheet = ctx->SHEET()) {
+            const auto index = externals_.AddSheet(ParseSheetName(sheet->getSymbol()->getText()));
+            args_.push_back(std::make_unique<CellExpr>(static_cast<std::uint32_t>(externals_.cells.size()), true));
+            externals_.cells.push_back({index, value});
+            return;
+        }
+        auto node = std::make_unique<CellExpr>(static_cast<std::uint32_t>(cells_.size()));
+        cells_.push_back(value);
+        args_.push_back(std::move(node));
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        Range range = FormulaAST::DELETED_RANGE;
+        if (!ctx->REF()) {
+            auto first_str = ctx->CELL(0)->getSymbol()->getText();
+            auto last_str = ctx->CELL(1)->getSymbol()->getText();
+            auto first = Position::FromString(first_str);
+            auto last = Position::FromString(last_str);
+            if (!first.IsValid() || !last.IsValid()) {
+                throw FormulaException("Invalid range: " + first_str + ':' + last_str);
+            }
+            range = Range::FromCorners(first, last);
+        }
+
+        if (auto* sheet = ctx->SHEET()) {
+            const auto index = externals_.AddSheet(ParseSheetName(sheet->getSymbol()->getText()));
+            args_.push_back(std::make_unique<RangeExpr>(static_cast<std::uint32_t>(externals_.ranges.size()), true));
+            externals_.ranges.push_back({index, range});
+            return;
         }
+        auto node = std::make_unique<RangeExpr>(static_cast<std::uint32_t>(ranges_.size()));
+        ranges_.push_back(range);
+        args_.push_back(std::move(node));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        const auto name = ctx->FUNCTION()->getSymbol()->getText();
+        auto function = std::find_if(std::begin(FUNCTIONS), std::end(FUNCTIONS), [&name](const auto& f) {
+            return f.first == name;
+        });
+        if (function == std::end(FUNCTIONS)) {
+            throw ParsingError("Unknown function: " + name);
+        }
+
+        const std::size_t arg_count = ctx->arg().size();
+        assert(args_.size() >= arg_count);
+        std::vector<std::unique_ptr<Expr>> args(std::make_move_iterator(args_.end() - arg_count),
+                                                std::make_move_iterator(args_.end()));
+        args_.erase(args_.end() - arg_count, args_.end());
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
+        auto node = std::make_unique<FunctionExpr>(function->second, std::move(args));
         args_.push_back(std::move(node));
     }
 
@@ -357,7 +634,9 @@ public:
 
 private:
     std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    std::vector<Position> cells_;
+    std::vector<Range> ranges_;
+    ExternalReferences externals_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -370,10 +649,610 @@ public:
     }
 };
 
+// Splits a formula into the tokens of Formula.g4, reading one token ahead.
+// Like the ANTLR lexer it always takes the longest match.
+class Lexer {
+public:
+    enum class Token {
+        End,
+        Number,
+        Cell,
+        Function,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        LeftParen,
+        RightParen,
+        Comma,
+        Colon,
+        Sheet,  // a sheet name followed by '!'
+        Ref,    // #REF!, a reference to deleted cells
+    };
+
+    explicit Lexer(std::string_view text)
+        : text_(text) {
+        Next();
+    }
+
+    Token Peek() const {
+        return token_;
+    }
+
+    std::string_view GetText() const {
+        return token_text_;
+    }
+
+    void Next() {
+        while (pos_ < text_.size() && IsSpace(text_[pos_])) {
+            ++pos_;
+        }
+        const std::size_t start = pos_;
+        if (pos_ == text_.size()) {
+            token_ = Token::End;
+        } else if (IsDigit(text_[pos_]) || text_[pos_] == '.') {
+            LexNumber();
+        } else if (LexSheet()) {
+            token_ = Token::Sheet;
+        } else if (text_.compare(pos_, REF.size(), REF) == 0) {
+            pos_ += REF.size();
+            token_ = Token::Ref;
+        } else if (IsUpper(text_[pos_])) {
+            pos_ = SkipWhile(pos_, IsUpper);
+            const std::size_t digits_end = SkipWhile(pos_, IsDigit);
+            token_ = digits_end != pos_ ? Token::Cell : Token::Function;
+            pos_ = digits_end;
+        } else {
+            token_ = LexPunctuation(text_[pos_++]);
+        }
+        token_text_ = text_.substr(start, pos_ - start);
+    }
+
+private:
+    static constexpr std::string_view REF = "#REF!";
+
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    static bool IsDigit(char c) {
+        return '0' <= c && c <= '9';
+    }
+
+    static bool IsUpper(char c) {
+        return 'A' <= c && c <= 'Z';
+    }
+
+    template <typename Predicate>
+    std::size_t SkipWhile(std::size_t pos, Predicate predicate) const {
+        while (pos < text_.size() && predicate(text_[pos])) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    // SHEET: ([A-Za-z_] [A-Za-z0-9_.]* | '\'' ('\'\'' | ~'\'')+ '\'') '!'
+    bool LexSheet() {
+        std::size_t end = pos_;
+        if (text_[end] == '\'') {
+            for (++end; end < text_.size(); ++end) {
+                if (text_[end] == '\'') {
+                    if (end + 1 < text_.size() && text_[end + 1] == '\'') {
+                        ++end;
+                        continue;
+                    }
+                    break;
+                }
+            }
+            if (end == text_.size() || end == pos_ + 1) {
+                return false;
+            }
+            ++end;
+        } else if (IsSheetNameStart(text_[end])) {
+            end = SkipWhile(end + 1, IsSheetNameChar);
+        }
+        if (end == pos_ || end == text_.size() || text_[end] != '!') {
+            return false;
+        }
+        pos_ = end + 1;
+        return true;
+    }
+
+    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    void LexNumber() {
+        std::size_t end = SkipWhile(pos_, IsDigit);
+        if (end + 1 < text_.size() && text_[end] == '.' && IsDigit(text_[end + 1])) {
+            end = SkipWhile(end + 1, IsDigit);
+        } else if (end == pos_) {
+            Fail();  // a '.' with no digits after it
+        }
+        if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E')) {
+            std::size_t exponent = end + 1;
+            if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                ++exponent;
+            }
+            const std::size_t exponent_end = SkipWhile(exponent, IsDigit);
+            if (exponent_end != exponent) {
+                end = exponent_end;
+            }
+        }
+        pos_ = end;
+        token_ = Token::Number;
+    }
+
+    Token LexPunctuation(char c) const {
+        switch (c) {
+        case '+':
+            return Token::Add;
+        case '-':
+            return Token::Sub;
+        case '*':
+            return Token::Mul;
+        case '/':
+            return Token::Div;
+        case '(':
+            return Token::LeftParen;
+        case ')':
+            return Token::RightParen;
+        case ',':
+            return Token::Comma;
+        case ':':
+            return Token::Colon;
+        default:
+            Fail();
+        }
+    }
+
+    [[noreturn]] void Fail() const {
+        throw ParsingError("Error when lexing at position " + std::to_string(pos_));
+    }
+
+    std::string_view text_;
+    std::size_t pos_ = 0;
+    Token token_ = Token::End;
+    std::string_view token_text_;
+};
+
+// Precedence climbing parser of Formula.g4 emitting the program the
+// expression tree would compile to: operands come before their operators,
+// so every instruction can be appended as soon as it is parsed.
+class HandwrittenParser {
+public:
+    explicit HandwrittenParser(std::string_view text)
+        : lexer_(text) {
+    }
+
+    FormulaAST Parse() && {
+        ParseExpr(PREC_ADD);
+        if (lexer_.Peek() != Lexer::Token::End) {
+            Fail();
+        }
+        return FormulaAST(std::move(program_), std::move(cells_), std::move(ranges_), std::move(externals_));
+    }
+
+private:
+    using Token = Lexer::Token;
+
+    // binding power of the operators; the operand of a unary operator is
+    // parsed at PREC_UNARY, so -A1*B1 is (-A1)*B1 as in the grammar
+    enum Precedence {
+        PREC_ADD = 1,
+        PREC_MUL,
+        PREC_UNARY,
+    };
+
+    // ParseExpr() recurses once per parenthesis, unary operator and
+    // function argument, so deeper formulas are rejected before they run
+    // out of stack
+    static constexpr int MAX_NESTING = 2048;
+
+    void ParseExpr(int min_precedence) {
+        if (++depth_ > MAX_NESTING) {
+            throw ParsingError("Formula nested deeper than " + std::to_string(MAX_NESTING));
+        }
+        ParsePrefix();
+        ParseOperators(min_precedence);
+        --depth_;
+    }
+
+    void ParseOperators(int min_precedence) {
+        for (;;) {
+            const Token token = lexer_.Peek();
+            Instruction instruction;
+            int precedence;
+            switch (token) {
+            case Token::Add:
+                instruction.op = Instruction::OpCode::Add;
+                precedence = PREC_ADD;
+                break;
+            case Token::Sub:
+                instruction.op = Instruction::OpCode::Subtract;
+                precedence = PREC_ADD;
+                break;
+            case Token::Mul:
+                instruction.op = Instruction::OpCode::Multiply;
+                precedence = PREC_MUL;
+                break;
+            case Token::Div:
+                instruction.op = Instruction::OpCode::Divide;
+                precedence = PREC_MUL;
+                break;
+            default:
+                return;
+            }
+            if (precedence < min_precedence) {
+                return;
+            }
+            lexer_.Next();
+            ParseExpr(precedence + 1);  // binary operators are left-associative
+            program_.push_back(instruction);
+        }
+    }
+
+    void ParsePrefix() {
+        Instruction instruction;
+        switch (lexer_.Peek()) {
+        case Token::LeftParen:
+            lexer_.Next();
+            ParseExpr(PREC_ADD);
+            Expect(Token::RightParen);
+            return;
+        case Token::Add:
+        case Token::Sub:
+            instruction.op = lexer_.Peek() == Token::Add ? Instruction::OpCode::UnaryPlus
+                                                         : Instruction::OpCode::UnaryMinus;
+            lexer_.Next();
+            ParseExpr(PREC_UNARY);
+            program_.push_back(instruction);
+            return;
+        case Token::Number:
+            instruction.op = Instruction::OpCode::PushNumber;
+            instruction.number = ParseNumber(lexer_.GetText());
+            lexer_.Next();
+            program_.push_back(instruction);
+            return;
+        case Token::Cell:
+        case Token::Ref:
+            instruction.op = Instruction::OpCode::LoadCell;
+            instruction.index = static_cast<std::uint32_t>(cells_.size());
+            cells_.push_back(ParseCell(lexer_));
+            lexer_.Next();
+            program_.push_back(instruction);
+            return;
+        case Token::Sheet: {
+            auto sheet = ParseSheetName(lexer_.GetText());
+            lexer_.Next();
+            instruction.op = Instruction::OpCode::LoadExternalCell;
+            instruction.index = static_cast<std::uint32_t>(externals_.cells.size());
+            externals_.cells.push_back({externals_.AddSheet(std::move(sheet)), ParseCell(lexer_)});
+            lexer_.Next();
+            program_.push_back(instruction);
+            return;
+        }
+        case Token::Function:
+            ParseFunction();
+            return;
+        default:
+            Fail();
+        }
+    }
+
+    void ParseFunction() {
+        const auto name = lexer_.GetText();
+        auto function = std::find_if(std::begin(FUNCTIONS), std::end(FUNCTIONS), [name](const auto& f) {
+            return f.first == name;
+        });
+        if (function == std::end(FUNCTIONS)) {
+            throw ParsingError("Unknown function: " + std::string(name));
+        }
+        lexer_.Next();
+        Expect(Token::LeftParen);
+
+        Instruction instruction;
+        instruction.op = Instruction::OpCode::BeginAggregate;
+        instruction.function = function->second;
+        program_.push_back(instruction);
+        if (lexer_.Peek() != Token::RightParen) {
+            for (;;) {
+                ParseArgument();
+                if (lexer_.Peek() != Token::Comma) {
+                    break;
+                }
+                lexer_.Next();
+            }
+        }
+        Expect(Token::RightParen);
+        instruction.op = Instruction::OpCode::EndAggregate;
+        program_.push_back(instruction);
+    }
+
+    void ParseArgument() {
+        Instruction instruction;
+        Lexer lookahead = lexer_;
+        std::optional<std::string> sheet;
+        if (lookahead.Peek() == Token::Sheet) {
+            sheet = ParseSheetName(lookahead.GetText());
+            lookahead.Next();
+        }
+        std::optional<Range> range;
+        if (lookahead.Peek() == Token::Cell) {
+            const auto first_str = lookahead.GetText();
+            lookahead.Next();
+            if (lookahead.Peek() == Token::Colon) {
+                lookahead.Next();
+                if (lookahead.Peek() != Token::Cell) {
+                    Fail();
+                }
+                const auto last_str = lookahead.GetText();
+                const auto first = Position::FromString(first_str);
+                const auto last = Position::FromString(last_str);
+                if (!first.IsValid() || !last.IsValid()) {
+                    throw FormulaException("Invalid range: " + std::string(first_str) + ':' +
+                                           std::string(last_str));
+                }
+                lookahead.Next();
+                range = Range::FromCorners(first, last);
+            }
+        } else if (lookahead.Peek() == Token::Ref) {
+            // a whole argument of #REF! is a deleted range, as it is printed,
+            // and otherwise a deleted cell in an expression
+            lookahead.Next();
+            if (lookahead.Peek() == Token::Comma || lookahead.Peek() == Token::RightParen) {
+                range = FormulaAST::DELETED_RANGE;
+            }
+        }
+        if (range) {
+            lexer_ = lookahead;
+            if (sheet) {
+                instruction.op = Instruction::OpCode::AccumulateExternalRange;
+                instruction.index = static_cast<std::uint32_t>(externals_.ranges.size());
+                externals_.ranges.push_back({externals_.AddSheet(std::move(*sheet)), *range});
+            } else {
+                instruction.op = Instruction::OpCode::AccumulateRange;
+                instruction.index = static_cast<std::uint32_t>(ranges_.size());
+                ranges_.push_back(*range);
+            }
+            program_.push_back(instruction);
+            return;
+        }
+        ParseExpr(PREC_ADD);
+        instruction.op = Instruction::OpCode::Accumulate;
+        program_.push_back(instruction);
+    }
+
+    // the position of the current token, which has to be a cell or #REF!
+    Position ParseCell(const Lexer& lexer) const {
+        if (lexer.Peek() == Token::Ref) {
+            return FormulaAST::DELETED_REFERENCE;
+        }
+        if (lexer.Peek() != Token::Cell) {
+            Fail();
+        }
+        const auto value_str = lexer.GetText();
+        const auto value = Position::FromString(value_str);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid position: " + std::string(value_str));
+        }
+        return value;
+    }
+
+    static double ParseNumber(std::string_view text) {
+        double value = 0;
+        const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (error != std::errc{} || end != text.data() + text.size()) {
+            throw ParsingError("Invalid number: " + std::string(text));
+        }
+        return value;
+    }
+
+    void Expect(Token token) {
+        if (lexer_.Peek() != token) {
+            Fail();
+        }
+        lexer_.Next();
+    }
+
+    [[noreturn]] void Fail() const {
+        throw ParsingError("Error when parsing: " + std::string(lexer_.GetText()));
+    }
+
+    Lexer lexer_;
+    int depth_ = 0;  // of ParseExpr()
+    Program program_;
+    std::vector<Position> cells_;
+    std::vector<Range> ranges_;
+    ExternalReferences externals_;
+};
+
+// the arithmetic of Execute()
+double Apply(Instruction::OpCode op, double lhs, double rhs) {
+    switch (op) {
+    case Instruction::OpCode::Add:
+        return lhs + rhs;
+    case Instruction::OpCode::Subtract:
+        return lhs - rhs;
+    case Instruction::OpCode::Multiply:
+        return lhs * rhs;
+    case Instruction::OpCode::Divide:
+        return lhs / rhs;
+    default:
+        assert(false);
+        return 0;
+    }
+}
+
+Instruction::OpCode WithNumber(Instruction::OpCode op) {
+    switch (op) {
+    case Instruction::OpCode::Add:
+        return Instruction::OpCode::AddNumber;
+    case Instruction::OpCode::Subtract:
+        return Instruction::OpCode::SubtractNumber;
+    case Instruction::OpCode::Multiply:
+        return Instruction::OpCode::MultiplyNumber;
+    default:
+        assert(op == Instruction::OpCode::Divide);
+        return Instruction::OpCode::DivideNumber;
+    }
+}
+
+// x * 1, x / 1 and x - 0 are x for every x, -0 and NaN included; x - (-0)
+// is not, as it turns -0 into 0
+bool IsIdentity(Instruction::OpCode op, double number) {
+    switch (op) {
+    case Instruction::OpCode::Multiply:
+    case Instruction::OpCode::Divide:
+        return number == 1;
+    case Instruction::OpCode::Subtract:
+        return number == 0 && !std::signbit(number);
+    default:
+        return false;
+    }
+}
+
 }  // namespace
+
+Program Optimize(const Program& program) {
+    // a value on the stack of Execute(): where its instructions start in
+    // the result and its number if it is a constant, pushed by the single
+    // instruction at start
+    struct Operand {
+        std::size_t start;
+        std::optional<double> number;
+    };
+    // an open function call, computed as Execute() would while all its
+    // arguments are numbers
+    struct Call {
+        std::size_t start;
+        bool constant = true;
+        Accumulator accumulator;
+    };
+
+    Program result;
+    result.reserve(program.size());
+    std::vector<Operand> operands;
+    std::vector<Call> calls;
+    auto push_number = [&](std::size_t start, double number) {
+        result.resize(start);
+        Instruction instruction;
+        instruction.op = Instruction::OpCode::PushNumber;
+        instruction.number = number;
+        result.push_back(instruction);
+        operands.push_back({start, number});
+    };
+    // the operator over the operand at start and the number
+    auto apply_number = [&](Instruction::OpCode op, std::size_t start, double number) {
+        if (!IsIdentity(op, number)) {
+            Instruction instruction;
+            instruction.op = WithNumber(op);
+            instruction.number = number;
+            result.push_back(instruction);
+        }
+        operands.push_back({start, std::nullopt});
+    };
+
+    for (const auto& instruction : program) {
+        switch (instruction.op) {
+        case Instruction::OpCode::PushNumber:
+            push_number(result.size(), instruction.number);
+            break;
+        case Instruction::OpCode::LoadCell:
+        case Instruction::OpCode::LoadExternalCell:
+            operands.push_back({result.size(), std::nullopt});
+            result.push_back(instruction);
+            break;
+        case Instruction::OpCode::Add:
+        case Instruction::OpCode::Subtract:
+        case Instruction::OpCode::Multiply:
+        case Instruction::OpCode::Divide: {
+            const Operand rhs = operands.back();
+            operands.pop_back();
+            const Operand lhs = operands.back();
+            operands.pop_back();
+            const bool commutative = instruction.op == Instruction::OpCode::Add ||
+                                     instruction.op == Instruction::OpCode::Multiply;
+            if (lhs.number && rhs.number) {
+                push_number(lhs.start, Apply(instruction.op, *lhs.number, *rhs.number));
+            } else if (rhs.number) {
+                result.resize(rhs.start);
+                apply_number(instruction.op, lhs.start, *rhs.number);
+            } else if (lhs.number && commutative) {
+                // nothing after lhs but rhs, which moves into its place
+                result.erase(result.begin() + static_cast<std::ptrdiff_t>(lhs.start));
+                apply_number(instruction.op, lhs.start, *lhs.number);
+            } else {
+                result.push_back(instruction);
+                operands.push_back({lhs.start, std::nullopt});
+            }
+            break;
+        }
+        case Instruction::OpCode::UnaryPlus:
+            break;
+        case Instruction::OpCode::UnaryMinus: {
+            Operand& operand = operands.back();
+            if (operand.number) {
+                operand.number = -*operand.number;
+                result.back().number = *operand.number;
+            } else if (result.back().op == Instruction::OpCode::UnaryMinus) {
+                result.pop_back();  // the operand is a negation itself
+            } else {
+                result.push_back(instruction);
+            }
+            break;
+        }
+        case Instruction::OpCode::BeginAggregate:
+            calls.push_back({result.size(), true, {}});
+            result.push_back(instruction);
+            break;
+        case Instruction::OpCode::Accumulate: {
+            Call& call = calls.back();
+            if (const auto number = operands.back().number; number && call.constant) {
+                call.accumulator.Add(*number);
+            } else {
+                call.constant = false;
+            }
+            operands.pop_back();
+            result.push_back(instruction);
+            break;
+        }
+        case Instruction::OpCode::AccumulateRange:
+        case Instruction::OpCode::AccumulateExternalRange:
+            calls.back().constant = false;
+            result.push_back(instruction);
+            break;
+        case Instruction::OpCode::EndAggregate: {
+            const Call call = calls.back();
+            calls.pop_back();
+            if (call.constant) {
+                push_number(call.start, call.accumulator.GetResult(instruction.function));
+            } else {
+                result.push_back(instruction);
+                operands.push_back({call.start, std::nullopt});
+            }
+            break;
+        }
+        default:
+            // the Number operations are only emitted here
+            assert(false);
+            result.push_back(instruction);
+        }
+    }
+    return result;
+}
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+namespace {
+
+std::atomic<FormulaParserBackend> parser_backend{
+#ifdef SPREADSHEET_ANTLR_PARSER
+    FormulaParserBackend::Antlr
+#else
+    FormulaParserBackend::Handwritten
+#endif
+};
+
+std::atomic<std::uint32_t> jit_threshold{DEFAULT_FORMULA_JIT_THRESHOLD};
+
+FormulaAST ParseWithAntlr(std::istream& in) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -394,36 +1273,511 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveRanges(),
+                      listener.MoveExternals());
+}
+
+}  // namespace
+
+void SetFormulaParserBackend(FormulaParserBackend backend) {
+    parser_backend.store(backend, std::memory_order_relaxed);
+}
+
+FormulaParserBackend GetFormulaParserBackend() {
+    return parser_backend.load(std::memory_order_relaxed);
+}
+
+void SetFormulaJitThreshold(std::uint32_t executions) {
+    jit_threshold.store(executions, std::memory_order_relaxed);
+}
+
+std::uint32_t GetFormulaJitThreshold() {
+    return jit_threshold.load(std::memory_order_relaxed);
+}
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    if (GetFormulaParserBackend() == FormulaParserBackend::Antlr) {
+        return ParseWithAntlr(in);
+    }
+    const std::string in_str(std::istreambuf_iterator<char>(in), {});
+    return ASTImpl::HandwrittenParser(in_str).Parse();
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    return ParseFormulaAST(in_str, GetFormulaParserBackend());
+}
+
+FormulaAST ParseFormulaAST(std::string_view in_str, FormulaParserBackend backend) {
+    if (backend == FormulaParserBackend::Antlr) {
+        std::istringstream in{std::string(in_str)};
+        return ParseWithAntlr(in);
+    }
+    return ASTImpl::HandwrittenParser(in_str).Parse();
+}
+
+std::uint32_t ExternalReferences::AddSheet(std::string name) {
+    auto it = std::find(sheets.begin(), sheets.end(), name);
+    if (it == sheets.end()) {
+        it = sheets.insert(sheets.end(), std::move(name));
+    }
+    return static_cast<std::uint32_t>(it - sheets.begin());
+}
+
+std::string FormatSheetReference(std::string_view name) {
+    using namespace ASTImpl;
+    if (!name.empty() && IsSheetNameStart(name.front()) &&
+        std::all_of(name.begin(), name.end(), IsSheetNameChar)) {
+        return std::string(name) + '!';
+    }
+    std::string text = "'";
+    for (char c : name) {
+        text += c;
+        if (c == '\'') {
+            text += c;
+        }
+    }
+    return text + "'!";
 }
 
-void FormulaAST::PrintCells(std::ostream& out) const {
+std::string NormalizeFormula(std::string_view in_str, Position origin) {
+    using ASTImpl::Lexer;
+
+    std::string key;
+    key.reserve(in_str.size() + 16);
+    for (Lexer lexer(in_str); lexer.Peek() != Lexer::Token::End; lexer.Next()) {
+        if (!key.empty()) {
+            key += ' ';  // keeps adjacent tokens apart, as "1 2" is not "12"
+        }
+        const Position cell = lexer.Peek() == Lexer::Token::Cell
+                                  ? Position::FromString(lexer.GetText())
+                                  : Position::NONE;
+        if (cell.IsValid()) {
+            key += "R[" + std::to_string(cell.row - origin.row) + "]C[" +
+                   std::to_string(cell.col - origin.col) + ']';
+        } else {
+            key += lexer.GetText();
+        }
+    }
+    return key;
+}
+
+namespace {
+
+// AST of the formulas in use by their normalized text. Expired entries are
+// swept whenever the table doubles in size, which keeps it proportional to
+// the number of live ASTs at an amortized constant cost per insertion.
+class InternTable {
+public:
+    std::shared_ptr<const FormulaAST> Intern(std::string_view in_str, Position origin) {
+        std::string key = NormalizeFormula(in_str, origin);
+        {
+            std::lock_guard lock(mutex_);
+            if (auto it = asts_.find(key); it != asts_.end()) {
+                if (auto ast = it->second.lock()) {
+                    return ast;
+                }
+            }
+        }
+
+        // parse unlocked, a concurrent parse of the same text is merged below
+        FormulaAST parsed = ParseFormulaAST(in_str, GetFormulaParserBackend());
+        parsed.MakeRelativeTo(origin);
+        auto ast = std::make_shared<const FormulaAST>(std::move(parsed));
+
+        std::lock_guard lock(mutex_);
+        auto& entry = asts_[std::move(key)];
+        if (auto existing = entry.lock()) {
+            return existing;
+        }
+        entry = ast;
+        if (asts_.size() >= next_sweep_) {
+            Sweep();
+        }
+        return ast;
+    }
+
+private:
+    static constexpr std::size_t MIN_SWEEP_SIZE = 1024;
+
+    void Sweep() {
+        for (auto it = asts_.begin(); it != asts_.end();) {
+            it = it->second.expired() ? asts_.erase(it) : std::next(it);
+        }
+        next_sweep_ = std::max(MIN_SWEEP_SIZE, 2 * asts_.size());
+    }
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::weak_ptr<const FormulaAST>> asts_;
+    std::size_t next_sweep_ = MIN_SWEEP_SIZE;
+};
+
+}  // namespace
+
+std::shared_ptr<const FormulaAST> InternFormulaAST(std::string_view in_str, Position origin) {
+    static InternTable table;
+    return table.Intern(in_str, origin);
+}
+
+void FormulaAST::PrintCells(std::ostream& out, Position origin) const {
     for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+        out << ASTImpl::Translate(cell, origin).ToString() << ' ';
+    }
+}
+
+void FormulaAST::Print(std::ostream& out, Position origin) const {
+    out << ASTImpl::ProgramPrinter(out, cells_, ranges_, externals_, origin).Print(program_);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position origin) const {
+    out << ASTImpl::ProgramPrinter(out, cells_, ranges_, externals_, origin).PrintFormula(program_);
+}
+
+void FormulaAST::MakeRelativeTo(Position origin) {
+    // translation keeps the lists sorted; a parsed #REF! is already
+    // deleted from any origin
+    const Position offset{-origin.row, -origin.col};
+    auto translate = [offset](Position cell) {
+        return cell == DELETED_REFERENCE ? cell : ASTImpl::Translate(cell, offset);
+    };
+    auto translate_range = [&translate](Range range) {
+        return Range{translate(range.first), translate(range.last)};
+    };
+    for (auto& cell : cells_) {
+        cell = translate(cell);
+    }
+    for (auto& range : ranges_) {
+        range = translate_range(range);
+    }
+    for (auto& ref : externals_.cells) {
+        ref.cell = translate(ref.cell);
+    }
+    for (auto& ref : externals_.ranges) {
+        ref.range = translate_range(ref.range);
+    }
+}
+
+FormulaAST FormulaAST::WithReferences(std::vector<Position> cells, std::vector<Range> ranges,
+                                      Position external_offset) const {
+    assert(cells.size() == cells_.size() && ranges.size() == ranges_.size());
+    auto externals = externals_;
+    for (auto& ref : externals.cells) {
+        ref.cell = ASTImpl::Translate(ref.cell, external_offset);
+    }
+    for (auto& ref : externals.ranges) {
+        ref.range = ASTImpl::Translate(ref.range, external_offset);
+    }
+    return FormulaAST(program_, std::move(cells), std::move(ranges), std::move(externals));
+}
+
+FormulaAST FormulaAST::WithExternalReferences(std::vector<Position> cells, std::vector<Range> ranges) const {
+    assert(cells.size() == externals_.cells.size() && ranges.size() == externals_.ranges.size());
+    auto externals = externals_;
+    for (std::size_t i = 0; i < cells.size(); ++i) {
+        externals.cells[i].cell = cells[i];
+    }
+    for (std::size_t i = 0; i < ranges.size(); ++i) {
+        externals.ranges[i].range = ranges[i];
+    }
+    return FormulaAST(program_, cells_, ranges_, std::move(externals));
+}
+
+FormulaAST FormulaAST::WithLocalReferences(std::string_view sheet) const {
+    using ASTImpl::Instruction;
+    auto program = program_;
+    auto cells = cells_;
+    auto ranges = ranges_;
+    ExternalReferences externals;
+    for (auto& instruction : program) {
+        if (instruction.op == Instruction::OpCode::LoadExternalCell) {
+            const auto& ref = externals_.cells[instruction.index];
+            if (externals_.sheets[ref.sheet] == sheet) {
+                instruction.op = Instruction::OpCode::LoadCell;
+                instruction.index = static_cast<std::uint32_t>(cells.size());
+                cells.push_back(ref.cell);
+            } else {
+                instruction.index = static_cast<std::uint32_t>(externals.cells.size());
+                externals.cells.push_back({externals.AddSheet(externals_.sheets[ref.sheet]), ref.cell});
+            }
+        } else if (instruction.op == Instruction::OpCode::AccumulateExternalRange) {
+            const auto& ref = externals_.ranges[instruction.index];
+            if (externals_.sheets[ref.sheet] == sheet) {
+                instruction.op = Instruction::OpCode::AccumulateRange;
+                instruction.index = static_cast<std::uint32_t>(ranges.size());
+                ranges.push_back(ref.range);
+            } else {
+                instruction.index = static_cast<std::uint32_t>(externals.ranges.size());
+                externals.ranges.push_back({externals.AddSheet(externals_.sheets[ref.sheet]), ref.range});
+            }
+        }
+    }
+    // the constructor sorts the cells and ranges and renumbers the program
+    return FormulaAST(std::move(program), std::move(cells), std::move(ranges), std::move(externals));
+}
+
+// The executions of a formula are counted until it is hot, then the
+// thread reaching the threshold compiles it and publishes the code.
+struct FormulaAST::NativeState {
+    std::atomic<std::uint32_t> executions{0};
+    std::atomic<bool> compiling{false};
+    std::atomic<ASTImpl::NativeFormula> function{nullptr};
+    std::unique_ptr<ASTImpl::NativeCode> code;  // written before function
+
+    // nullptr while the formula is interpreted
+    ASTImpl::NativeFormula Find(const ASTImpl::Program& program) {
+        if (const auto compiled = function.load(std::memory_order_acquire)) {
+            return compiled;
+        }
+        const std::uint32_t threshold = GetFormulaJitThreshold();
+        if (threshold == 0 || executions.fetch_add(1, std::memory_order_relaxed) + 1 < threshold
+            || compiling.exchange(true, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        code = ASTImpl::CompileNative(program);
+        if (!code) {
+            return nullptr;
+        }
+        const auto compiled = code->GetFunction();
+        function.store(compiled, std::memory_order_release);
+        return compiled;
+    }
+};
+
+FormulaAST::Value FormulaAST::Execute(const CellSolver& solver, const RangeSolver& range_solver,
+                                      const ExternalCellSolver& external_solver,
+                                      const ExternalRangeSolver& external_range_solver) const {
+    using ASTImpl::Instruction;
+
+    // the native code takes the cells as numbers: with an error among them
+    // the program is interpreted, which reports the error it meets first
+    if (const auto native = native_ ? native_->Find(GetExecutedProgram()) : nullptr) {
+        constexpr std::size_t INLINE_CELLS = 32;
+        double inline_cells[INLINE_CELLS];
+        std::unique_ptr<double[]> heap_cells;
+        double* cells = inline_cells;
+        if (cells_.size() > INLINE_CELLS) {
+            heap_cells = std::make_unique<double[]>(cells_.size());
+            cells = heap_cells.get();
+        }
+        bool numbers = true;
+        for (std::size_t i = 0; numbers && i < cells_.size(); ++i) {
+            const auto value = solver(&cells_[i]);
+            if (const double* number = std::get_if<double>(&value)) {
+                cells[i] = *number;
+            } else {
+                numbers = false;
+            }
+        }
+        if (numbers) {
+            return native(cells);
+        }
+    }
+
+    // formulas rarely nest deeper than this, so usually no allocation is needed
+    constexpr std::size_t INLINE_STACK_DEPTH = 32;
+    double inline_stack[INLINE_STACK_DEPTH];
+    std::unique_ptr<double[]> heap_stack;
+    double* stack = inline_stack;
+    if (stack_depth_ > INLINE_STACK_DEPTH) {
+        heap_stack = std::make_unique<double[]>(stack_depth_);
+        stack = heap_stack.get();
+    }
+
+    std::vector<Accumulator> accumulators;  // one per open function call
+    std::vector<double> range_values;
+
+    double* top = stack;  // one past the topmost value
+    for (const auto& instruction : GetExecutedProgram()) {
+        switch (instruction.op) {
+        case Instruction::OpCode::PushNumber:
+            *top++ = instruction.number;
+            break;
+        case Instruction::OpCode::LoadCell: {
+            const auto value = solver(&cells_[instruction.index]);
+            if (const auto* error = std::get_if<FormulaError>(&value)) {
+                return *error;
+            }
+            *top++ = std::get<double>(value);
+            break;
+        }
+        case Instruction::OpCode::LoadExternalCell: {
+            const auto value = external_solver(&externals_.cells[instruction.index]);
+            if (const auto* error = std::get_if<FormulaError>(&value)) {
+                return *error;
+            }
+            *top++ = std::get<double>(value);
+            break;
+        }
+        case Instruction::OpCode::Add:
+            --top;
+            top[-1] += top[0];
+            break;
+        case Instruction::OpCode::Subtract:
+            --top;
+            top[-1] -= top[0];
+            break;
+        case Instruction::OpCode::Multiply:
+            --top;
+            top[-1] *= top[0];
+            break;
+        case Instruction::OpCode::Divide:
+            --top;
+            top[-1] /= top[0];
+            break;
+        case Instruction::OpCode::AddNumber:
+            top[-1] += instruction.number;
+            break;
+        case Instruction::OpCode::SubtractNumber:
+            top[-1] -= instruction.number;
+            break;
+        case Instruction::OpCode::MultiplyNumber:
+            top[-1] *= instruction.number;
+            break;
+        case Instruction::OpCode::DivideNumber:
+            top[-1] /= instruction.number;
+            break;
+        case Instruction::OpCode::UnaryPlus:
+            break;
+        case Instruction::OpCode::UnaryMinus:
+            top[-1] = -top[-1];
+            break;
+        case Instruction::OpCode::BeginAggregate:
+            accumulators.emplace_back();
+            break;
+        case Instruction::OpCode::Accumulate:
+            accumulators.back().Add(*--top);
+            break;
+        case Instruction::OpCode::AccumulateRange:
+            range_values.clear();
+            if (auto error = range_solver(&ranges_[instruction.index], range_values)) {
+                return *error;
+            }
+            accumulators.back().Add(range_values.data(), range_values.size());
+            break;
+        case Instruction::OpCode::AccumulateExternalRange:
+            range_values.clear();
+            if (auto error = external_range_solver(&externals_.ranges[instruction.index], range_values)) {
+                return *error;
+            }
+            accumulators.back().Add(range_values.data(), range_values.size());
+            break;
+        case Instruction::OpCode::EndAggregate:
+            *top++ = accumulators.back().GetResult(instruction.function);
+            accumulators.pop_back();
+            break;
+        }
     }
+    assert(top == stack + 1);
+    return stack[0];
 }
 
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+namespace {
+
+ASTImpl::Program Compile(const ASTImpl::Expr& root_expr) {
+    ASTImpl::Program program;
+    root_expr.Compile(program);
+    return program;
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+// Sorts the values and removes duplicates, returning the new index of
+// every value in the original order.
+template <typename T>
+std::vector<std::uint32_t> SortUnique(std::vector<T>& values) {
+    std::vector<T> sorted = values;
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    std::vector<std::uint32_t> new_index(values.size());
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        new_index[i] = static_cast<std::uint32_t>(
+            std::lower_bound(sorted.begin(), sorted.end(), values[i]) - sorted.begin());
+    }
+    values = std::move(sorted);
+    return new_index;
 }
 
-double FormulaAST::Execute(std::function<double(const Position*)> solver) const {
-    return root_expr_->Evaluate(solver);
+}  // namespace
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::vector<Position> cells,
+                       std::vector<Range> ranges, ExternalReferences externals)
+    : FormulaAST(Compile(*root_expr), std::move(cells), std::move(ranges), std::move(externals)) {
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+FormulaAST::FormulaAST(ASTImpl::Program program, std::vector<Position> cells,
+                       std::vector<Range> ranges, ExternalReferences externals)
+    : program_(std::move(program))
+    , cells_(std::move(cells))
+    , ranges_(std::move(ranges))
+    , externals_(std::move(externals)) {
+    using ASTImpl::Instruction;
+
+    // to avoid sorting in GetReferencedCells
+    const auto cell_index = SortUnique(cells_);
+    const auto range_index = SortUnique(ranges_);
+    for (auto& instruction : program_) {
+        if (instruction.op == Instruction::OpCode::LoadCell) {
+            instruction.index = cell_index[instruction.index];
+        } else if (instruction.op == Instruction::OpCode::AccumulateRange) {
+            instruction.index = range_index[instruction.index];
+        }
+    }
+    program_.shrink_to_fit();  // formulas live long, the parser's spare capacity would too
+
+    // every optimization drops instructions
+    if (auto optimized = ASTImpl::Optimize(program_); optimized.size() < program_.size()) {
+        optimized.shrink_to_fit();
+        optimized_ = std::move(optimized);
+    }
+
+    std::size_t depth = 0;
+    for (const auto& instruction : GetExecutedProgram()) {
+        switch (instruction.op) {
+        case Instruction::OpCode::PushNumber:
+        case Instruction::OpCode::LoadCell:
+        case Instruction::OpCode::LoadExternalCell:
+        case Instruction::OpCode::EndAggregate:
+            stack_depth_ = std::max(stack_depth_, ++depth);
+            break;
+        case Instruction::OpCode::AddNumber:
+        case Instruction::OpCode::SubtractNumber:
+        case Instruction::OpCode::MultiplyNumber:
+        case Instruction::OpCode::DivideNumber:
+        case Instruction::OpCode::UnaryPlus:
+        case Instruction::OpCode::UnaryMinus:
+        case Instruction::OpCode::BeginAggregate:
+        case Instruction::OpCode::AccumulateRange:
+        case Instruction::OpCode::AccumulateExternalRange:
+            break;
+        default:
+            --depth;
+        }
+    }
+
+    if (ASTImpl::CanCompileNative(GetExecutedProgram())) {
+        native_ = std::make_unique<NativeState>();
+    }
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) noexcept = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) noexcept = default;
 FormulaAST::~FormulaAST() = default;
+
+bool FormulaAST::IsCompiled() const {
+    return native_ && native_->function.load(std::memory_order_acquire) != nullptr;
+}
+
+std::size_t FormulaAST::GetMemoryUsage() const {
+    std::size_t bytes = sizeof(FormulaAST) + GetVectorMemory(program_) + GetVectorMemory(optimized_) +
+                        GetVectorMemory(cells_) + GetVectorMemory(ranges_) +
+                        GetVectorMemory(externals_.sheets) + GetVectorMemory(externals_.cells) +
+                        GetVectorMemory(externals_.ranges);
+    for (const auto& name : externals_.sheets) {
+        bytes += name.capacity() > std::string().capacity() ? name.capacity() + 1 : 0;
+    }
+    if (native_) {
+        bytes += sizeof(NativeState);
+        // the code is set before the function is published
+        if (native_->function.load(std::memory_order_acquire) != nullptr) {
+            bytes += native_->code->GetSize();
+        }
+    }
+    return bytes;
+}
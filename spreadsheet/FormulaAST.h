@@ -1,49 +1,261 @@
 #pragma once
 
 #include "FormulaLexer.h"
+#include "aggregate.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
+
+// A single step of a compiled formula. The program is the formula in
+// reverse Polish notation: operands are pushed onto a value stack and
+// operators replace their operands with the result.
+//
+// A function call runs between BeginAggregate and EndAggregate on an
+// accumulator of its own: every argument is computed and added to it
+// with Accumulate, a range argument is added with AccumulateRange.
+//
+// The Number operations apply the operator to the top of the stack and the
+// number of the instruction. Only the optimized program, never printed or
+// saved, uses them.
+struct Instruction {
+    enum class OpCode : char {
+        PushNumber,
+        LoadCell,
+        Add = '+',
+        Subtract = '-',
+        Multiply = '*',
+        Divide = '/',
+        UnaryPlus,
+        UnaryMinus,
+        BeginAggregate,
+        Accumulate,
+        AccumulateRange,
+        EndAggregate,
+        LoadExternalCell,
+        AccumulateExternalRange,
+        AddNumber,
+        SubtractNumber,
+        MultiplyNumber,
+        DivideNumber,
+    };
+
+    OpCode op;
+    union {
+        double number;               // PushNumber, the Number operations
+        std::uint32_t index;         // LoadCell: in FormulaAST::cells_, AccumulateRange: in
+                                     // ranges_, the External ones: in the external references
+        AggregateFunction function;  // BeginAggregate, EndAggregate
+    };
+};
+
+using Program = std::vector<Instruction>;
+
+// The program with its constant parts computed: operators and function
+// calls over numbers only are replaced with their results, unary pluses
+// and double negations are dropped, a number operand becomes part of the
+// operator (on the right, for + and *) and multiplications and divisions
+// by 1 and subtractions of 0 are removed. The arithmetic done is the one
+// Execute() would do, to the bit, so the results and the #DIV/0! errors
+// stay the same. Adding 0 is kept, as it turns -0 into 0.
+Program Optimize(const Program& program);
 }
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+// A reference to a cell or a range of another sheet of the workbook, as in
+// Sheet1!A1 or 'Other sheet'!A1:B2; sheet is the index of the name of the
+// sheet in ExternalReferences::sheets.
+struct ExternalCell {
+    std::uint32_t sheet;
+    Position cell;
+};
+
+struct ExternalRange {
+    std::uint32_t sheet;
+    Range range;
+};
+
+// The references to other sheets are kept apart from the cells and ranges
+// of the formula's own sheet, in the order the instructions index.
+struct ExternalReferences {
+    std::vector<std::string> sheets;  // distinct names
+    std::vector<ExternalCell> cells;
+    std::vector<ExternalRange> ranges;
+
+    // the index of the name in sheets, added if it is not there
+    std::uint32_t AddSheet(std::string name);
+};
+
+// The name as written in formulas, followed by '!': in quotes, with the
+// quotes in it doubled, unless it is a letter or '_' followed by letters,
+// digits, '_' and '.'.
+std::string FormatSheetReference(std::string_view name);
+
 class FormulaAST {
 public:
+    // cells and ranges are in the order of the references, which the
+    // instructions index
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+                        std::vector<Position> cells,
+                        std::vector<Range> ranges,
+                        ExternalReferences externals = {});
+    explicit FormulaAST(ASTImpl::Program program,
+                        std::vector<Position> cells,
+                        std::vector<Range> ranges,
+                        ExternalReferences externals = {});
+    FormulaAST(FormulaAST&&) noexcept;
+    FormulaAST& operator=(FormulaAST&&) noexcept;
     ~FormulaAST();
 
-    double Execute(std::function<double(const Position*)> solver) const;
-    void PrintCells(std::ostream& out) const;
-    void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    using Value = std::variant<double, FormulaError>;
+
+    using CellSolver = std::function<Value(const Position*)>;
+    using RangeSolver = std::function<std::optional<FormulaError>(const Range*, std::vector<double>&)>;
+    using ExternalCellSolver = std::function<Value(const ExternalCell*)>;
+    using ExternalRangeSolver =
+        std::function<std::optional<FormulaError>(const ExternalRange*, std::vector<double>&)>;
+
+    // The solvers report errors as values: execution stops at the first
+    // error and returns it, nothing is thrown. range_solver appends the
+    // numeric values of the range cells to the vector, which is then
+    // aggregated as one contiguous block. The external solvers are called
+    // only for formulas with references to other sheets.
+    Value Execute(const CellSolver& solver, const RangeSolver& range_solver,
+                  const ExternalCellSolver& external_solver = {},
+                  const ExternalRangeSolver& external_range_solver = {}) const;
+    // a relative formula is printed with its references placed at origin
+    void PrintCells(std::ostream& out, Position origin = {0, 0}) const;
+    void Print(std::ostream& out, Position origin = {0, 0}) const;
+    void PrintFormula(std::ostream& out, Position origin = {0, 0}) const;
 
-    std::forward_list<Position>& GetCells() {
+    // Makes the references relative to origin, R1C1-style: a cell is then
+    // stored as its offset from origin, and the solvers passed to Execute
+    // have to add origin back. Parsed formulas are relative to A1, which
+    // is the same as absolute.
+    void MakeRelativeTo(Position origin);
+
+    // The offset given to a reference to a deleted cell: it is outside the
+    // sheet from any origin, so the reference prints and evaluates as #REF!.
+    static constexpr Position DELETED_REFERENCE{-2 * Position::MAX_ROWS, -2 * Position::MAX_COLS};
+    static constexpr Range DELETED_RANGE{DELETED_REFERENCE, DELETED_REFERENCE};
+
+    // The same program over other references: cells and ranges replace
+    // GetCells() and GetRanges() one for one, and external_offset is added
+    // to the references to other sheets.
+    FormulaAST WithReferences(std::vector<Position> cells, std::vector<Range> ranges,
+                              Position external_offset = {0, 0}) const;
+    // The same program over other references to other sheets: cells and
+    // ranges replace the offsets of GetExternals() one for one.
+    FormulaAST WithExternalReferences(std::vector<Position> cells, std::vector<Range> ranges) const;
+    // The same program with the references to the sheet named sheet made
+    // references to the formula's own sheet.
+    FormulaAST WithLocalReferences(std::string_view sheet) const;
+
+    // sorted and without duplicates
+    const std::vector<Position>& GetCells() const {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    const std::vector<Range>& GetRanges() const {
+        return ranges_;
     }
 
+    const ExternalReferences& GetExternals() const {
+        return externals_;
+    }
+
+    // as parsed, which is printed and saved
+    const ASTImpl::Program& GetProgram() const {
+        return program_;
+    }
+
+    // what Execute() runs, see ASTImpl::Optimize()
+    const ASTImpl::Program& GetExecutedProgram() const {
+        return optimized_.empty() ? program_ : optimized_;
+    }
+
+    // the most values Execute() keeps on its stack at once
+    std::size_t GetStackDepth() const {
+        return stack_depth_;
+    }
+
+    // whether Execute() runs native code, see SetFormulaJitThreshold()
+    bool IsCompiled() const;
+
+    // the bytes of the AST and of its native code, see memory_usage.h
+    std::size_t GetMemoryUsage() const;
+
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    struct NativeState;
+
+
+    // the expression tree built by the parser is lowered into this
+    // program and is not kept; printing decompiles the program
+    ASTImpl::Program program_;
+    // empty when optimizing leaves the program as it is
+    ASTImpl::Program optimized_;
+    std::size_t stack_depth_ = 0;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
+    std::vector<Position> cells_;
+    // ranges are kept whole rather than expanded into cells_
+    std::vector<Range> ranges_;
+    ExternalReferences externals_;
+    // only for the programs formula_jit.h can compile
+    std::unique_ptr<NativeState> native_;
+};
+
+// A formula executed this many times is compiled to native code, which
+// the next executions run once the cells it refers to are all numbers;
+// 0 keeps every formula interpreted. Only the builds with
+// SPREADSHEET_ENABLE_JIT compile formulas, and only the arithmetic ones,
+// see formula_jit.h. The results are the same either way.
+inline constexpr std::uint32_t DEFAULT_FORMULA_JIT_THRESHOLD = 64;
+
+void SetFormulaJitThreshold(std::uint32_t executions);
+std::uint32_t GetFormulaJitThreshold();
+
+// Antlr is the parser generated from Formula.g4. Handwritten is a
+// recursive-descent parser of the same grammar, which reads the text in
+// place and emits the program directly, without a parse tree and an
+// expression tree; it is used by default unless the build defines
+// SPREADSHEET_ANTLR_PARSER.
+enum class FormulaParserBackend {
+    Antlr,
+    Handwritten,
 };
 
+void SetFormulaParserBackend(FormulaParserBackend backend);
+FormulaParserBackend GetFormulaParserBackend();
+
+// these use the current backend
 FormulaAST ParseFormulaAST(std::istream& in);
 FormulaAST ParseFormulaAST(const std::string& in_str);
+
+FormulaAST ParseFormulaAST(std::string_view in_str, FormulaParserBackend backend);
+
+// The text of the formula with every reference replaced by its offset from
+// origin, so that copies of one formula filled across a sheet (B2*C2 in D2,
+// B3*C3 in D3, ...) all normalize to the same key. Throws ParsingError if
+// the text cannot be split into tokens.
+std::string NormalizeFormula(std::string_view in_str, Position origin);
+
+// Returns the formula parsed and made relative to origin. Formulas with the
+// same normalized text share one immutable AST, which is kept in a process
+// wide table for as long as any formula uses it.
+std::shared_ptr<const FormulaAST> InternFormulaAST(std::string_view in_str, Position origin);
@@ -0,0 +1,67 @@
+#include "aggregate.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SPREADSHEET_AGGREGATE_SSE2 1
+#endif
+
+void Accumulator::Add(double value) {
+    sum += value;
+    min = std::min(min, value);
+    max = std::max(max, value);
+    ++count;
+}
+
+void Accumulator::Add(const double* values, std::size_t size) {
+    std::size_t i = 0;
+#ifdef SPREADSHEET_AGGREGATE_SSE2
+    // two independent vectors per operation hide the latency of the adds
+    if (size >= 4) {
+        __m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd();
+        __m128d min0 = _mm_set1_pd(min), min1 = min0;
+        __m128d max0 = _mm_set1_pd(max), max1 = max0;
+        for (; i + 4 <= size; i += 4) {
+            const __m128d a = _mm_loadu_pd(values + i);
+            const __m128d b = _mm_loadu_pd(values + i + 2);
+            sum0 = _mm_add_pd(sum0, a);
+            sum1 = _mm_add_pd(sum1, b);
+            min0 = _mm_min_pd(min0, a);
+            min1 = _mm_min_pd(min1, b);
+            max0 = _mm_max_pd(max0, a);
+            max1 = _mm_max_pd(max1, b);
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes, _mm_add_pd(sum0, sum1));
+        sum += lanes[0] + lanes[1];
+        _mm_storeu_pd(lanes, _mm_min_pd(min0, min1));
+        min = std::min(lanes[0], lanes[1]);
+        _mm_storeu_pd(lanes, _mm_max_pd(max0, max1));
+        max = std::max(lanes[0], lanes[1]);
+        count += i;
+    }
+#endif
+    for (; i < size; ++i) {
+        Add(values[i]);
+    }
+}
+
+double Accumulator::GetResult(AggregateFunction function) const {
+    switch (function) {
+    case AggregateFunction::Sum:
+        return sum;
+    case AggregateFunction::Average:
+        return count != 0 ? sum / static_cast<double>(count) : std::nan("");
+    case AggregateFunction::Min:
+        return count != 0 ? min : 0.;
+    case AggregateFunction::Max:
+        return count != 0 ? max : 0.;
+    case AggregateFunction::Count:
+        return static_cast<double>(count);
+    }
+    assert(false);
+    return 0.;
+}
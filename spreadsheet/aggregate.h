@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+
+enum class AggregateFunction : char {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+// Running state of an aggregate function call. All the supported functions
+// are computed from the sum, count and extremes of the arguments, so one
+// kind of accumulator serves all of them.
+struct Accumulator {
+    double sum = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    std::size_t count = 0;
+
+    void Add(double value);
+
+    // Adds a contiguous block of values, using SIMD where available.
+    void Add(const double* values, std::size_t size);
+
+    // AVERAGE of no values is NaN (reported as #DIV/0!), MIN and MAX of no
+    // values are 0.
+    double GetResult(AggregateFunction function) const;
+};
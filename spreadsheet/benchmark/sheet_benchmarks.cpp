@@ -0,0 +1,444 @@
+#include "FormulaAST.h"
+#include "sheet.h"
+#include "tsv.h"
+#include "workloads.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+using workloads::Cells;
+
+// the recalculation mode arguments: 0 is Lazy, 1 Eager and 2 Parallel
+Sheet::RecalcMode ModeArg(const benchmark::State& state, int index) {
+    return static_cast<Sheet::RecalcMode>(state.range(index));
+}
+
+std::unique_ptr<Sheet> MakeSheet(const Cells& cells, Sheet::RecalcMode mode = Sheet::RecalcMode::Lazy) {
+    auto sheet = std::make_unique<Sheet>();
+    sheet->SetRecalcMode(mode);
+    sheet->SetCells(cells);
+    sheet->Recalculate();
+    return sheet;
+}
+
+// Changes A1 of the sheet and reads the given cell: the eager modes
+// recompute everything depending on A1 while setting it, the lazy one only
+// what the cell read depends on.
+void ChangeAndRecalculate(benchmark::State& state, Sheet& sheet, Position read) {
+    int value = 0;
+    for (auto _ : state) {
+        sheet.SetCell({0, 0}, std::to_string(++value % 100));
+        benchmark::DoNotOptimize(sheet.GetCell(read)->GetValue());
+    }
+}
+
+// -- Building sheets --
+
+void BM_SetCellDenseGrid(benchmark::State& state) {
+    const auto cells = workloads::DenseGrid(state.range(0), state.range(0));
+    for (auto _ : state) {
+        Sheet sheet;
+        for (const auto& [pos, text] : cells) {
+            sheet.SetCell(pos, text);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * cells.size());
+}
+BENCHMARK(BM_SetCellDenseGrid)->Arg(64)->Arg(256);
+
+void BM_SetCellFillDown(benchmark::State& state) {
+    const auto cells = workloads::FillDown(state.range(0));
+    for (auto _ : state) {
+        Sheet sheet;
+        for (const auto& [pos, text] : cells) {
+            sheet.SetCell(pos, text);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * cells.size());
+}
+BENCHMARK(BM_SetCellFillDown)->Arg(1 << 10)->Arg(1 << 14);
+
+void BM_SetCellsFillDown(benchmark::State& state) {
+    const auto cells = workloads::FillDown(state.range(0));
+    for (auto _ : state) {
+        Sheet sheet;
+        sheet.SetCells(cells);
+    }
+    state.SetItemsProcessed(state.iterations() * cells.size());
+}
+BENCHMARK(BM_SetCellsFillDown)->Arg(1 << 10)->Arg(1 << 14);
+
+void BM_SetCellChain(benchmark::State& state) {
+    const auto cells = workloads::Chain(state.range(0));
+    for (auto _ : state) {
+        Sheet sheet;
+        for (const auto& [pos, text] : cells) {
+            sheet.SetCell(pos, text);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * cells.size());
+}
+BENCHMARK(BM_SetCellChain)->Arg(1 << 10)->Arg(1 << 14);
+
+void BM_SetCellsRandomDag(benchmark::State& state) {
+    const auto cells = workloads::RandomDag(state.range(0), 4, 42);
+    for (auto _ : state) {
+        Sheet sheet;
+        sheet.SetCells(cells);
+    }
+    state.SetItemsProcessed(state.iterations() * cells.size());
+}
+BENCHMARK(BM_SetCellsRandomDag)->Arg(1 << 12)->Arg(1 << 16);
+
+// -- Recalculation --
+
+void BM_RecalcChain(benchmark::State& state) {
+    const int length = state.range(0);
+    auto sheet = MakeSheet(workloads::Chain(length), ModeArg(state, 1));
+    ChangeAndRecalculate(state, *sheet, {length - 1, 0});
+    state.SetItemsProcessed(state.iterations() * length);
+}
+BENCHMARK(BM_RecalcChain)->ArgsProduct({{1 << 10, 1 << 14}, {0, 1, 2}});
+
+void BM_RecalcFanOut(benchmark::State& state) {
+    const int width = state.range(0);
+    auto sheet = MakeSheet(workloads::FanOut(width), ModeArg(state, 1));
+    ChangeAndRecalculate(state, *sheet, {width - 1, 1});
+    state.SetItemsProcessed(state.iterations() * width);
+}
+BENCHMARK(BM_RecalcFanOut)->ArgsProduct({{1 << 10, 1 << 14}, {0, 1, 2}});
+
+void BM_RecalcDiamond(benchmark::State& state) {
+    const int layers = state.range(0);
+    const int width = 64;
+    auto sheet = MakeSheet(workloads::Diamond(layers, width), ModeArg(state, 1));
+    ChangeAndRecalculate(state, *sheet, {0, layers - 1});
+    state.SetItemsProcessed(state.iterations() * layers * width);
+}
+BENCHMARK(BM_RecalcDiamond)->ArgsProduct({{16, 256}, {0, 1, 2}});
+
+void BM_RecalcRandomDag(benchmark::State& state) {
+    const int count = state.range(0);
+    const auto cells = workloads::RandomDag(count, 4, 42);
+    auto sheet = MakeSheet(cells, ModeArg(state, 1));
+    ChangeAndRecalculate(state, *sheet, cells.back().first);
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_RecalcRandomDag)->ArgsProduct({{1 << 12, 1 << 16}, {0, 1, 2}});
+
+// Keeps changing the input of a long chain without reading anything, like
+// typing into a cell: only the first change walks the chain, the next ones
+// stop at its first, already invalid, formula, so the time does not grow
+// with the length.
+void BM_InvalidateUnread(benchmark::State& state) {
+    const int length = state.range(0);
+    auto sheet = MakeSheet(workloads::Chain(length));
+    sheet->GetCell({length - 1, 0})->GetValue();
+    int value = 0;
+    for (auto _ : state) {
+        sheet->SetCell({0, 0}, std::to_string(++value % 100));
+    }
+}
+BENCHMARK(BM_InvalidateUnread)->Arg(1 << 10)->Arg(1 << 14);
+
+// A formula closing a cycle through the whole chain is looked for and
+// rejected every time.
+void BM_CircularDependency(benchmark::State& state) {
+    const int length = state.range(0);
+    auto sheet = MakeSheet(workloads::Chain(length));
+    const std::string closing = "=" + Position{length - 1, 0}.ToString();
+    for (auto _ : state) {
+        try {
+            sheet->SetCell({0, 0}, closing);
+        } catch (const CircularDependencyException&) {
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * length);
+}
+BENCHMARK(BM_CircularDependency)->Arg(1 << 10)->Arg(1 << 14);
+
+// A row inserted and deleted again in the middle of a filled column: the
+// rows below move, and their formulas keep their shared ASTs and values.
+void BM_InsertDeleteRows(benchmark::State& state) {
+    const int rows = state.range(0);
+    auto sheet = MakeSheet(workloads::FillDown(rows));
+    sheet->GetCell({rows - 1, 1})->GetValue();
+    for (auto _ : state) {
+        sheet->InsertRows(rows / 2);
+        sheet->DeleteRows(rows / 2);
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+}
+BENCHMARK(BM_InsertDeleteRows)->Arg(1 << 10)->Arg(1 << 13);
+
+// One edit and a new version of a large sheet: only the changed blocks of
+// the version are copied.
+void BM_PublishVersion(benchmark::State& state) {
+    auto sheet = MakeSheet(workloads::FillDown(state.range(0)));
+    sheet->PublishVersion();
+    int value = 0;
+    for (auto _ : state) {
+        sheet->SetCell({0, 0}, std::to_string(++value % 100));
+        benchmark::DoNotOptimize(sheet->PublishVersion());
+    }
+}
+BENCHMARK(BM_PublishVersion)->Arg(1 << 10)->Arg(1 << 14);
+
+// -- Memory --
+
+// A computed sheet hibernated and woken by a read; the counters give the
+// bytes it holds awake and hibernated.
+void BM_HibernateAndWake(benchmark::State& state) {
+    auto sheet = MakeSheet(workloads::FillDown(state.range(0)));
+    const std::size_t awake = sheet->GetMemoryUsage().GetTotal();
+    sheet->Hibernate();
+    const std::size_t hibernated = sheet->GetMemoryUsage().GetTotal();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(sheet->GetCell({0, 1})->GetValue());
+        sheet->Hibernate();
+    }
+    state.counters["awake_bytes"] = static_cast<double>(awake);
+    state.counters["hibernated_bytes"] = static_cast<double>(hibernated);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_HibernateAndWake)->Arg(1 << 10)->Arg(1 << 14);
+
+// -- Positions --
+
+// Position::ToString(), Position::FromString() and Sheet::KeyHash as they
+// were before the single-pass versions, to compare with
+std::string LegacyToString(Position pos) {
+    std::string result;
+    for (int c = pos.col; c >= 0; c = c / 26 - 1) {
+        result.insert(result.begin(), static_cast<char>('A' + c % 26));
+    }
+    return result + std::to_string(pos.row + 1);
+}
+
+Position LegacyFromString(std::string_view str) {
+    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
+        return !(std::isalpha(c) && std::isupper(c));
+    });
+    auto letters = str.substr(0, it - str.begin());
+    auto digits = str.substr(it - str.begin());
+    if (letters.empty() || digits.empty() || letters.size() > 3 || !std::isdigit(digits[0])) {
+        return Position::NONE;
+    }
+    int row;
+    std::istringstream row_in{std::string{digits}};
+    if (!(row_in >> row) || !row_in.eof()) {
+        return Position::NONE;
+    }
+    int col = 0;
+    for (char ch : letters) {
+        col = col * 26 + ch - 'A' + 1;
+    }
+    return {row - 1, col - 1};
+}
+
+struct LegacyKeyHash {
+    std::size_t operator()(const Position& pos) const {
+        return static_cast<std::size_t>(pos.row) + 100'000 * static_cast<std::size_t>(pos.col);
+    }
+};
+
+struct PackedKeyHash {
+    std::size_t operator()(const Position& pos) const {
+        return pos.ToKey();
+    }
+};
+
+// positions spread over the columns of one, two and three letters
+std::vector<Position> SamplePositions() {
+    std::vector<Position> positions;
+    for (int i = 0; i < 1024; ++i) {
+        positions.push_back({i * 16 % Position::MAX_ROWS, i * i % Position::MAX_COLS});
+    }
+    return positions;
+}
+
+// argument 0 is the legacy version, 1 the current one
+void BM_PositionToString(benchmark::State& state) {
+    const auto positions = SamplePositions();
+    for (auto _ : state) {
+        for (const auto& pos : positions) {
+            benchmark::DoNotOptimize(state.range(0) != 0 ? pos.ToString() : LegacyToString(pos));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * positions.size());
+}
+BENCHMARK(BM_PositionToString)->Arg(0)->Arg(1);
+
+void BM_PositionFromString(benchmark::State& state) {
+    std::vector<std::string> texts;
+    for (const auto& pos : SamplePositions()) {
+        texts.push_back(pos.ToString());
+    }
+    for (auto _ : state) {
+        for (const auto& text : texts) {
+            benchmark::DoNotOptimize(state.range(0) != 0 ? Position::FromString(text) : LegacyFromString(text));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * texts.size());
+}
+BENCHMARK(BM_PositionFromString)->Arg(0)->Arg(1);
+
+// a set of the cells of columns filled down, as the dependency graph
+// keeps, by rows and columns
+template <typename Hash>
+void BM_PositionHash(benchmark::State& state) {
+    const int rows = state.range(0);
+    const int cols = state.range(1);
+    for (auto _ : state) {
+        std::unordered_set<Position, Hash> cells;
+        for (int col = 0; col < cols; ++col) {
+            for (int row = 0; row < rows; ++row) {
+                cells.insert({row, col});
+            }
+        }
+        for (int col = 0; col < cols; ++col) {
+            for (int row = 0; row < rows; ++row) {
+                benchmark::DoNotOptimize(cells.count({row, col}));
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * rows * cols);
+}
+BENCHMARK_TEMPLATE(BM_PositionHash, LegacyKeyHash)->Args({4096, 16})->Args({16384, 64});
+BENCHMARK_TEMPLATE(BM_PositionHash, PackedKeyHash)->Args({4096, 16})->Args({16384, 64});
+
+// -- Parsing --
+
+void BM_ParseFormulaAST(benchmark::State& state) {
+    const std::vector<std::string> expressions = {
+        "1+2*3",
+        "A1+B2*C3-D4/E5",
+        "(A1+A2)*(B1-B2)/(C1+1)-(-D1)",
+        "SUM(A1:B100)+MAX(C1:C10)*2",
+        "ZZ1000*3.25e-2+AB12/(1+XY99)",
+    };
+    std::size_t bytes = 0;
+    for (auto _ : state) {
+        for (const auto& expression : expressions) {
+            benchmark::DoNotOptimize(ParseFormulaAST(expression));
+            bytes += expression.size();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * expressions.size());
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_ParseFormulaAST);
+
+// -- Evaluation --
+
+// formulas with constant parts, which are computed once when parsing; the
+// argument is the JIT threshold, 0 keeping them interpreted
+void BM_ExecuteFormulaAST(benchmark::State& state) {
+    const std::uint32_t threshold = GetFormulaJitThreshold();
+    SetFormulaJitThreshold(state.range(0));
+    const std::vector<std::string> expressions = {
+        "A1*(1+0.07)/12",
+        "(A1-32)*5/9",
+        "+A1*1-(-B1)+SUM(1,2,3)*C1",
+        "A1/(24*60*60)",
+    };
+    std::vector<FormulaAST> asts;
+    for (const auto& expression : expressions) {
+        asts.push_back(ParseFormulaAST(expression));
+    }
+    const FormulaAST::CellSolver solver = [](const Position*) -> FormulaAST::Value {
+        return 2.0;
+    };
+    const FormulaAST::RangeSolver range_solver = [](const Range*, std::vector<double>&) {
+        return std::optional<FormulaError>();
+    };
+    for (auto _ : state) {
+        for (const auto& ast : asts) {
+            benchmark::DoNotOptimize(ast.Execute(solver, range_solver));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * asts.size());
+    SetFormulaJitThreshold(threshold);
+}
+BENCHMARK(BM_ExecuteFormulaAST)->Arg(0)->Arg(1);
+
+// -- Scenarios --
+
+// The diamond over as many scenarios of its first column: setting the
+// inputs and reading the last column lane after lane (argument 0), or all
+// the lanes at once with EvaluateScenarios() (argument 1).
+void BM_EvaluateScenarios(benchmark::State& state) {
+    const int layers = 16;
+    const int width = 64;
+    const auto lane_count = static_cast<std::size_t>(state.range(0));
+    auto sheet = MakeSheet(workloads::Diamond(layers, width));
+    std::vector<Position> inputs;
+    std::vector<Position> outputs;
+    for (int row = 0; row < width; ++row) {
+        inputs.push_back({row, 0});
+        outputs.push_back({row, layers - 1});
+    }
+    ScenarioBlock values(inputs.size(), lane_count);
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        for (std::size_t lane = 0; lane < lane_count; ++lane) {
+            values.GetColumn(i)[lane] = static_cast<double>((i + lane) % 100);
+        }
+    }
+    for (auto _ : state) {
+        if (state.range(1) != 0) {
+            benchmark::DoNotOptimize(sheet->EvaluateScenarios(inputs, values, outputs));
+            continue;
+        }
+        for (std::size_t lane = 0; lane < lane_count; ++lane) {
+            for (std::size_t i = 0; i < inputs.size(); ++i) {
+                sheet->SetCell(inputs[i], std::to_string(static_cast<int>(values.GetColumn(i)[lane])));
+            }
+            for (const auto& output : outputs) {
+                benchmark::DoNotOptimize(sheet->GetCell(output)->GetValue());
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * lane_count);
+}
+BENCHMARK(BM_EvaluateScenarios)->ArgsProduct({{64, 1024}, {0, 1}});
+
+// -- Output and bulk input --
+
+void BM_PrintValues(benchmark::State& state) {
+    auto sheet = MakeSheet(workloads::FillDown(state.range(0)));
+    std::ostringstream out;
+    for (auto _ : state) {
+        out.str({});
+        sheet->PrintValues(out);
+    }
+    state.SetBytesProcessed(state.iterations() * out.str().size());
+}
+BENCHMARK(BM_PrintValues)->Arg(1 << 10)->Arg(1 << 14);
+
+void BM_ImportTsv(benchmark::State& state) {
+    std::ostringstream tsv;
+    ExportTsv(*MakeSheet(workloads::FillDown(state.range(0))), tsv, TsvContent::Texts);
+    const std::string input = tsv.str();
+    TsvImportOptions options;
+    options.pipelined = state.range(1) != 0;
+    for (auto _ : state) {
+        Sheet sheet;
+        std::istringstream in(input);
+        ImportTsv(in, sheet, options);
+    }
+    state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_ImportTsv)->ArgsProduct({{1 << 14}, {0, 1}});
+
+}  // namespace
+
+BENCHMARK_MAIN();
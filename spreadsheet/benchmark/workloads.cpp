@@ -0,0 +1,110 @@
+#include "workloads.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace workloads {
+
+namespace {
+
+std::string Ref(int row, int col) {
+    return Position{row, col}.ToString();
+}
+
+}  // namespace
+
+Cells DenseGrid(int rows, int cols) {
+    Cells cells;
+    cells.reserve(static_cast<std::size_t>(rows) * cols);
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            cells.emplace_back(Position{row, col}, std::to_string(row * cols + col));
+        }
+    }
+    return cells;
+}
+
+Cells FillDown(int rows) {
+    Cells cells;
+    cells.reserve(2 * static_cast<std::size_t>(rows));
+    for (int row = 0; row < rows; ++row) {
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+        cells.emplace_back(Position{row, 1}, "=" + Ref(row, 0) + "*2+1");
+    }
+    return cells;
+}
+
+Cells Chain(int length) {
+    Cells cells;
+    cells.reserve(length);
+    cells.emplace_back(Position{0, 0}, "1");
+    for (int row = 1; row < length; ++row) {
+        cells.emplace_back(Position{row, 0}, "=" + Ref(row - 1, 0) + "+1");
+    }
+    return cells;
+}
+
+Cells FanOut(int width) {
+    Cells cells;
+    cells.reserve(width + 1);
+    cells.emplace_back(Position{0, 0}, "1");
+    for (int row = 0; row < width; ++row) {
+        cells.emplace_back(Position{row, 1}, "=A1*" + std::to_string(row));
+    }
+    return cells;
+}
+
+Cells Diamond(int layers, int width) {
+    Cells cells;
+    cells.reserve(static_cast<std::size_t>(layers) * width);
+    for (int row = 0; row < width; ++row) {
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+    }
+    for (int col = 1; col < layers; ++col) {
+        for (int row = 0; row < width; ++row) {
+            cells.emplace_back(Position{row, col},
+                               "=" + Ref(row, col - 1) + "+" + Ref((row + 1) % width, col - 1));
+        }
+    }
+    return cells;
+}
+
+Cells RandomDag(int count, int max_refs, std::uint32_t seed) {
+    const int cols = std::max(1, static_cast<int>(std::sqrt(count)));
+    auto position = [cols](int index) {
+        return Position{index / cols, index % cols};
+    };
+
+    std::mt19937 random(seed);
+    Cells cells;
+    cells.reserve(count);
+    for (int index = 0; index < count; ++index) {
+        const int refs = index < cols ? 0 : std::uniform_int_distribution(0, max_refs)(random);
+        if (refs == 0) {
+            cells.emplace_back(position(index), std::to_string(random() % 1000));
+            continue;
+        }
+        // everything in the rows above the current one is already set
+        const int above = index / cols * cols;
+        std::uniform_int_distribution<int> earlier(0, above - 1);
+        std::string formula = "=";
+        for (int ref = 0; ref < refs; ++ref) {
+            if (ref != 0) {
+                formula += '+';
+            }
+            const Position first = position(earlier(random));
+            if (random() % 4 == 0) {
+                const Position last = {std::min(first.row + 3, above / cols - 1),
+                                       std::min(first.col + 3, cols - 1)};
+                formula += "SUM(" + first.ToString() + ":" + last.ToString() + ")";
+            } else {
+                formula += first.ToString();
+            }
+        }
+        cells.emplace_back(position(index), std::move(formula));
+    }
+    return cells;
+}
+
+}  // namespace workloads
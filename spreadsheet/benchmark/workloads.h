@@ -0,0 +1,37 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Synthetic sheets for the benchmarks, as SetCells() input. The same
+// arguments always give the same cells.
+namespace workloads {
+
+using Cells = std::vector<std::pair<Position, std::string>>;
+
+// rows x cols numbers
+Cells DenseGrid(int rows, int cols);
+
+// numbers in column A and "=An*2+1" next to each in column B, the formulas
+// differing only in their row like a column filled down
+Cells FillDown(int rows);
+
+// A1 is a number and every next cell of column A adds one to the previous
+Cells Chain(int length);
+
+// A1 is a number and width formulas in column B read it
+Cells FanOut(int width);
+
+// layers columns of width cells, each reading two cells of the previous
+// column, so every cell is reached from the first column along many paths
+Cells Diamond(int layers, int width);
+
+// count cells filling the rows of a square, each a number or a formula
+// reading up to max_refs cells and ranges set before it, chosen with seed
+Cells RandomDag(int count, int max_refs, std::uint32_t seed);
+
+}  // namespace workloads
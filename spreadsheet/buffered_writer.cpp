@@ -0,0 +1,112 @@
+#include "buffered_writer.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <sstream>
+#include <variant>
+
+namespace {
+
+// the longest output of to_chars in the general format with a precision up
+// to MAX_PRECISION: sign, digits, point and exponent
+constexpr int MAX_PRECISION = 17;
+constexpr std::size_t MAX_LENGTH = 32;
+
+bool IsDefaultFloatFormat(const std::ostream& out) {
+    constexpr auto flags = std::ios_base::floatfield | std::ios_base::uppercase |
+                           std::ios_base::showpoint | std::ios_base::showpos;
+    return (out.flags() & flags) == std::ios_base::fmtflags{} && out.precision() <= MAX_PRECISION;
+}
+
+}  // namespace
+
+BufferedWriter::BufferedWriter(std::ostream& out)
+    : out_(out)
+    , use_to_chars_(IsDefaultFloatFormat(out))
+    // like printf, a zero precision is taken as one
+    , precision_(std::max(static_cast<int>(out.precision()), 1))
+    , buffer_(std::make_unique<char[]>(BUFFER_SIZE)) {
+}
+
+void BufferedWriter::Write(std::string_view text) {
+    if (text.size() > BUFFER_SIZE - size_) {
+        Flush();
+        if (text.size() > BUFFER_SIZE) {
+            out_.write(text.data(), static_cast<std::streamsize>(text.size()));
+            return;
+        }
+    }
+    std::memcpy(buffer_.get() + size_, text.data(), text.size());
+    size_ += text.size();
+}
+
+void BufferedWriter::Write(char c) {
+    if (size_ == BUFFER_SIZE) {
+        Flush();
+    }
+    buffer_[size_++] = c;
+}
+
+void BufferedWriter::Write(double number) {
+    if (!use_to_chars_) {
+        std::ostringstream formatted;
+        formatted.copyfmt(out_);
+        formatted.width(0);
+        formatted << number;
+        Write(formatted.str());
+        return;
+    }
+    if (BUFFER_SIZE - size_ < MAX_LENGTH) {
+        Flush();
+    }
+    char* first = buffer_.get() + size_;
+    const auto result =
+        std::to_chars(first, first + MAX_LENGTH, number, std::chars_format::general, precision_);
+    size_ += result.ptr - first;
+}
+
+void BufferedWriter::Repeat(char c, std::size_t count) {
+    while (count > 0) {
+        if (size_ == BUFFER_SIZE) {
+            Flush();
+        }
+        const std::size_t chunk = std::min(count, BUFFER_SIZE - size_);
+        std::memset(buffer_.get() + size_, c, chunk);
+        size_ += chunk;
+        count -= chunk;
+    }
+}
+
+void BufferedWriter::Flush() {
+    out_.write(buffer_.get(), static_cast<std::streamsize>(size_));
+    size_ = 0;
+}
+
+void WriteValue(BufferedWriter& writer, const CellInterface::Value& value) {
+    if (const auto* text = std::get_if<std::string>(&value)) {
+        writer.Write(*text);
+    } else if (const auto* number = std::get_if<double>(&value)) {
+        writer.Write(*number);
+    } else {
+        writer.Write(std::get<FormulaError>(value).ToString());
+    }
+}
+
+GridPrinter::GridPrinter(BufferedWriter& writer, Size size)
+    : writer_(writer)
+    , size_(size) {
+}
+
+void GridPrinter::MoveTo(Position pos) {
+    for (; next_.row < pos.row; ++next_.row, next_.col = 0) {
+        writer_.Repeat('\t', size_.cols - 1 - next_.col);
+        writer_.Write('\n');
+    }
+    writer_.Repeat('\t', pos.col - next_.col);
+    next_.col = pos.col;
+}
+
+void GridPrinter::Finish() {
+    MoveTo({size_.rows, 0});
+}
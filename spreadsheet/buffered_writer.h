@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <string_view>
+
+#include "common.h"
+
+// Collects output in a buffer and passes it to the stream in large blocks.
+// Doubles are formatted with std::to_chars, giving what the stream would
+// print with its precision in the default float format; other formats go
+// through the stream's own formatting. Flush() must be called at the end,
+// the destructor discards what is left.
+class BufferedWriter {
+public:
+    explicit BufferedWriter(std::ostream& out);
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+    void Write(std::string_view text);
+    void Write(char c);
+    void Write(double number);
+    void Repeat(char c, std::size_t count);
+    void Flush();
+
+private:
+    static constexpr std::size_t BUFFER_SIZE = 1 << 16;
+
+    std::ostream& out_;
+    const bool use_to_chars_;
+    const int precision_;
+    std::unique_ptr<char[]> buffer_;
+    std::size_t size_ = 0;
+};
+
+// Writes a cell value the way PrintValues() does.
+void WriteValue(BufferedWriter& writer, const CellInterface::Value& value);
+
+// Lays out fields given in row-major order as the rows x cols grid that the
+// sheets print, with a tab between fields and a newline after every row.
+class GridPrinter {
+public:
+    GridPrinter(BufferedWriter& writer, Size size);
+
+    // Writes the separators before the field at pos, which must come after
+    // the previous one.
+    void MoveTo(Position pos);
+    // Writes the separators after the last field.
+    void Finish();
+
+private:
+    BufferedWriter& writer_;
+    const Size size_;
+    Position next_{0, 0};  // the separators before next_ are written
+};
@@ -2,136 +2,368 @@
 #include "sheet.h"
 
 #include <cassert>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <new>
 #include <optional>
+#include <sstream>
 #include <string>
+#include <utility>
 
-Cell::Cell(const Sheet& sh)
-    : sheet_(sh), impl_(std::make_unique<EmptyImpl>(EmptyImpl{})) {}
+namespace {
 
-Cell::Cell(const Sheet& sh, std::string text)
-    : sheet_(sh), impl_(nullptr) {
-    Set(std::move(text));
+// the same rule formulas apply to the values of text cells
+std::optional<double> ParseNumber(std::string_view value) {
+    double result;
+    std::istringstream value_in{std::string(value)};
+    if (!value.empty() && value_in >> result && value_in.eof()) {
+        return result;
+    }
+    return std::nullopt;
+}
+
+std::string_view GetTextValue(std::string_view text) {
+    if (!text.empty() && text[0] == ESCAPE_SIGN) {
+        text.remove_prefix(1);
+    }
+    return text;
+}
+
+std::unique_ptr<FormulaInterface> CountedParseFormula(const Sheet& sh, std::string expr, Position pos) {
+    SheetCounters& counters = sh.GetCounters();
+    counters.Add(SheetCounters::FormulaParses);
+    SheetCounters::Timer timer(counters, SheetCounters::ParseNanoseconds);
+    return ParseFormula(std::move(expr), pos);
 }
 
-Cell::~Cell() {}
+}  // namespace
+
+static_assert(sizeof(Cell) == 3 * sizeof(void*));
+
+Cell::Cell() = default;
 
-void Cell::Set(std::string text) {
+Cell::Cell(const Sheet& sh, std::string text, Position pos) {
     if (text.empty()) {
-        impl_ = std::make_unique<EmptyImpl>(EmptyImpl{});
-    } else if (text[0] == FORMULA_SIGN && text.size() > 1) {
-        impl_ = std::make_unique<FormulaImpl>(sheet_, text.substr(1));
+        return;
+    }
+    if (text[0] == FORMULA_SIGN && text.size() > 1) {
+        SetRecord(Kind::Formula, NewRecord<FormulaRecord>(sh.GetCellMemory(), sh, text.substr(1), pos));
+        return;
+    }
+    const auto number = ParseNumber(GetTextValue(text));
+    SetText(sh, std::move(text), number);
+}
+
+Cell::Cell(const Sheet& sh, std::string text, std::optional<double> number) {
+    if (!text.empty()) {
+        SetText(sh, std::move(text), number);
+    }
+}
+
+Cell::Cell(const Sheet& sh, std::unique_ptr<FormulaInterface> formula,
+           std::optional<FormulaInterface::Value> cache) {
+    SetRecord(Kind::Formula,
+              NewRecord<FormulaRecord>(sh.GetCellMemory(), sh, std::move(formula), std::move(cache)));
+}
+
+void Cell::SetText(const Sheet& sh, std::string text, std::optional<double> number) {
+    assert(!text.empty());
+    if (number && text.size() <= SHORT_NUMBER_TEXT_SIZE) {
+        std::memcpy(payload_, &*number, sizeof(double));
+        std::memcpy(payload_ + sizeof(double), text.data(), text.size());
+        SetTag(Kind::ShortNumber, text.size());
+    } else if (!number && text.size() <= PAYLOAD_SIZE) {
+        std::memcpy(payload_, text.data(), text.size());
+        SetTag(Kind::ShortText, text.size());
     } else {
-        impl_ = std::make_unique<TextImpl>(TextImpl(std::move(text)));
+        auto& memory = sh.GetCellMemory();
+        SetRecord(Kind::Text, NewRecord<TextRecord>(memory, memory, std::move(text), number));
+    }
+}
+
+Cell::Cell(Cell&& other) noexcept
+    : tag_(other.tag_) {
+    std::memcpy(payload_, other.payload_, PAYLOAD_SIZE);
+    other.SetTag(Kind::Empty);
+}
+
+Cell::~Cell() {
+    if (GetKind() == Kind::Text) {
+        DeleteRecord(&GetTextRecord());
+    } else if (GetKind() == Kind::Formula) {
+        DeleteRecord(&GetFormulaRecord());
     }
 }
 
 Cell::Value Cell::GetValue() const {
-    return impl_->GetValue();
+    switch (GetKind()) {
+    case Kind::Empty:
+        return std::string{};
+    case Kind::ShortText:
+    case Kind::ShortNumber:
+        return std::string(GetTextValue(GetShortText()));
+    case Kind::Text:
+        return std::string(GetTextValue(GetTextRecord().GetText()));
+    case Kind::Formula:
+        return GetFormulaRecord().GetValue();
+    }
+    assert(false);
+    return std::string{};
+}
+
+Cell::Value Cell::ComputeValue() const {
+    if (GetKind() == Kind::Formula) {
+        return GetFormulaRecord().GetValue(true);
+    }
+    return GetValue();
 }
 
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    switch (GetKind()) {
+    case Kind::Empty:
+        return std::string{};
+    case Kind::ShortText:
+    case Kind::ShortNumber:
+        return std::string(GetShortText());
+    case Kind::Text:
+        return GetTextRecord().GetText();
+    case Kind::Formula:
+        return GetFormulaRecord().GetText();
+    }
+    assert(false);
+    return std::string{};
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
+    if (GetKind() == Kind::Formula) {
+        return GetFormulaRecord().GetReferencedCells();
+    }
+    return {};
+}
+
+std::vector<Range> Cell::GetReferencedRanges() const {
+    if (GetKind() == Kind::Formula) {
+        return GetFormulaRecord().GetReferencedRanges();
+    }
+    return {};
+}
+
+std::optional<double> Cell::GetNumber() const {
+    switch (GetKind()) {
+    case Kind::ShortNumber:
+        return GetShortNumber();
+    case Kind::Text:
+        return GetTextRecord().GetNumber();
+    case Kind::Formula:
+        return GetFormulaRecord().GetNumber();
+    default:
+        return std::nullopt;
+    }
 }
 
 void Cell::InvalidateCellCache() const {
-    impl_->InvalidateCache();
+    if (GetKind() == Kind::Formula) {
+        GetFormulaRecord().InvalidateCache();
+    }
+}
+
+bool Cell::IsCacheValid() const {
+    return GetKind() != Kind::Formula || GetFormulaRecord().IsCacheValid();
 }
 
 bool Cell::IsEmpty() const {
-    return impl_->IsEmpty();
+    return GetKind() == Kind::Empty;
 }
 
-// -- EmptyImpl --
+const FormulaInterface* Cell::GetFormula() const {
+    return GetKind() == Kind::Formula ? &GetFormulaRecord().GetFormula() : nullptr;
+}
 
-CellInterface::Value Cell::EmptyImpl::GetValue() const {
-    return std::string{};
+std::optional<FormulaInterface::Value> Cell::GetCachedValue() const {
+    if (GetKind() == Kind::Formula) {
+        return GetFormulaRecord().GetCachedValue();
+    }
+    return std::nullopt;
 }
 
-std::string Cell::EmptyImpl::GetText() const {
-    return std::string{};
+std::size_t Cell::GetHeapMemory() const {
+    switch (GetKind()) {
+    case Kind::Text: {
+        const std::string& text = GetTextRecord().GetText();
+        // a short string is kept inside the record
+        return text.capacity() > std::string().capacity() ? text.capacity() + 1 : 0;
+    }
+    case Kind::Formula:
+        return GetFormulaRecord().GetFormula().GetMemoryUsage();
+    default:
+        return 0;
+    }
 }
 
-std::vector<Position> Cell::EmptyImpl::GetReferencedCells() const {
-    return {};
+std::string_view Cell::GetShortText() const {
+    if (GetKind() == Kind::ShortNumber) {
+        return {payload_ + sizeof(double), GetShortSize()};
+    }
+    assert(GetKind() == Kind::ShortText);
+    return {payload_, GetShortSize()};
 }
 
-void Cell::EmptyImpl::InvalidateCache() const {
-    //    does nothing
+double Cell::GetShortNumber() const {
+    assert(GetKind() == Kind::ShortNumber);
+    double number;
+    std::memcpy(&number, payload_, sizeof(double));
+    return number;
 }
 
-bool Cell::EmptyImpl::IsEmpty() const {
-    return true;
+const Cell::TextRecord& Cell::GetTextRecord() const {
+    assert(GetKind() == Kind::Text);
+    const TextRecord* record;
+    std::memcpy(&record, payload_, sizeof(record));
+    return *record;
 }
 
-// -- TextImpl --
+const Cell::FormulaRecord& Cell::GetFormulaRecord() const {
+    assert(GetKind() == Kind::Formula);
+    const FormulaRecord* record;
+    std::memcpy(&record, payload_, sizeof(record));
+    return *record;
+}
 
-Cell::TextImpl::TextImpl(std::string text) : text_(std::move(text)) {}
+void Cell::SetRecord(Kind kind, const void* record) {
+    std::memcpy(payload_, &record, sizeof(record));
+    SetTag(kind);
+}
 
-CellInterface::Value Cell::TextImpl::GetValue() const {
-    assert(!text_.empty());
-    if (text_[0] == ESCAPE_SIGN) {
-        return text_.substr(1);
+template <typename Record, typename... Args>
+Record* Cell::NewRecord(std::pmr::memory_resource& memory, Args&&... args) {
+    void* block = memory.allocate(sizeof(Record), alignof(Record));
+    try {
+        return new (block) Record(std::forward<Args>(args)...);
+    } catch (...) {
+        memory.deallocate(block, sizeof(Record), alignof(Record));
+        throw;
     }
-    return text_;
 }
 
-std::string Cell::TextImpl::GetText() const {
-    return text_;
+template <typename Record>
+void Cell::DeleteRecord(const Record* record) {
+    auto& memory = record->GetMemory();
+    record->~Record();
+    memory.deallocate(const_cast<Record*>(record), sizeof(Record), alignof(Record));
 }
 
-std::vector<Position> Cell::TextImpl::GetReferencedCells() const {
-    return {};
+// -- TextRecord --
+
+Cell::TextRecord::TextRecord(std::pmr::memory_resource& memory, std::string text,
+                             std::optional<double> number)
+    : memory_(memory), text_(std::move(text)), number_(number) {}
+
+std::pmr::memory_resource& Cell::TextRecord::GetMemory() const {
+    return memory_;
 }
 
-void Cell::TextImpl::InvalidateCache() const {
-    //    does nothing
+const std::string& Cell::TextRecord::GetText() const {
+    return text_;
 }
 
-bool Cell::TextImpl::IsEmpty() const {
-    return false;
+std::optional<double> Cell::TextRecord::GetNumber() const {
+    return number_;
 }
 
-// -- FormulaImpl --
+// -- FormulaRecord --
 
-Cell::FormulaImpl::FormulaImpl(const Sheet& sh, std::string expr)
-    : sheet_(sh), formula_(ParseFormula(std::move(expr))) {}
+Cell::FormulaRecord::FormulaRecord(const Sheet& sh, std::string expr, Position pos)
+    : sheet_(sh), formula_(CountedParseFormula(sh, std::move(expr), pos)) {}
 
-CellInterface::Value Cell::FormulaImpl::GetValue() const {
+Cell::FormulaRecord::FormulaRecord(const Sheet& sh, std::unique_ptr<FormulaInterface> formula,
+                                   std::optional<FormulaInterface::Value> cache)
+    : sheet_(sh), formula_(std::move(formula)) {
+    assert(formula_);
+    if (cache) {
+        cache_ = *cache;
+        cache_state_.store(CacheState::Ready, std::memory_order_relaxed);
+    }
+}
+
+std::pmr::memory_resource& Cell::FormulaRecord::GetMemory() const {
+    return sheet_.GetCellMemory();
+}
+
+CellInterface::Value Cell::FormulaRecord::GetValue(bool inputs_computed) const {
     constexpr bool cache_enabled = true;
+    auto to_cell_value = [](auto&& r) -> Value { return r; };
     if constexpr (cache_enabled) {
 
-        if (cache_) {
-            return *cache_;
+        SheetCounters& counters = sheet_.GetCounters();
+        if (cache_state_.load(std::memory_order_acquire) == CacheState::Ready) {
+            counters.Add(SheetCounters::CacheHits);
+            return std::visit(to_cell_value, cache_);
+        }
+        counters.Add(SheetCounters::CacheMisses);
+        if (!inputs_computed) {
+            // the stale inputs go first, in post-order, so the evaluation
+            // does not recurse
+            sheet_.EvaluateInputs(formula_->GetReferencedCells(), formula_->GetReferencedRanges());
         }
-        std::visit([this](auto&& r){ cache_ = r; }, formula_->Evaluate(sheet_));
-        return *cache_;
+        counters.Add(SheetCounters::Evaluations);
+        auto result = [&] {
+            SheetCounters::Timer timer(counters, SheetCounters::EvaluationNanoseconds);
+            return formula_->Evaluate(sheet_);
+        }();
+        // when several threads compute the same formula, the first one to
+        // finish publishes the value and the others just return theirs
+        auto state = CacheState::Empty;
+        if (cache_state_.compare_exchange_strong(state, CacheState::Computing,
+                                                 std::memory_order_acquire)) {
+            cache_ = result;
+            cache_state_.store(CacheState::Ready, std::memory_order_release);
+        }
+        return std::visit(to_cell_value, result);
 
     } else {
 
-        return std::visit([](auto&& r) -> Value { return r; },
-                          formula_->Evaluate(sheet_));
+        return std::visit(to_cell_value, formula_->Evaluate(sheet_));
 
     }
 }
 
-std::string Cell::FormulaImpl::GetText() const {
+std::string Cell::FormulaRecord::GetText() const {
     using namespace std::literals;
     return "="s + formula_->GetExpression();
 }
 
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
+std::vector<Position> Cell::FormulaRecord::GetReferencedCells() const {
     return formula_->GetReferencedCells();
 }
 
-void Cell::FormulaImpl::InvalidateCache() const {
-    cache_.reset();
+std::vector<Range> Cell::FormulaRecord::GetReferencedRanges() const {
+    return formula_->GetReferencedRanges();
+}
+
+std::optional<double> Cell::FormulaRecord::GetNumber() const {
+    const auto value = GetValue();
+    if (const double* number = std::get_if<double>(&value); number && std::isfinite(*number)) {
+        return *number;
+    }
+    return std::nullopt;
 }
 
-bool Cell::FormulaImpl::IsEmpty() const {
-    return false;
+void Cell::FormulaRecord::InvalidateCache() const {
+    cache_state_.store(CacheState::Empty, std::memory_order_release);
+}
+
+bool Cell::FormulaRecord::IsCacheValid() const {
+    return cache_state_.load(std::memory_order_acquire) == CacheState::Ready;
+}
+
+const FormulaInterface& Cell::FormulaRecord::GetFormula() const {
+    return *formula_;
+}
+
+std::optional<FormulaInterface::Value> Cell::FormulaRecord::GetCachedValue() const {
+    if (cache_state_.load(std::memory_order_acquire) == CacheState::Ready) {
+        return cache_;
+    }
+    return std::nullopt;
 }
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <atomic>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <memory_resource>
 #include <optional>
+#include <string_view>
 #include <unordered_set>
 
 #include "common.h"
@@ -10,75 +16,134 @@
 
 class Sheet;
 
+// A cell is stored by value in the sheet and takes three words: the
+// CellInterface vtable pointer, 15 bytes of payload and a tag. Empty cells,
+// texts up to 15 characters and numbers written in up to 7 characters fit
+// into the payload. Longer texts and formulas keep a pointer to a record
+// allocated from the cell memory of the sheet.
 class Cell : public CellInterface {
 public:
-    Cell(const Sheet& sh);
-    Cell(const Sheet& sh, std::string text);
+    Cell();
+    // pos is where the cell goes, formulas keep their references relative to it
+    Cell(const Sheet& sh, std::string text, Position pos);
+    // a text cell whose number, if any, is already parsed
+    Cell(const Sheet& sh, std::string text, std::optional<double> number);
+    // a formula cell, computed if cache is set
+    Cell(const Sheet& sh, std::unique_ptr<FormulaInterface> formula,
+         std::optional<FormulaInterface::Value> cache);
+    Cell(Cell&& other) noexcept;
     ~Cell();
 
     Value GetValue() const override;
     std::string GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
+    std::vector<Range> GetReferencedRanges() const override;
+    std::optional<double> GetNumber() const override;
+    // GetValue() for the recalculations, which compute the cells in an
+    // order putting their inputs first: the inputs not computed yet are not
+    // looked for beforehand
+    Value ComputeValue() const;
 
     void InvalidateCellCache() const;
+    bool IsCacheValid() const;
     bool IsEmpty() const;
 
+    // nullptr unless the cell is a formula
+    const FormulaInterface* GetFormula() const;
+    // the computed value of a formula, if it is computed
+    std::optional<FormulaInterface::Value> GetCachedValue() const;
+    // the bytes the cell holds beside its record in the cell memory of the
+    // sheet: the buffer of a long text or the formula object, without the
+    // AST
+    std::size_t GetHeapMemory() const;
+
 private:
-    void Set(std::string text);
+    enum class Kind : std::uint8_t {
+        Empty,
+        ShortText,    // the text is in the payload
+        ShortNumber,  // the number, then its text, are in the payload
+        Text,         // a TextRecord, also used for numbers with longer texts
+        Formula,      // a FormulaRecord
+    };
 
-    class Impl;
-    class EmptyImpl;
-    class TextImpl;
-    class FormulaImpl;
+    class TextRecord;
+    class FormulaRecord;
 
-    const Sheet& sheet_;
-    std::unique_ptr<Impl> impl_;
-};
+    static constexpr std::size_t PAYLOAD_SIZE = 15;
+    static constexpr std::size_t SHORT_NUMBER_TEXT_SIZE = PAYLOAD_SIZE - sizeof(double);
+    static constexpr int KIND_BITS = 4;
 
-class Cell::Impl {
-public:
-    virtual ~Impl() = default;
-    virtual Value GetValue() const = 0;
-    virtual std::string GetText() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-    virtual void InvalidateCache() const = 0;
-    virtual bool IsEmpty() const = 0;
-};
+    Kind GetKind() const {
+        return static_cast<Kind>(tag_ & ((1 << KIND_BITS) - 1));
+    }
 
-class Cell::EmptyImpl : public Cell::Impl {
-public:
-    explicit EmptyImpl() = default;
-    Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-    void InvalidateCache() const override;
-    bool IsEmpty() const override;
+    // the length of the text kept in the payload
+    std::size_t GetShortSize() const {
+        return tag_ >> KIND_BITS;
+    }
+
+    void SetTag(Kind kind, std::size_t short_size = 0) {
+        assert(short_size < (1 << (8 - KIND_BITS)));
+        tag_ = static_cast<std::uint8_t>(short_size << KIND_BITS | static_cast<std::uint8_t>(kind));
+    }
+
+    void SetText(const Sheet& sh, std::string text, std::optional<double> number);
+    std::string_view GetShortText() const;
+    double GetShortNumber() const;
+    const TextRecord& GetTextRecord() const;
+    const FormulaRecord& GetFormulaRecord() const;
+    void SetRecord(Kind kind, const void* record);
+
+    template <typename Record, typename... Args>
+    static Record* NewRecord(std::pmr::memory_resource& memory, Args&&... args);
+    template <typename Record>
+    static void DeleteRecord(const Record* record);
+
+    alignas(sizeof(void*)) char payload_[PAYLOAD_SIZE] = {};
+    std::uint8_t tag_ = 0;
 };
 
-class Cell::TextImpl : public Cell::Impl {
+class Cell::TextRecord {
 public:
-    explicit TextImpl(std::string text);
-    Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-    void InvalidateCache() const override;
-    bool IsEmpty() const override;
+    TextRecord(std::pmr::memory_resource& memory, std::string text, std::optional<double> number);
+    std::pmr::memory_resource& GetMemory() const;
+    const std::string& GetText() const;
+    std::optional<double> GetNumber() const;
 private:
+    std::pmr::memory_resource& memory_;
     std::string text_;
+    // a text representing a number is parsed once, when the cell is set,
+    // instead of on every evaluation of the formulas using it
+    std::optional<double> number_;
 };
 
-class Cell::FormulaImpl : public Cell::Impl {
+class Cell::FormulaRecord {
 public:
-    explicit FormulaImpl(const Sheet& sh, std::string expr);
-    Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-    void InvalidateCache() const override;
-    bool IsEmpty() const override;
+    FormulaRecord(const Sheet& sh, std::string expr, Position pos);
+    FormulaRecord(const Sheet& sh, std::unique_ptr<FormulaInterface> formula,
+                  std::optional<FormulaInterface::Value> cache);
+    std::pmr::memory_resource& GetMemory() const;
+    // computes the inputs not computed yet first unless inputs_computed
+    Value GetValue(bool inputs_computed = false) const;
+    std::string GetText() const;
+    std::vector<Position> GetReferencedCells() const;
+    std::vector<Range> GetReferencedRanges() const;
+    std::optional<double> GetNumber() const;
+    void InvalidateCache() const;
+    bool IsCacheValid() const;
+    const FormulaInterface& GetFormula() const;
+    std::optional<FormulaInterface::Value> GetCachedValue() const;
 private:
-    using Cache = std::optional<Value>;
+    enum class CacheState : char {
+        Empty,
+        Computing,
+        Ready,
+    };
 
     const Sheet& sheet_;
     std::unique_ptr<FormulaInterface> formula_;
-    mutable Cache cache_;
+    // cache_ is published to other threads by the release store of
+    // CacheState::Ready and must be read only after observing it
+    mutable FormulaInterface::Value cache_;
+    mutable std::atomic<CacheState> cache_state_{CacheState::Empty};
 };
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "memory_usage.h"
+
+// Storage for the cells of a sheet.
+//
+// The sheet is split into fixed-size tiles of TILE_ROWS x TILE_COLS cells.
+// A tile is a flat row-major array of slots indexed directly from Position,
+// so lookups are two array indexations and neighbouring cells share cache
+// lines. Tiles are allocated on first write and released when they become
+// empty again.
+//
+// Very sparse sheets would waste most of a tile per occupied cell, so cells
+// are first put into a hash map and are moved into a tile only when the
+// tile's region collects PROMOTE_THRESHOLD of them.
+//
+// A tile keeps a bitmap of its occupied slots, one word per row, so scans
+// skip empty slots without touching them and a slot is just the value.
+//
+// Pointers to stored values are invalidated by Emplace() and Erase().
+template <typename T, typename Hash, typename KeyEqual>
+class TiledStorage {
+    static_assert(std::is_nothrow_move_constructible_v<T>, "values are moved between the map and the tiles");
+
+public:
+    static constexpr int TILE_ROWS_LOG2 = 5;
+    static constexpr int TILE_COLS_LOG2 = 5;
+    static constexpr int TILE_ROWS = 1 << TILE_ROWS_LOG2;
+    static constexpr int TILE_COLS = 1 << TILE_COLS_LOG2;
+    static constexpr int PROMOTE_THRESHOLD = 8;
+
+    T* Find(Position pos) {
+        if (Tile* tile = FindTile(pos)) {
+            return tile->IsOccupied(pos) ? tile->Slot(SlotIndex(pos)) : nullptr;
+        }
+        if (sparse_.empty()) {
+            return nullptr;
+        }
+        auto it = sparse_.find(pos);
+        return it != sparse_.end() ? &it->second : nullptr;
+    }
+
+    const T* Find(Position pos) const {
+        return const_cast<TiledStorage*>(this)->Find(pos);
+    }
+
+    template <typename... Args>
+    T& Emplace(Position pos, Args&&... args) {
+        assert(pos.IsValid());
+        Tile* tile = FindTile(pos);
+        if (!tile) {
+            auto it = sparse_.find(pos);
+            if (it != sparse_.end()) {
+                // the new value is built first, so the old one stays if it throws
+                T value(std::forward<Args>(args)...);
+                it->second.~T();
+                return *new (&it->second) T(std::move(value));
+            }
+            int& count = sparse_tile_count_[TileKey(pos)];
+            if (count + 1 < PROMOTE_THRESHOLD) {
+                ++count;
+                return sparse_.try_emplace(pos, std::forward<Args>(args)...).first->second;
+            }
+            tile = PromoteTile(pos);
+        }
+        return tile->Emplace(pos, std::forward<Args>(args)...);
+    }
+
+    void Erase(Position pos) {
+        if (Tile* tile = FindTile(pos)) {
+            if (tile->IsOccupied(pos)) {
+                tile->Erase(pos);
+                if (tile->occupied == 0) {
+                    (*bands_[BandIndex(pos)])[TileInBandIndex(pos)].reset();
+                }
+            }
+            return;
+        }
+        if (sparse_.erase(pos) != 0) {
+            auto it = sparse_tile_count_.find(TileKey(pos));
+            assert(it != sparse_tile_count_.end());
+            if (--it->second == 0) {
+                sparse_tile_count_.erase(it);
+            }
+        }
+    }
+
+    // Calls f(pos, value) for every stored value in the rectangle from first
+    // to last inclusive. Only the allocated tiles are scanned.
+    template <typename F>
+    void ForEach(Position first, Position last, F&& f) const {
+        const int last_band = std::min(BandIndex(last), static_cast<int>(bands_.size()) - 1);
+        for (int band = BandIndex(first); band <= last_band; ++band) {
+            if (!bands_[band]) {
+                continue;
+            }
+            const int first_row = std::max(first.row, band << TILE_ROWS_LOG2);
+            const int last_row = std::min(last.row, ((band + 1) << TILE_ROWS_LOG2) - 1);
+            for (int t = TileInBandIndex(first); t <= TileInBandIndex(last); ++t) {
+                const Tile* tile = (*bands_[band])[t].get();
+                if (!tile) {
+                    continue;
+                }
+                const int first_col = std::max(first.col, t << TILE_COLS_LOG2);
+                const int last_col = std::min(last.col, ((t + 1) << TILE_COLS_LOG2) - 1);
+                const RowBits mask = ColumnMask(first_col, last_col);
+                for (int row = first_row; row <= last_row; ++row) {
+                    tile->ForEachInRow(row, t << TILE_COLS_LOG2, mask, f);
+                }
+            }
+        }
+
+        if (sparse_.empty()) {
+            return;
+        }
+        const auto area = static_cast<std::size_t>(last.row - first.row + 1) *
+                          static_cast<std::size_t>(last.col - first.col + 1);
+        if (area < sparse_.size()) {
+            for (int row = first.row; row <= last.row; ++row) {
+                for (int col = first.col; col <= last.col; ++col) {
+                    if (auto it = sparse_.find({row, col}); it != sparse_.end()) {
+                        f(it->first, it->second);
+                    }
+                }
+            }
+            return;
+        }
+        for (const auto& [pos, value] : sparse_) {
+            if (first.row <= pos.row && pos.row <= last.row &&
+                first.col <= pos.col && pos.col <= last.col) {
+                f(pos, value);
+            }
+        }
+    }
+
+    // Calls f(pos, value) for every stored value in row-major order. Rows
+    // of bands with no tiles are skipped as a whole, the others are walked
+    // through the occupancy bitmaps.
+    template <typename F>
+    void ForEachOrdered(F&& f) const {
+        std::vector<std::pair<Position, const T*>> sparse;
+        sparse.reserve(sparse_.size());
+        for (const auto& [pos, value] : sparse_) {
+            sparse.emplace_back(pos, &value);
+        }
+        std::sort(sparse.begin(), sparse.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.first < rhs.first;
+        });
+
+        auto next_sparse = sparse.begin();
+        auto flush_sparse = [&](Position before) {
+            for (; next_sparse != sparse.end() && next_sparse->first < before; ++next_sparse) {
+                f(next_sparse->first, *next_sparse->second);
+            }
+        };
+        for (int band = 0; band < static_cast<int>(bands_.size()); ++band) {
+            if (!bands_[band]) {
+                continue;
+            }
+            const int first_row = band << TILE_ROWS_LOG2;
+            for (int row = first_row; row < first_row + TILE_ROWS; ++row) {
+                for (int t = 0; t < TILES_PER_BAND; ++t) {
+                    if (const Tile* tile = (*bands_[band])[t].get()) {
+                        // a tile region holds no sparse cells
+                        flush_sparse({row, t << TILE_COLS_LOG2});
+                        tile->ForEachInRow(row, t << TILE_COLS_LOG2, ~RowBits{0}, f);
+                    }
+                }
+            }
+        }
+        flush_sparse({Position::MAX_ROWS, 0});
+    }
+
+    // the bytes of the bands, the tiles and the sparse map, the values
+    // included but not what they point to
+    std::size_t GetMemoryUsage() const {
+        std::size_t bytes = GetVectorMemory(bands_) + GetHashTableMemory(sparse_) +
+                            GetHashTableMemory(sparse_tile_count_);
+        for (const auto& band : bands_) {
+            if (!band) {
+                continue;
+            }
+            bytes += sizeof(Band);
+            for (const auto& tile : *band) {
+                bytes += tile ? sizeof(Tile) : 0;
+            }
+        }
+        return bytes;
+    }
+
+private:
+    static constexpr int BAND_COUNT = Position::MAX_ROWS >> TILE_ROWS_LOG2;
+    static constexpr int TILES_PER_BAND = Position::MAX_COLS >> TILE_COLS_LOG2;
+
+    using RowBits = std::uint32_t;
+    static_assert(TILE_COLS <= 32, "a row of a tile must fit into RowBits");
+
+    // Slots are raw storage: a value is constructed in a slot when its bit
+    // is set and destroyed when the bit is cleared.
+    struct Tile {
+        Tile() = default;
+        Tile(const Tile&) = delete;
+        Tile& operator=(const Tile&) = delete;
+
+        ~Tile() {
+            for (int row = 0; row < TILE_ROWS; ++row) {
+                for (RowBits bits = rows[row]; bits != 0; bits &= bits - 1) {
+                    Slot(row << TILE_COLS_LOG2 | __builtin_ctz(bits))->~T();
+                }
+            }
+        }
+
+        bool IsOccupied(Position pos) const {
+            return rows[pos.row & (TILE_ROWS - 1)] >> (pos.col & (TILE_COLS - 1)) & 1;
+        }
+
+        T* Slot(int index) {
+            return std::launder(reinterpret_cast<T*>(&slots[index]));
+        }
+
+        const T* Slot(int index) const {
+            return std::launder(reinterpret_cast<const T*>(&slots[index]));
+        }
+
+        template <typename... Args>
+        T& Emplace(Position pos, Args&&... args) {
+            if (IsOccupied(pos)) {
+                Erase(pos);  // so that the slot stays free if the value throws
+            }
+            T* value = new (Slot(SlotIndex(pos))) T(std::forward<Args>(args)...);
+            rows[pos.row & (TILE_ROWS - 1)] |= ColumnBit(pos.col);
+            ++occupied;
+            return *value;
+        }
+
+        void Erase(Position pos) {
+            assert(IsOccupied(pos));
+            Slot(SlotIndex(pos))->~T();
+            rows[pos.row & (TILE_ROWS - 1)] &= ~ColumnBit(pos.col);
+            --occupied;
+        }
+
+        // calls f(pos, value) for the values of the row under mask, left to
+        // right; first_col is the column of the tile's first slot
+        template <typename F>
+        void ForEachInRow(int row, int first_col, RowBits mask, F& f) const {
+            const int tile_row = row & (TILE_ROWS - 1);
+            for (RowBits bits = rows[tile_row] & mask; bits != 0; bits &= bits - 1) {
+                const int col = __builtin_ctz(bits);
+                f(Position{row, first_col + col}, *Slot(tile_row << TILE_COLS_LOG2 | col));
+            }
+        }
+
+        std::array<RowBits, TILE_ROWS> rows{};
+        int occupied = 0;
+        std::array<std::aligned_storage_t<sizeof(T), alignof(T)>, TILE_ROWS * TILE_COLS> slots;
+    };
+
+    static RowBits ColumnBit(int col) {
+        return RowBits{1} << (col & (TILE_COLS - 1));
+    }
+
+    // the columns from first_col to last_col of one tile
+    static RowBits ColumnMask(int first_col, int last_col) {
+        const int first = first_col & (TILE_COLS - 1);
+        const int count = last_col - first_col + 1;
+        const RowBits ones = count >= 32 ? ~RowBits{0} : (RowBits{1} << count) - 1;
+        return ones << first;
+    }
+
+    using Band = std::array<std::unique_ptr<Tile>, TILES_PER_BAND>;
+
+    static int BandIndex(Position pos) {
+        return pos.row >> TILE_ROWS_LOG2;
+    }
+
+    static int TileInBandIndex(Position pos) {
+        return pos.col >> TILE_COLS_LOG2;
+    }
+
+    static int SlotIndex(Position pos) {
+        return ((pos.row & (TILE_ROWS - 1)) << TILE_COLS_LOG2) | (pos.col & (TILE_COLS - 1));
+    }
+
+    static int TileKey(Position pos) {
+        return BandIndex(pos) * TILES_PER_BAND + TileInBandIndex(pos);
+    }
+
+    Tile* FindTile(Position pos) const {
+        const int band = BandIndex(pos);
+        if (band >= static_cast<int>(bands_.size()) || !bands_[band]) {
+            return nullptr;
+        }
+        return (*bands_[band])[TileInBandIndex(pos)].get();
+    }
+
+    // Allocates the tile covering pos and moves its sparse cells into it.
+    Tile* PromoteTile(Position pos) {
+        const int band = BandIndex(pos);
+        if (band >= static_cast<int>(bands_.size())) {
+            bands_.resize(band + 1);
+        }
+        if (!bands_[band]) {
+            bands_[band] = std::make_unique<Band>();
+        }
+        auto& tile = (*bands_[band])[TileInBandIndex(pos)];
+        assert(!tile);
+        tile = std::make_unique<Tile>();
+
+        const Position origin{pos.row & ~(TILE_ROWS - 1), pos.col & ~(TILE_COLS - 1)};
+        for (int r = 0; r < TILE_ROWS; ++r) {
+            for (int c = 0; c < TILE_COLS; ++c) {
+                auto it = sparse_.find({origin.row + r, origin.col + c});
+                if (it != sparse_.end()) {
+                    tile->Emplace(it->first, std::move(it->second));
+                    sparse_.erase(it);
+                }
+            }
+        }
+        sparse_tile_count_.erase(TileKey(pos));
+        return tile.get();
+    }
+
+    std::vector<std::unique_ptr<Band>> bands_;
+    std::unordered_map<Position, T, Hash, KeyEqual> sparse_;
+    std::unordered_map<int, int> sparse_tile_count_;
+};
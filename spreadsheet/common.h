@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -18,14 +21,36 @@ struct Position {
 
     bool IsValid() const;
     std::string ToString() const;
+    // Записывает то же, что ToString(), в буфер из MAX_STRING_LENGTH символов
+    // без выделения памяти и возвращает указатель за последним символом.
+    char* ToChars(char* out) const;
 
+    // Для некорректной позиции возвращает NONE.
     static Position FromString(std::string_view str);
 
+    // Позиция, упакованная в 32 бита: столбец в старших битах, строка в
+    // младших KEY_ROW_BITS, так что ячейки столбца, заполненного вниз,
+    // получают ключи подряд. Ключи корректных позиций различны и меньше
+    // KEY_COUNT, поэтому ими можно индексировать массив и хешировать
+    // позиции.
+    std::uint32_t ToKey() const {
+        return static_cast<std::uint32_t>(col) << KEY_ROW_BITS | static_cast<std::uint32_t>(row);
+    }
+
+    static Position FromKey(std::uint32_t key) {
+        return {static_cast<int>(key & ((1u << KEY_ROW_BITS) - 1)), static_cast<int>(key >> KEY_ROW_BITS)};
+    }
+
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    static const int MAX_STRING_LENGTH = 8;  // XFD16384
+    static const int KEY_ROW_BITS = 14;
+    static const std::uint32_t KEY_COUNT = static_cast<std::uint32_t>(MAX_COLS) << KEY_ROW_BITS;
     static const Position NONE;
 };
 
+static_assert(Position::MAX_ROWS <= 1 << Position::KEY_ROW_BITS, "a row must fit into its bits of the key");
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -33,6 +58,23 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольный диапазон ячеек от first (левая верхняя) до last (правая
+// нижняя) включительно, например A1:B5.
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(Range rhs) const;
+    bool operator<(Range rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+
+    // Диапазон с углами в переданных позициях, перечисленных в любом порядке.
+    static Range FromCorners(Position a, Position b);
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -97,6 +139,19 @@ public:
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает значение ячейки в виде числа для использования в формулах:
+    // число, которое представляет её текст, или конечное значение формулы.
+    // Если значение не является числом, возвращает nullopt. Реализация по
+    // умолчанию разбирает результат GetValue().
+    virtual std::optional<double> GetNumber() const;
+
+    // Возвращает список диапазонов, которые задействованы в формуле целиком.
+    // Ячейки диапазонов не входят в GetReferencedCells(). Список отсортирован
+    // по возрастанию и не содержит повторяющихся диапазонов.
+    virtual std::vector<Range> GetReferencedRanges() const {
+        return {};
+    }
 };
 
 inline constexpr char FORMULA_SIGN = '=';
@@ -143,6 +198,18 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Вызывает action в произвольном порядке для ячеек диапазона, для которых
+    // GetCell() не возвращает nullptr. Ячейки с пустым текстом могут быть
+    // пропущены. Реализация по умолчанию перебирает печатную область через
+    // GetCell().
+    virtual void ForEachCell(
+        Range range, const std::function<void(Position, const CellInterface&)>& action) const;
+
+    // Возвращает лист с переданным именем из той же книги, по которому
+    // вычисляются ссылки вида Лист!A1, либо nullptr, если такого листа нет.
+    // У таблицы не из книги других листов нет.
+    virtual const SheetInterface* FindSheet(std::string_view name) const;
 };
 
 // Создаёт готовую к работе пустую таблицу.
@@ -4,100 +4,210 @@
 #include <cassert>
 #include <cctype>
 #include <cmath>
+#include <optional>
 #include <sstream>
+#include <string_view>
+#include <utility>
 
 #include "FormulaAST.h"
 
 using namespace std::literals;
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    return output << "#DIV/0!";
+    return output << fe.ToString();
 }
 
 namespace {
 
+// Interprets the value of a referenced cell which is not a number: empty
+// text reads as zero, anything else is an error.
+FormulaInterface::Value GetNonNumber(const CellInterface::Value& value) {
+    if (std::holds_alternative<std::string>(value)) {
+        if (std::get<std::string>(value).empty()) {
+            return .0;
+        }
+        return FormulaError(FormulaError::Category::Value);
+    }
+    if (std::holds_alternative<double>(value)) {
+        return FormulaError(FormulaError::Category::Div0);
+    }
+    return std::get<FormulaError>(value);
+}
+
+// The AST is shared by all the copies of a formula filled across a sheet,
+// with the references stored relative to the cell holding the formula.
 class Formula : public FormulaInterface {
 public:
     // Реализуйте следующие методы:
-    explicit Formula(std::string expression);
+    Formula(std::string_view expression, Position origin);
+    Formula(std::shared_ptr<const FormulaAST> ast, Position origin);
     Value Evaluate(const SheetInterface& sheet) const override;
     std::string GetExpression() const override;
     std::vector<Position> GetReferencedCells() const override;
+    std::vector<Range> GetReferencedRanges() const override;
+    std::vector<ExternalReference> GetExternalReferences() const override;
+    std::shared_ptr<const FormulaAST> GetAST() const override;
+    Position GetOrigin() const override;
+    std::size_t GetMemoryUsage() const override;
 
 private:
-    FormulaAST ast_;
+    Position ToAbsolute(Position offset) const {
+        return {offset.row + origin_.row, offset.col + origin_.col};
+    }
+
+    Range ToAbsolute(Range offset) const {
+        return {ToAbsolute(offset.first), ToAbsolute(offset.last)};
+    }
+
+    std::shared_ptr<const FormulaAST> ast_;
+    Position origin_;
 };
 
-Formula::Formula(std::string expression) : ast_(ParseFormulaAST(expression)) {}
+Formula::Formula(std::string_view expression, Position origin)
+    : ast_(InternFormulaAST(expression, origin)), origin_(origin) {}
+
+Formula::Formula(std::shared_ptr<const FormulaAST> ast, Position origin)
+    : ast_(std::move(ast)), origin_(origin) {}
 
 FormulaInterface::Value Formula::Evaluate(const SheetInterface& sheet) const {
-    auto solver = [&sheet](const Position* c) -> double {
-        auto cell_ptr = sheet.GetCell(*c);
-        if (!cell_ptr) {
-            return .0;
+    auto solver = [this](const SheetInterface& sheet, Position offset) -> Value {
+        const Position pos = ToAbsolute(offset);
+        if (!pos.IsValid()) {
+            return FormulaError(FormulaError::Category::Ref);  // the cell was deleted
         }
-        auto value = cell_ptr->GetValue();
-        if (std::holds_alternative<std::string>(value)) {
-            const auto& value_str = std::get<std::string>(value);
-            if (value_str.empty()) {
-                return .0;
-            }
-            double result;
-            std::istringstream value_in{value_str};
-            if (value_in >> result && value_in.eof()) {
-                return result;
-            }
-            throw FormulaError(FormulaError::Category::Value);
+        return GetReferencedValue(sheet.GetCell(pos));
+    };
+    // unlike a single reference, a range skips empty cells and text
+    auto range_solver = [this](const SheetInterface& sheet, Range offset,
+                               std::vector<double>& values) -> std::optional<FormulaError> {
+        const Range cells = ToAbsolute(offset);
+        if (!cells.IsValid()) {
+            return FormulaError(FormulaError::Category::Ref);
         }
-        if (std::holds_alternative<double>(value)) {
-            double result = std::get<double>(value);
-            if (!std::isinf(result) && !std::isnan(result)) {
-                return result;
+        std::optional<FormulaError> error;
+        sheet.ForEachCell(cells, [&values, &error](Position, const CellInterface& cell) {
+            if (error) {
+                return;
             }
-            throw FormulaError(FormulaError::Category::Div0);
-        }
-        throw std::get<FormulaError>(value);
+            if (auto number = cell.GetNumber()) {
+                values.push_back(*number);
+            } else if (auto value = cell.GetValue(); !std::holds_alternative<std::string>(value)) {
+                error = std::get<FormulaError>(GetNonNumber(value));
+            }
+        });
+        return error;
+    };
+    // a reference to a sheet which is not there is an invalid one
+    const auto& externals = ast_->GetExternals();
+    auto find_sheet = [&sheet, &externals](std::uint32_t index) {
+        return sheet.FindSheet(externals.sheets[index]);
     };
 
-    try {
-        double result = ast_.Execute(solver);
-        if (!std::isinf(result) && !std::isnan(result)) {
-            return result;
-        }
+    auto result = ast_->Execute(
+        [&](const Position* c) {
+            return solver(sheet, *c);
+        },
+        [&](const Range* range, std::vector<double>& values) {
+            return range_solver(sheet, *range, values);
+        },
+        [&](const ExternalCell* ref) -> Value {
+            const SheetInterface* other = find_sheet(ref->sheet);
+            return other ? solver(*other, ref->cell) : FormulaError(FormulaError::Category::Ref);
+        },
+        [&](const ExternalRange* ref, std::vector<double>& values) -> std::optional<FormulaError> {
+            const SheetInterface* other = find_sheet(ref->sheet);
+            return other ? range_solver(*other, ref->range, values) : FormulaError(FormulaError::Category::Ref);
+        });
+    if (const double* number = std::get_if<double>(&result); number && !std::isfinite(*number)) {
         return FormulaError(FormulaError::Category::Div0);
-    } catch (FormulaError& ferror) {
-        return ferror;
     }
+    return result;
 }
 
 std::string Formula::GetExpression() const {
     std::ostringstream out;
-    ast_.PrintFormula(out);
+    ast_->PrintFormula(out, origin_);
     return out.str();
 }
 
 std::vector<Position> Formula::GetReferencedCells() const {
-    const auto& pos_list = ast_.GetCells();
-    auto it = pos_list.begin();
+    const auto& offsets = ast_->GetCells();
     std::vector<Position> result;
-    if (!pos_list.empty()) {
-        result.push_back(*it);
-        it = std::next(it);
+    result.reserve(offsets.size());
+    for (const auto& offset : offsets) {
+        // references to deleted cells depend on nothing
+        if (const Position pos = ToAbsolute(offset); pos.IsValid()) {
+            result.push_back(pos);
+        }
     }
-    for (; it != pos_list.end(); it = std::next(it)) {
-        if (!(*it == result.back())) {
-            result.push_back(*it);
+    return result;
+}
+
+std::vector<Range> Formula::GetReferencedRanges() const {
+    const auto& offsets = ast_->GetRanges();
+    std::vector<Range> result;
+    result.reserve(offsets.size());
+    for (const auto& offset : offsets) {
+        if (const Range range = ToAbsolute(offset); range.IsValid()) {
+            result.push_back(range);
+        }
+    }
+    return result;
+}
+
+std::vector<ExternalReference> Formula::GetExternalReferences() const {
+    const auto& externals = ast_->GetExternals();
+    std::vector<ExternalReference> result;
+    result.reserve(externals.cells.size() + externals.ranges.size());
+    for (const auto& ref : externals.cells) {
+        if (const Position pos = ToAbsolute(ref.cell); pos.IsValid()) {
+            result.push_back({externals.sheets[ref.sheet], {pos, pos}});
+        }
+    }
+    for (const auto& ref : externals.ranges) {
+        if (const Range range = ToAbsolute(ref.range); range.IsValid()) {
+            result.push_back({externals.sheets[ref.sheet], range});
         }
     }
     return result;
 }
 
+std::shared_ptr<const FormulaAST> Formula::GetAST() const {
+    return ast_;
+}
+
+Position Formula::GetOrigin() const {
+    return origin_;
+}
+
+std::size_t Formula::GetMemoryUsage() const {
+    return sizeof(Formula);
+}
+
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
+    return ParseFormula(std::move(expression), Position{0, 0});
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position origin) {
     try {
-        return std::make_unique<Formula>(std::move(expression));
+        return std::make_unique<Formula>(expression, origin);
     } catch (std::exception&) {
         throw FormulaException("ParseFormula():Invalid formula syntax");
     }
 }
+
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position origin) {
+    return std::make_unique<Formula>(std::move(ast), origin);
+}
+
+FormulaInterface::Value GetReferencedValue(const CellInterface* cell) {
+    if (!cell) {
+        return .0;
+    }
+    if (auto number = cell->GetNumber()) {
+        return *number;
+    }
+    return GetNonNumber(cell->GetValue());
+}
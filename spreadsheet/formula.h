@@ -2,13 +2,27 @@
 
 #include "common.h"
 
+#include <cstddef>
 #include <memory>
+#include <string>
 #include <vector>
 
+class FormulaAST;
+
+// Ссылка на ячейку или диапазон другого листа книги по имени листа. Ячейка
+// записывается диапазоном из неё одной.
+struct ExternalReference {
+    std::string sheet;
+    Range range;
+};
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Функции SUM, AVERAGE, MIN, MAX и COUNT от выражений и диапазонов:
+//   SUM(A1:B5,C3*2). В диапазоне учитываются только ячейки с числами, пустые
+//   ячейки и текст, который не является числом, пропускаются.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -34,8 +48,40 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает список диапазонов, задействованных в формуле. Ячейки
+    // диапазонов не входят в GetReferencedCells(). Список отсортирован по
+    // возрастанию и не содержит повторяющихся диапазонов.
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
+
+    // Возвращает ссылки на другие листы в порядке их записи в формуле. Они
+    // не входят ни в GetReferencedCells(), ни в GetReferencedRanges().
+    virtual std::vector<ExternalReference> GetExternalReferences() const = 0;
+
+    // Разобранное выражение, ссылки в котором хранятся относительно ячейки
+    // GetOrigin(). Нужно для сохранения формулы в снимок таблицы без её текста.
+    virtual std::shared_ptr<const FormulaAST> GetAST() const = 0;
+    virtual Position GetOrigin() const = 0;
+
+    // Возвращает размер объекта формулы в байтах без разобранного
+    // выражения, которое считается отдельно: копии формулы разделяют его.
+    virtual std::size_t GetMemoryUsage() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// То же для формулы, записанной в ячейке origin. Ссылки хранятся относительно
+// origin, и формулы, которые получаются друг из друга копированием в другие
+// ячейки (B2*C2 в D2, B3*C3 в D3), разделяют одно разобранное выражение.
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position origin);
+
+// Создаёт формулу из уже разобранного выражения, например, прочитанного из
+// снимка таблицы. Ссылки в ast отсчитываются от ячейки origin.
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position origin);
+
+// Значение ячейки, на которую ссылается формула: число, ноль для пустой
+// ячейки (cell может быть nullptr) и пустого текста, ошибка #VALUE! для
+// другого текста либо ошибка формулы в ячейке.
+FormulaInterface::Value GetReferencedValue(const CellInterface* cell);
@@ -0,0 +1,236 @@
+#include "formula_jit.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(SPREADSHEET_ENABLE_JIT) && defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define SPREADSHEET_NATIVE_FORMULAS
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace ASTImpl {
+
+namespace {
+
+using OpCode = Instruction::OpCode;
+
+// xmm0 to xmm14 hold the stack, xmm0 being its bottom and so the result
+constexpr int MAX_NATIVE_DEPTH = 15;
+// the byte offset of a cell is a 32-bit displacement
+constexpr std::uint32_t MAX_NATIVE_CELLS = 1u << 28;
+
+#ifdef SPREADSHEET_NATIVE_FORMULAS
+
+// holds the numbers of the instructions
+constexpr int SCRATCH = 15;
+
+// The few instructions the compiled programs are made of, in the System V
+// calling convention: the cells come in rdi, the result goes in xmm0.
+class Emitter {
+public:
+    // movsd xmm, [rdi + 8 * index]
+    void LoadCell(int xmm, std::uint32_t index) {
+        Sse(0xF2, 0x10, xmm, 0b111, 0b10);
+        Imm32(index * 8);
+    }
+
+    // mov rax, number; movq xmm, rax
+    void LoadNumber(int xmm, double number) {
+        std::uint64_t bits;
+        std::memcpy(&bits, &number, sizeof bits);
+        code_.push_back(0x48);
+        code_.push_back(0xB8);
+        for (int i = 0; i < 8; ++i) {
+            code_.push_back(static_cast<std::uint8_t>(bits >> (8 * i)));
+        }
+        code_.push_back(0x66);
+        code_.push_back(0x48 | (xmm >= 8 ? 0x04 : 0));
+        code_.push_back(0x0F);
+        code_.push_back(0x6E);
+        code_.push_back(0xC0 | ((xmm & 7) << 3));
+    }
+
+    // addsd, subsd, mulsd or divsd dst, src
+    void Arithmetic(OpCode op, int dst, int src) {
+        Sse(0xF2, ArithmeticOpcode(op), dst, src, 0b11);
+    }
+
+    // flips the sign bit, as unary minus does
+    void Negate(int xmm) {
+        LoadNumber(SCRATCH, -0.0);
+        Sse(0x66, 0x57, xmm, SCRATCH, 0b11);  // xorpd
+    }
+
+    void Return() {
+        code_.push_back(0xC3);
+    }
+
+    const std::vector<std::uint8_t>& GetCode() const {
+        return code_;
+    }
+
+private:
+    static std::uint8_t ArithmeticOpcode(OpCode op) {
+        switch (op) {
+        case OpCode::Add:
+        case OpCode::AddNumber:
+            return 0x58;
+        case OpCode::Subtract:
+        case OpCode::SubtractNumber:
+            return 0x5C;
+        case OpCode::Multiply:
+        case OpCode::MultiplyNumber:
+            return 0x59;
+        default:
+            return 0x5E;
+        }
+    }
+
+    // prefix [REX] 0F opcode ModRM, rm being a register for mode 0b11
+    void Sse(std::uint8_t prefix, std::uint8_t opcode, int reg, int rm, int mode) {
+        code_.push_back(prefix);
+        if (reg >= 8 || rm >= 8) {
+            code_.push_back(0x40 | (reg >= 8 ? 0x04 : 0) | (rm >= 8 ? 0x01 : 0));
+        }
+        code_.push_back(0x0F);
+        code_.push_back(opcode);
+        code_.push_back(static_cast<std::uint8_t>((mode << 6) | ((reg & 7) << 3) | (rm & 7)));
+    }
+
+    void Imm32(std::uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            code_.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    std::vector<std::uint8_t> code_;
+};
+
+#endif
+
+}  // namespace
+
+NativeCode::NativeCode(void* memory, std::size_t size)
+    : memory_(memory)
+    , size_(size) {
+}
+
+NativeCode::~NativeCode() {
+#ifdef SPREADSHEET_NATIVE_FORMULAS
+    munmap(memory_, size_);
+#endif
+}
+
+NativeFormula NativeCode::GetFunction() const {
+    return reinterpret_cast<NativeFormula>(memory_);
+}
+
+std::size_t NativeCode::GetSize() const {
+    return size_;
+}
+
+bool IsNativeCompilationAvailable() {
+#ifdef SPREADSHEET_NATIVE_FORMULAS
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool CanCompileNative(const Program& program) {
+    if (!IsNativeCompilationAvailable()) {
+        return false;
+    }
+    int depth = 0;
+    for (const auto& instruction : program) {
+        switch (instruction.op) {
+        case OpCode::LoadCell:
+            if (instruction.index >= MAX_NATIVE_CELLS) {
+                return false;
+            }
+            [[fallthrough]];
+        case OpCode::PushNumber:
+            if (++depth > MAX_NATIVE_DEPTH) {
+                return false;
+            }
+            break;
+        case OpCode::Add:
+        case OpCode::Subtract:
+        case OpCode::Multiply:
+        case OpCode::Divide:
+            --depth;
+            break;
+        case OpCode::AddNumber:
+        case OpCode::SubtractNumber:
+        case OpCode::MultiplyNumber:
+        case OpCode::DivideNumber:
+        case OpCode::UnaryPlus:
+        case OpCode::UnaryMinus:
+            break;
+        default:
+            return false;
+        }
+    }
+    return depth == 1;
+}
+
+std::unique_ptr<NativeCode> CompileNative(const Program& program) {
+#ifdef SPREADSHEET_NATIVE_FORMULAS
+    if (!CanCompileNative(program)) {
+        return nullptr;
+    }
+    Emitter emitter;
+    int top = -1;  // the register of the topmost value
+    for (const auto& instruction : program) {
+        switch (instruction.op) {
+        case OpCode::PushNumber:
+            emitter.LoadNumber(++top, instruction.number);
+            break;
+        case OpCode::LoadCell:
+            emitter.LoadCell(++top, instruction.index);
+            break;
+        case OpCode::Add:
+        case OpCode::Subtract:
+        case OpCode::Multiply:
+        case OpCode::Divide:
+            emitter.Arithmetic(instruction.op, top - 1, top);
+            --top;
+            break;
+        case OpCode::AddNumber:
+        case OpCode::SubtractNumber:
+        case OpCode::MultiplyNumber:
+        case OpCode::DivideNumber:
+            emitter.LoadNumber(SCRATCH, instruction.number);
+            emitter.Arithmetic(instruction.op, top, SCRATCH);
+            break;
+        case OpCode::UnaryMinus:
+            emitter.Negate(top);
+            break;
+        default:
+            break;
+        }
+    }
+    emitter.Return();
+
+    // written first, then made executable instead of writable
+    const auto& code = emitter.GetCode();
+    const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    const std::size_t size = (code.size() + page - 1) / page * page;
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    std::memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return nullptr;
+    }
+    return std::unique_ptr<NativeCode>(new NativeCode(memory, size));
+#else
+    return nullptr;
+#endif
+}
+
+}  // namespace ASTImpl
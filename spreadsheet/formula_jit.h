@@ -0,0 +1,53 @@
+#pragma once
+
+#include "FormulaAST.h"
+
+#include <cstddef>
+#include <memory>
+
+// Compiles formula programs to x86-64 machine code. Only the builds
+// defining SPREADSHEET_ENABLE_JIT compile anything, and only for x86-64
+// Linux and macOS; elsewhere no program can be compiled and the formulas
+// are always interpreted.
+//
+// The native code keeps the value stack of Execute() in the SSE registers,
+// so it handles the arithmetic over numbers and cells of the formula's own
+// sheet, at most 15 values deep: function calls, ranges and references to
+// other sheets are left to the interpreter. Every instruction becomes the
+// scalar double operation the interpreter does, so the results are the
+// same to the bit.
+namespace ASTImpl {
+
+// cells holds the values of FormulaAST::GetCells(), in order; a value
+// that is not finite is returned as it is, as Execute() does
+using NativeFormula = double (*)(const double* cells);
+
+// executable memory holding one compiled program
+class NativeCode {
+public:
+    NativeCode(const NativeCode&) = delete;
+    NativeCode& operator=(const NativeCode&) = delete;
+    ~NativeCode();
+
+    NativeFormula GetFunction() const;
+    // the bytes mapped, whole pages
+    std::size_t GetSize() const;
+
+private:
+    friend std::unique_ptr<NativeCode> CompileNative(const Program& program);
+
+    NativeCode(void* memory, std::size_t size);
+
+    void* memory_;
+    std::size_t size_;
+};
+
+// whether this build compiles programs on this machine
+bool IsNativeCompilationAvailable();
+// whether CompileNative() handles every instruction of the program
+bool CanCompileNative(const Program& program);
+// nullptr if the program cannot be compiled or no executable memory is
+// left
+std::unique_ptr<NativeCode> CompileNative(const Program& program);
+
+}  // namespace ASTImpl
@@ -1,7 +1,25 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <limits>
+#include <stdexcept>
+#include <thread>
+#include "cell_storage.h"
 #include "common.h"
 #include "formula.h"
+#include "FormulaAST.h"
+#include "formula_jit.h"
+#include "range_index.h"
+#include "sheet.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
+#include "thread_pool.h"
+#include "tsv.h"
+#include "workbook.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -411,8 +429,1952 @@ void TestMyEmptyCellsPrintableSize() {
     ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{6, 6}));
 }
 
+void TestMyDenseAndSparseStorage() {
+    auto sheet = CreateSheet();
+    for (int row = 0; row < 40; ++row) {
+        for (int col = 0; col < 40; ++col) {
+            sheet->SetCell(Position{row, col}, std::to_string(row * 40 + col));
+        }
+    }
+    sheet->SetCell(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "=A1+AN40");
+    for (int row = 0; row < 40; ++row) {
+        for (int col = 0; col < 40; ++col) {
+            const CellInterface* cell = sheet->GetCell(Position{row, col});
+            ASSERT(cell != nullptr);
+            ASSERT_EQUAL(cell->GetText(), std::to_string(row * 40 + col));
+        }
+    }
+    ASSERT_EQUAL(sheet->GetCell("XFD16384"_pos)->GetValue(), CellInterface::Value(1599.0));
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+
+    for (int row = 0; row < 40; ++row) {
+        for (int col = 1; col < 40; ++col) {
+            sheet->ClearCell(Position{row, col});
+        }
+    }
+    ASSERT(sheet->GetCell("B1"_pos) == nullptr);
+    // XFD16384 still refers to it
+    ASSERT_EQUAL(sheet->GetCell("AN40"_pos)->GetText(), "");
+    ASSERT_EQUAL(sheet->GetCell("A40"_pos)->GetText(), "1560");
+    sheet->ClearCell("XFD16384"_pos);
+    ASSERT(sheet->GetCell("AN40"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{40, 1}));
+
+    // a replacement that throws keeps the old value and the count of the
+    // tile's sparse values
+    struct Value {
+        explicit Value(int v) : value(v) {
+            if (v < 0) {
+                throw std::runtime_error("no value");
+            }
+        }
+        Value(Value&&) noexcept = default;
+        int value;
+    };
+    struct Hash {
+        std::size_t operator()(const Position& pos) const {
+            return pos.ToKey();
+        }
+    };
+    TiledStorage<Value, Hash, std::equal_to<Position>> storage;
+    const int below_promotion = decltype(storage)::PROMOTE_THRESHOLD - 1;
+    for (int col = 0; col < below_promotion; ++col) {
+        storage.Emplace(Position{0, col}, col);
+    }
+    try {
+        storage.Emplace(Position{0, 0}, -1);
+        ASSERT(false);
+    } catch (const std::runtime_error&) {
+    }
+    ASSERT(storage.Find(Position{0, 0}) != nullptr);
+    ASSERT_EQUAL(storage.Find(Position{0, 0})->value, 0);
+    // promotes the tile
+    storage.Emplace(Position{0, below_promotion}, below_promotion);
+    for (int col = 0; col <= below_promotion; ++col) {
+        ASSERT_EQUAL(storage.Find(Position{0, col})->value, col);
+    }
+}
+
+void TestMyCompiledFormulaPrinting() {
+    auto reformat = [](std::string expr) {
+        return ParseFormula(std::move(expr))->GetExpression();
+    };
+    auto print = [](const std::string& expr) {
+        std::ostringstream out;
+        ParseFormulaAST(expr).Print(out);
+        return out.str();
+    };
+
+    ASSERT_EQUAL(reformat("1-(2-3)"), "1-(2-3)");
+    ASSERT_EQUAL(reformat("(1-2)-3"), "1-2-3");
+    ASSERT_EQUAL(reformat("1/(2*3)"), "1/(2*3)");
+    ASSERT_EQUAL(reformat("(1*2)/3"), "1*2/3");
+    ASSERT_EQUAL(reformat("-(2*3)"), "-2*3");
+    ASSERT_EQUAL(reformat("-(A1+B2)"), "-(A1+B2)");
+    ASSERT_EQUAL(reformat("+(A1-B2)/C3"), "+(A1-B2)/C3");
+    ASSERT_EQUAL(reformat("2*-(3+4)"), "2*-(3+4)");
+    ASSERT_EQUAL(reformat("0.5*1e10"), "0.5*1e+10");
+
+    ASSERT_EQUAL(print("1+2*A1"), "(+ 1 (* 2 A1))");
+    ASSERT_EQUAL(print("-(1-B2)/3"), "(/ (- (- 1 B2)) 3)");
+
+    auto sheet = CreateSheet();
+    auto evaluate = [&](std::string expr) {
+        return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*sheet));
+    };
+    sheet->SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(evaluate("-(1-A1)/2"), 1);
+    ASSERT_EQUAL(evaluate("((((((((((((((((((((((((((((((((((A1))))))))))))))))))))))))))))))))))"), 3);
+    std::string deep = "1";
+    for (int i = 0; i < 100; ++i) {
+        deep = "1+(" + deep + ")";
+    }
+    ASSERT_EQUAL(evaluate(deep), 101);
+}
+
+void TestMyRecalculation() {
+    auto chain_pos = [](int i) {
+        return Position{i % 1000, i / 1000};
+    };
+    constexpr int chain_length = 20000;
+
+    for (auto mode : {Sheet::RecalcMode::Lazy, Sheet::RecalcMode::Eager, Sheet::RecalcMode::Parallel}) {
+        Sheet sheet;
+        sheet.SetRecalcMode(mode);
+        sheet.SetRecalcThreads(4);
+        sheet.SetCell(chain_pos(0), "1");
+        for (int i = 1; i < chain_length; ++i) {
+            sheet.SetCell(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+        }
+        ASSERT_EQUAL(sheet.GetCell(chain_pos(chain_length - 1))->GetValue(),
+                     CellInterface::Value(double(chain_length)));
+
+        sheet.SetCell(chain_pos(0), "10");
+        ASSERT_EQUAL(sheet.GetCell(chain_pos(chain_length - 1))->GetValue(),
+                     CellInterface::Value(double(chain_length + 9)));
+
+        // diamond: every cell is computed from the two cells of the previous level
+        sheet.SetCell("Z1"_pos, "1");
+        Position prev_left = "Z1"_pos, prev_right = "Z1"_pos;
+        for (int level = 2; level <= 40; ++level) {
+            Position left{level - 1, 25}, right{level - 1, 26};
+            std::string formula = "=" + prev_left.ToString() + "+" + prev_right.ToString();
+            sheet.SetCell(left, formula);
+            sheet.SetCell(right, formula);
+            prev_left = left;
+            prev_right = right;
+        }
+        ASSERT_EQUAL(sheet.GetCell("AA40"_pos)->GetValue(), CellInterface::Value(std::ldexp(1.0, 39)));
+        sheet.SetCell("Z1"_pos, "2");
+        ASSERT_EQUAL(sheet.GetCell("AA40"_pos)->GetValue(), CellInterface::Value(std::ldexp(1.0, 40)));
+    }
+
+    {
+        // wide fan-out with several levels, enough to be computed in parallel
+        Sheet sheet;
+        sheet.SetRecalcMode(Sheet::RecalcMode::Parallel);
+        sheet.SetRecalcThreads(4);
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 0; row < 500; ++row) {
+            sheet.SetCell(Position{row, 1}, "=A1*" + std::to_string(row));
+            sheet.SetCell(Position{row, 2}, "=" + Position{row, 1}.ToString() + "+A1");
+            sheet.SetCell(Position{row, 3}, "=" + Position{row, 2}.ToString() + "*" +
+                                                Position{row, 1}.ToString());
+        }
+        sheet.SetCell("A1"_pos, "2");
+        for (int row = 0; row < 500; ++row) {
+            const double b = 2.0 * row;
+            ASSERT_EQUAL(sheet.GetCell(Position{row, 3})->GetValue(), CellInterface::Value((b + 2) * b));
+        }
+    }
+
+    {
+        // an exception of a task reaches the thread waiting for the pool,
+        // the other tasks still run
+        ThreadPool pool(4);
+        std::atomic<int> finished{0};
+        for (int i = 0; i < 100; ++i) {
+            pool.Submit([&finished, i] {
+                if (i == 50) {
+                    throw std::runtime_error("task failed");
+                }
+                finished.fetch_add(1);
+            });
+        }
+        try {
+            pool.Wait();
+            ASSERT(false);
+        } catch (const std::runtime_error&) {
+        }
+        ASSERT_EQUAL(finished.load(), 99);
+        pool.Submit([&finished] {
+            finished.fetch_add(1);
+        });
+        pool.Wait();
+        ASSERT_EQUAL(finished.load(), 100);
+    }
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "=B1+A1");
+    sheet.SetCell("A1"_pos, "5");
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(15.0));
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
+void TestMyCircularDependencyDetection() {
+    auto chain_pos = [](int i) {
+        return Position{i % 1000, i / 1000};
+    };
+    constexpr int chain_length = 20000;
+    const Position last = chain_pos(chain_length - 1);
+
+    Sheet sheet;
+    sheet.SetCell(chain_pos(0), "1");
+    for (int i = 1; i < chain_length; ++i) {
+        sheet.SetCell(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+    }
+    try {
+        sheet.SetCell(chain_pos(0), "=" + last.ToString());
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // the head of the chain starts depending on a cell created after the
+    // whole chain, which moves the chain in the topological order
+    sheet.SetCell("ZZ1"_pos, "=ZZ2");
+    sheet.SetCell(chain_pos(0), "=ZZ1+1");
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(double(chain_length)));
+    try {
+        sheet.SetCell("ZZ2"_pos, "=" + last.ToString());
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(sheet.GetCell("ZZ2"_pos)->GetText().empty());
+
+    // references that are already ordered before the cell need no search
+    sheet.SetCell("ZZ2"_pos, "=" + Position{0, 30}.ToString());
+    sheet.SetCell(chain_pos(0), "=ZZ2+ZZ1");
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(double(chain_length - 1)));
+    try {
+        sheet.SetCell(Position{0, 30}, "=" + chain_pos(5).ToString());
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+}
+
+void TestMyRangeFunctions() {
+    {
+        Accumulator accumulator;
+        std::vector<double> values;
+        for (int i = 1; i <= 11; ++i) {
+            values.push_back(i % 2 ? i : -i);
+        }
+        accumulator.Add(values.data(), values.size());
+        accumulator.Add(100.);
+        ASSERT_EQUAL(accumulator.GetResult(AggregateFunction::Sum), 106.);
+        ASSERT_EQUAL(accumulator.GetResult(AggregateFunction::Count), 12.);
+        ASSERT_EQUAL(accumulator.GetResult(AggregateFunction::Min), -10.);
+        ASSERT_EQUAL(accumulator.GetResult(AggregateFunction::Max), 100.);
+        ASSERT_EQUAL(Accumulator{}.GetResult(AggregateFunction::Max), 0.);
+    }
+
+    auto formula = ParseFormula("SUM(B2:A1,A1:B2)+MAX(C3*2,-1)-COUNT()");
+    ASSERT_EQUAL(formula->GetExpression(), "SUM(A1:B2,A1:B2)+MAX(C3*2,-1)-COUNT()");
+    ASSERT_EQUAL(formula->GetReferencedCells(), std::vector<Position>{"C3"_pos});
+    ASSERT_EQUAL(formula->GetReferencedRanges().size(), 1u);
+    ASSERT_EQUAL(formula->GetReferencedRanges().front().ToString(), "A1:B2");
+    for (const auto& bad : {"SUM(A1:B2", "A1:B2", "SUM(A1:ZZZZ1)", "1+SUM"}) {
+        try {
+            ParseFormula(bad);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+
+    auto sheet = CreateSheet();
+    for (int row = 0; row < 500; ++row) {
+        sheet->SetCell(Position{row, 0}, std::to_string(row + 1));
+    }
+    sheet->SetCell("B1"_pos, "=SUM(A1:A500)");
+    sheet->SetCell("B2"_pos, "=AVERAGE(A1:A500)");
+    sheet->SetCell("B3"_pos, "=MIN(A1:A500,B1)");
+    sheet->SetCell("B4"_pos, "=MAX(A1:A500)*2");
+    sheet->SetCell("B5"_pos, "=COUNT(A1:A1000)");
+    sheet->SetCell("B6"_pos, "=AVERAGE(C1:C10)");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(125250.));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(250.5));
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(1.));
+    ASSERT_EQUAL(sheet->GetCell("B4"_pos)->GetValue(), CellInterface::Value(1000.));
+    ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetValue(), CellInterface::Value(500.));
+    ASSERT_EQUAL(sheet->GetCell("B6"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
+
+    // text is skipped, errors are propagated, changes are tracked
+    sheet->SetCell("A1"_pos, "text");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(125249.));
+    ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetValue(), CellInterface::Value(499.));
+    sheet->SetCell("A2"_pos, "=1/0");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    sheet->ClearCell("A2"_pos);
+    sheet->SetCell("A600"_pos, "1000");
+    sheet->SetCell("C1"_pos, "=B1+1");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(125248.));
+    ASSERT_EQUAL(sheet->GetCell("B6"_pos)->GetValue(), CellInterface::Value(125248.));
+    ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetValue(), CellInterface::Value(499.));
+
+    // a cycle can be closed through a range from either side
+    for (const auto& [pos, text] : {std::pair{"A3"_pos, "=B1"}, {"B7"_pos, "=SUM(B1:B7)"},
+                                    {"A4"_pos, "=C1*2"}, {"C7"_pos, "=SUM(B5:B6)"}}) {
+        try {
+            sheet->SetCell(pos, text);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+    }
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetText(), "3");
+
+    // a formula inside a range which was ranked after the range formula
+    sheet->SetCell("D1"_pos, "5");
+    sheet->SetCell("A3"_pos, "=D1");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(125250.));
+    try {
+        sheet->SetCell("D1"_pos, "=C1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    Sheet batch;
+    batch.SetRecalcMode(Sheet::RecalcMode::Eager);
+    try {
+        batch.SetCells({{"A1"_pos, "=SUM(B1:B3)"}, {"B2"_pos, "=A1"}});
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    batch.SetCells({{"A1"_pos, "=SUM(B1:B3)"}, {"B2"_pos, "=C1"}, {"C1"_pos, "4"}});
+    ASSERT_EQUAL(batch.GetCell("A1"_pos)->GetValue(), CellInterface::Value(4.));
+    batch.SetCell("B3"_pos, "1.5");
+    ASSERT_EQUAL(batch.GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.5));
+}
+
+void TestMyRangeIndex() {
+    // deterministic pseudo-random ranges of all sizes, checked by brute force
+    std::uint32_t seed = 12345;
+    auto next = [&seed](int bound) {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<int>((seed >> 8) % static_cast<std::uint32_t>(bound));
+    };
+    std::vector<std::pair<Range, Position>> ranges;
+    RangeIndex index;
+    for (int i = 0; i < 300; ++i) {
+        const int extent = 1 << next(15);
+        const Position a{next(Position::MAX_ROWS), next(Position::MAX_COLS)};
+        const Position b{std::min(a.row + next(extent), Position::MAX_ROWS - 1),
+                         std::min(a.col + next(extent), Position::MAX_COLS - 1)};
+        ranges.push_back({Range::FromCorners(a, b), Position{i, 0}});
+        index.Add(ranges.back().first, ranges.back().second);
+    }
+    for (int i = 0; i < 100; ++i) {
+        index.Remove(ranges[i].first, ranges[i].second);
+    }
+    ranges.erase(ranges.begin(), ranges.begin() + 100);
+
+    for (int probe = 0; probe < 2000; ++probe) {
+        Position pos{next(Position::MAX_ROWS), next(Position::MAX_COLS)};
+        if (probe % 2 == 0) {
+            // corners hit the bucket borders
+            const Range& range = ranges[probe % ranges.size()].first;
+            pos = probe % 4 == 0 ? range.first : range.last;
+        }
+        std::vector<int> expected, found;
+        for (const auto& [range, dependent] : ranges) {
+            if (range.Contains(pos)) {
+                expected.push_back(dependent.row);
+            }
+        }
+        index.ForEachContaining(pos, [&found](Position dependent) {
+            found.push_back(dependent.row);
+        });
+        std::sort(found.begin(), found.end());
+        ASSERT_EQUAL(found, expected);
+    }
+
+    // many formulas over small rows of cells
+    Sheet sheet;
+    for (int row = 0; row < 2000; ++row) {
+        const Range range{{row, 0}, {row, 9}};
+        sheet.SetCell(Position{row, 10}, "=SUM(" + range.ToString() + ")");
+        sheet.SetCell(Position{row, 3}, std::to_string(row));
+    }
+    ASSERT_EQUAL(sheet.GetCell("K1500"_pos)->GetValue(), CellInterface::Value(1499.));
+    ASSERT_EQUAL(sheet.GetCell("K1499"_pos)->GetValue(), CellInterface::Value(1498.));
+    sheet.SetCell("J1500"_pos, "1");
+    // only the formula over the changed row is invalidated
+    ASSERT(static_cast<const Cell*>(sheet.GetCell("K1499"_pos))->IsCacheValid());
+    ASSERT(!static_cast<const Cell*>(sheet.GetCell("K1500"_pos))->IsCacheValid());
+    ASSERT_EQUAL(sheet.GetCell("K1500"_pos)->GetValue(), CellInterface::Value(1500.));
+}
+
+void TestMyNumericTextCells() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1e2");
+    sheet->SetCell("A2"_pos, "'2.5");
+    sheet->SetCell("A3"_pos, "3 apples");
+    sheet->SetCell("A4"_pos, " 4");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "1e2");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(std::string("1e2")));
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(std::string("2.5")));
+    ASSERT_EQUAL(*sheet->GetCell("A1"_pos)->GetNumber(), 100.);
+    ASSERT_EQUAL(*sheet->GetCell("A2"_pos)->GetNumber(), 2.5);
+    ASSERT(!sheet->GetCell("A3"_pos)->GetNumber());
+    ASSERT_EQUAL(*sheet->GetCell("A4"_pos)->GetNumber(), 4.);
+
+    sheet->SetCell("B1"_pos, "=A1+A2+A4");
+    sheet->SetCell("B2"_pos, "=A3");
+    sheet->SetCell("B3"_pos, "=SUM(A1:A4)");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(106.5));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(106.5));
+    ASSERT_EQUAL(*sheet->GetCell("B1"_pos)->GetNumber(), 106.5);
+    ASSERT(!sheet->GetCell("B2"_pos)->GetNumber());
+
+    sheet->SetCell("A1"_pos, "abc");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+}
+
+void TestMyErrorPropagation() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "text");
+    for (int row = 1; row < 5000; ++row) {
+        sheet.SetCell(Position{row, 0}, "=" + Position{row - 1, 0}.ToString() + "*2+1");
+    }
+    sheet.SetCell("B1"_pos, "=SUM(A1:A5000)");
+    sheet.SetCell("B2"_pos, "=1/0+A5000");
+    sheet.SetCell("B3"_pos, "=A5000/0");
+    const CellInterface::Value value_error = FormulaError(FormulaError::Category::Value);
+    ASSERT_EQUAL(sheet.GetCell("A5000"_pos)->GetValue(), value_error);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), value_error);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), value_error);
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), value_error);
+
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(7.));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+
+    std::ostringstream out;
+    out << FormulaError(FormulaError::Category::Ref) << ' ' << FormulaError(FormulaError::Category::Value);
+    ASSERT_EQUAL(out.str(), "#REF! #VALUE!");
+}
+
+void TestMyHandwrittenParser() {
+    // the hand-written parser must agree with the ANTLR one on every input
+    auto describe = [](std::string_view text, FormulaParserBackend backend) -> std::string {
+        try {
+            auto ast = ParseFormulaAST(text, backend);
+            std::ostringstream out;
+            ast.Print(out);
+            out << " | ";
+            ast.PrintFormula(out);
+            out << " | ";
+            ast.PrintCells(out);
+            for (const auto& range : ast.GetRanges()) {
+                out << range.ToString() << ' ';
+            }
+            return out.str();
+        } catch (const std::exception&) {
+            return "error";
+        }
+    };
+    auto check = [&describe](std::string_view text) {
+        ASSERT_EQUAL(describe(text, FormulaParserBackend::Handwritten),
+                     describe(text, FormulaParserBackend::Antlr));
+    };
+
+    for (const auto* text : {"1", " 1 + 2 * 3 ", "-A1*B1", "-(A1+B1)/+C1", "1-2-3", "1/(2/3)",
+                             "((A1))", "2.5e-3+.5+1E3", "1e", "1.", ".", "A1B2", "SUM(A1:B3)",
+                             "SUM()", "MAX(1,-A1,(B2))*COUNT(Z9:A1,2)", "SUM(A1:)", "SUM(A1:B2+1)",
+                             "FOO(1)", "SUM", "A0", "ZZZZ1", "SUM(A1:XFE1)", "1+", "(1", "1)", "",
+                             "MIN(AVERAGE(A1:A2),SUM(-B1))", "#REF!", "SUM(#REF!,#REF!*2)", "#REF!:A1",
+                             "#REF", "SUM(A1:#REF!)"}) {
+        check(text);
+    }
+
+    std::uint32_t seed = 2024;
+    auto next = [&seed](std::size_t bound) {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) % bound;
+    };
+    const std::string_view tokens[] = {"A1", "B2", "ZZ10", "1", "2.5", ".5", "1e3", "+", "-", "*",
+                                       "/", "(", ")", "SUM(", "MAX(", ",", ":", " "};
+    for (int i = 0; i < 3000; ++i) {
+        std::string text;
+        for (std::size_t length = 1 + next(12); length > 0; --length) {
+            text += tokens[next(std::size(tokens))];
+        }
+        check(text);
+    }
+
+    const auto backend = GetFormulaParserBackend();
+    SetFormulaParserBackend(FormulaParserBackend::Antlr);
+    ASSERT_EQUAL(ParseFormula("1+(2*A1)")->GetExpression(), "1+2*A1");
+    SetFormulaParserBackend(backend);
+
+    // deep nesting is an error, not a stack overflow
+    const std::string nested = std::string(1000, '(') + "A1" + std::string(1000, ')') + "+1";
+    ASSERT_EQUAL(ParseFormula(nested)->GetExpression(), "A1+1");
+    ASSERT_EQUAL(ParseFormula(std::string(1000, '-') + "1")->GetExpression().size(), 1001u);
+    for (const auto& text : {std::string(100000, '(') + "1" + std::string(100000, ')'),
+                             std::string(100000, '-') + "1",
+                             std::string(100000, '(') + "1",
+                             "SUM(" + std::string(100000, '(') + "1"}) {
+        try {
+            ParseFormula(text);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+}
+
+void TestMyBatchUpdates() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    sheet.SetCells({{"A1"_pos, "2"}, {"C1"_pos, "=B1*D1"}, {"D1"_pos, "3"}, {"D1"_pos, "4"}});
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(12.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 4}));
+
+    auto expect_unchanged = [&] {
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "2");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=B1*D1");
+        ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 4}));
+    };
+
+    bool caught = false;
+    try {
+        sheet.SetCells({{"E1"_pos, "=1"}, {"A1"_pos, "=C1"}});
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    expect_unchanged();
+
+    caught = false;
+    try {
+        sheet.SetCells({{"E1"_pos, "=1"}, {"A1"_pos, "=2+"}});
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    expect_unchanged();
+
+    // the cycle only exists in the final state of the batch
+    caught = false;
+    try {
+        sheet.SetCells({{"E1"_pos, "=D1"}, {"D1"_pos, "=F1"}, {"F1"_pos, "=E1"}});
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    expect_unchanged();
+
+    // a cycle broken within the same batch is fine
+    sheet.SetCells({{"D1"_pos, "=C1"}, {"C1"_pos, "=A1"}});
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    sheet.BeginBatch();
+    sheet.SetCell("A1"_pos, "10");
+    sheet.ClearCell("C1"_pos);
+    sheet.SetCell("C1"_pos, "=A1*3");
+    ASSERT(sheet.IsInBatch());
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0));
+    sheet.CommitBatch();
+    ASSERT(!sheet.IsInBatch());
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(30.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.0));
+
+    sheet.BeginBatch();
+    sheet.SetCell("A1"_pos, "=D1");
+    caught = false;
+    try {
+        sheet.CommitBatch();
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(!sheet.IsInBatch());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "10");
+
+    sheet.BeginBatch();
+    sheet.ClearCell("A1"_pos);
+    sheet.AbortBatch();
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "10");
+
+    // a large batch of ranges over other new cells, which a check testing
+    // every new cell against every range makes quadratic
+    const int rows = 16000;
+    auto range_batch = [rows] {
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < rows; ++row) {
+            const std::string next = std::to_string(row + 2);
+            const std::string current = std::to_string(row + 1);
+            cells.emplace_back(Position{row, 1}, "=SUM(A" + current + ":A" + next + ")");
+            cells.emplace_back(Position{row, 2}, "=SUM(B" + current + ":B" + next + ")");
+        }
+        return cells;
+    };
+    Sheet ranges;
+    auto cells = range_batch();
+    for (int row = 0; row < rows; ++row) {
+        cells.emplace_back(Position{row, 0}, "1");
+    }
+    ranges.SetCells(std::move(cells));
+    ASSERT_EQUAL(ranges.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT_EQUAL(ranges.GetCell(Position{rows - 1, 2})->GetValue(), CellInterface::Value(1.0));
+
+    // the cycle goes through the ranges of the new cells only
+    cells = range_batch();
+    cells.emplace_back(Position{rows, 0}, "=SUM(C1:C" + std::to_string(rows) + ")");
+    caught = false;
+    try {
+        ranges.SetCells(std::move(cells));
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(ranges.GetCell(Position{rows, 0}) == nullptr);
+}
+
 }  // namespace
 
+void TestMyFormulaInterning() {
+    // copies of a formula filled down a column share one AST
+    ASSERT(InternFormulaAST("B2*C2", "D2"_pos) == InternFormulaAST("B3 * C3", "D3"_pos));
+    ASSERT(InternFormulaAST("SUM(A1:B2)+E5", "C3"_pos) ==
+           InternFormulaAST("SUM(B1:C2)+F5", "D3"_pos));
+    ASSERT(InternFormulaAST("B2*C2", "D2"_pos) != InternFormulaAST("B2*C2", "D3"_pos));
+    ASSERT(NormalizeFormula("1 2", "A1"_pos) != NormalizeFormula("12", "A1"_pos));
+    ASSERT_EQUAL(NormalizeFormula("B3 * C3", "D3"_pos), "R[0]C[-2] * R[0]C[-1]");
+    ASSERT_EQUAL(NormalizeFormula("1E5+E5", "A1"_pos), "1E5 + R[4]C[4]");
+
+    auto sheet = CreateSheet();
+    constexpr int ROWS = 1000;
+    for (int row = 0; row < ROWS; ++row) {
+        const auto r = std::to_string(row + 1);
+        sheet->SetCell({row, 0}, r);
+        sheet->SetCell({row, 1}, "2");
+        sheet->SetCell({row, 2}, "=A" + r + "*B" + r + "+SUM(A1:A" + r + ")");
+    }
+    for (int row = 0; row < ROWS; ++row) {
+        const auto r = std::to_string(row + 1);
+        const auto* cell = sheet->GetCell({row, 2});
+        ASSERT_EQUAL(cell->GetText(), "=A" + r + "*B" + r + "+SUM(A1:A" + r + ")");
+        ASSERT_EQUAL(cell->GetReferencedCells(),
+                     (std::vector<Position>{{row, 0}, {row, 1}}));
+        const double n = row + 1;
+        ASSERT_EQUAL(std::get<double>(cell->GetValue()), n * 2 + n * (n + 1) / 2);
+    }
+    // SUM(A1:A<r>) is not a copy of itself from row to row, A1 stays put
+    ASSERT(InternFormulaAST("A2*B2+SUM(A1:A2)", "C2"_pos) !=
+           InternFormulaAST("A3*B3+SUM(A1:A3)", "C3"_pos));
+
+    // shared references at the edges of the sheet stay correct
+    sheet->SetCell("XFD16384"_pos, "=XFC16383+1");
+    sheet->SetCell("B2"_pos, "=A1+1");
+    ASSERT_EQUAL(sheet->GetCell("XFD16384"_pos)->GetText(), "=XFC16383+1");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "=A1+1");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector<Position>{"A1"_pos});
+}
+
+void TestMyCellMemory() {
+    auto ast = ParseFormulaAST("B2+A1*B2+SUM(C1:C3,A1:A2,C1:C3)");
+    ASSERT_EQUAL(ast.GetCells(), (std::vector<Position>{"A1"_pos, "B2"_pos}));
+    ASSERT_EQUAL(ast.GetRanges().size(), 2u);
+    std::ostringstream out;
+    ast.PrintFormula(out);
+    ASSERT_EQUAL(out.str(), "B2+A1*B2+SUM(C1:C3,A1:A2,C1:C3)");
+
+    // freed blocks are reused by the cells set after, across tile promotion
+    auto sheet = CreateSheet();
+    for (int round = 0; round < 3; ++round) {
+        for (int row = 0; row < 200; ++row) {
+            const auto text = round % 2 == 0 ? "=A" + std::to_string(row + 2) + "+1"
+                                             : "text " + std::to_string(row);
+            sheet->SetCell({row, round}, text);
+            sheet->SetCell({row, 5}, std::to_string(row));
+        }
+        for (int row = 0; row < 200; row += 2) {
+            sheet->ClearCell({row, round});
+        }
+        for (int row = 1; row < 200; row += 2) {
+            const auto* cell = sheet->GetCell({row, round});
+            if (round % 2 == 0) {
+                ASSERT_EQUAL(cell->GetText(), "=A" + std::to_string(row + 2) + "+1");
+            } else {
+                ASSERT_EQUAL(cell->GetText(), "text " + std::to_string(row));
+            }
+        }
+    }
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("A2"_pos)->GetValue()), 1.0);
+    ASSERT_EQUAL(sheet->GetCell("F200"_pos)->GetText(), "199");
+}
+
+void TestMyCompactCells() {
+    auto sheet = CreateSheet();
+    // texts and numbers right at and past the size kept inside the cell
+    const std::pair<std::string, CellInterface::Value> cases[] = {
+        {"1234567", 1234567.0},
+        {"12345678", 12345678.0},
+        {"'1.5", 1.5},
+        {"-1.5e-3", -1.5e-3},
+        {"7.000000000001", 7.000000000001},
+        {"fifteen chars!!", std::string("fifteen chars!!")},
+        {"sixteen chars!!!", std::string("sixteen chars!!!")},
+        {"'=1+2", std::string("=1+2")},
+        {"=", std::string("=")},
+        {"'", std::string()},
+    };
+    for (int row = 0; row < 40; ++row) {  // enough rows to fill a tile
+        for (int col = 0; col < 10; ++col) {
+            sheet->SetCell({row, col}, cases[col].first);
+        }
+    }
+    for (int row = 0; row < 40; ++row) {
+        for (int col = 0; col < 10; ++col) {
+            const auto* cell = sheet->GetCell({row, col});
+            ASSERT_EQUAL(cell->GetText(), cases[col].first);
+            const auto number = cell->GetNumber();
+            if (const auto* expected = std::get_if<double>(&cases[col].second)) {
+                ASSERT(number && *number == *expected);
+                const auto value = std::get<std::string>(cell->GetValue());
+                ASSERT_EQUAL(value, cases[col].first.substr(cases[col].first[0] == '\'' ? 1 : 0));
+            } else {
+                ASSERT(!number);
+                ASSERT_EQUAL(cell->GetValue(), cases[col].second);
+            }
+        }
+    }
+    sheet->SetCell("K1"_pos, "=A1+B1+C1+D1+E1");
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("K1"_pos)->GetValue()),
+                 1234567.0 + 12345678.0 + 1.5 - 1.5e-3 + 7.000000000001);
+    sheet->SetCell("A1"_pos, "=F1");
+    ASSERT_EQUAL(sheet->GetCell("K1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+}
+
+void TestMyStreamingPrint() {
+    // the printed sheet must match printing every position in the area
+    auto reference = [](const SheetInterface& sheet, std::ostream& out, bool values) {
+        const Size size = sheet.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                if (col != 0) {
+                    out << '\t';
+                }
+                if (const auto* cell = sheet.GetCell({row, col})) {
+                    if (values) {
+                        std::visit([&out](const auto& value) { out << value; }, cell->GetValue());
+                    } else {
+                        out << cell->GetText();
+                    }
+                }
+            }
+            out << '\n';
+        }
+    };
+    auto check = [&reference](const SheetInterface& sheet, int precision) {
+        for (bool values : {false, true}) {
+            std::ostringstream expected;
+            std::ostringstream actual;
+            expected.precision(precision);
+            actual.precision(precision);
+            reference(sheet, expected, values);
+            if (values) {
+                sheet.PrintValues(actual);
+            } else {
+                sheet.PrintTexts(actual);
+            }
+            ASSERT_EQUAL(actual.str(), expected.str());
+        }
+    };
+
+    auto sheet = CreateSheet();
+    std::uint32_t seed = 7;
+    auto next = [&seed](std::uint32_t bound) {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) % bound;
+    };
+    for (int i = 0; i < 3000; ++i) {
+        // a dense block that gets tiles and scattered cells that stay sparse
+        const Position pos = i % 2 == 0 ? Position{static_cast<int>(next(70)), static_cast<int>(next(70))}
+                                        : Position{static_cast<int>(next(300)), static_cast<int>(next(200))};
+        switch (next(5)) {
+        case 0:
+            sheet->SetCell(pos, std::to_string(next(1000)) + "." + std::to_string(next(1000)));
+            break;
+        case 1:
+            sheet->SetCell(pos, "=1/" + std::to_string(next(7)) + "+" + Position{static_cast<int>(next(5)), 250}.ToString());
+            break;
+        case 2:
+            sheet->SetCell(pos, "text");
+            break;
+        case 3:
+            sheet->SetCell(pos, "=" + Position{static_cast<int>(next(300)) + 400, 0}.ToString());
+            break;
+        default:
+            sheet->ClearCell(pos);
+        }
+    }
+    check(*sheet, 6);
+    check(*sheet, 3);
+    check(*sheet, 17);
+
+    auto corner = CreateSheet();
+    corner->SetCell("XFD200"_pos, "=1/3");
+    check(*corner, 6);
+    corner->ClearCell("XFD200"_pos);
+    std::ostringstream out;
+    corner->PrintValues(out);
+    ASSERT_EQUAL(out.str(), "");
+}
+
+void TestMySnapshot() {
+    const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test.snapshot").string();
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "'3");
+    sheet.SetCell("A3"_pos, "a rather long text, not a number");
+    sheet.SetCell("A4"_pos, "1.00000000000000000001");
+    for (int row = 0; row < 100; ++row) {
+        const auto r = std::to_string(row + 1);
+        sheet.SetCell({row, 1}, "=A1*" + r + "+SUM(A1:A4)");
+    }
+    sheet.SetCell("C1"_pos, "=1/0");
+    sheet.SetCell("C2"_pos, "=A3+Z100");
+    sheet.SetCell("C3"_pos, "=MAX(B1:B100)-C1");
+    sheet.SetCell("D1"_pos, "=B5");
+    sheet.SetCell("D2"_pos, "=D1");  // stays not computed
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B100"_pos)->GetValue()), 2 * 100 + 6);
+    sheet.GetCell("C1"_pos)->GetValue();
+    sheet.GetCell("D1"_pos)->GetValue();
+    sheet.SaveSnapshot(path);
+
+    auto loaded = Sheet::LoadSnapshot(path);
+    auto texts = [](const Sheet& s) {
+        std::ostringstream out;
+        s.PrintTexts(out);
+        return out.str();
+    };
+    ASSERT_EQUAL(texts(*loaded), texts(sheet));
+    ASSERT_EQUAL(loaded->GetPrintableSize(), sheet.GetPrintableSize());
+    // the computed values come from the file, the rest is computed on demand
+    ASSERT(static_cast<const Cell*>(loaded->GetCell("B100"_pos))->IsCacheValid());
+    ASSERT(static_cast<const Cell*>(loaded->GetCell("C1"_pos))->IsCacheValid());
+    ASSERT(!static_cast<const Cell*>(loaded->GetCell("D2"_pos))->IsCacheValid());
+    std::ostringstream expected_values;
+    std::ostringstream loaded_values;
+    sheet.PrintValues(expected_values);
+    loaded->PrintValues(loaded_values);
+    ASSERT_EQUAL(loaded_values.str(), expected_values.str());
+    ASSERT(loaded->GetCell("Z100"_pos) != nullptr);  // kept for its dependent
+
+    // the dependency graph comes back with the sheet
+    loaded->SetCell("A1"_pos, "10");
+    ASSERT_EQUAL(std::get<double>(loaded->GetCell("B3"_pos)->GetValue()), 10 * 3 + 14.0);
+    ASSERT_EQUAL(std::get<double>(loaded->GetCell("D2"_pos)->GetValue()), 10 * 5 + 14.0);
+    ASSERT_EQUAL(loaded->GetCell("A4"_pos)->GetNumber().value(), 1.0);
+    try {
+        loaded->SetCell("A2"_pos, "=C3");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    loaded->SetCell("A5"_pos, "=A1*2");
+    loaded->SetCell("A4"_pos, "=SUM(A5:A6)");
+    ASSERT_EQUAL(std::get<double>(loaded->GetCell("B1"_pos)->GetValue()), 10 + 10 + 3 + 20.0);
+
+    // damaged files are rejected
+    std::string bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), {});
+    }
+    for (std::size_t cut : {std::size_t{0}, std::size_t{10}, bytes.size() / 2, bytes.size() - 1}) {
+        std::ofstream(path, std::ios::binary | std::ios::trunc).write(bytes.data(), cut);
+        try {
+            Sheet::LoadSnapshot(path);
+            ASSERT(false);
+        } catch (const SnapshotException&) {
+        }
+    }
+
+    // and so are the files whose references or graph are made up
+    Sheet small;
+    small.SetCell("C7"_pos, "=XY1000+1");
+    small.SaveSnapshot(path);
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), {});
+    }
+    auto replace_position = [&bytes, &path](Position from, Position to) {
+        const std::int32_t from_record[] = {from.row, from.col};
+        const std::int32_t to_record[] = {to.row, to.col};
+        std::string changed = bytes;
+        // the last one, which for a formula cell is its dependent record
+        const auto at = changed.rfind(std::string_view(reinterpret_cast<const char*>(from_record), sizeof(from_record)));
+        ASSERT(at != std::string::npos);
+        std::memcpy(changed.data() + at, to_record, sizeof(to_record));
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << changed;
+        try {
+            Sheet::LoadSnapshot(path);
+            ASSERT(false);
+        } catch (const SnapshotException&) {
+        }
+    };
+    const Position offset{"XY1000"_pos.row - "C7"_pos.row, "XY1000"_pos.col - "C7"_pos.col};
+    constexpr int max_int = std::numeric_limits<std::int32_t>::max();
+    replace_position(offset, {max_int, max_int});
+    replace_position(offset, {-max_int, 0});
+    replace_position("C7"_pos, "C8"_pos);
+    replace_position("C7"_pos, "XY1000"_pos);
+    std::remove(path.c_str());
+}
+
+void TestMyTsv() {
+    std::string input = "1\tabc\t=A1+B2\r\n\t\t\t'=x\n";
+    input += "=SUM(A1:A3)\t" + std::string(100, 'w') + "\t=A3*2\n";
+    input += "5";  // no line end
+    Sheet expected;
+    expected.SetCell("B2"_pos, "1");
+    expected.SetCell("C2"_pos, "abc");
+    expected.SetCell("D2"_pos, "=A1+B2");
+    expected.SetCell("E3"_pos, "'=x");
+    expected.SetCell("B4"_pos, "=SUM(A1:A3)");
+    expected.SetCell("C4"_pos, std::string(100, 'w'));
+    expected.SetCell("D4"_pos, "=A3*2");
+    expected.SetCell("B5"_pos, "5");
+    auto print = [](const Sheet& s, TsvContent content) {
+        std::ostringstream out;
+        ExportTsv(s, out, content);
+        return out.str();
+    };
+
+    for (bool pipelined : {false, true}) {
+        // small chunks and batches split lines and fields across reads
+        for (std::size_t chunk_size : {1, 7, 1 << 20}) {
+            Sheet sheet;
+            std::istringstream in(input);
+            TsvImportOptions options;
+            options.origin = "B2"_pos;
+            options.batch_size = 2;
+            options.chunk_size = chunk_size;
+            options.pipelined = pipelined;
+            ASSERT_EQUAL(ImportTsv(in, sheet, options), 8u);
+            ASSERT_EQUAL(print(sheet, TsvContent::Texts), print(expected, TsvContent::Texts));
+            ASSERT_EQUAL(print(sheet, TsvContent::Values), print(expected, TsvContent::Values));
+        }
+    }
+
+    // exported texts read back to the same sheet
+    {
+        Sheet sheet;
+        std::istringstream in(print(expected, TsvContent::Texts));
+        ImportTsv(in, sheet);
+        ASSERT_EQUAL(print(sheet, TsvContent::Texts), print(expected, TsvContent::Texts));
+    }
+
+    // and so do texts with tabs, line ends and backslashes, escaped
+    {
+        Sheet special;
+        special.SetCell("A1"_pos, "a\tb");
+        special.SetCell("B1"_pos, "two\nlines\r");
+        special.SetCell("A2"_pos, "C:\\new\\");
+        special.SetCell("B2"_pos, "=1+2");
+        const std::string exported = print(special, TsvContent::Texts);
+        ASSERT_EQUAL(exported, "a\\tb\ttwo\\nlines\\r\nC:\\\\new\\\\\t=1+2\n");
+        Sheet sheet;
+        std::istringstream in(exported);
+        ASSERT_EQUAL(ImportTsv(in, sheet), 4u);
+        for (const auto pos : {"A1"_pos, "B1"_pos, "A2"_pos, "B2"_pos}) {
+            ASSERT_EQUAL(sheet.GetCell(pos)->GetText(), special.GetCell(pos)->GetText());
+        }
+        // a backslash escaping nothing stays
+        std::istringstream plain("C:\\dir\\\tend\\");
+        ImportTsv(plain, sheet);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "C:\\dir\\");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "end\\");
+    }
+
+    // a failing batch stops the import, the earlier ones stay
+    for (bool pipelined : {false, true}) {
+        std::string rows;
+        for (int row = 0; row < 1000; ++row) {
+            rows += row == 500 ? "=1+\n" : std::to_string(row) + "\n";
+        }
+        Sheet sheet;
+        std::istringstream in(rows);
+        TsvImportOptions options;
+        options.batch_size = 10;
+        options.pipelined = pipelined;
+        try {
+            ImportTsv(in, sheet, options);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{500, 1}));
+    }
+}
+
+void TestMyStats() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2+A1");
+    auto stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.graph_nodes, 3u);
+    ASSERT_EQUAL(stats.graph_edges, 3u);
+
+    sheet.ResetStats();
+    std::ostringstream dump;
+    sheet.SetStatsDump(&dump, 2);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A3"_pos)->GetValue()), 3.0);
+    sheet.GetCell("A3"_pos)->GetValue();
+    sheet.SetCell("A1"_pos, "5");
+    try {
+        sheet.SetCell("A1"_pos, "=A3");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    sheet.SetCell("B1"_pos, "=A3");
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.graph_nodes, 4u);
+    if constexpr (STATS_ENABLED) {
+        ASSERT_EQUAL(stats.formula_parses, 2u);
+        // A3 computes A2 first and then reads it from the cache
+        ASSERT_EQUAL(stats.evaluations, 2u);
+        ASSERT_EQUAL(stats.cache_misses, 2u);
+        ASSERT_EQUAL(stats.cache_hits, 2u);
+        ASSERT_EQUAL(stats.invalidations, 2u);
+        ASSERT_EQUAL(stats.invalidated_cells, 2u);
+        ASSERT(stats.cycle_checks >= 2u);
+        ASSERT(stats.cycle_check_visits >= 1u);
+        std::ostringstream expected;
+        expected << stats << '\n';
+        ASSERT_EQUAL(dump.str(), expected.str());
+    } else {
+        ASSERT_EQUAL(stats.formula_parses, 0u);
+        ASSERT_EQUAL(stats.cache_hits, 0u);
+        ASSERT(dump.str().empty());
+    }
+}
+
+void TestMyInvalidationStopsAtInvalidCells() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("C1"_pos, "=A1*2");
+    sheet.SetCell("D1"_pos, "=B1+C1");
+    for (int row = 1; row < 100; ++row) {
+        sheet.SetCell({row, 3}, "=" + Position{row - 1, 3}.ToString() + "+1");
+    }
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D100"_pos)->GetValue()), 4.0 + 99);
+
+    auto invalidated = [&sheet](Position pos, std::string text) {
+        sheet.ResetStats();
+        sheet.SetCell(pos, std::move(text));
+        return sheet.GetStats().invalidated_cells;
+    };
+    const std::uint64_t all = invalidated("A1"_pos, "2");
+    // nothing was computed since, so only the direct dependents are checked
+    const std::uint64_t again = invalidated("A1"_pos, "3");
+    // B1 alone was computed again
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 4.0);
+    const std::uint64_t after_b1 = invalidated("A1"_pos, "4");
+    if constexpr (STATS_ENABLED) {
+        ASSERT_EQUAL(all, 102u);
+        ASSERT_EQUAL(again, 0u);
+        ASSERT_EQUAL(after_b1, 1u);
+    }
+    ASSERT(!static_cast<const Cell*>(sheet.GetCell("D100"_pos))->IsCacheValid());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D100"_pos)->GetValue()), 5.0 + 8 + 99);
+
+    // a new formula passes the change on even though it is not computed
+    sheet.SetCell("C1"_pos, "=A1*3");
+    sheet.SetCell("B1"_pos, "=A1*10");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D100"_pos)->GetValue()), 40.0 + 12 + 99);
+
+    // the eager modes recompute every cell left invalid
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A1"_pos, "0");
+    sheet.SetRecalcMode(Sheet::RecalcMode::Eager);
+    ASSERT(static_cast<const Cell*>(sheet.GetCell("D100"_pos))->IsCacheValid());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D100"_pos)->GetValue()), 99.0);
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT(static_cast<const Cell*>(sheet.GetCell("D100"_pos))->IsCacheValid());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D100"_pos)->GetValue()), 10.0 + 3 + 99);
+}
+
+void TestMyPublishedVersions() {
+    Sheet sheet;
+    ASSERT(sheet.GetPublishedVersion() == nullptr);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "=Z100");
+    sheet.SetCell("A100"_pos, "'far away");
+    auto first = sheet.PublishVersion();
+    ASSERT(sheet.GetPublishedVersion() == first);
+    ASSERT_EQUAL(first->GetNumber(), 1u);
+
+    sheet.SetCell("A1"_pos, "5");
+    sheet.ClearCell("A100"_pos);
+    sheet.SetCell("AA1"_pos, "=B1+1");
+    // the first version does not see the changes
+    ASSERT_EQUAL(std::get<double>(first->GetCell("B1"_pos)->GetValue()), 2.0);
+    ASSERT_EQUAL(first->GetCell("A100"_pos)->GetText(), "'far away");
+    ASSERT(first->GetCell("AA1"_pos) == nullptr);
+    ASSERT(first->GetCell("Z100"_pos) != nullptr);  // the empty cell C1 refers to
+    ASSERT_EQUAL(first->GetPrintableSize(), (Size{100, 3}));
+
+    auto second = sheet.PublishVersion();
+    ASSERT_EQUAL(second->GetNumber(), 2u);
+    ASSERT(second->GetCell("A100"_pos) == nullptr);
+    ASSERT_EQUAL(std::get<double>(second->GetCell("AA1"_pos)->GetValue()), 11.0);
+    ASSERT_EQUAL(second->GetCell("AA1"_pos)->GetText(), "=B1+1");
+    ASSERT_EQUAL(second->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+
+    auto print = [](const auto& s, bool values) {
+        std::ostringstream out;
+        values ? s.PrintValues(out) : s.PrintTexts(out);
+        return out.str();
+    };
+    ASSERT_EQUAL(print(*second, true), print(sheet, true));
+    ASSERT_EQUAL(print(*second, false), print(sheet, false));
+    first.reset();
+    second.reset();
+
+    // one writer keeps changing the sheet while readers check that every
+    // version they take is consistent in itself
+    Sheet big;
+    const int rows = 200;
+    for (int row = 0; row < rows; ++row) {
+        big.SetCell({row, 0}, "0");
+        big.SetCell({row, 1}, "=" + Position{row, 0}.ToString() + "+A1");
+    }
+    big.SetCell({rows, 1}, "=SUM(B1:B" + std::to_string(rows) + ")");
+    big.PublishVersion();
+
+    std::atomic<bool> done = false;
+    std::atomic<int> failures = 0;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&] {
+            std::uint64_t last_number = 0;
+            while (!done.load()) {
+                auto version = big.GetPublishedVersion();
+                if (version->GetNumber() < last_number) {
+                    ++failures;
+                }
+                last_number = version->GetNumber();
+                // the writer sets the whole column A to the version number
+                const double a1 = version->GetCell({0, 0})->GetNumber().value();
+                const double sum = std::get<double>(version->GetCell({rows, 1})->GetValue());
+                if (sum != 2 * a1 * rows) {
+                    ++failures;
+                }
+                std::ostringstream out;
+                version->PrintValues(out);
+            }
+        });
+    }
+    for (int step = 1; step <= 50; ++step) {
+        std::vector<std::pair<Position, std::string>> column;
+        for (int row = 0; row < rows; ++row) {
+            column.emplace_back(Position{row, 0}, std::to_string(step));
+        }
+        big.SetCells(std::move(column));
+        big.PublishVersion();
+    }
+    done = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    ASSERT_EQUAL(failures.load(), 0);
+    ASSERT_EQUAL(std::get<double>(big.GetPublishedVersion()->GetCell({rows, 1})->GetValue()), 2.0 * 50 * rows);
+}
+
+void TestMyRequestValue() {
+    const int length = 3000;
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 1; row < length; ++row) {
+        sheet.SetCell({row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+    }
+    const Position last{length - 1, 0};
+
+    // a text, an empty cell and a missing one need no computing
+    sheet.SetCell("B1"_pos, "text");
+    ASSERT_EQUAL(std::get<std::string>(sheet.RequestValue("B1"_pos).get()), "text");
+    ASSERT_EQUAL(std::get<std::string>(sheet.RequestValue("Z9"_pos).get()), "");
+
+    auto first = sheet.RequestValue(last);
+    auto second = sheet.RequestValue(last);
+    ASSERT_EQUAL(std::get<double>(first.get()), length * 1.0);
+    ASSERT_EQUAL(std::get<double>(second.get()), length * 1.0);
+    ASSERT(static_cast<const Cell*>(sheet.GetCell(last))->IsCacheValid());
+
+    // edits while the value is computed: it reflects one of them at least
+    for (int round = 0; round < 10; ++round) {
+        sheet.SetCell("A1"_pos, "0");
+        auto pending = sheet.RequestValue(last);
+        for (int input = 1; input <= 5; ++input) {
+            sheet.SetCell("A1"_pos, std::to_string(input * 100));
+        }
+        const bool ready_after_edits = pending.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        const double value = std::get<double>(pending.get());
+        const double input = value - (length - 1);
+        ASSERT(input == 0 || input == 100 || input == 200 || input == 300 || input == 400 ||
+               input == 500);
+        // a future still pending after the edits has a value seeing them all
+        ASSERT(ready_after_edits || input == 500);
+        ASSERT_EQUAL(std::get<double>(sheet.RequestValue(last).get()), 500.0 + length - 1);
+    }
+
+    // the cells change shape under a pending request
+    sheet.SetCell("A1"_pos, "1");
+    auto pending = sheet.RequestValue(last);
+    sheet.SetCell({length / 2, 0}, "=1000");
+    sheet.ClearCell({length / 4, 0});
+    const double value = std::get<double>(pending.get());
+    ASSERT(value == length || value == 1000 + length - 1 - length / 2);
+    ASSERT_EQUAL(std::get<double>(sheet.RequestValue(last).get()), 1000.0 + length - 1 - length / 2);
+
+    // pending requests of a destroyed sheet break their promises
+    std::shared_future<CellInterface::Value> orphan;
+    {
+        Sheet doomed;
+        doomed.SetCell("A1"_pos, "1");
+        for (int row = 1; row < length; ++row) {
+            doomed.SetCell({row, 0}, "=" + Position{row - 1, 0}.ToString() + "*1");
+        }
+        orphan = doomed.RequestValue(last);
+    }
+    try {
+        ASSERT_EQUAL(std::get<double>(orphan.get()), 1.0);
+    } catch (const std::future_error& e) {
+        ASSERT(e.code() == std::future_errc::broken_promise);
+    }
+}
+
+void TestMyPlaceholdersAndArea() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B2+C3");
+    ASSERT(sheet.GetCell("B2"_pos) != nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+    ASSERT_EQUAL(sheet.GetStats().graph_nodes, 3u);
+
+    // a cleared cell stays for the formula, and goes with its last reference
+    sheet.SetCell("B2"_pos, "5");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 2}));
+    sheet.ClearCell("B2"_pos);
+    ASSERT(sheet.GetCell("B2"_pos) != nullptr);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+    sheet.SetCell("A1"_pos, "=C3");
+    ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetStats().graph_nodes, 2u);
+    sheet.ClearCell("A1"_pos);
+    ASSERT(sheet.GetCell("C3"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetStats().graph_nodes, 0u);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+
+    // an empty cell set on purpose is not a placeholder
+    sheet.SetCell("D4"_pos, "");
+    sheet.SetCell("A1"_pos, "=D4");
+    sheet.ClearCell("A1"_pos);
+    ASSERT(sheet.GetCell("D4"_pos) != nullptr);
+
+    // the size follows the last row and column across words of the bitmaps
+    sheet.SetCell("A1"_pos, "x");
+    for (int i : {63, 64, 127, 4095, 4096, Position::MAX_ROWS - 1}) {
+        sheet.SetCell({i, i}, "x");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{i + 1, i + 1}));
+    }
+    for (int i : {Position::MAX_ROWS - 1, 4096, 4095, 127, 64, 63}) {
+        sheet.ClearCell({i, i});
+        const auto size = sheet.GetPrintableSize();
+        ASSERT(size.rows <= i && size.cols <= i);
+    }
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+
+    // a snapshot keeps the placeholders apart from the set empty cells
+    const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_placeholders.snapshot").string();
+    sheet.SetCell("A2"_pos, "=E5+D4");
+    sheet.SaveSnapshot(path);
+    auto loaded = Sheet::LoadSnapshot(path);
+    std::remove(path.c_str());
+    loaded->ClearCell("A2"_pos);
+    ASSERT(loaded->GetCell("E5"_pos) == nullptr);
+    ASSERT(loaded->GetCell("D4"_pos) != nullptr);
+    ASSERT_EQUAL(loaded->GetPrintableSize(), (Size{1, 1}));
+}
+
+void TestMyStructuralEdits() {
+    Sheet sheet;
+    auto value = [&sheet](Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    auto text = [&sheet](Position pos) {
+        return sheet.GetCell(pos)->GetText();
+    };
+    sheet.SetCell("A3"_pos, "5");
+    sheet.SetCell("A1"_pos, "=A3*2");
+    sheet.SetCell("B1"_pos, "=SUM(A2:A4)+A1");
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(15.0));
+
+    // references follow the cells, a range grows with rows inserted inside it
+    sheet.InsertRows(2, 2);
+    ASSERT(sheet.GetCell("A3"_pos) == nullptr);
+    ASSERT_EQUAL(text("A5"_pos), "5");
+    ASSERT_EQUAL(text("A1"_pos), "=A5*2");
+    ASSERT_EQUAL(text("B1"_pos), "=SUM(A2:A6)+A1");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 2}));
+    ASSERT(static_cast<const Cell*>(sheet.GetCell("B1"_pos))->IsCacheValid());
+    sheet.SetCell("A5"_pos, "6");
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(18.0));
+
+    // references to deleted cells become #REF!, and their dependents follow
+    sheet.DeleteRows(4);
+    ASSERT_EQUAL(text("A1"_pos), "=#REF!*2");
+    ASSERT_EQUAL(text("B1"_pos), "=SUM(A2:A5)+A1");
+    ASSERT_EQUAL(value("A1"_pos), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 2}));
+    sheet.SetCell("A1"_pos, "=A3");
+    sheet.SetCell("A3"_pos, "4");
+    ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(8.0));
+
+    // a range losing cells is computed again, one losing all is #REF!
+    sheet.DeleteRows(2);
+    ASSERT_EQUAL(text("B1"_pos), "=SUM(A2:A4)+A1");
+    ASSERT_EQUAL(text("A1"_pos), "=#REF!");
+    sheet.SetCell("A1"_pos, "=SUM(C2:D3)");
+    sheet.SetCell("D2"_pos, "7");
+    ASSERT_EQUAL(value("A1"_pos), CellInterface::Value(7.0));
+    sheet.DeleteCols(2, 2);
+    ASSERT_EQUAL(text("A1"_pos), "=SUM(#REF!)");
+    ASSERT_EQUAL(value("A1"_pos), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT(sheet.GetCell("D2"_pos) == nullptr);
+
+    // copies of a formula moved together keep one AST, columns work alike
+    Sheet filled;
+    for (int row = 0; row < 3; ++row) {
+        filled.SetCell({row, 0}, std::to_string(row));
+        filled.SetCell({row, 1}, "=A" + std::to_string(row + 1) + "*10");
+    }
+    filled.SetCell("C1"_pos, "=SUM(B1:B3)");
+    filled.InsertCols(1);
+    filled.InsertRows(0);
+    ASSERT_EQUAL(filled.GetCell("C3"_pos)->GetText(), "=A3*10");
+    ASSERT_EQUAL(filled.GetCell("D2"_pos)->GetText(), "=SUM(C2:C4)");
+    ASSERT(static_cast<const Cell*>(filled.GetCell("C2"_pos))->GetFormula()->GetAST() ==
+           static_cast<const Cell*>(filled.GetCell("C4"_pos))->GetFormula()->GetAST());
+    ASSERT_EQUAL(filled.GetCell("D2"_pos)->GetValue(), CellInterface::Value(30.0));
+    filled.SetCell("A4"_pos, "5");
+    ASSERT_EQUAL(filled.GetCell("D2"_pos)->GetValue(), CellInterface::Value(60.0));
+    ASSERT_EQUAL(filled.GetStats().graph_nodes, 7u);
+
+    // a snapshot keeps the #REF! references
+    const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_structural.snapshot").string();
+    filled.SetCell("E1"_pos, "=A5+SUM(A2:A3)");
+    filled.DeleteRows(1, 3);
+    ASSERT_EQUAL(filled.GetCell("E1"_pos)->GetText(), "=A2+SUM(#REF!)");
+    filled.SaveSnapshot(path);
+    auto loaded = Sheet::LoadSnapshot(path);
+    std::remove(path.c_str());
+    ASSERT_EQUAL(loaded->GetCell("E1"_pos)->GetText(), "=A2+SUM(#REF!)");
+    ASSERT_EQUAL(loaded->GetCell("E1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+
+    // the printed #REF! parses back to the same formula
+    Sheet deleted;
+    deleted.SetCell("A2"_pos, "=A1+1");
+    deleted.SetCell("B2"_pos, "=SUM(A1:B1)+SUM(A1,A2)");
+    deleted.DeleteRows(0, 1);
+    for (const auto pos : {"A1"_pos, "B1"_pos}) {
+        const std::string printed = deleted.GetCell(pos)->GetText();
+        const auto printed_value = deleted.GetCell(pos)->GetValue();
+        deleted.SetCell(pos, printed);
+        ASSERT_EQUAL(deleted.GetCell(pos)->GetText(), printed);
+        ASSERT_EQUAL(deleted.GetCell(pos)->GetValue(), printed_value);
+    }
+    ASSERT_EQUAL(deleted.GetCell("A1"_pos)->GetText(), "=#REF!+1");
+    ASSERT_EQUAL(deleted.GetCell("B1"_pos)->GetText(), "=SUM(#REF!)+SUM(#REF!,A1)");
+    ASSERT_EQUAL(deleted.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    ASSERT(deleted.GetCell("A1"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(ParseFormula("SUM(#REF!*2,#REF!)+Other!#REF!")->GetExpression(),
+                 "SUM(#REF!*2,#REF!)+Other!#REF!");
+    for (const auto* text : {"#REF", "#REF!:A1", "SUM(A1:#REF!)", "#REF!!A1"}) {
+        try {
+            ParseFormula(text);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+
+    // nothing changes when the edit is refused
+    sheet.SetCell({Position::MAX_ROWS - 1, 0}, "x");
+    try {
+        sheet.InsertRows(0);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    ASSERT_EQUAL(text({Position::MAX_ROWS - 1, 0}), "x");
+    for (auto edit : {std::pair{-1, 1}, {0, 0}, {Position::MAX_COLS - 1, 2}}) {
+        try {
+            sheet.DeleteCols(edit.first, edit.second);
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+    }
+    sheet.BeginBatch();
+    try {
+        sheet.DeleteRows(0);
+        ASSERT(false);
+    } catch (const std::logic_error&) {
+    }
+    sheet.AbortBatch();
+    sheet.DeleteRows(0, Position::MAX_ROWS);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+    ASSERT_EQUAL(sheet.GetStats().graph_nodes, 0u);
+}
+
+void TestMyWorkbook() {
+    Workbook book;
+    Sheet& prices = book.AddSheet("Prices");
+    Sheet& totals = book.AddSheet("Q1 totals");
+    prices.SetCell("A1"_pos, "2");
+    prices.SetCell("A2"_pos, "3");
+    totals.SetCell("A1"_pos, "=Prices!A1*10");
+    totals.SetCell("B1"_pos, "=SUM(Prices!A1:A2)+A1");
+    ASSERT_EQUAL(totals.GetCell("B1"_pos)->GetValue(), CellInterface::Value(25.0));
+    ASSERT_EQUAL(totals.GetCell("B1"_pos)->GetText(), "=SUM(Prices!A1:A2)+A1");
+
+    // a change invalidates the formulas of other sheets over it
+    prices.SetCell("A1"_pos, "4");
+    ASSERT(!static_cast<const Cell*>(totals.GetCell("A1"_pos))->IsCacheValid());
+    book.Recalculate();
+    ASSERT(static_cast<const Cell*>(totals.GetCell("B1"_pos))->IsCacheValid());
+    ASSERT_EQUAL(totals.GetCell("B1"_pos)->GetValue(), CellInterface::Value(47.0));
+
+    // names needing quotes, and copies of a formula shared across sheets
+    Sheet& report = book.AddSheet("Report");
+    report.SetCell("A1"_pos, "='Q1 totals'!B1/2");
+    report.SetCell("A2"_pos, "='Q1 totals'!B2/2");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetText(), "='Q1 totals'!B1/2");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(23.5));
+    ASSERT_EQUAL(report.GetCell("A2"_pos)->GetValue(), CellInterface::Value(0.0));
+    prices.SetCell("A2"_pos, "5");
+    ASSERT(!static_cast<const Cell*>(report.GetCell("A1"_pos))->IsCacheValid());
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(24.5));
+
+    // sheets may refer to each other while their formulas do not form a
+    // cycle, and a reference naming the own sheet is an ordinary one
+    prices.SetCell("C1"_pos, "=Report!A1");
+    ASSERT_EQUAL(prices.GetCell("C1"_pos)->GetValue(), CellInterface::Value(24.5));
+    prices.SetCell("C1"_pos, "='Q1 totals'!A1");
+    ASSERT_EQUAL(prices.GetCell("C1"_pos)->GetValue(), CellInterface::Value(40.0));
+    prices.SetCell("C1"_pos, "=Prices!A2");
+    ASSERT_EQUAL(prices.GetCell("C1"_pos)->GetText(), "=A2");
+    ASSERT_EQUAL(prices.GetCell("C1"_pos)->GetValue(), CellInterface::Value(5.0));
+    prices.SetCell("C1"_pos, "=SUM(Report!A1:B2)");
+    ASSERT_EQUAL(prices.GetCell("C1"_pos)->GetValue(), CellInterface::Value(24.5));
+    for (const auto& [pos, formula] : {std::pair{"A1"_pos, "=Report!A1"}, std::pair{"C1"_pos, "=Prices!C1"}}) {
+        try {
+            prices.SetCell(pos, formula);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+    }
+    ASSERT_EQUAL(prices.GetCell("A1"_pos)->GetText(), "4");
+    ASSERT_EQUAL(prices.GetCell("C1"_pos)->GetText(), "=SUM(Report!A1:B2)");
+    prices.ClearCell("C1"_pos);
+
+    // references to a missing sheet are #REF! until it comes
+    report.SetCell("B1"_pos, "=Later!A1+1");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    Sheet& later = book.AddSheet("Later");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+    later.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(report.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    // a sheet removed and loaded again from its snapshot
+    const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_workbook.snapshot").string();
+    totals.SaveSnapshot(path);
+    book.RemoveSheet("Q1 totals");
+    ASSERT(book.GetSheet("Q1 totals") == nullptr);
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    Sheet& reloaded = book.LoadSheet("Q1 totals", path);
+    std::remove(path.c_str());
+    ASSERT_EQUAL(reloaded.GetCell("B1"_pos)->GetText(), "=SUM(Prices!A1:A2)+A1");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(24.5));
+    prices.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(8.0));
+    try {
+        book.AddSheet("Report");
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+    ASSERT_EQUAL(book.GetSheetNames(), (std::vector<std::string>{"Later", "Prices", "Q1 totals", "Report"}));
+
+    // moving a formula keeps its references to other sheets in place, and
+    // the references of other sheets follow the cells they refer to
+    reloaded.InsertRows(0);
+    ASSERT_EQUAL(reloaded.GetCell("A2"_pos)->GetText(), "=Prices!A1*10");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetText(), "='Q1 totals'!B2/2");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(8.0));
+    prices.InsertCols(0);
+    ASSERT_EQUAL(reloaded.GetCell("A2"_pos)->GetText(), "=Prices!B1*10");
+    ASSERT_EQUAL(reloaded.GetCell("B2"_pos)->GetText(), "=SUM(Prices!B1:B2)+A2");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(8.0));
+
+    // references to deleted cells of another sheet become #REF!, the others
+    // are linked to their new places
+    prices.DeleteRows(0);
+    ASSERT_EQUAL(reloaded.GetCell("A2"_pos)->GetText(), "=Prices!#REF!*10");
+    ASSERT_EQUAL(reloaded.GetCell("B2"_pos)->GetText(), "=SUM(Prices!B1:B1)+A2");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    reloaded.SetCell("A2"_pos, "3");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(4.0));
+    prices.SetCell("B1"_pos, "7");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+    prices.SetCell("B2"_pos, "100");
+    ASSERT(static_cast<const Cell*>(reloaded.GetCell("B2"_pos))->IsCacheValid());
+    reloaded.SetCell("A3"_pos, "=Prices!#REF!+Prices!B1");
+    ASSERT_EQUAL(reloaded.GetCell("A3"_pos)->GetText(), "=Prices!#REF!+Prices!B1");
+    reloaded.SaveSnapshot(path);
+    ASSERT_EQUAL(Sheet::LoadSnapshot(path)->GetCell("A3"_pos)->GetText(), "=Prices!#REF!+Prices!B1");
+    std::remove(path.c_str());
+
+    // independent sheets are computed in parallel, in the order of the links
+    Workbook wide;
+    wide.SetRecalcThreads(4);
+    Sheet& source = wide.AddSheet("Source");
+    for (int i = 0; i < 8; ++i) {
+        Sheet& sheet = wide.AddSheet("S" + std::to_string(i));
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell({row, 0}, "=Source!A" + std::to_string(row + 1) + "*" + std::to_string(i));
+        }
+        sheet.SetCell("B1"_pos, "=SUM(A1:A100)");
+    }
+    Sheet& sum = wide.AddSheet("Sum");
+    sum.SetCell("A1"_pos, "=S1!B1+S7!B1");
+    for (int row = 0; row < 100; ++row) {
+        source.SetCell({row, 0}, "1");
+    }
+    wide.Recalculate();
+    ASSERT(static_cast<const Cell*>(sum.GetCell("A1"_pos))->IsCacheValid());
+    ASSERT_EQUAL(sum.GetCell("A1"_pos)->GetValue(), CellInterface::Value(800.0));
+
+    // sheets referring to each other are computed together, cell by cell
+    Workbook mutual;
+    Sheet& first = mutual.AddSheet("A");
+    Sheet& second = mutual.AddSheet("B");
+    first.SetCell("A1"_pos, "1");
+    second.SetCell("A1"_pos, "=A!A1*2");
+    first.SetCell("A2"_pos, "=B!A1+1");
+    second.SetCell("A2"_pos, "=A!A2*3");
+    first.SetCell("A1"_pos, "5");
+    ASSERT(!static_cast<const Cell*>(second.GetCell("A2"_pos))->IsCacheValid());
+    mutual.Recalculate();
+    ASSERT(static_cast<const Cell*>(first.GetCell("A2"_pos))->IsCacheValid());
+    ASSERT(static_cast<const Cell*>(second.GetCell("A2"_pos))->IsCacheValid());
+    ASSERT_EQUAL(second.GetCell("A2"_pos)->GetValue(), CellInterface::Value(33.0));
+    try {
+        first.SetCell("A1"_pos, "=B!A2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(first.GetCell("A1"_pos)->GetText(), "5");
+
+    // a loaded sheet naming itself has its references made ordinary ones,
+    // and one closing a cycle of formulas is not added
+    Workbook saved;
+    Sheet& third = saved.AddSheet("Saved");
+    third.SetCell("A1"_pos, "=C!B1+A!A4");
+    third.SetCell("B1"_pos, "2");
+    third.SaveSnapshot(path);
+    first.SetCell("A4"_pos, "=C!A3");
+    first.SetCell("A5"_pos, "=C!A1");
+    Sheet& loaded = mutual.LoadSheet("C", path);
+    ASSERT_EQUAL(loaded.GetCell("A1"_pos)->GetText(), "=B1+A!A4");
+    ASSERT_EQUAL(first.GetCell("A5"_pos)->GetValue(), CellInterface::Value(2.0));
+    mutual.RemoveSheet("C");
+    first.SetCell("A4"_pos, "=C!A1");
+    try {
+        mutual.LoadSheet("C", path);
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    std::remove(path.c_str());
+    ASSERT(mutual.GetSheet("C") == nullptr);
+    ASSERT_EQUAL(first.GetCell("A4"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+}
+
+void TestMyConstantFolding() {
+    using ASTImpl::Instruction;
+    auto executed = [](std::string_view expression) {
+        const auto ast = ParseFormulaAST(std::string(expression));
+        std::vector<Instruction::OpCode> ops;
+        for (const auto& instruction : ast.GetExecutedProgram()) {
+            ops.push_back(instruction.op);
+        }
+        return ops;
+    };
+    using Op = Instruction::OpCode;
+    ASSERT(executed("A1*(1+0.07)/12") == (std::vector{Op::LoadCell, Op::MultiplyNumber, Op::DivideNumber}));
+    ASSERT(executed("2*A1") == (std::vector{Op::LoadCell, Op::MultiplyNumber}));
+    ASSERT(executed("2-A1") == (std::vector{Op::PushNumber, Op::LoadCell, Op::Subtract}));
+    ASSERT(executed("+A1*1-(-(-B1))/1") == (std::vector{Op::LoadCell, Op::LoadCell, Op::Subtract}));
+    ASSERT(executed("-(-(-B1))") == (std::vector{Op::LoadCell, Op::UnaryMinus}));
+    ASSERT(executed("SUM(1,2,MAX(3,4))*(1/0)") == (std::vector{Op::PushNumber}));
+    ASSERT(executed("SUM(1,A1:A2)") ==
+           (std::vector{Op::BeginAggregate, Op::PushNumber, Op::Accumulate, Op::AccumulateRange, Op::EndAggregate}));
+    // adding or subtracting -0 would turn -0 into 0
+    ASSERT(executed("A1+0") == (std::vector{Op::LoadCell, Op::AddNumber}));
+    ASSERT(executed("A1-(-0)") == (std::vector{Op::LoadCell, Op::SubtractNumber}));
+    ASSERT(executed("A1-0") == (std::vector{Op::LoadCell}));
+
+    // the text stays as printed before folding, the values and errors as unfolded
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "120");
+    sheet.SetCell("B1"_pos, "=A1*(1+0.07)/12");
+    sheet.SetCell("B2"_pos, "=+A1*1-(-(-A1))/1");
+    sheet.SetCell("B3"_pos, "=A1+1/0*0");
+    sheet.SetCell("B4"_pos, "=AVERAGE()+A1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*(1+0.07)/12");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=+A1*1---A1/1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(120 * (1 + 0.07) / 12));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+}
+
+void TestMyNativeFormulas() {
+    const std::uint32_t threshold = GetFormulaJitThreshold();
+    const double inf = std::numeric_limits<double>::infinity();
+    const std::vector<double> inputs = {0.0, -0.0, 1.0, -2.5, 3e300, 1e-310, inf, -inf,
+                                        std::numeric_limits<double>::quiet_NaN()};
+    // which NaN comes out of an operation over two of them is not defined
+    auto same = [](double lhs, double rhs) {
+        return std::isnan(lhs) ? std::isnan(rhs) : std::memcmp(&lhs, &rhs, sizeof lhs) == 0;
+    };
+    const FormulaAST::RangeSolver no_ranges = [](const Range*, std::vector<double>&) {
+        return std::optional<FormulaError>();
+    };
+
+    for (const std::string expression : {"A1+B1", "A1-B1*C1", "(A1-B1)/(C1+1)", "-A1/B1", "A1-(-0)",
+                                         "2/A1+A1*3-1", "A1*A1*A1+B1", "+A1", "C1*(B1-(A1+-0))",
+                                         "A1-(B1-(C1-(A1-(B1-(C1-(A1-(B1-(C1-(A1-(B1-(C1-(A1-(B1/-(C1*2))))))))))))))"}) {
+        const auto ast = ParseFormulaAST(expression);
+        std::vector<double> expected;
+        std::vector<double> cells(3);
+        const FormulaAST::CellSolver solver = [&cells](const Position* pos) -> FormulaAST::Value {
+            return cells[pos->col];
+        };
+        auto for_each_input = [&](auto check) {
+            for (double a : inputs) {
+                for (double b : inputs) {
+                    for (double c : inputs) {
+                        cells = {a, b, c};
+                        check(std::get<double>(ast.Execute(solver, no_ranges)));
+                    }
+                }
+            }
+        };
+        SetFormulaJitThreshold(0);
+        for_each_input([&expected](double result) {
+            expected.push_back(result);
+        });
+        ASSERT(!ast.IsCompiled());
+        SetFormulaJitThreshold(1);
+        std::size_t i = 0;
+        for_each_input([&](double result) {
+            ASSERT(same(result, expected[i++]));
+        });
+        ASSERT_EQUAL(ast.IsCompiled(), ASTImpl::IsNativeCompilationAvailable());
+    }
+
+    // the first error met by the interpreter, the native code taking only numbers
+    {
+        const auto ast = ParseFormulaAST("B1/A1");
+        FormulaAST::Value a = FormulaError(FormulaError::Category::Ref);
+        FormulaAST::Value b = FormulaError(FormulaError::Category::Value);
+        const FormulaAST::CellSolver solver = [&](const Position* pos) {
+            return pos->col == 0 ? a : b;
+        };
+        ast.Execute(solver, no_ranges);
+        ASSERT(std::get<FormulaError>(ast.Execute(solver, no_ranges)) == FormulaError::Category::Value);
+        b = 3.0;
+        ASSERT(std::get<FormulaError>(ast.Execute(solver, no_ranges)) == FormulaError::Category::Ref);
+        a = 2.0;
+        ASSERT_EQUAL(std::get<double>(ast.Execute(solver, no_ranges)), 1.5);
+    }
+
+    // left to the interpreter: function calls, other sheets and stacks too deep for the registers
+    std::string deep = "A1";
+    for (int i = 2; i <= 16; ++i) {
+        deep = "A" + std::to_string(i) + "-(" + deep + ")";
+    }
+    for (const auto& expression : std::vector<std::string>{"SUM(A1,B1)", "Other!A1+1", deep}) {
+        const auto ast = ParseFormulaAST(expression);
+        for (int i = 0; i < 3; ++i) {
+            ast.Execute([](const Position*) { return FormulaAST::Value(1.0); }, no_ranges,
+                        [](const ExternalCell*) { return FormulaAST::Value(1.0); });
+        }
+        ASSERT(!ast.IsCompiled());
+    }
+
+    Sheet sheet;
+    sheet.SetCell("B1"_pos, "=A1*3+1");
+    sheet.SetCell("B2"_pos, "=B1/(A1-2)");
+    for (int i = 0; i < 5; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(i * 3 + 1.0));
+        if (i == 2) {
+            ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+        } else {
+            ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value((i * 3 + 1.0) / (i - 2)));
+        }
+    }
+    sheet.SetCell("A1"_pos, "x");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    SetFormulaJitThreshold(threshold);
+}
+
+void TestMyScenarios() {
+    auto fill = [](Sheet& sheet) {
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("C1"_pos, "4");
+        sheet.SetCell("D1"_pos, "x");
+        sheet.SetCell("B1"_pos, "=A1*2+A2");
+        sheet.SetCell("B2"_pos, "=B1/(A1-1)");
+        sheet.SetCell("B3"_pos, "=SUM(A1:A3)+B1");  // A3 is an empty input, summed lane by lane
+        sheet.SetCell("B4"_pos, "=C1*3");
+        sheet.SetCell("B5"_pos, "hello");
+        sheet.SetCell("B6"_pos, "=B1+D1");
+        sheet.SetCell("B7"_pos, "=-B2*2-B3");
+    };
+    Sheet sheet;
+    fill(sheet);
+    const std::vector<Position> inputs = {"A1"_pos, "A2"_pos, "A3"_pos};
+    const std::vector<Position> outputs = {"B1"_pos, "B2"_pos, "B3"_pos, "B4"_pos, "B5"_pos,
+                                           "B6"_pos, "B7"_pos, "A2"_pos, "E1"_pos};
+    // more lanes than a block
+    const std::size_t lane_count = 600;
+    ScenarioBlock values(inputs.size(), lane_count);
+    for (std::size_t lane = 0; lane < lane_count; ++lane) {
+        values.GetColumn(0)[lane] = static_cast<double>(lane % 5);
+        values.GetColumn(1)[lane] = lane * 0.5;
+        values.GetColumn(2)[lane] = -static_cast<double>(lane);
+    }
+    const auto results = sheet.EvaluateScenarios(inputs, values, outputs);
+    ASSERT_EQUAL(results.GetOutputCount(), outputs.size());
+    ASSERT_EQUAL(results.GetLaneCount(), lane_count);
+
+    // the same as setting the inputs
+    Sheet expected;
+    fill(expected);
+    for (std::size_t lane = 0; lane < lane_count; lane += 7) {
+        for (std::size_t i = 0; i < inputs.size(); ++i) {
+            std::ostringstream text;
+            text << values.GetColumn(i)[lane];
+            expected.SetCell(inputs[i], text.str());
+        }
+        // an input is given as its number rather than its text
+        for (std::size_t i = 0; i < outputs.size(); ++i) {
+            const CellInterface* cell = expected.GetCell(outputs[i]);
+            if (outputs[i] == "A2"_pos) {
+                ASSERT_EQUAL(results.GetValue(i, lane), CellInterface::Value(*cell->GetNumber()));
+            } else {
+                ASSERT_EQUAL(results.GetValue(i, lane), cell ? cell->GetValue() : CellInterface::Value(""));
+            }
+        }
+    }
+    ASSERT_EQUAL(results.GetValue(1, 1), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT(std::isnan(results.GetNumbers(1)[1]));
+    ASSERT_EQUAL(results.GetNumbers(0)[1], 1 * 2 + 0.5);
+    ASSERT_EQUAL(results.GetNumbers(3)[599], 12.0);
+    ASSERT_EQUAL(results.GetValue(4, 599), CellInterface::Value("hello"));
+
+    // the sheet is left as it was
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    ASSERT(sheet.GetCell("A3"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+
+    try {
+        sheet.EvaluateScenarios({"A1"_pos, "A1"_pos}, ScenarioBlock(2, 1), outputs);
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+    try {
+        sheet.EvaluateScenarios(inputs, ScenarioBlock(2, 1), outputs);
+        ASSERT(false);
+    } catch (const std::invalid_argument&) {
+    }
+    try {
+        sheet.EvaluateScenarios(inputs, values, {Position::NONE});
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestMyPositionKeys() {
+    // every column both ways, and the keys growing from column to column
+    std::uint32_t previous_key = 0;
+    for (int col = 0; col < Position::MAX_COLS; ++col) {
+        for (int row : {0, 8, Position::MAX_ROWS - 1}) {
+            const Position pos{row, col};
+            char buffer[Position::MAX_STRING_LENGTH];
+            const std::string text(buffer, pos.ToChars(buffer));
+            ASSERT_EQUAL(pos.ToString(), text);
+            ASSERT_EQUAL(Position::FromString(text), pos);
+            ASSERT(pos.ToKey() < Position::KEY_COUNT);
+            ASSERT_EQUAL(Position::FromKey(pos.ToKey()), pos);
+        }
+        const std::uint32_t key = Position{0, col}.ToKey();
+        ASSERT(col == 0 || previous_key < key);
+        previous_key = key;
+    }
+    ASSERT((Position{Position::MAX_ROWS - 1, 0}.ToKey() + 1 == Position{0, 1}.ToKey()));
+    // the widest position fills the buffer exactly
+    char buffer[Position::MAX_STRING_LENGTH];
+    const Position last{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+    ASSERT_EQUAL(last.ToChars(buffer) - buffer, std::ptrdiff_t{Position::MAX_STRING_LENGTH});
+    ASSERT_EQUAL(Position::FromString("XFD16384"), (Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}));
+    ASSERT_EQUAL(Position::FromString("B0007"), (Position{6, 1}));
+    ASSERT_EQUAL(Position::FromString("A00000000000000000001"), (Position{0, 0}));
+    for (std::string_view text : {"A0", "XFE1", "A16385", "AAAA1", "A1B", "a1", "@1", "[1", "A1 ", " A1", "A/"}) {
+        ASSERT_EQUAL(Position::FromString(text), Position::NONE);
+    }
+    ASSERT_EQUAL((Position{-1, 0}).ToString(), "");
+}
+
+void TestMyMemoryUsage() {
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "a text too long to fit into the cell " + std::to_string(row));
+        sheet.SetCell({row, 2}, "=A" + std::to_string(row + 1) + "*2");
+    }
+    const SheetMemoryUsage usage = sheet.GetMemoryUsage();
+    ASSERT(usage.cells >= 300 * sizeof(Cell));
+    ASSERT(usage.contents > 0);
+    ASSERT_EQUAL(usage.values, 0u);
+    ASSERT(usage.asts > 0);
+    ASSERT(usage.dependency_graph > 0);
+    ASSERT(usage.bookkeeping > 0);
+    ASSERT_EQUAL(usage.hibernated, 0u);
+
+    // the copies of a formula share one AST, and computing adds the values
+    ASSERT(usage.asts < 2 * sizeof(FormulaAST) + 1024);
+    for (int row = 0; row < 100; ++row) {
+        sheet.GetCell({row, 2})->GetValue();
+    }
+    const SheetMemoryUsage computed = sheet.GetMemoryUsage();
+    ASSERT_EQUAL(computed.values, 100 * sizeof(FormulaInterface::Value));
+
+    std::ostringstream out;
+    out << computed;
+    ASSERT(out.str().find("values=" + std::to_string(computed.values)) != std::string::npos);
+}
+
+void TestMyHibernation() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "a text too long to fit into the cell");
+    sheet.SetCell("B1"_pos, "=A1*3");
+    sheet.SetCell("B2"_pos, "=SUM(A1:B1)+Z9");
+    sheet.SetCell("B3"_pos, "=1/0");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(8.0));
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+
+    const std::size_t awake = sheet.GetMemoryUsage().GetTotal();
+    sheet.Hibernate();
+    ASSERT(sheet.IsHibernated());
+    const SheetMemoryUsage hibernated = sheet.GetMemoryUsage();
+    ASSERT(hibernated.hibernated > 0);
+    ASSERT_EQUAL(hibernated.GetTotal(), hibernated.hibernated);
+    ASSERT(hibernated.GetTotal() < awake);
+
+    // computed values come back computed, the rest is computed on reading
+    ASSERT(static_cast<const Cell*>(sheet.GetCell("B2"_pos))->IsCacheValid());
+    ASSERT(!sheet.IsHibernated());
+    ASSERT(!static_cast<const Cell*>(sheet.GetCell("B3"_pos))->IsCacheValid());
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT((sheet.GetPrintableSize() == Size{3, 2}));
+    std::ostringstream woken_texts;
+    sheet.PrintTexts(woken_texts);
+    ASSERT_EQUAL(woken_texts.str(), texts.str());
+    // with nothing left to compute, recalculating does not wake the sheet
+    sheet.Hibernate();
+    sheet.Recalculate();
+    ASSERT(sheet.IsHibernated());
+
+    // the graph comes back too, placeholders included
+    sheet.Hibernate();
+    sheet.SetCell("Z9"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(12.0));
+    sheet.Hibernate();
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+    sheet.Hibernate();
+    try {
+        sheet.SetCell("A1"_pos, "=B2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    sheet.Hibernate();
+    ASSERT_EQUAL(std::get<double>(sheet.RequestValue("B2"_pos).get()), 4.0);
+
+    // readers of other sheets wake the cold ones the budget hibernated
+    Workbook book;
+    Sheet& prices = book.AddSheet("Prices");
+    Sheet& totals = book.AddSheet("Totals");
+    for (int row = 0; row < 100; ++row) {
+        prices.SetCell({row, 0}, std::to_string(row));
+    }
+    totals.SetCell("A1"_pos, "=SUM(Prices!A1:A100)");
+    ASSERT_EQUAL(totals.GetCell("A1"_pos)->GetValue(), CellInterface::Value(4950.0));
+    book.SetMemoryBudget(std::numeric_limits<std::size_t>::max());
+    book.TrimMemory();
+    ASSERT(!prices.IsHibernated() && !totals.IsHibernated());
+
+    // the sheet not accessed since goes first, though it is the smaller
+    prices.GetCell("A1"_pos);
+    book.SetMemoryBudget(book.GetMemoryUsage().GetTotal() - 1);
+    book.TrimMemory();
+    ASSERT(totals.IsHibernated());
+    ASSERT(!prices.IsHibernated());
+    ASSERT(book.GetMemoryUsage().GetTotal() <= book.GetMemoryBudget());
+
+    // a change wakes the sheets over it, and a budget of one byte
+    // hibernates every sheet, warm or not
+    prices.SetCell("A1"_pos, "50");
+    ASSERT(!totals.IsHibernated());
+    book.SetMemoryBudget(1);
+    book.Recalculate();
+    ASSERT(prices.IsHibernated() && totals.IsHibernated());
+    ASSERT_EQUAL(totals.GetCell("A1"_pos)->GetValue(), CellInterface::Value(5000.0));
+    ASSERT(prices.IsHibernated());
+}
+
 int main() {
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
@@ -437,5 +2399,34 @@ int main() {
     RUN_TEST(tr, TestMyCircularDep);
     RUN_TEST(tr, TestMyGraphAndCache);
     RUN_TEST(tr, TestMyEmptyCellsPrintableSize);
+    RUN_TEST(tr, TestMyDenseAndSparseStorage);
+    RUN_TEST(tr, TestMyCompiledFormulaPrinting);
+    RUN_TEST(tr, TestMyRecalculation);
+    RUN_TEST(tr, TestMyCircularDependencyDetection);
+    RUN_TEST(tr, TestMyBatchUpdates);
+    RUN_TEST(tr, TestMyRangeFunctions);
+    RUN_TEST(tr, TestMyRangeIndex);
+    RUN_TEST(tr, TestMyNumericTextCells);
+    RUN_TEST(tr, TestMyErrorPropagation);
+    RUN_TEST(tr, TestMyHandwrittenParser);
+    RUN_TEST(tr, TestMyFormulaInterning);
+    RUN_TEST(tr, TestMyCellMemory);
+    RUN_TEST(tr, TestMyCompactCells);
+    RUN_TEST(tr, TestMyStreamingPrint);
+    RUN_TEST(tr, TestMySnapshot);
+    RUN_TEST(tr, TestMyTsv);
+    RUN_TEST(tr, TestMyStats);
+    RUN_TEST(tr, TestMyInvalidationStopsAtInvalidCells);
+    RUN_TEST(tr, TestMyPublishedVersions);
+    RUN_TEST(tr, TestMyRequestValue);
+    RUN_TEST(tr, TestMyPlaceholdersAndArea);
+    RUN_TEST(tr, TestMyStructuralEdits);
+    RUN_TEST(tr, TestMyWorkbook);
+    RUN_TEST(tr, TestMyConstantFolding);
+    RUN_TEST(tr, TestMyNativeFormulas);
+    RUN_TEST(tr, TestMyScenarios);
+    RUN_TEST(tr, TestMyPositionKeys);
+    RUN_TEST(tr, TestMyMemoryUsage);
+    RUN_TEST(tr, TestMyHibernation);
     return 0;
 }
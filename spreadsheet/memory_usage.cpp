@@ -0,0 +1,38 @@
+#include "memory_usage.h"
+
+SheetMemoryUsage& SheetMemoryUsage::operator+=(const SheetMemoryUsage& other) {
+    cells += other.cells;
+    contents += other.contents;
+    values += other.values;
+    asts += other.asts;
+    dependency_graph += other.dependency_graph;
+    bookkeeping += other.bookkeeping;
+    hibernated += other.hibernated;
+    return *this;
+}
+
+std::ostream& operator<<(std::ostream& output, const SheetMemoryUsage& usage) {
+    return output << "cells=" << usage.cells
+                  << " contents=" << usage.contents
+                  << " values=" << usage.values
+                  << " asts=" << usage.asts
+                  << " dependency_graph=" << usage.dependency_graph
+                  << " bookkeeping=" << usage.bookkeeping
+                  << " hibernated=" << usage.hibernated
+                  << " total=" << usage.GetTotal();
+}
+
+void* CountingMemoryResource::do_allocate(std::size_t bytes, std::size_t alignment) {
+    void* p = std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    allocated_ += bytes;
+    return p;
+}
+
+void CountingMemoryResource::do_deallocate(void* p, std::size_t bytes, std::size_t alignment) {
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    allocated_ -= bytes;
+}
+
+bool CountingMemoryResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return this == &other;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <ostream>
+
+// The memory a sheet holds, in bytes, as Sheet::GetMemoryUsage() reports
+// it. The containers are measured by their capacity, with the per-node
+// overhead of the standard library's hash tables estimated, so the figures
+// are close to what the allocator hands out rather than exact.
+struct SheetMemoryUsage {
+    std::size_t cells = 0;     // the tiles and the sparse map of the storage
+    std::size_t contents = 0;  // long texts and formulas, without their values
+    std::size_t values = 0;    // the computed values of the formulas
+    // the ASTs of the formulas, each counted once per sheet even when
+    // several sheets share it
+    std::size_t asts = 0;
+    std::size_t dependency_graph = 0;  // the nodes and the range index
+    std::size_t bookkeeping = 0;       // the sets of dirty, placeholder and changed cells
+    std::size_t hibernated = 0;        // the snapshot of a hibernated sheet
+
+    std::size_t GetTotal() const {
+        return cells + contents + values + asts + dependency_graph + bookkeeping + hibernated;
+    }
+
+    SheetMemoryUsage& operator+=(const SheetMemoryUsage& other);
+};
+
+// One line of "name=value" pairs.
+std::ostream& operator<<(std::ostream& output, const SheetMemoryUsage& usage);
+
+// The bytes of a std::unordered_map or std::unordered_set: the bucket array
+// and a node per element, holding the next pointer and the hash next to
+// the element.
+template <typename HashTable>
+std::size_t GetHashTableMemory(const HashTable& table) {
+    return table.bucket_count() * sizeof(void*) +
+           table.size() * (sizeof(typename HashTable::value_type) + 2 * sizeof(void*));
+}
+
+template <typename Vector>
+std::size_t GetVectorMemory(const Vector& vector) {
+    return vector.capacity() * sizeof(typename Vector::value_type);
+}
+
+// Passes allocations to the default resource and counts the bytes held.
+// Not synchronized.
+class CountingMemoryResource : public std::pmr::memory_resource {
+public:
+    std::size_t GetAllocated() const {
+        return allocated_;
+    }
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+    std::size_t allocated_ = 0;
+};
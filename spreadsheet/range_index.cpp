@@ -0,0 +1,53 @@
+#include "range_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "memory_usage.h"
+
+void RangeIndex::Add(Range range, Position dependent) {
+    assert(range.IsValid());
+    const int level = GetLevel(range);
+    ForEachBucket(range, level, [&](std::uint64_t key) {
+        buckets_[key].push_back({range, dependent});
+    });
+    ++level_sizes_[level];
+}
+
+void RangeIndex::Remove(Range range, Position dependent) {
+    const int level = GetLevel(range);
+    ForEachBucket(range, level, [&](std::uint64_t key) {
+        auto bucket = buckets_.find(key);
+        assert(bucket != buckets_.end());
+        auto& entries = bucket->second;
+        auto it = std::find_if(entries.begin(), entries.end(), [&](const Entry& entry) {
+            return entry.range == range && entry.dependent == dependent;
+        });
+        assert(it != entries.end());
+        *it = entries.back();
+        entries.pop_back();
+        if (entries.empty()) {
+            buckets_.erase(bucket);
+        }
+    });
+    --level_sizes_[level];
+}
+
+int RangeIndex::GetLevel(Range range) {
+    int level = 0;
+    for (int shift = BASE_LOG2; level < LEVELS - 1; ++level, ++shift) {
+        if ((range.last.row >> shift) - (range.first.row >> shift) <= 1 &&
+            (range.last.col >> shift) - (range.first.col >> shift) <= 1) {
+            break;
+        }
+    }
+    return level;
+}
+
+std::size_t RangeIndex::GetMemoryUsage() const {
+    std::size_t bytes = GetHashTableMemory(buckets_);
+    for (const auto& [key, entries] : buckets_) {
+        bytes += GetVectorMemory(entries);
+    }
+    return bytes;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+// Spatial index of the formulas referencing ranges, answering "which
+// formulas depend on this position?" without per-cell edges.
+//
+// The sheet is covered by a hierarchy of grids: the buckets of level l are
+// squares of 2^(BASE_LOG2 + l) cells. A range is stored at the lowest level
+// where it overlaps at most 2x2 buckets, in each of them. A lookup checks
+// the single bucket containing the position on every level, so it costs
+// O(LEVELS) = O(log(sheet size)) bucket probes, and every range found in a
+// probed bucket is near the position.
+class RangeIndex {
+public:
+    void Add(Range range, Position dependent);
+    void Remove(Range range, Position dependent);
+
+    // in bytes, see memory_usage.h
+    std::size_t GetMemoryUsage() const;
+
+    // Calls f(dependent) for every added range containing pos.
+    template <typename F>
+    void ForEachContaining(Position pos, F&& f) const {
+        for (int level = 0; level < LEVELS; ++level) {
+            if (level_sizes_[level] == 0) {
+                continue;
+            }
+            const int shift = BASE_LOG2 + level;
+            auto bucket = buckets_.find(BucketKey(level, pos.row >> shift, pos.col >> shift));
+            if (bucket == buckets_.end()) {
+                continue;
+            }
+            for (const auto& entry : bucket->second) {
+                if (entry.range.Contains(pos)) {
+                    f(entry.dependent);
+                }
+            }
+        }
+    }
+
+    // Calls f(dependent) for every added range intersecting area, possibly
+    // more than once for the same range. The buckets overlapping area are
+    // probed, or all the buckets are scanned when there are fewer of them.
+    template <typename F>
+    void ForEachIntersecting(Range area, F&& f) const {
+        std::size_t probes = 0;
+        for (int level = 0; level < LEVELS; ++level) {
+            if (level_sizes_[level] != 0) {
+                const int shift = BASE_LOG2 + level;
+                probes += static_cast<std::size_t>((area.last.row >> shift) - (area.first.row >> shift) + 1) *
+                          static_cast<std::size_t>((area.last.col >> shift) - (area.first.col >> shift) + 1);
+            }
+        }
+        auto visit = [&area, &f](const std::vector<Entry>& entries) {
+            for (const auto& entry : entries) {
+                if (Intersect(entry.range, area)) {
+                    f(entry.dependent);
+                }
+            }
+        };
+        if (probes >= buckets_.size()) {
+            for (const auto& [key, entries] : buckets_) {
+                visit(entries);
+            }
+            return;
+        }
+        for (int level = 0; level < LEVELS; ++level) {
+            if (level_sizes_[level] == 0) {
+                continue;
+            }
+            ForEachBucket(area, level, [&](std::uint64_t key) {
+                if (auto bucket = buckets_.find(key); bucket != buckets_.end()) {
+                    visit(bucket->second);
+                }
+            });
+        }
+    }
+
+private:
+    static constexpr int BASE_LOG2 = 5;
+    static constexpr int LEVELS = 15 - BASE_LOG2;  // the last level is a single bucket
+
+    struct Entry {
+        Range range;
+        Position dependent;
+    };
+
+    static int GetLevel(Range range);
+
+    static bool Intersect(Range lhs, Range rhs) {
+        return lhs.first.row <= rhs.last.row && rhs.first.row <= lhs.last.row &&
+               lhs.first.col <= rhs.last.col && rhs.first.col <= lhs.last.col;
+    }
+
+    static std::uint64_t BucketKey(int level, int row, int col) {
+        return (static_cast<std::uint64_t>(level) << 32) |
+               (static_cast<std::uint64_t>(row) << 16) | static_cast<std::uint64_t>(col);
+    }
+
+    // calls f(key) for each bucket of the level overlapped by the range
+    template <typename F>
+    static void ForEachBucket(Range range, int level, F&& f) {
+        const int shift = BASE_LOG2 + level;
+        for (int row = range.first.row >> shift; row <= range.last.row >> shift; ++row) {
+            for (int col = range.first.col >> shift; col <= range.last.col >> shift; ++col) {
+                f(BucketKey(level, row, col));
+            }
+        }
+    }
+
+    std::unordered_map<std::uint64_t, std::vector<Entry>> buckets_;
+    std::array<std::size_t, LEVELS> level_sizes_{};  // ranges stored per level
+};
@@ -0,0 +1,500 @@
+#include "scenario.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+#include "FormulaAST.h"
+#include "sheet.h"
+
+ScenarioBlock::ScenarioBlock(std::size_t column_count, std::size_t lane_count)
+    : column_count_(column_count)
+    , lane_count_(lane_count)
+    , values_(column_count * lane_count) {
+}
+
+std::size_t ScenarioBlock::GetColumnCount() const {
+    return column_count_;
+}
+
+std::size_t ScenarioBlock::GetLaneCount() const {
+    return lane_count_;
+}
+
+double* ScenarioBlock::GetColumn(std::size_t column) {
+    return values_.data() + column * lane_count_;
+}
+
+const double* ScenarioBlock::GetColumn(std::size_t column) const {
+    return values_.data() + column * lane_count_;
+}
+
+namespace {
+
+using ErrorCode = std::uint8_t;
+constexpr ErrorCode NO_FORMULA_ERROR = 0;
+
+ErrorCode ToErrorCode(FormulaError error) {
+    return static_cast<ErrorCode>(static_cast<ErrorCode>(error.GetCategory()) + 1);
+}
+
+FormulaError FromErrorCode(ErrorCode code) {
+    return FormulaError(static_cast<FormulaError::Category>(code - 1));
+}
+
+// lanes computed at once: the stack of a formula over them stays in the
+// L1 cache
+constexpr std::size_t BLOCK_LANES = 256;
+
+// the values of a cell over the lanes of a block
+struct Lanes {
+    const double* numbers;
+    const ErrorCode* errors;  // nullptr if they are all numbers
+};
+
+// A cell referenced by a formula computed over blocks of lanes: one with
+// values of its own in every lane, or one of the sheet, the same in all.
+struct Operand {
+    std::optional<std::size_t> slot;
+    FormulaInterface::Value value;  // without a slot
+};
+
+// whether the program is only arithmetic over numbers and cells of its
+// sheet, which ExecuteLanes() runs
+bool IsLaneProgram(const ASTImpl::Program& program) {
+    using OpCode = ASTImpl::Instruction::OpCode;
+    return std::all_of(program.begin(), program.end(), [](const ASTImpl::Instruction& instruction) {
+        switch (instruction.op) {
+        case OpCode::PushNumber:
+        case OpCode::LoadCell:
+        case OpCode::Add:
+        case OpCode::Subtract:
+        case OpCode::Multiply:
+        case OpCode::Divide:
+        case OpCode::AddNumber:
+        case OpCode::SubtractNumber:
+        case OpCode::MultiplyNumber:
+        case OpCode::DivideNumber:
+        case OpCode::UnaryPlus:
+        case OpCode::UnaryMinus:
+            return true;
+        default:
+            return false;
+        }
+    });
+}
+
+// Runs the program over count lanes as FormulaAST::Execute() and
+// Formula::Evaluate() would in each of them, one instruction over all the
+// lanes at a time: a lane keeps the first error its operands give, and a
+// result which is not finite is #DIV/0!. stack holds BLOCK_LANES values
+// for every value of the program's stack.
+void ExecuteLanes(const ASTImpl::Program& program, const std::vector<Operand>& operands,
+                  const std::vector<Lanes>& slots, std::size_t count, double* stack,
+                  double* numbers, ErrorCode* errors) {
+    using OpCode = ASTImpl::Instruction::OpCode;
+
+    std::fill(errors, errors + count, NO_FORMULA_ERROR);
+    double* top = stack;  // one past the topmost column
+    auto binary = [&top, count](auto operation) {
+        top -= BLOCK_LANES;
+        double* lhs = top - BLOCK_LANES;
+        const double* rhs = top;
+        for (std::size_t lane = 0; lane < count; ++lane) {
+            lhs[lane] = operation(lhs[lane], rhs[lane]);
+        }
+    };
+    auto with_number = [&top, count](double number, auto operation) {
+        double* values = top - BLOCK_LANES;
+        for (std::size_t lane = 0; lane < count; ++lane) {
+            values[lane] = operation(values[lane], number);
+        }
+    };
+
+    for (const auto& instruction : program) {
+        switch (instruction.op) {
+        case OpCode::PushNumber:
+            std::fill(top, top + count, instruction.number);
+            top += BLOCK_LANES;
+            break;
+        case OpCode::LoadCell: {
+            const Operand& operand = operands[instruction.index];
+            if (operand.slot) {
+                const Lanes& lanes = slots[*operand.slot];
+                std::memcpy(top, lanes.numbers, count * sizeof(double));
+                if (lanes.errors) {
+                    for (std::size_t lane = 0; lane < count; ++lane) {
+                        errors[lane] = errors[lane] ? errors[lane] : lanes.errors[lane];
+                    }
+                }
+            } else if (const double* number = std::get_if<double>(&operand.value)) {
+                std::fill(top, top + count, *number);
+            } else {
+                std::fill(top, top + count, 0.0);
+                const ErrorCode code = ToErrorCode(std::get<FormulaError>(operand.value));
+                for (std::size_t lane = 0; lane < count; ++lane) {
+                    errors[lane] = errors[lane] ? errors[lane] : code;
+                }
+            }
+            top += BLOCK_LANES;
+            break;
+        }
+        case OpCode::Add:
+            binary([](double lhs, double rhs) { return lhs + rhs; });
+            break;
+        case OpCode::Subtract:
+            binary([](double lhs, double rhs) { return lhs - rhs; });
+            break;
+        case OpCode::Multiply:
+            binary([](double lhs, double rhs) { return lhs * rhs; });
+            break;
+        case OpCode::Divide:
+            binary([](double lhs, double rhs) { return lhs / rhs; });
+            break;
+        case OpCode::AddNumber:
+            with_number(instruction.number, [](double lhs, double rhs) { return lhs + rhs; });
+            break;
+        case OpCode::SubtractNumber:
+            with_number(instruction.number, [](double lhs, double rhs) { return lhs - rhs; });
+            break;
+        case OpCode::MultiplyNumber:
+            with_number(instruction.number, [](double lhs, double rhs) { return lhs * rhs; });
+            break;
+        case OpCode::DivideNumber:
+            with_number(instruction.number, [](double lhs, double rhs) { return lhs / rhs; });
+            break;
+        case OpCode::UnaryMinus: {
+            double* values = top - BLOCK_LANES;
+            for (std::size_t lane = 0; lane < count; ++lane) {
+                values[lane] = -values[lane];
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    std::memcpy(numbers, stack, count * sizeof(double));
+    const ErrorCode div0 = ToErrorCode(FormulaError::Category::Div0);
+    for (std::size_t lane = 0; lane < count; ++lane) {
+        if (!errors[lane] && !std::isfinite(numbers[lane])) {
+            errors[lane] = div0;
+        }
+    }
+}
+
+}  // namespace
+
+ScenarioResults::ScenarioResults(std::size_t output_count, std::size_t lane_count)
+    : numbers_(output_count, lane_count)
+    , errors_(output_count * lane_count)
+    , texts_(output_count) {
+}
+
+std::size_t ScenarioResults::GetOutputCount() const {
+    return numbers_.GetColumnCount();
+}
+
+std::size_t ScenarioResults::GetLaneCount() const {
+    return numbers_.GetLaneCount();
+}
+
+const double* ScenarioResults::GetNumbers(std::size_t output) const {
+    return numbers_.GetColumn(output);
+}
+
+CellInterface::Value ScenarioResults::GetValue(std::size_t output, std::size_t lane) const {
+    if (texts_[output]) {
+        return *texts_[output];
+    }
+    if (const ErrorCode code = errors_[output * GetLaneCount() + lane]) {
+        return FromErrorCode(code);
+    }
+    return numbers_.GetColumn(output)[lane];
+}
+
+// -- Lane by lane --
+
+// The inputs and the formulas computed so far hold their values in the
+// current lane, the other cells are those of the sheet. Only what formulas
+// read is provided: the sheet cannot be changed or printed.
+class Sheet::ScenarioSheet : public SheetInterface {
+public:
+    using Slots = std::unordered_map<Position, std::size_t, KeyHash, KeyEqual>;
+
+    ScenarioSheet(const Sheet& sheet, const Slots& slots, const std::vector<Lanes>& lanes)
+        : sheet_(sheet)
+        , slots_(slots)
+        , lanes_(lanes) {
+        cells_.reserve(lanes.size());
+        for (std::size_t slot = 0; slot < lanes.size(); ++slot) {
+            cells_.emplace_back(*this, slot);
+        }
+        for (const auto& [pos, slot] : slots) {
+            if (!sheet.sheet_.Find(pos)) {
+                unstored_.push_back(pos);
+            }
+        }
+        std::sort(unstored_.begin(), unstored_.end());
+    }
+
+    // of the current block
+    void SetLane(std::size_t lane) {
+        lane_ = lane;
+    }
+
+    void SetCell(Position, std::string) override {
+        throw std::logic_error("A scenario cannot be changed");
+    }
+
+    const CellInterface* GetCell(Position pos) const override {
+        if (auto slot = slots_.find(pos); slot != slots_.end()) {
+            return &cells_[slot->second];
+        }
+        return sheet_.GetCell(pos);
+    }
+
+    CellInterface* GetCell(Position pos) override {
+        return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+    }
+
+    void ClearCell(Position) override {
+        throw std::logic_error("A scenario cannot be changed");
+    }
+
+    Size GetPrintableSize() const override {
+        return sheet_.GetPrintableSize();
+    }
+
+    void PrintValues(std::ostream&) const override {
+        throw std::logic_error("A scenario cannot be printed");
+    }
+
+    void PrintTexts(std::ostream&) const override {
+        throw std::logic_error("A scenario cannot be printed");
+    }
+
+    // The inputs which are empty cells of the sheet come after the cells
+    // the sheet has, so a sum over them may round differently from the one
+    // of the sheet with the inputs set.
+    void ForEachCell(Range range,
+                     const std::function<void(Position, const CellInterface&)>& action) const override {
+        sheet_.ForEachCell(range, [this, &action](Position pos, const CellInterface& cell) {
+            if (auto slot = slots_.find(pos); slot != slots_.end()) {
+                action(pos, cells_[slot->second]);
+            } else {
+                action(pos, cell);
+            }
+        });
+        for (const auto& pos : unstored_) {
+            if (range.Contains(pos)) {
+                action(pos, cells_[slots_.at(pos)]);
+            }
+        }
+    }
+
+    const SheetInterface* FindSheet(std::string_view name) const override {
+        return sheet_.FindSheet(name);
+    }
+
+private:
+    // reads its value in the current lane
+    class LaneCell : public CellInterface {
+    public:
+        LaneCell(const ScenarioSheet& sheet, std::size_t slot)
+            : sheet_(sheet)
+            , slot_(slot) {
+        }
+
+        Value GetValue() const override {
+            const Lanes& lanes = sheet_.lanes_[slot_];
+            if (lanes.errors && lanes.errors[sheet_.lane_]) {
+                return FromErrorCode(lanes.errors[sheet_.lane_]);
+            }
+            return lanes.numbers[sheet_.lane_];
+        }
+
+        // not read by formulas
+        std::string GetText() const override {
+            return {};
+        }
+
+        std::vector<Position> GetReferencedCells() const override {
+            return {};
+        }
+
+        std::optional<double> GetNumber() const override {
+            const Lanes& lanes = sheet_.lanes_[slot_];
+            if (lanes.errors && lanes.errors[sheet_.lane_]) {
+                return std::nullopt;
+            }
+            return lanes.numbers[sheet_.lane_];
+        }
+
+    private:
+        const ScenarioSheet& sheet_;
+        std::size_t slot_;
+    };
+
+    const Sheet& sheet_;
+    const Slots& slots_;
+    const std::vector<Lanes>& lanes_;
+    std::vector<LaneCell> cells_;  // by slot
+    std::vector<Position> unstored_;  // the slots with no cell in the sheet
+    std::size_t lane_ = 0;
+};
+
+// -- Evaluation --
+
+ScenarioResults Sheet::EvaluateScenarios(const std::vector<Position>& inputs, const ScenarioBlock& values,
+                                         const std::vector<Position>& outputs) const {
+    if (values.GetColumnCount() != inputs.size()) {
+        throw std::invalid_argument("EvaluateScenarios(): every input needs a column of values");
+    }
+    // the inputs, then the formulas of the cone, have their values in every lane
+    ScenarioSheet::Slots slots;
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        if (!inputs[i].IsValid()) {
+            throw InvalidPositionException("Invalid input position in EvaluateScenarios()");
+        }
+        if (!slots.emplace(inputs[i], i).second) {
+            throw std::invalid_argument("EvaluateScenarios(): input " + inputs[i].ToString() + " repeats");
+        }
+    }
+    for (const auto& output : outputs) {
+        if (!output.IsValid()) {
+            throw InvalidPositionException("Invalid output position in EvaluateScenarios()");
+        }
+    }
+    WakeIfHibernated();
+
+    const auto cone = GetScenarioCone(inputs, outputs);
+    std::vector<Position> constants(outputs);
+    std::vector<Range> constant_ranges;
+    for (const auto& pos : cone) {
+        slots.emplace(pos, slots.size());
+    }
+    for (const auto& pos : cone) {
+        const Cell& cell = *sheet_.Find(pos);
+        for (const auto& input : cell.GetReferencedCells()) {
+            if (slots.count(input) == 0) {
+                constants.push_back(input);
+            }
+        }
+        const auto ranges = cell.GetReferencedRanges();
+        constant_ranges.insert(constant_ranges.end(), ranges.begin(), ranges.end());
+    }
+    // so that reading them does not recurse
+    EvaluateInputs(std::move(constants), constant_ranges);
+
+    // Every formula of the cone runs over blocks of lanes if it is only
+    // arithmetic, with the cells it refers to resolved once, and lane by
+    // lane otherwise.
+    struct Step {
+        const FormulaInterface* formula;
+        const ASTImpl::Program* program;  // nullptr lane by lane
+        std::vector<Operand> operands;    // by FormulaAST::GetCells()
+    };
+    std::vector<Step> steps;
+    steps.reserve(cone.size());
+    std::size_t stack_depth = 0;
+    for (const auto& pos : cone) {
+        const FormulaInterface* formula = sheet_.Find(pos)->GetFormula();
+        const auto& ast = *formula->GetAST();
+        Step& step = steps.emplace_back(Step{formula, nullptr, {}});
+        if (!IsLaneProgram(ast.GetExecutedProgram())) {
+            continue;
+        }
+        step.program = &ast.GetExecutedProgram();
+        stack_depth = std::max(stack_depth, ast.GetStackDepth());
+        const Position origin = formula->GetOrigin();
+        for (const auto& offset : ast.GetCells()) {
+            const Position cell{origin.row + offset.row, origin.col + offset.col};
+            if (!cell.IsValid()) {
+                step.operands.push_back({std::nullopt, FormulaError(FormulaError::Category::Ref)});
+            } else if (auto slot = slots.find(cell); slot != slots.end()) {
+                step.operands.push_back({slot->second, {}});
+            } else {
+                step.operands.push_back({std::nullopt, GetReferencedValue(sheet_.Find(cell))});
+            }
+        }
+    }
+
+    const std::size_t lane_count = values.GetLaneCount();
+    ScenarioResults results(outputs.size(), lane_count);
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    std::vector<std::optional<std::size_t>> output_slots;
+    for (std::size_t i = 0; i < outputs.size(); ++i) {
+        if (auto slot = slots.find(outputs[i]); slot != slots.end()) {
+            output_slots.push_back(slot->second);
+            continue;
+        }
+        output_slots.push_back(std::nullopt);
+        const Cell* cell = sheet_.Find(outputs[i]);
+        const CellInterface::Value value = cell ? cell->GetValue() : CellInterface::Value(std::string());
+        double* numbers = results.numbers_.GetColumn(i);
+        if (const double* number = std::get_if<double>(&value)) {
+            std::fill(numbers, numbers + lane_count, *number);
+            continue;
+        }
+        std::fill(numbers, numbers + lane_count, nan);
+        if (const auto* error = std::get_if<FormulaError>(&value)) {
+            std::fill_n(results.errors_.begin() + i * lane_count, lane_count, ToErrorCode(*error));
+        } else {
+            results.texts_[i] = std::get<std::string>(value);
+        }
+    }
+
+    std::vector<double> cone_numbers(cone.size() * BLOCK_LANES);
+    std::vector<ErrorCode> cone_errors(cone.size() * BLOCK_LANES);
+    std::vector<double> stack(stack_depth * BLOCK_LANES);
+    std::vector<Lanes> lanes(slots.size());
+    for (std::size_t i = 0; i < cone.size(); ++i) {
+        lanes[inputs.size() + i] = {&cone_numbers[i * BLOCK_LANES], &cone_errors[i * BLOCK_LANES]};
+    }
+    ScenarioSheet scenario(*this, slots, lanes);
+
+    for (std::size_t first = 0; first < lane_count; first += BLOCK_LANES) {
+        const std::size_t count = std::min(BLOCK_LANES, lane_count - first);
+        for (std::size_t i = 0; i < inputs.size(); ++i) {
+            lanes[i] = {values.GetColumn(i) + first, nullptr};
+        }
+        for (std::size_t i = 0; i < steps.size(); ++i) {
+            double* numbers = &cone_numbers[i * BLOCK_LANES];
+            ErrorCode* errors = &cone_errors[i * BLOCK_LANES];
+            if (steps[i].program) {
+                ExecuteLanes(*steps[i].program, steps[i].operands, lanes, count, stack.data(), numbers, errors);
+                continue;
+            }
+            for (std::size_t lane = 0; lane < count; ++lane) {
+                scenario.SetLane(lane);
+                const auto value = steps[i].formula->Evaluate(scenario);
+                if (const double* number = std::get_if<double>(&value)) {
+                    numbers[lane] = *number;
+                    errors[lane] = NO_FORMULA_ERROR;
+                } else {
+                    numbers[lane] = 0;
+                    errors[lane] = ToErrorCode(std::get<FormulaError>(value));
+                }
+            }
+        }
+        for (std::size_t i = 0; i < outputs.size(); ++i) {
+            if (!output_slots[i]) {
+                continue;
+            }
+            const Lanes& output = lanes[*output_slots[i]];
+            double* numbers = results.numbers_.GetColumn(i) + first;
+            ErrorCode* errors = results.errors_.data() + i * lane_count + first;
+            for (std::size_t lane = 0; lane < count; ++lane) {
+                const ErrorCode code = output.errors ? output.errors[lane] : NO_FORMULA_ERROR;
+                numbers[lane] = code ? nan : output.numbers[lane];
+                errors[lane] = code;
+            }
+        }
+    }
+    return results;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// The values of a set of cells over many scenarios, stored by column: a
+// column holds the values of one cell, lane after lane, so that one
+// operation of a formula runs over all the lanes of its operands in turn.
+class ScenarioBlock {
+public:
+    // filled with zeros
+    ScenarioBlock(std::size_t column_count, std::size_t lane_count);
+
+    std::size_t GetColumnCount() const;
+    std::size_t GetLaneCount() const;
+
+    // GetLaneCount() values
+    double* GetColumn(std::size_t column);
+    const double* GetColumn(std::size_t column) const;
+
+private:
+    std::size_t column_count_;
+    std::size_t lane_count_;
+    std::vector<double> values_;
+};
+
+// The values of the outputs of Sheet::EvaluateScenarios(), a column for
+// every output. Numbers are kept in a ScenarioBlock, errors and texts
+// apart.
+class ScenarioResults {
+public:
+    std::size_t GetOutputCount() const;
+    std::size_t GetLaneCount() const;
+
+    // The numbers of the output, NaN in the lanes where its value is an
+    // error or a text.
+    const double* GetNumbers(std::size_t output) const;
+    // as Sheet::GetCell(output)->GetValue() would return it, "" for an
+    // empty cell, except that an input is its number
+    CellInterface::Value GetValue(std::size_t output, std::size_t lane) const;
+
+private:
+    friend class Sheet;
+
+    ScenarioResults(std::size_t output_count, std::size_t lane_count);
+
+    ScenarioBlock numbers_;
+    // by column, as the numbers: 0 for no error, otherwise the category of
+    // the error plus one
+    std::vector<std::uint8_t> errors_;
+    // the value of the outputs which are texts in every lane
+    std::vector<std::optional<std::string>> texts_;
+};
@@ -1,39 +1,56 @@
 #include "sheet.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <optional>
+#include <sstream>
+#include <thread>
 #include <variant>
 
+#include "FormulaAST.h"
+#include "buffered_writer.h"
 #include "cell.h"
 #include "common.h"
+#include "formula.h"
+#include "tsv.h"
+#include "workbook.h"
 
 using namespace std::literals;
 
-Sheet::~Sheet() {}
+namespace {
+
+bool HasInputs(const Cell& cell) {
+    return !cell.GetReferencedCells().empty() || !cell.GetReferencedRanges().empty();
+}
+
+}  // namespace
+
+Sheet::~Sheet() {
+    // the background computations read the cells
+    async_recalc_.reset();
+}
 
 void Sheet::SetCell(Position pos, std::string text) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position in SetCell()");
     }
-    auto new_cell = std::make_unique<Cell>(*this, std::move(text)); // Can throw FormulaException
-    CheckCircularDependency(pos, new_cell); // Can throw CircularDependencyException
-    auto& cell_in_place = sheet_[pos];
-    if (cell_in_place) {
-        RemoveDependencies(pos, cell_in_place);
-    }
-    if (cell_in_place && !cell_in_place->IsEmpty() && new_cell->IsEmpty()) {
-        area_.RemovePosition(pos);
-    }
-    if (!(cell_in_place && !cell_in_place->IsEmpty()) && !new_cell->IsEmpty()) {
-        area_.AddPosition(pos);
+    if (batch_) {
+        batch_->push_back({pos, std::move(text)});
+        return;
     }
-    cell_in_place = std::move(new_cell);
-    MakeEmptyDependentCells(cell_in_place);
-    AddDependencies(pos, cell_in_place);
-    InvalidateCache(pos);
+    WakeIfHibernated();
+    Cell new_cell = MakeCell(std::move(text), pos); // Can throw FormulaException
+    CheckCircularDependency(pos, new_cell); // Can throw CircularDependencyException
+    const auto pause = PauseAsyncRecalc();
+    ReplaceCell(pos, std::move(new_cell));
+    FinishUpdate({pos});
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
@@ -44,143 +61,1778 @@ CellInterface* Sheet::GetCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position in GetCell()");
     }
-    if (sheet_.count(pos) != 0) {
-        return sheet_.at(pos).get();
-    }
-    return nullptr;
+    WakeIfHibernated();
+    return sheet_.Find(pos);
 }
 
 void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position in ClearCell()");
     }
-    if (sheet_.count(pos) != 0 && sheet_.at(pos)) {
-        auto& cell = sheet_.at(pos);
-        if (!cell->IsEmpty()) {
-            area_.RemovePosition(pos);
-            RemoveDependencies(pos, cell);
-        }
-        cell.reset();
+    if (batch_) {
+        batch_->push_back({pos, std::nullopt});
+        return;
+    }
+    WakeIfHibernated();
+    if (sheet_.Find(pos)) {
+        const auto pause = PauseAsyncRecalc();
+        ReplaceCell(pos, std::nullopt);
+        FinishUpdate({pos});
     }
 }
 
 Size Sheet::GetPrintableSize() const {
+    WakeIfHibernated();
     return area_.GetSize();
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-    auto printer = [this](std::ostream& output, Position pos) {
-        auto val = sheet_.at(pos)->GetValue();
-        std::visit([&output](auto&& v){ output << v; }, val);
-    };
-    Print(output, printer);
+    Print(output, [](BufferedWriter& writer, const Cell& cell) {
+        WriteValue(writer, cell.GetValue());
+    });
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
-    auto printer = [this](std::ostream& output, Position pos) {
-        output << sheet_.at(pos)->GetText();
+    Print(output, [](BufferedWriter& writer, const Cell& cell) {
+        writer.Write(cell.GetText());
+    });
+}
+
+void Sheet::PrintEscapedTexts(std::ostream& output) const {
+    Print(output, [](BufferedWriter& writer, const Cell& cell) {
+        WriteTsvField(writer, cell.GetText());
+    });
+}
+
+void Sheet::ForEachCell(Range range,
+                        const std::function<void(Position, const CellInterface&)>& action) const {
+    WakeIfHibernated();
+    sheet_.ForEach(range.first, range.last, [&action](Position pos, const Cell& cell) {
+        action(pos, cell);
+    });
+}
+
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    return workbook_ ? workbook_->GetSheet(name) : nullptr;
+}
+
+// -- Batch updates --
+
+void Sheet::BeginBatch() {
+    if (batch_) {
+        throw std::logic_error("BeginBatch(): a batch is already open");
+    }
+    batch_.emplace();
+}
+
+void Sheet::CommitBatch() {
+    if (!batch_) {
+        throw std::logic_error("CommitBatch(): no batch is open");
+    }
+    auto updates = std::move(*batch_);
+    batch_.reset();
+    ApplyUpdates(std::move(updates));
+}
+
+void Sheet::AbortBatch() {
+    batch_.reset();
+}
+
+bool Sheet::IsInBatch() const {
+    return batch_.has_value();
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    std::vector<CellUpdate> updates;
+    updates.reserve(cells.size());
+    for (auto& [pos, text] : cells) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Invalid position in SetCells()");
+        }
+        updates.push_back({pos, std::move(text)});
+    }
+    if (batch_) {
+        std::move(updates.begin(), updates.end(), std::back_inserter(*batch_));
+        return;
+    }
+    ApplyUpdates(std::move(updates));
+}
+
+void Sheet::ApplyUpdates(std::vector<CellUpdate> updates) {
+    WakeIfHibernated();
+    NewCells new_cells;
+    std::vector<Position> positions;
+    for (auto& update : updates) {
+        auto [it, inserted] = new_cells.try_emplace(update.pos);
+        if (inserted) {
+            positions.push_back(update.pos);
+        }
+        it->second.reset();
+        if (update.text) {
+            it->second.emplace(MakeCell(std::move(*update.text), update.pos)); // Can throw FormulaException
+        }
+    }
+    CheckCircularDependency(new_cells); // Can throw CircularDependencyException
+
+    const auto pause = PauseAsyncRecalc();
+    for (const auto& pos : positions) {
+        auto& new_cell = new_cells.at(pos);
+        if (new_cell || sheet_.Find(pos)) {
+            ReplaceCell(pos, std::move(new_cell));
+        }
+    }
+    FinishUpdate(positions);
+}
+
+// -- Updates --
+
+Cell Sheet::MakeCell(std::string text, Position pos) const {
+    Cell cell(*this, std::move(text), pos);
+    if (const FormulaInterface* formula = cell.GetFormula()) {
+        if (auto local = MakeReferencesLocal(*formula)) {
+            return Cell(*this, std::move(local), std::nullopt);
+        }
+    }
+    return cell;
+}
+
+// A cell referenced by a formula is always stored, as an empty placeholder
+// if nothing is set there, and a placeholder goes away with the last
+// reference to it, so the stored cells, the graph and the printable area
+// never keep anything for cells which are gone.
+void Sheet::ReplaceCell(Position pos, std::optional<Cell> new_cell) {
+    MarkChanged(pos);
+    placeholders_.erase(pos);
+    const Cell* cell_in_place = sheet_.Find(pos);
+    std::vector<Position> released;
+    if (cell_in_place) {
+        released = RemoveDependencies(pos, *cell_in_place);
+    }
+    if (!new_cell && HasDependentCells(pos)) {
+        new_cell.emplace();
+        placeholders_.insert(pos);
+    }
+    const bool was_printable = cell_in_place && !cell_in_place->IsEmpty();
+    const bool is_printable = new_cell && !new_cell->IsEmpty();
+    if (was_printable && !is_printable) {
+        area_.RemovePosition(pos);
+    }
+    if (!was_printable && is_printable) {
+        area_.AddPosition(pos);
+    }
+    if (new_cell) {
+        sheet_.Emplace(pos, std::move(*new_cell));
+    } else if (cell_in_place) {
+        sheet_.Erase(pos);
+    }
+    released.push_back(pos);
+    for (const auto& p : released) {
+        ReleaseUnreferenced(p);
+    }
+}
+
+// Drops the node of a cell which neither depends on nor is referenced by
+// anything, and the cell too if it is a placeholder.
+void Sheet::ReleaseUnreferenced(Position pos) {
+    if (HasDependentCells(pos)) {
+        return;
+    }
+    if (const Cell* cell = sheet_.Find(pos); cell && HasInputs(*cell)) {
+        return;
+    }
+    dependency_graph_.erase(pos);
+    if (placeholders_.erase(pos) != 0) {
+        sheet_.Erase(pos);
+        MarkChanged(pos);
+    }
+}
+
+bool Sheet::HasDependentCells(Position pos) const {
+    auto node = dependency_graph_.find(pos);
+    return node != dependency_graph_.end() && !node->second.GetDependent().empty();
+}
+
+// Links the cells put in place by ReplaceCell() into the dependency graph
+// and brings the values depending on them up to date.
+void Sheet::FinishUpdate(const std::vector<Position>& positions) {
+    for (const auto& pos : positions) {
+        if (const Cell* cell = sheet_.Find(pos)) {
+            MakeEmptyDependentCells(*cell); // Can move cells around
+            const Cell& placed = *sheet_.Find(pos);
+            AddDependencies(pos, placed);
+            UpdateOrder(pos, placed);
+        }
+    }
+    InvalidateCache(positions);
+    for (const auto& pos : positions) {
+        const Cell* cell = sheet_.Find(pos);
+        if (cell && !cell->IsCacheValid()) {
+            dirty_.insert(pos);
+        }
+    }
+    FinishChange();
+}
+
+// Brings the values up to date after a change of the sheet and counts it.
+void Sheet::FinishChange() {
+    if (recalc_mode_ != RecalcMode::Lazy) {
+        Recalculate();
+    }
+    if constexpr (STATS_ENABLED) {
+        if (stats_dump_ && ++changes_since_dump_ >= stats_dump_period_) {
+            changes_since_dump_ = 0;
+            *stats_dump_ << GetStats() << '\n';
+        }
+    }
+}
+
+void Sheet::CheckCircularDependency(const NewCells& new_cells) const {
+    // iterative DFS over the references, with the new cells taking the place
+    // of the current ones; every cell is visited at most once
+
+    // only formulas can close a cycle; the new ones are sorted so that a
+    // range shorter than their count finds those inside it row by row
+    // instead of testing them all
+    std::vector<Position> new_formulas;
+    for (const auto& [p, new_cell] : new_cells) {
+        if (new_cell && HasInputs(*new_cell)) {
+            new_formulas.push_back(p);
+        }
+    }
+    std::sort(new_formulas.begin(), new_formulas.end());
+
+    auto inputs = [this, &new_cells, &new_formulas](const Cell& cell) {
+        auto result = cell.GetReferencedCells();
+        for (const auto& range : cell.GetReferencedRanges()) {
+            sheet_.ForEach(range.first, range.last, [&](Position p, const Cell& c) {
+                if (new_cells.count(p) == 0 && HasInputs(c)) {
+                    result.push_back(p);
+                }
+            });
+            const auto rows = static_cast<std::size_t>(range.last.row - range.first.row + 1);
+            if (rows > new_formulas.size()) {
+                for (const auto& p : new_formulas) {
+                    if (range.Contains(p)) {
+                        result.push_back(p);
+                    }
+                }
+                continue;
+            }
+            for (int row = range.first.row; row <= range.last.row; ++row) {
+                auto it = std::lower_bound(new_formulas.begin(), new_formulas.end(),
+                                           Position{row, range.first.col});
+                for (; it != new_formulas.end() && it->row == row && it->col <= range.last.col; ++it) {
+                    result.push_back(*it);
+                }
+            }
+        }
+        return result;
+    };
+    auto references = [this, &new_cells, &inputs](Position pos) -> std::vector<Position> {
+        if (auto it = new_cells.find(pos); it != new_cells.end()) {
+            return it->second ? inputs(*it->second) : std::vector<Position>{};
+        }
+        const Cell* cell = sheet_.Find(pos);
+        return cell ? inputs(*cell) : std::vector<Position>{};
+    };
+
+    enum class Mark : char {
+        InProgress,
+        Done,
+    };
+    struct Frame {
+        Position pos;
+        std::vector<Position> references;
+        std::size_t next = 0;
+    };
+
+    std::vector<std::pair<Position, const Cell*>> replaced;
+    replaced.reserve(new_cells.size());
+    for (const auto& [p, new_cell] : new_cells) {
+        replaced.emplace_back(p, new_cell ? &*new_cell : nullptr);
+    }
+    CheckWorkbookCycle(replaced);
+
+    counters_.Add(SheetCounters::CycleChecks);
+    std::unordered_map<Position, Mark, KeyHash, KeyEqual> marks;
+    std::vector<Frame> stack;
+    for (const auto& [start, cell] : new_cells) {
+        if (!cell || marks.count(start) != 0) {
+            continue;
+        }
+        marks.emplace(start, Mark::InProgress);
+        stack.push_back({start, inputs(*cell)});
+        while (!stack.empty()) {
+            auto& frame = stack.back();
+            if (frame.next == frame.references.size()) {
+                marks[frame.pos] = Mark::Done;
+                stack.pop_back();
+                continue;
+            }
+            const Position p = frame.references[frame.next++];
+            auto [it, inserted] = marks.emplace(p, Mark::InProgress);
+            if (inserted) {
+                counters_.Add(SheetCounters::CycleCheckVisits);
+                stack.push_back({p, references(p)});
+            } else if (it->second == Mark::InProgress) {
+                throw CircularDependencyException("Circular dependency detected.");
+            }
+        }
+    }
+}
+
+void Sheet::CheckCircularDependency(Position pos, const Cell& cell) const {
+    CheckWorkbookCycle({{pos, &cell}});
+    const auto references = cell.GetReferencedCells();
+    const auto ranges = cell.GetReferencedRanges();
+    auto is_reference = [&references, &ranges](Position p) {
+        return std::binary_search(references.begin(), references.end(), p) ||
+               std::any_of(ranges.begin(), ranges.end(), [p](const Range& range) {
+                   return range.Contains(p);
+               });
+    };
+    if (is_reference(pos)) {
+        throw CircularDependencyException("Circular dependency detected.");
+    }
+    if (references.empty() && ranges.empty()) {
+        return;
+    }
+    counters_.Add(SheetCounters::CycleChecks);
+
+    // a cycle means that one of the references depends on pos, so it must
+    // come after pos in the topological order; only the cells ranked between
+    // pos and the last reference need to be searched
+    const Node::Order last_reference = GetLastInputOrder(cell);
+    if (auto node = dependency_graph_.find(pos);
+        node != dependency_graph_.end() && last_reference < node->second.GetOrder()) {
+        return;
+    }
+
+    std::unordered_set<Position, KeyHash, KeyEqual> visited{pos};
+    std::vector<Position> stack{pos};
+    while (!stack.empty()) {
+        const Position current = stack.back();
+        stack.pop_back();
+        ForEachDependent(current, [&](Position p) {
+            if (dependency_graph_.at(p).GetOrder() > last_reference || !visited.insert(p).second) {
+                return;
+            }
+            counters_.Add(SheetCounters::CycleCheckVisits);
+            if (is_reference(p)) {
+                throw CircularDependencyException("Circular dependency detected.");
+            }
+            stack.push_back(p);
+        });
+    }
+}
+
+// Restores the topological order after the references of the formula at
+// pos are added to the graph. If some reference comes after pos, pos and
+// everything depending on it are moved to the back of the order, keeping
+// their relative order.
+void Sheet::UpdateOrder(Position pos, const Cell& cell) {
+    if (!HasInputs(cell)) {
+        return;
+    }
+    auto node = dependency_graph_.find(pos);
+    if (node == dependency_graph_.end()) {
+        node = dependency_graph_.emplace(pos, Node(back_order_++)).first;
+        // only the formulas over a range containing pos can already depend
+        // on it, and they are ranked before it now
+        bool has_dependents = false;
+        ForEachDependent(pos, [&has_dependents](Position) {
+            has_dependents = true;
+        });
+        if (!has_dependents) {
+            return;
+        }
+    } else if (GetLastInputOrder(cell) < node->second.GetOrder()) {
+        return;
+    }
+
+    std::unordered_set<Position, KeyHash, KeyEqual> visited{pos};
+    std::vector<Position> to_move{pos};
+    for (std::size_t i = 0; i < to_move.size(); ++i) {
+        ForEachDependent(to_move[i], [&](Position p) {
+            if (visited.insert(p).second) {
+                to_move.push_back(p);
+            }
+        });
+    }
+    std::vector<Node*> nodes;
+    nodes.reserve(to_move.size());
+    for (const auto& p : to_move) {
+        nodes.push_back(&dependency_graph_.at(p));
+    }
+    // pos goes first: it has just been ranked at the back if it is new
+    std::sort(nodes.begin() + 1, nodes.end(), [](const Node* lhs, const Node* rhs) {
+        return lhs->GetOrder() < rhs->GetOrder();
+    });
+    for (Node* moved : nodes) {
+        moved->SetOrder(back_order_++);
+    }
+}
+
+Sheet::Node::Order Sheet::GetLastInputOrder(const Cell& cell) const {
+    Node::Order last = std::numeric_limits<Node::Order>::min();
+    auto update = [this, &last](Position p) {
+        if (auto node = dependency_graph_.find(p); node != dependency_graph_.end()) {
+            last = std::max(last, node->second.GetOrder());
+        }
     };
-    Print(output, printer);
+    for (const auto& p : cell.GetReferencedCells()) {
+        update(p);
+    }
+    for (const auto& range : cell.GetReferencedRanges()) {
+        sheet_.ForEach(range.first, range.last, [&update](Position p, const Cell&) {
+            update(p);
+        });
+    }
+    return last;
+}
+
+void Sheet::AddDependencies(Position pos, const Cell& cell) {
+    for (const auto& p : cell.GetReferencedCells()) {
+        auto node = dependency_graph_.find(p);
+        if (node == dependency_graph_.end()) {
+            node = dependency_graph_.emplace(p, Node(front_order_--)).first;
+        }
+        node->second.AddDependent(pos);
+    }
+    for (const auto& range : cell.GetReferencedRanges()) {
+        range_dependencies_.Add(range, pos);
+    }
+    if (const FormulaInterface* formula = cell.GetFormula(); workbook_ && formula) {
+        workbook_->AddLinks(*this, pos, formula->GetExternalReferences());
+    }
+}
+
+std::vector<Position> Sheet::RemoveDependencies(Position pos, const Cell& cell) {
+    std::vector<Position> released;
+    for (const auto& p : cell.GetReferencedCells()) {
+        if (auto node = dependency_graph_.find(p); node != dependency_graph_.end()) {
+            node->second.RemoveDependent(pos);
+            if (node->second.GetDependent().empty()) {
+                released.push_back(p);
+            }
+        }
+    }
+    for (const auto& range : cell.GetReferencedRanges()) {
+        range_dependencies_.Remove(range, pos);
+    }
+    if (const FormulaInterface* formula = cell.GetFormula(); workbook_ && formula) {
+        workbook_->RemoveLinks(*this, pos, formula->GetExternalReferences());
+    }
+    return released;
+}
+
+// Calls f for every cell depending on pos directly, through a reference or
+// a range. A cell may be passed more than once.
+template <typename F>
+void Sheet::ForEachDependent(Position pos, F&& f) const {
+    if (auto node = dependency_graph_.find(pos); node != dependency_graph_.end()) {
+        for (const auto& p : node->second.GetDependent()) {
+            f(p);
+        }
+    }
+    range_dependencies_.ForEachContaining(pos, f);
+}
+
+void Sheet::MakeEmptyDependentCells(const Cell& cell) {
+    for (const auto& p : cell.GetReferencedCells()) {
+        if (!sheet_.Find(p)) {
+            sheet_.Emplace(p);
+            placeholders_.insert(p);
+            MarkChanged(p);
+        }
+    }
+}
+
+void Sheet::MarkChanged(Position pos) {
+    if (last_version_) {
+        changed_blocks_.insert(SheetVersion::GetBlockPosition(pos));
+    }
+}
+
+// A formula is computed only after its inputs, so the dependents of a cell
+// not computed since it was invalidated are invalid as well: the walk stops
+// at such cells and costs only the cells it invalidates. The cells at
+// positions have just been replaced and always pass the change on, and
+// every changed cell passes it on to the formulas of other sheets.
+void Sheet::InvalidateCache(const std::vector<Position>& positions) {
+    const bool has_dependent_sheets = workbook_ && workbook_->HasDependents(name_);
+    std::vector<Position> changed;
+    if (has_dependent_sheets) {
+        changed = positions;
+    }
+    std::size_t invalidated = 0;
+    std::vector<Position> stack = positions;
+    while (!stack.empty()) {
+        const Position pos = stack.back();
+        stack.pop_back();
+        ForEachDependent(pos, [&](Position p) {
+            const Cell* cell = sheet_.Find(p);
+            assert(cell);
+            if (cell->IsCacheValid()) {
+                cell->InvalidateCellCache();
+                dirty_.insert(p);
+                MarkChanged(p);
+                stack.push_back(p);
+                ++invalidated;
+                if (has_dependent_sheets) {
+                    changed.push_back(p);
+                }
+            }
+        });
+    }
+    counters_.Add(SheetCounters::Invalidations);
+    counters_.Add(SheetCounters::InvalidatedCells, invalidated);
+    if (has_dependent_sheets) {
+        workbook_->InvalidateDependents(name_, changed);
+    }
+}
+
+// -- Workbook --
+
+std::unique_ptr<FormulaInterface> Sheet::MakeReferencesLocal(const FormulaInterface& formula) const {
+    const auto ast = formula.GetAST();
+    const auto& sheets = ast->GetExternals().sheets;
+    if (name_.empty() || std::find(sheets.begin(), sheets.end(), name_) == sheets.end()) {
+        return nullptr;
+    }
+    return MakeFormula(std::make_shared<const FormulaAST>(ast->WithLocalReferences(name_)), formula.GetOrigin());
+}
+
+// Calls f(sheet, p) for every formula of the workbook depending on pos
+// directly, the ones of this sheet included. A formula may be passed more
+// than once.
+template <typename F>
+void Sheet::ForEachWorkbookDependent(Position pos, F&& f) const {
+    ForEachDependent(pos, [this, &f](Position p) {
+        f(*this, p);
+    });
+    if (!workbook_) {
+        return;
+    }
+    auto target = workbook_->links_.find(name_);
+    if (target == workbook_->links_.end()) {
+        return;
+    }
+    for (const auto& [source, links] : target->second) {
+        // a sheet being attached is not in the workbook yet
+        const Sheet& sheet = source == name_ ? *this : *workbook_->sheets_.at(source);
+        links.references.ForEachContaining(pos, [&sheet, &f](Position p) {
+            f(sheet, p);
+        });
+    }
 }
 
-void Sheet::CheckCircularDependency(Position pos, const std::unique_ptr<Cell>& cell) const {
-    if (!cell) {
+// The graph of the sheet keeps the cycles out of it, so a cycle left to
+// look for goes through another sheet: one of the cells of this sheet has
+// dependents in other sheets, and one of its formulas refers to them. The
+// search walks the dependents over the workbook from the new formulas, see
+// ForEachWorkbookDependent(), with the new cells in place of the current
+// ones: the edges to the replaced cells are dropped and those of the new
+// cells are taken from an index of their references.
+void Sheet::CheckWorkbookCycle(const std::vector<std::pair<Position, const Cell*>>& new_cells) const {
+    if (!workbook_ || !workbook_->HasDependents(name_)) {
+        return;
+    }
+    std::unordered_set<Position, KeyHash, KeyEqual> replaced;
+    RangeIndex local_references;
+    std::map<std::string, RangeIndex, std::less<>> external_references;
+    std::vector<Position> starts;
+    for (const auto& [pos, cell] : new_cells) {
+        replaced.insert(pos);
+        const FormulaInterface* formula = cell ? cell->GetFormula() : nullptr;
+        if (!formula) {
+            continue;
+        }
+        for (const auto& p : formula->GetReferencedCells()) {
+            local_references.Add({p, p}, pos);
+        }
+        for (const auto& range : formula->GetReferencedRanges()) {
+            local_references.Add(range, pos);
+        }
+        for (const auto& reference : formula->GetExternalReferences()) {
+            external_references[reference.sheet].Add(reference.range, pos);
+        }
+        starts.push_back(pos);
+    }
+    if (external_references.empty() && !workbook_->RefersToOtherSheets(name_)) {
         return;
     }
-    for (const auto& p : cell->GetReferencedCells()) {
-        if (pos == p) {
-            throw CircularDependencyException("Circular dependency detected.");
+
+    // the dependents in the graph with the new cells
+    auto dependents = [&](const Sheet& sheet, Position pos) {
+        std::vector<std::pair<const Sheet*, Position>> result;
+        sheet.ForEachWorkbookDependent(pos, [&](const Sheet& dependent, Position p) {
+            if (&dependent != this || replaced.count(p) == 0) {
+                result.emplace_back(&dependent, p);
+            }
+        });
+        auto add_new = [this, &result](Position p) {
+            result.emplace_back(this, p);
+        };
+        if (&sheet == this) {
+            local_references.ForEachContaining(pos, add_new);
+        } else if (auto it = external_references.find(sheet.name_); it != external_references.end()) {
+            it->second.ForEachContaining(pos, add_new);
+        }
+        return result;
+    };
+
+    enum class Mark : char {
+        InProgress,
+        Done,
+    };
+    struct Frame {
+        const Sheet* sheet;
+        Position pos;
+        std::vector<std::pair<const Sheet*, Position>> dependents;
+        std::size_t next = 0;
+    };
+
+    std::unordered_map<const Sheet*, std::unordered_map<Position, Mark, KeyHash, KeyEqual>> marks;
+    std::vector<Frame> stack;
+    for (const auto& start : starts) {
+        if (!marks[this].emplace(start, Mark::InProgress).second) {
+            continue;
+        }
+        stack.push_back({this, start, dependents(*this, start)});
+        while (!stack.empty()) {
+            auto& frame = stack.back();
+            if (frame.next == frame.dependents.size()) {
+                marks[frame.sheet][frame.pos] = Mark::Done;
+                stack.pop_back();
+                continue;
+            }
+            const auto [sheet, p] = frame.dependents[frame.next++];
+            auto [it, inserted] = marks[sheet].emplace(p, Mark::InProgress);
+            if (inserted) {
+                counters_.Add(SheetCounters::CycleCheckVisits);
+                sheet->WakeIfHibernated();
+                stack.push_back({sheet, p, dependents(*sheet, p)});
+            } else if (it->second == Mark::InProgress) {
+                throw CircularDependencyException("Circular dependency detected.");
+            }
+        }
+    }
+}
+
+// The references naming the sheet become ordinary ones, which is checked
+// for cycles in the sheet, and then the formulas referring to other sheets
+// are checked together with the formulas of the workbook referring to it.
+void Sheet::AttachTo(Workbook& workbook, std::string name) {
+    WakeIfHibernated();
+    name_ = std::move(name);
+    NewCells local_cells;
+    std::vector<Position> positions;
+    sheet_.ForEachOrdered([&](Position pos, const Cell& cell) {
+        if (const FormulaInterface* formula = cell.GetFormula()) {
+            if (auto local = MakeReferencesLocal(*formula)) {
+                local_cells.try_emplace(pos).first->second.emplace(*this, std::move(local), std::nullopt);
+                positions.push_back(pos);
+            }
+        }
+    });
+    try {
+        CheckCircularDependency(local_cells);
+    } catch (...) {
+        name_.clear();
+        throw;
+    }
+    if (!positions.empty()) {
+        for (const auto& pos : positions) {
+            ReplaceCell(pos, std::move(local_cells.at(pos)));
+        }
+        FinishUpdate(positions);
+    }
+
+    workbook_ = &workbook;
+    std::vector<std::pair<Position, const Cell*>> external;
+    sheet_.ForEachOrdered([&external](Position pos, const Cell& cell) {
+        if (const FormulaInterface* formula = cell.GetFormula(); formula && !formula->GetExternalReferences().empty()) {
+            external.emplace_back(pos, &cell);
+        }
+    });
+    try {
+        // the links of the sheet are not there yet, so its cells are new
+        CheckWorkbookCycle(external);
+    } catch (...) {
+        workbook_ = nullptr;
+        name_.clear();
+        throw;
+    }
+    for (const auto& [pos, cell] : external) {
+        workbook_->AddLinks(*this, pos, cell->GetFormula()->GetExternalReferences());
+    }
+}
+
+void Sheet::Detach() {
+    WakeIfHibernated();
+    sheet_.ForEachOrdered([this](Position pos, const Cell& cell) {
+        if (const FormulaInterface* formula = cell.GetFormula()) {
+            workbook_->RemoveLinks(*this, pos, formula->GetExternalReferences());
+        }
+    });
+    workbook_ = nullptr;
+    name_.clear();
+}
+
+// The workbook pauses the computations of the sheet beforehand.
+void Sheet::InvalidateFormulas(const std::vector<Position>& positions) {
+    WakeIfHibernated();
+    std::vector<Position> invalidated;
+    for (const auto& pos : positions) {
+        const Cell* cell = sheet_.Find(pos);
+        if (cell && cell->IsCacheValid()) {
+            cell->InvalidateCellCache();
+            dirty_.insert(pos);
+            MarkChanged(pos);
+            invalidated.push_back(pos);
+        }
+    }
+    if (!invalidated.empty()) {
+        InvalidateCache(invalidated);
+    }
+}
+
+// The workbook pauses the computations of the sheet beforehand. Only the
+// references to other sheets change, so the graph of the sheet stays.
+void Sheet::MoveExternalReferences(std::string_view sheet, const Shift& shift, std::vector<Position> positions) {
+    WakeIfHibernated();
+    std::sort(positions.begin(), positions.end());
+    positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+    Shift::RewrittenASTs asts;
+    for (const auto& pos : positions) {
+        const FormulaInterface& formula = *sheet_.Find(pos)->GetFormula();
+        auto moved = shift.MoveExternalReferences(formula, sheet, asts);
+        workbook_->RemoveLinks(*this, pos, formula.GetExternalReferences());
+        workbook_->AddLinks(*this, pos, moved->GetExternalReferences());
+        sheet_.Emplace(pos, *this, std::move(moved), std::nullopt);
+        dirty_.insert(pos);
+        MarkChanged(pos);
+    }
+    InvalidateCache(positions);
+}
+
+// Walks only the stored cells, in row-major order, and writes the tabs and
+// newlines between them in bulk.
+template <typename F>
+void Sheet::Print(std::ostream& output, F&& printer) const {
+    WakeIfHibernated();
+    const Size size = area_.GetSize();
+    BufferedWriter writer(output);
+    GridPrinter grid(writer, size);
+    sheet_.ForEachOrdered([&](Position pos, const Cell& cell) {
+        // empty cells kept for their dependents can lie outside the area
+        if (pos.row < size.rows && pos.col < size.cols && !cell.IsEmpty()) {
+            grid.MoveTo(pos);
+            printer(writer, cell);
+        }
+    });
+    grid.Finish();
+    writer.Flush();
+}
+
+// -- Structural edits --
+
+void Sheet::InsertRows(int row, int count) {
+    ApplyShift(Shift(Shift::Axis::Rows, row, count, false));
+}
+
+void Sheet::DeleteRows(int row, int count) {
+    ApplyShift(Shift(Shift::Axis::Rows, row, count, true));
+}
+
+void Sheet::InsertCols(int col, int count) {
+    ApplyShift(Shift(Shift::Axis::Cols, col, count, false));
+}
+
+void Sheet::DeleteCols(int col, int count) {
+    ApplyShift(Shift(Shift::Axis::Cols, col, count, true));
+}
+
+// The formulas moved or referring to moved cells are unlinked from the
+// graph, rewritten once the cells are in their new places and linked again.
+// The edges of the graph are the old ones moved along with the cells, less
+// those to deleted cells, so the order stays topological and only the
+// dependents of the formulas losing inputs need invalidating.
+void Sheet::ApplyShift(const Shift& shift) {
+    WakeIfHibernated();
+    if (batch_) {
+        throw std::logic_error("Structural edits cannot be made in a batch");
+    }
+    const Range area = shift.GetMovedArea();
+    std::vector<Position> moved;
+    sheet_.ForEach(area.first, area.last, [&moved](Position pos, const Cell&) {
+        moved.push_back(pos);
+    });
+    for (const auto& pos : moved) {
+        if (!shift.IsDeleted(pos) && !shift.Map(pos).IsValid()) {
+            throw InvalidPositionException("The insertion would push cells out of the sheet");
+        }
+    }
+
+    const auto pause = PauseAsyncRecalc();
+    // at their old positions
+    std::unordered_set<Position, KeyHash, KeyEqual> affected;
+    for (const auto& pos : moved) {
+        if (sheet_.Find(pos)->GetFormula()) {
+            affected.insert(pos);
+        }
+        if (auto node = dependency_graph_.find(pos); node != dependency_graph_.end()) {
+            const auto& dependents = node->second.GetDependent();
+            affected.insert(dependents.begin(), dependents.end());
+        }
+    }
+    range_dependencies_.ForEachIntersecting(area, [&affected](Position pos) {
+        affected.insert(pos);
+    });
+    std::vector<Position> released;
+    for (const auto& pos : affected) {
+        const auto unreferenced = RemoveDependencies(pos, *sheet_.Find(pos));
+        released.insert(released.end(), unreferenced.begin(), unreferenced.end());
+    }
+
+    MoveCells(shift, moved);
+
+    Shift::RewrittenASTs asts;
+    std::vector<Position> rewritten;
+    std::vector<Position> changed;
+    for (const auto& old_pos : affected) {
+        if (shift.IsDeleted(old_pos)) {
+            continue;
+        }
+        const Position pos = shift.Map(old_pos);
+        const Cell& cell = *sheet_.Find(pos);
+        bool keeps_value = false;
+        auto formula = shift.MoveFormula(*cell.GetFormula(), asts, keeps_value);
+        auto cache = keeps_value ? cell.GetCachedValue() : std::nullopt;
+        if (!cache) {
+            dirty_.insert(pos);
+        }
+        sheet_.Emplace(pos, *this, std::move(formula), std::move(cache));
+        MarkChanged(pos);
+        rewritten.push_back(pos);
+        if (!keeps_value) {
+            changed.push_back(pos);
+        }
+    }
+    for (const auto& pos : rewritten) {
+        MakeEmptyDependentCells(*sheet_.Find(pos)); // Can move cells around
+        AddDependencies(pos, *sheet_.Find(pos));
+    }
+    for (const auto& pos : released) {
+        if (!shift.IsDeleted(pos)) {
+            ReleaseUnreferenced(shift.Map(pos));
+        }
+    }
+    for (const auto& pos : rewritten) {
+        ReleaseUnreferenced(pos);
+    }
+    InvalidateCache(changed);
+    if (workbook_) {
+        // the formulas of other sheets follow the cells they refer to
+        for (auto& [sheet, formulas] : workbook_->GetDependentFormulas(name_, area)) {
+            sheet->MoveExternalReferences(name_, shift, std::move(formulas));
         }
-        if (sheet_.count(p) != 0) {
-            CheckCircularDependency(pos, sheet_.at(p));
+    }
+    FinishChange();
+}
+
+// Moves the stored cells at moved, which the graph no longer links to
+// anything, with their nodes, and drops the deleted ones. All of them are
+// taken out before any is put back, as the new positions may be taken yet.
+void Sheet::MoveCells(const Shift& shift, const std::vector<Position>& moved) {
+    std::vector<std::pair<Position, Cell>> cells;
+    std::vector<std::pair<Position, Node>> nodes;
+    std::vector<Position> placeholders;
+    std::vector<Position> dirty;
+    cells.reserve(moved.size());
+    for (const auto& pos : moved) {
+        Cell* cell = sheet_.Find(pos);
+        const Position to = shift.Map(pos);
+        if (!cell->IsEmpty()) {
+            area_.RemovePosition(pos);
+        }
+        if (auto node = dependency_graph_.extract(pos); !node.empty() && to.IsValid()) {
+            assert(node.mapped().GetDependent().empty());
+            nodes.emplace_back(to, std::move(node.mapped()));
+        }
+        if (placeholders_.erase(pos) != 0 && to.IsValid()) {
+            placeholders.push_back(to);
+        }
+        if (dirty_.erase(pos) != 0 && to.IsValid()) {
+            dirty.push_back(to);
+        }
+        if (to.IsValid()) {
+            cells.emplace_back(to, std::move(*cell));
+        }
+        sheet_.Erase(pos);
+        MarkChanged(pos);
+    }
+    for (auto& [pos, cell] : cells) {
+        if (!cell.IsEmpty()) {
+            area_.AddPosition(pos);
+        }
+        sheet_.Emplace(pos, std::move(cell));
+        MarkChanged(pos);
+    }
+    for (auto& [pos, node] : nodes) {
+        dependency_graph_.emplace(pos, std::move(node));
+    }
+    placeholders_.insert(placeholders.begin(), placeholders.end());
+    dirty_.insert(dirty.begin(), dirty.end());
+}
+
+// -- Recalculation --
+
+void Sheet::SetRecalcMode(RecalcMode mode) {
+    recalc_mode_ = mode;
+    if (recalc_mode_ != RecalcMode::Lazy) {
+        Recalculate();
+    }
+}
+
+Sheet::RecalcMode Sheet::GetRecalcMode() const {
+    return recalc_mode_;
+}
+
+void Sheet::SetRecalcThreads(std::size_t count) {
+    recalc_threads_ = count;
+    thread_pool_.reset();
+}
+
+bool Sheet::WakeToRecalculate() {
+    if (hibernated_.load(std::memory_order_acquire)) {
+        std::lock_guard lock(wake_mutex_);
+        if (hibernation_ && hibernation_->computed) {
+            return false;
         }
     }
+    WakeIfHibernated();
+    return true;
 }
 
-void Sheet::AddDependencies(Position pos, const std::unique_ptr<Cell>& cell) {
-    assert(cell);
-    for (const auto& p : cell->GetReferencedCells()) {
-        dependency_graph_[p].AddDependent(pos);
+void Sheet::Recalculate() {
+    if (!WakeToRecalculate()) {
+        return;
+    }
+    // Kahn's algorithm over the subgraph of dirty cells: a cell is computed
+    // once all the dirty cells it references are
+    std::unordered_map<Position, std::atomic<int>, KeyHash, KeyEqual> pending_inputs;
+    for (const auto& pos : dirty_) {
+        pending_inputs.try_emplace(pos, 0);
+    }
+    for (const auto& pos : dirty_) {
+        ForEachDependent(pos, [&pending_inputs](Position p) {
+            if (auto it = pending_inputs.find(p); it != pending_inputs.end()) {
+                it->second.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    std::vector<Position> ready;
+    for (const auto& [pos, count] : pending_inputs) {
+        if (count.load(std::memory_order_relaxed) == 0) {
+            ready.push_back(pos);
+        }
     }
+
+    // computes the cell and passes every dependent which has no more
+    // pending inputs to release()
+    auto compute = [this, &pending_inputs](Position pos, auto&& release) {
+        if (const Cell* cell = sheet_.Find(pos)) {
+            cell->ComputeValue();
+        }
+        ForEachDependent(pos, [&](Position p) {
+            auto it = pending_inputs.find(p);
+            if (it != pending_inputs.end() && it->second.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                release(p);
+            }
+        });
+    };
+
+    // small recalculations are not worth the scheduling overhead
+    constexpr std::size_t PARALLEL_THRESHOLD = 256;
+    if (recalc_mode_ != RecalcMode::Parallel || pending_inputs.size() < PARALLEL_THRESHOLD) {
+        while (!ready.empty()) {
+            const Position pos = ready.back();
+            ready.pop_back();
+            compute(pos, [&ready](Position p) {
+                ready.push_back(p);
+            });
+        }
+    } else {
+        ThreadPool& pool = GetThreadPool();
+        std::function<void(Position)> task = [&](Position pos) {
+            // keep computing one of the released dependents on this
+            // thread and hand the others over to the pool
+            std::optional<Position> next = pos;
+            while (next) {
+                const Position current = *next;
+                next.reset();
+                compute(current, [&](Position p) {
+                    if (!next) {
+                        next = p;
+                    } else {
+                        pool.Submit([&task, p] { task(p); });
+                    }
+                });
+            }
+        };
+        for (const auto& pos : ready) {
+            pool.Submit([&task, pos] { task(pos); });
+        }
+        pool.Wait();
+    }
+    dirty_.clear();
 }
 
-void Sheet::RemoveDependencies(Position pos, const std::unique_ptr<Cell>& cell) {
-    assert(cell);
-    for (const auto& p : cell->GetReferencedCells()) {
-        dependency_graph_[p].RemoveDependent(pos);
+// Kahn's algorithm as in Recalculate(), over the dirty cells of all the
+// sheets and the links between them, on one thread.
+void Sheet::RecalculateTogether(const std::vector<Sheet*>& sheets) {
+    using Node = std::pair<const Sheet*, Position>;
+    std::unordered_map<const Sheet*, std::unordered_map<Position, int, KeyHash, KeyEqual>> pending_inputs;
+    for (Sheet* sheet : sheets) {
+        if (sheet->WakeToRecalculate()) {
+            auto& pending = pending_inputs[sheet];
+            for (const auto& pos : sheet->dirty_) {
+                pending.try_emplace(pos, 0);
+            }
+        }
+    }
+    // calls f on the pending inputs count of every dirty dependent
+    auto for_each_pending_dependent = [&pending_inputs](const Sheet& sheet, Position pos, auto&& f) {
+        sheet.ForEachWorkbookDependent(pos, [&](const Sheet& dependent, Position p) {
+            auto pending = pending_inputs.find(&dependent);
+            if (pending == pending_inputs.end()) {
+                return;
+            }
+            if (auto it = pending->second.find(p); it != pending->second.end()) {
+                f(&dependent, p, it->second);
+            }
+        });
+    };
+    for (const auto& [sheet, pending] : pending_inputs) {
+        for (const auto& [pos, count] : pending) {
+            for_each_pending_dependent(*sheet, pos, [](const Sheet*, Position, int& count) {
+                ++count;
+            });
+        }
+    }
+
+    std::vector<Node> ready;
+    for (const auto& [sheet, pending] : pending_inputs) {
+        for (const auto& [pos, count] : pending) {
+            if (count == 0) {
+                ready.emplace_back(sheet, pos);
+            }
+        }
+    }
+    while (!ready.empty()) {
+        const auto [sheet, pos] = ready.back();
+        ready.pop_back();
+        if (const Cell* cell = sheet->sheet_.Find(pos)) {
+            cell->ComputeValue();
+        }
+        for_each_pending_dependent(*sheet, pos, [&ready](const Sheet* dependent, Position p, int& count) {
+            if (--count == 0) {
+                ready.emplace_back(dependent, p);
+            }
+        });
+    }
+    for (Sheet* sheet : sheets) {
+        if (pending_inputs.count(sheet) != 0) {
+            sheet->dirty_.clear();
+        }
     }
 }
 
-void Sheet::MakeEmptyDependentCells(const std::unique_ptr<Cell>& cell) {
-    assert(cell);
-    for (const auto& p : cell->GetReferencedCells()) {
-        auto& cell_in_place = sheet_[p];
-        if (!cell_in_place) {
-            cell_in_place = std::make_unique<Cell>(*this);
+void Sheet::EvaluateInputs(std::vector<Position> cells, const std::vector<Range>& ranges) const {
+    WakeIfHibernated();
+    ForEachStaleInput(std::move(cells), ranges, [](Position, const Cell& cell) {
+        cell.GetValue();
+    });
+}
+
+// Calls f(pos, cell) for the formulas not computed yet among the cells and
+// ranges and their inputs, every input before the formulas using it. This
+// is an iterative post-order DFS: computing the cells in this order never
+// has to recurse into other formulas.
+template <typename F>
+void Sheet::ForEachStaleInput(std::vector<Position> cells, const std::vector<Range>& ranges, F&& f) const {
+    struct Frame {
+        Position pos;
+        const Cell* cell;
+        std::vector<Position> inputs;
+        std::size_t next_input = 0;
+    };
+
+    std::unordered_set<Position, KeyHash, KeyEqual> visited;
+    std::vector<Frame> stack;
+    AddStaleInputs(ranges, cells);
+    stack.push_back({Position::NONE, nullptr, std::move(cells)});
+    while (!stack.empty()) {
+        auto& frame = stack.back();
+        if (frame.next_input == frame.inputs.size()) {
+            if (frame.cell) {
+                f(frame.pos, *frame.cell);
+            }
+            stack.pop_back();
+            continue;
         }
+        const Position input = frame.inputs[frame.next_input++];
+        const Cell* cell = sheet_.Find(input);
+        if (cell && !cell->IsCacheValid() && visited.insert(input).second) {
+            auto inputs = cell->GetReferencedCells();
+            AddStaleInputs(cell->GetReferencedRanges(), inputs);
+            stack.push_back({input, cell, std::move(inputs)});
+        }
+    }
+}
+
+// Appends the range cells which are not computed yet to inputs.
+void Sheet::AddStaleInputs(const std::vector<Range>& ranges, std::vector<Position>& inputs) const {
+    for (const auto& range : ranges) {
+        sheet_.ForEach(range.first, range.last, [&inputs](Position pos, const Cell& cell) {
+            if (!cell.IsCacheValid()) {
+                inputs.push_back(pos);
+            }
+        });
     }
 }
 
-void Sheet::InvalidateCache(Position pos) const {
-    if (dependency_graph_.count(pos) != 0) {
-        for (const auto& p : dependency_graph_.at(pos).GetDependent()) {
-            assert(sheet_.count(p) != 0);
-            InvalidateCache(p);
-            sheet_.at(p)->InvalidateCellCache();
+// The formulas depending on the inputs, found by walking the dependents
+// forward, are then walked back from the outputs in post-order, which puts
+// every formula after its inputs and leaves out the ones no output needs.
+// An input stands for a number, so the formulas beyond it do not depend
+// on its own inputs.
+std::vector<Position> Sheet::GetScenarioCone(const std::vector<Position>& inputs,
+                                             const std::vector<Position>& outputs) const {
+    const std::unordered_set<Position, KeyHash, KeyEqual> input_set(inputs.begin(), inputs.end());
+    std::unordered_set<Position, KeyHash, KeyEqual> affected;
+    std::vector<Position> pending = inputs;
+    while (!pending.empty()) {
+        const Position pos = pending.back();
+        pending.pop_back();
+        ForEachDependent(pos, [&](Position dependent) {
+            if (input_set.count(dependent) == 0 && affected.insert(dependent).second) {
+                pending.push_back(dependent);
+            }
+        });
+    }
+
+    struct Frame {
+        Position pos;
+        std::vector<Position> inputs;
+        std::size_t next_input = 0;
+    };
+
+    std::vector<Position> cone;
+    std::unordered_set<Position, KeyHash, KeyEqual> visited;
+    std::vector<Frame> stack;
+    auto visit = [&](Position pos) {
+        if (affected.count(pos) == 0 || !visited.insert(pos).second) {
+            return;
+        }
+        const Cell* cell = sheet_.Find(pos);
+        auto cell_inputs = cell->GetReferencedCells();
+        for (const auto& range : cell->GetReferencedRanges()) {
+            sheet_.ForEach(range.first, range.last, [&](Position p, const Cell&) {
+                if (affected.count(p) != 0) {
+                    cell_inputs.push_back(p);
+                }
+            });
+        }
+        stack.push_back({pos, std::move(cell_inputs)});
+    };
+    for (const auto& output : outputs) {
+        visit(output);
+        while (!stack.empty()) {
+            auto& frame = stack.back();
+            if (frame.next_input == frame.inputs.size()) {
+                cone.push_back(frame.pos);
+                stack.pop_back();
+                continue;
+            }
+            visit(frame.inputs[frame.next_input++]);
         }
     }
+    return cone;
+}
+
+SheetStats Sheet::GetStats() const {
+    WakeIfHibernated();
+    SheetStats stats;
+    counters_.Fill(stats);
+    stats.graph_nodes = dependency_graph_.size();
+    for (const auto& [pos, node] : dependency_graph_) {
+        stats.graph_edges += node.GetDependent().size();
+    }
+    return stats;
+}
+
+void Sheet::ResetStats() {
+    counters_.Reset();
+}
+
+void Sheet::SetStatsDump(std::ostream* output, std::size_t period) {
+    stats_dump_ = output;
+    stats_dump_period_ = std::max<std::size_t>(period, 1);
+    changes_since_dump_ = 0;
+}
+
+SheetCounters& Sheet::GetCounters() const {
+    return counters_;
+}
+
+// -- Asynchronous values --
+
+std::shared_future<CellInterface::Value> Sheet::RequestValue(Position pos) {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position in RequestValue()");
+    }
+    WakeIfHibernated();
+    const Cell* cell = sheet_.Find(pos);
+    if (!cell || cell->IsCacheValid()) {
+        std::promise<CellInterface::Value> promise;
+        promise.set_value(cell ? cell->GetValue() : CellInterface::Value(std::string()));
+        return promise.get_future().share();
+    }
+    if (!async_recalc_) {
+        async_recalc_ = std::make_unique<AsyncRecalc>(*this);
+    }
+    return async_recalc_->Request(pos);
+}
+
+std::vector<std::unique_lock<std::mutex>> Sheet::PauseAsyncRecalc() {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    if (workbook_) {
+        locks = workbook_->PauseDependents(name_);
+    }
+    if (auto lock = PauseOwnAsyncRecalc()) {
+        locks.push_back(std::move(lock));
+    }
+    return locks;
+}
+
+std::unique_lock<std::mutex> Sheet::PauseOwnAsyncRecalc() {
+    return async_recalc_ ? async_recalc_->Pause() : std::unique_lock<std::mutex>();
+}
+
+Sheet::AsyncRecalc::AsyncRecalc(const Sheet& sheet)
+    : sheet_(sheet) {
+}
+
+Sheet::AsyncRecalc::~AsyncRecalc() {
+    // the running computation stops at the next cell and the queued ones
+    // right away, leaving their promises broken
+    stopping_.store(true);
+}
+
+std::shared_future<CellInterface::Value> Sheet::AsyncRecalc::Request(Position pos) {
+    std::lock_guard lock(pending_mutex_);
+    if (auto it = pending_.find(pos); it != pending_.end()) {
+        return it->second;
+    }
+    auto promise = std::make_shared<std::promise<CellInterface::Value>>();
+    auto future = promise->get_future().share();
+    pending_.emplace(pos, future);
+    pool_.Submit([this, pos, promise] {
+        Compute(pos, *promise);
+    });
+    return future;
 }
 
-void Sheet::Print(std::ostream& output, std::function<void(std::ostream&, Position)> printer) const {
-    assert(printer);
-    Size sz = area_.GetSize();
-    for (int row = 0; row < sz.rows; ++row) {
-        for (int col = 0; col < sz.cols; ++col) {
-            if (col != 0) {
-                output << '\t';
+std::unique_lock<std::mutex> Sheet::AsyncRecalc::Pause() {
+    pause_requested_.store(true);
+    std::unique_lock lock(cells_mutex_);
+    pause_requested_.store(false);
+    return lock;
+}
+
+void Sheet::AsyncRecalc::Compute(Position pos, std::promise<CellInterface::Value>& promise) {
+    // the value is published before the mutex is let go, so no change comes
+    // between computing it and the future being ready
+    std::unique_lock lock(cells_mutex_);
+    std::optional<CellInterface::Value> value;
+    std::exception_ptr error;
+    std::vector<Position> order;
+    std::size_t next = 0;
+    bool planned = false;
+    try {
+        while (!stopping_.load()) {
+            if (pause_requested_.load()) {
+                // the cells may change meanwhile, nothing of the plan is kept
+                lock.unlock();
+                std::this_thread::yield();
+                lock.lock();
+                planned = false;
+                continue;
+            }
+            if (!planned) {
+                // the sheet may have been hibernated meanwhile
+                sheet_.WakeIfHibernated();
+                order.clear();
+                sheet_.ForEachStaleInput({pos}, {}, [&order](Position p, const Cell&) {
+                    order.push_back(p);
+                });
+                next = 0;
+                planned = true;
+            }
+            if (next == order.size()) {
+                const Cell* cell = sheet_.sheet_.Find(pos);
+                value = cell ? cell->GetValue() : CellInterface::Value(std::string());
+                break;
             }
-            Position pos{row, col};
-            if (sheet_.count(pos) != 0 && sheet_.at(pos)) {
-                printer(output, pos);
+            if (const Cell* cell = sheet_.sheet_.Find(order[next++])) {
+                cell->ComputeValue();
             }
         }
-        output << '\n';
+    } catch (...) {
+        error = std::current_exception();
+    }
+    {
+        // a request coming after this sees the cell computed or starts anew
+        std::lock_guard pending_lock(pending_mutex_);
+        pending_.erase(pos);
+    }
+    if (value) {
+        promise.set_value(std::move(*value));
+    } else if (error) {
+        promise.set_exception(error);
+    }
+}
+
+// -- Versions --
+
+std::shared_ptr<const SheetVersion> Sheet::PublishVersion() {
+    WakeIfHibernated();
+    Recalculate();
+
+    std::vector<Position> blocks;
+    if (last_version_) {
+        blocks.assign(changed_blocks_.begin(), changed_blocks_.end());
+        std::sort(blocks.begin(), blocks.end());
+    } else {
+        sheet_.ForEachOrdered([&blocks](Position pos, const Cell&) {
+            const Position block = SheetVersion::GetBlockPosition(pos);
+            if (blocks.empty() || !(blocks.back() == block)) {
+                blocks.push_back(block);
+            }
+        });
+        // the bands come in order, the blocks within a band may not
+        std::sort(blocks.begin(), blocks.end());
+        blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+    }
+
+    std::vector<SheetVersion::BlockChange> changes;
+    changes.reserve(blocks.size());
+    std::vector<std::pair<Position, const Cell*>> cells;
+    for (const Position block : blocks) {
+        const Position first{block.row * SheetVersion::BLOCK_ROWS, block.col * SheetVersion::BLOCK_COLS};
+        const Position last{first.row + SheetVersion::BLOCK_ROWS - 1, first.col + SheetVersion::BLOCK_COLS - 1};
+        cells.clear();
+        sheet_.ForEach(first, last, [&cells](Position pos, const Cell& cell) {
+            cells.emplace_back(pos, &cell);
+        });
+        std::sort(cells.begin(), cells.end());
+        changes.emplace_back(block, cells.empty() ? nullptr : SheetVersion::MakeBlock(cells));
+    }
+
+    last_version_.reset(new SheetVersion(last_version_.get(), changes, area_.GetSize()));
+    changed_blocks_.clear();
+    std::atomic_store(&published_version_, last_version_);
+    return last_version_;
+}
+
+std::shared_ptr<const SheetVersion> Sheet::GetPublishedVersion() const {
+    return std::atomic_load(&published_version_);
+}
+
+std::pmr::memory_resource& Sheet::GetCellMemory() const {
+    return cell_memory_;
+}
+
+ThreadPool& Sheet::GetThreadPool() {
+    if (!thread_pool_) {
+        const std::size_t count = recalc_threads_ != 0
+                                      ? recalc_threads_
+                                      : std::max(1u, std::thread::hardware_concurrency());
+        thread_pool_ = std::make_unique<ThreadPool>(count);
+    }
+    return *thread_pool_;
+}
+
+// -- Memory --
+
+SheetMemoryUsage Sheet::GetMemoryUsage() const {
+    SheetMemoryUsage usage;
+    if (hibernated_.load(std::memory_order_acquire)) {
+        std::lock_guard lock(wake_mutex_);
+        if (hibernation_) {
+            usage.hibernated = hibernation_->size;
+            return usage;
+        }
+    }
+    usage.cells = sheet_.GetMemoryUsage();
+    usage.contents = cell_memory_blocks_.GetAllocated();
+    std::unordered_set<const FormulaAST*> asts;
+    constexpr Position LAST{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+    sheet_.ForEach({0, 0}, LAST, [&](Position, const Cell& cell) {
+        usage.contents += cell.GetHeapMemory();
+        const FormulaInterface* formula = cell.GetFormula();
+        if (!formula) {
+            return;
+        }
+        if (cell.IsCacheValid()) {
+            usage.values += sizeof(FormulaInterface::Value);
+        }
+        const auto ast = formula->GetAST();
+        if (asts.insert(ast.get()).second) {
+            usage.asts += ast->GetMemoryUsage();
+        }
+    });
+    // the values are kept in the records of the formulas
+    usage.contents -= std::min(usage.values, usage.contents);
+    usage.dependency_graph = GetHashTableMemory(dependency_graph_) + range_dependencies_.GetMemoryUsage();
+    for (const auto& [pos, node] : dependency_graph_) {
+        usage.dependency_graph += GetHashTableMemory(node.GetDependent());
+    }
+    usage.bookkeeping = GetHashTableMemory(placeholders_) + GetHashTableMemory(dirty_) +
+                        GetHashTableMemory(changed_blocks_) + area_.GetMemoryUsage();
+    return usage;
+}
+
+void Sheet::Hibernate() {
+    if (IsHibernated()) {
+        return;
     }
+    const auto pause = PauseAsyncRecalc();
+    std::ostringstream out(std::ios::binary);
+    WriteSnapshot(out);
+    const std::string bytes = out.str();
+    auto hibernation = std::make_unique<Hibernation>();
+    hibernation->snapshot = std::make_unique<std::uint64_t[]>((bytes.size() + sizeof(std::uint64_t) - 1) /
+                                                              sizeof(std::uint64_t));
+    std::memcpy(hibernation->snapshot.get(), bytes.data(), bytes.size());
+    hibernation->size = bytes.size();
+    hibernation->computed = std::all_of(dirty_.begin(), dirty_.end(), [this](Position pos) {
+        const Cell* cell = sheet_.Find(pos);
+        return !cell || cell->IsCacheValid();
+    });
+    ClearContents();
+    std::lock_guard lock(wake_mutex_);
+    hibernation_ = std::move(hibernation);
+    hibernated_.store(true, std::memory_order_release);
+}
+
+bool Sheet::IsHibernated() const {
+    return hibernated_.load(std::memory_order_acquire);
+}
+
+// Readers of the sheet can wake it from several threads at once, the first
+// one loads the snapshot and the others wait for it under the mutex.
+void Sheet::Wake() const {
+    std::lock_guard lock(wake_mutex_);
+    if (!hibernated_.load(std::memory_order_relaxed)) {
+        return;
+    }
+    // only the readers of the sheet are const, never the sheet itself
+    Sheet& sheet = const_cast<Sheet&>(*this);
+    sheet.ReadSnapshot(reinterpret_cast<const char*>(hibernation_->snapshot.get()), hibernation_->size);
+    sheet.hibernation_.reset();
+    hibernated_.store(false, std::memory_order_release);
+}
+
+void Sheet::ClearContents() {
+    // the cells go before the memory they take their records from
+    sheet_ = {};
+    cell_memory_.release();
+    dependency_graph_ = {};
+    range_dependencies_ = {};
+    front_order_ = -1;
+    back_order_ = 0;
+    area_.Clear();
+    placeholders_ = {};
+    dirty_ = {};
 }
 
 // -- PrintableArea --
 
 void Sheet::PrintableArea::AddPosition(Position pos) {
-    ++row_index_count[pos.row];
-    ++col_index_count[pos.col];
+    rows_.Add(pos.row);
+    cols_.Add(pos.col);
+}
+
+void Sheet::PrintableArea::AddPositions(const std::vector<Position>& positions) {
+    for (const auto& pos : positions) {
+        AddPosition(pos);
+    }
 }
 
 void Sheet::PrintableArea::RemovePosition(Position pos) {
-    assert(row_index_count.count(pos.row) != 0 &&
-           col_index_count.count(pos.col) != 0);
+    rows_.Remove(pos.row);
+    cols_.Remove(pos.col);
+}
+
+Size Sheet::PrintableArea::GetSize() const {
+    return {rows_.GetEnd(), cols_.GetEnd()};
+}
+
+void Sheet::PrintableArea::Clear() {
+    rows_.Clear();
+    cols_.Clear();
+}
+
+std::size_t Sheet::PrintableArea::GetMemoryUsage() const {
+    return rows_.GetMemoryUsage() + cols_.GetMemoryUsage();
+}
+
+Sheet::PrintableArea::AxisCounts::AxisCounts(int size)
+    : size_(size) {
+}
+
+void Sheet::PrintableArea::AxisCounts::Add(int index) {
+    if (counts_.empty()) {
+        const int words = (size_ + WORD_BITS - 1) / WORD_BITS;
+        counts_.resize(size_);
+        used_.resize(words);
+        used_words_.resize((words + WORD_BITS - 1) / WORD_BITS);
+    }
+    if (counts_[index]++ == 0) {
+        const int word = index / WORD_BITS;
+        used_[word] |= Word{1} << index % WORD_BITS;
+        used_words_[word / WORD_BITS] |= Word{1} << word % WORD_BITS;
+    }
+}
+
+void Sheet::PrintableArea::AxisCounts::Remove(int index) {
+    assert(!counts_.empty() && counts_[index] > 0);
+    if (--counts_[index] == 0) {
+        const int word = index / WORD_BITS;
+        used_[word] &= ~(Word{1} << index % WORD_BITS);
+        if (used_[word] == 0) {
+            used_words_[word / WORD_BITS] &= ~(Word{1} << word % WORD_BITS);
+        }
+    }
+}
+
+void Sheet::PrintableArea::AxisCounts::Clear() {
+    counts_ = {};
+    used_ = {};
+    used_words_ = {};
+}
+
+std::size_t Sheet::PrintableArea::AxisCounts::GetMemoryUsage() const {
+    return GetVectorMemory(counts_) + GetVectorMemory(used_) + GetVectorMemory(used_words_);
+}
+
+int Sheet::PrintableArea::AxisCounts::GetEnd() const {
+    for (int top = static_cast<int>(used_words_.size()) - 1; top >= 0; --top) {
+        if (const Word words = used_words_[top]) {
+            const int word = top * WORD_BITS + WORD_BITS - 1 - __builtin_clzll(words);
+            return word * WORD_BITS + WORD_BITS - __builtin_clzll(used_[word]);
+        }
+    }
+    return 0;
+}
+
+// -- Shift --
+
+Sheet::Shift::Shift(Axis axis, int first, int count, bool deletes)
+    : axis_(axis)
+    , first_(first)
+    , count_(count)
+    , deletes_(deletes)
+    , size_(axis == Axis::Rows ? Position::MAX_ROWS : Position::MAX_COLS) {
+    if (first < 0 || count < 1 || count > size_ - first) {
+        throw InvalidPositionException(deletes ? "Deleting rows or columns out of the sheet"
+                                               : "Inserting rows or columns out of the sheet");
+    }
+}
+
+Range Sheet::Shift::GetMovedArea() const {
+    Range area{{0, 0}, {Position::MAX_ROWS - 1, Position::MAX_COLS - 1}};
+    (axis_ == Axis::Rows ? area.first.row : area.first.col) = first_;
+    return area;
+}
 
-    RemoveProjection(row_index_count, pos.row);
-    RemoveProjection(col_index_count, pos.col);
+bool Sheet::Shift::IsDeleted(Position pos) const {
+    const int index = GetIndex(pos);
+    return deletes_ && first_ <= index && index < first_ + count_;
 }
 
-void Sheet::PrintableArea::RemoveProjection(std::map<AxisIndex, int>& index_count, int pos_on_axis) {
-    auto& ic = index_count.at(pos_on_axis);
-    if (ic == 1) {
-        index_count.erase(pos_on_axis);
+Position Sheet::Shift::Map(Position pos) const {
+    int& index = axis_ == Axis::Rows ? pos.row : pos.col;
+    index = MapIndex(index);
+    return index < 0 ? Position::NONE : pos;
+}
+
+Range Sheet::Shift::Map(Range range) const {
+    int& first = axis_ == Axis::Rows ? range.first.row : range.first.col;
+    int& last = axis_ == Axis::Rows ? range.last.row : range.last.col;
+    if (deletes_) {
+        if (first_ <= first && last < first_ + count_) {
+            return {Position::NONE, Position::NONE};
+        }
+        // the ends inside the deleted part move to its edges
+        first = first < first_ ? first : std::max(first - count_, first_);
+        last = last < first_ ? last : std::max(last - count_, first_ - 1);
     } else {
-        --ic;
+        // past the edge of the sheet, first makes the range invalid and
+        // last is cut, as nothing stored is pushed out
+        first = MapIndex(first);
+        last = last < first_ ? last : std::min(last + count_, size_ - 1);
     }
+    return range;
 }
 
-Size Sheet::PrintableArea::GetSize() const {
-    return {row_index_count.empty() ?
-                0 : std::prev(row_index_count.end())->first + 1,
-            col_index_count.empty() ?
-                0 : std::prev(col_index_count.end())->first + 1};
+bool Sheet::Shift::Cuts(Range range) const {
+    const int first = GetIndex(range.first);
+    const int last = GetIndex(range.last);
+    return deletes_ && first < first_ + count_ && first_ <= last;
+}
+
+// Only the offsets of the references moving differently from the formula
+// change, and when none does the new formula shares the AST of the old one.
+std::unique_ptr<FormulaInterface> Sheet::Shift::MoveFormula(const FormulaInterface& formula,
+                                                            RewrittenASTs& rewritten,
+                                                            bool& keeps_value) const {
+    auto ast = formula.GetAST();
+    const Position origin = formula.GetOrigin();
+    const Position new_origin = Map(origin);
+    auto to_absolute = [origin](Position offset) {
+        return Position{offset.row + origin.row, offset.col + origin.col};
+    };
+    auto to_offset = [new_origin](Position pos) {
+        return Position{pos.row - new_origin.row, pos.col - new_origin.col};
+    };
+
+    keeps_value = true;
+    bool same_offsets = true;
+    std::vector<Position> cells;
+    cells.reserve(ast->GetCells().size());
+    for (const auto& offset : ast->GetCells()) {
+        // a reference to a deleted cell stays one
+        Position new_offset = FormulaAST::DELETED_REFERENCE;
+        if (const Position pos = to_absolute(offset); pos.IsValid()) {
+            if (const Position moved = Map(pos); moved.IsValid()) {
+                new_offset = to_offset(moved);
+            } else {
+                keeps_value = false;
+            }
+        }
+        same_offsets = same_offsets && new_offset == offset;
+        cells.push_back(new_offset);
+    }
+    std::vector<Range> ranges;
+    ranges.reserve(ast->GetRanges().size());
+    for (const auto& offset : ast->GetRanges()) {
+        Range new_offset = FormulaAST::DELETED_RANGE;
+        if (const Range range{to_absolute(offset.first), to_absolute(offset.last)}; range.IsValid()) {
+            keeps_value = keeps_value && !Cuts(range);
+            if (const Range moved = Map(range); moved.IsValid()) {
+                new_offset = {to_offset(moved.first), to_offset(moved.last)};
+            }
+        }
+        same_offsets = same_offsets && new_offset == offset;
+        ranges.push_back(new_offset);
+    }
+    // the references to other sheets stay where they are as the formula moves
+    const Position external_offset{origin.row - new_origin.row, origin.col - new_origin.col};
+    const auto& externals = ast->GetExternals();
+    if (!externals.cells.empty() || !externals.ranges.empty()) {
+        same_offsets = same_offsets && external_offset == Position{0, 0};
+    }
+    if (same_offsets) {
+        return MakeFormula(std::move(ast), new_origin);
+    }
+    auto& copies = rewritten[ast];
+    auto copy = std::find_if(copies.begin(), copies.end(), [&](const RewrittenAST& c) {
+        return c.cells == cells && c.ranges == ranges && c.external_offset == external_offset;
+    });
+    if (copy == copies.end()) {
+        auto new_ast = std::make_shared<const FormulaAST>(ast->WithReferences(cells, ranges, external_offset));
+        copy = copies.insert(copies.end(),
+                             {std::move(cells), std::move(ranges), external_offset, std::move(new_ast)});
+    }
+    return MakeFormula(copy->ast, new_origin);
+}
+
+std::unique_ptr<FormulaInterface> Sheet::Shift::MoveExternalReferences(const FormulaInterface& formula,
+                                                                       std::string_view sheet,
+                                                                       RewrittenASTs& rewritten) const {
+    auto ast = formula.GetAST();
+    const Position origin = formula.GetOrigin();
+    auto to_absolute = [origin](Position offset) {
+        return Position{offset.row + origin.row, offset.col + origin.col};
+    };
+    auto to_offset = [origin](Position pos) {
+        return Position{pos.row - origin.row, pos.col - origin.col};
+    };
+
+    const auto& externals = ast->GetExternals();
+    std::vector<Position> cells;
+    cells.reserve(externals.cells.size());
+    for (const auto& ref : externals.cells) {
+        Position new_offset = ref.cell;
+        if (externals.sheets[ref.sheet] == sheet) {
+            new_offset = FormulaAST::DELETED_REFERENCE;
+            if (const Position pos = to_absolute(ref.cell); pos.IsValid()) {
+                if (const Position moved = Map(pos); moved.IsValid()) {
+                    new_offset = to_offset(moved);
+                }
+            }
+        }
+        cells.push_back(new_offset);
+    }
+    std::vector<Range> ranges;
+    ranges.reserve(externals.ranges.size());
+    for (const auto& ref : externals.ranges) {
+        Range new_offset = ref.range;
+        if (externals.sheets[ref.sheet] == sheet) {
+            new_offset = FormulaAST::DELETED_RANGE;
+            if (const Range range{to_absolute(ref.range.first), to_absolute(ref.range.last)}; range.IsValid()) {
+                if (const Range moved = Map(range); moved.IsValid()) {
+                    new_offset = {to_offset(moved.first), to_offset(moved.last)};
+                }
+            }
+        }
+        ranges.push_back(new_offset);
+    }
+    auto& copies = rewritten[ast];
+    auto copy = std::find_if(copies.begin(), copies.end(), [&](const RewrittenAST& c) {
+        return c.cells == cells && c.ranges == ranges;
+    });
+    if (copy == copies.end()) {
+        auto new_ast = std::make_shared<const FormulaAST>(ast->WithExternalReferences(cells, ranges));
+        copy = copies.insert(copies.end(), {std::move(cells), std::move(ranges), {0, 0}, std::move(new_ast)});
+    }
+    return MakeFormula(copy->ast, origin);
+}
+
+int Sheet::Shift::MapIndex(int index) const {
+    if (index < first_) {
+        return index;
+    }
+    if (deletes_) {
+        return index < first_ + count_ ? -1 : index - count_;
+    }
+    return index < size_ - count_ ? index + count_ : -1;
+}
+
+int Sheet::Shift::GetIndex(Position pos) const {
+    return axis_ == Axis::Rows ? pos.row : pos.col;
 }
 
 // -- Node --
 
+Sheet::Node::Node(Order order) : order_(order) {}
+
 void Sheet::Node::AddDependent(Position pos) {
     dependent_cells_.insert(pos);
 }
@@ -193,6 +1845,14 @@ const Sheet::Node::DependentCells& Sheet::Node::GetDependent() const {
     return dependent_cells_;
 }
 
+Sheet::Node::Order Sheet::Node::GetOrder() const {
+    return order_;
+}
+
+void Sheet::Node::SetOrder(Order order) {
+    order_ = order;
+}
+
 // -- aux --
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -1,16 +1,43 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
-#include <map>
+#include <future>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
 
 #include "cell.h"
+#include "cell_storage.h"
 #include "common.h"
+#include "memory_usage.h"
+#include "range_index.h"
+#include "scenario.h"
+#include "sheet_stats.h"
+#include "sheet_version.h"
+#include "thread_pool.h"
+
+class Workbook;
 
 class Sheet : public SheetInterface {
 public:
+    // Lazy: formulas are computed on first GetValue() after a change.
+    // Eager: every change recomputes the affected formulas right away.
+    // Parallel: like Eager, with independent formulas computed concurrently.
+    enum class RecalcMode {
+        Lazy,
+        Eager,
+        Parallel,
+    };
+
     ~Sheet();
     void SetCell(Position pos, std::string text) override;
 
@@ -23,32 +50,137 @@ public:
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
-private:
-    void CheckCircularDependency(Position pos, const std::unique_ptr<Cell>& cell) const;
-    void AddDependencies(Position pos, const std::unique_ptr<Cell>& cell);
-    void RemoveDependencies(Position pos, const std::unique_ptr<Cell>& cell);
-    void MakeEmptyDependentCells(const std::unique_ptr<Cell>& cell);
-    void InvalidateCache(Position pos) const;
-    void Print(std::ostream& output, std::function<void(std::ostream&, Position)> printer) const;
+    // PrintTexts() with the texts escaped as the fields of tsv.h
+    void PrintEscapedTexts(std::ostream& output) const;
 
-    class PrintableArea {
-    public:
-        void AddPosition(Position pos);
-        void RemovePosition(Position pos);
-        Size GetSize() const;
-    private:
-        using AxisIndex = int;
+    // Visits only the allocated part of the storage.
+    void ForEachCell(Range range,
+                     const std::function<void(Position, const CellInterface&)>& action) const override;
 
-        void RemoveProjection(std::map<AxisIndex, int>& index_count, int axis);
+    // The sheet of the same workbook, see workbook.h.
+    const SheetInterface* FindSheet(std::string_view name) const override;
 
-        std::map<AxisIndex, int> row_index_count;
-        std::map<AxisIndex, int> col_index_count;
-    };
+    void SetRecalcMode(RecalcMode mode);
+    RecalcMode GetRecalcMode() const;
+
+    // Number of threads used in RecalcMode::Parallel, all cores by default.
+    void SetRecalcThreads(std::size_t count);
+
+    // Computes every formula invalidated since the last recalculation,
+    // each exactly once and in dependency order.
+    void Recalculate();
+
+    // Between BeginBatch() and CommitBatch() SetCell() and ClearCell() only
+    // record the change and GetCell() keeps returning the committed cells.
+    // CommitBatch() applies all recorded changes as one SetCells() call; if
+    // it throws, the batch is discarded and the sheet is left unchanged.
+    void BeginBatch();
+    void CommitBatch();
+    void AbortBatch();
+    bool IsInBatch() const;
+
+    // Sets all the cells at once: parses every text, checks the changed part
+    // of the graph for cycles once and invalidates dependent cells in a
+    // single pass. Throws FormulaException or CircularDependencyException
+    // without changing anything if any of the texts would do so in
+    // SetCell(). When a position repeats, its last text is used.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+    // Structural edits. InsertRows() puts count empty rows before row and
+    // DeleteRows() removes count rows from row on, moving up or down the
+    // rows below; the column ones move the columns to the right. References
+    // follow the cells they point to, those of the other sheets of the
+    // workbook included, references to deleted cells become #REF! and
+    // ranges grow or shrink with the rows or columns inserted or deleted
+    // inside them. Only the moved cells and the formulas referring to them
+    // are touched, and the values not depending on deleted cells stay
+    // computed in the sheet. Throws InvalidPositionException if the rows or columns
+    // are not in the sheet or an insertion would push cells out of it, and
+    // std::logic_error in a batch.
+    void InsertRows(int row, int count = 1);
+    void DeleteRows(int row, int count = 1);
+    void InsertCols(int col, int count = 1);
+    void DeleteCols(int col, int count = 1);
+
+    // Computes the not yet computed formulas that the given cells and ranges
+    // depend on, so that evaluating a formula over them does not recurse.
+    void EvaluateInputs(std::vector<Position> cells, const std::vector<Range>& ranges) const;
 
+    // Computes the value of the cell on a background thread. Requests for a
+    // cell already being computed share one future. Changing the sheet
+    // pauses the computation, which then goes on from what the change left
+    // computed, so the value is never older than the changes made before
+    // the future is ready. Cells needing no computation are answered right
+    // away. Requests still pending when the sheet is destroyed end with a
+    // broken_promise std::future_error.
+    std::shared_future<CellInterface::Value> RequestValue(Position pos);
+
+    // Computes the outputs over many scenarios without changing the sheet:
+    // lane l of the results holds the values the outputs would have with
+    // the number values.GetColumn(i)[l] in the cell inputs[i], for every i.
+    // Only the formulas between the inputs and the outputs are computed,
+    // in blocks of lanes: the arithmetic ones run each instruction over the
+    // whole block, the others lane by lane. Throws InvalidPositionException
+    // for an invalid position and std::invalid_argument if an input repeats
+    // or the columns of values do not match the inputs.
+    ScenarioResults EvaluateScenarios(const std::vector<Position>& inputs, const ScenarioBlock& values,
+                                      const std::vector<Position>& outputs) const;
+
+    // Writes the sheet to a binary snapshot file, described in snapshot.h,
+    // with the formulas compiled and their computed values. Throws
+    // SnapshotException if the file cannot be written.
+    void SaveSnapshot(const std::string& path) const;
+    // Creates a sheet from a snapshot file without parsing or computing
+    // anything. Throws SnapshotException if the file cannot be read or is
+    // not a valid snapshot.
+    static std::unique_ptr<Sheet> LoadSnapshot(const std::string& path);
+
+    // Computes every formula not computed yet and publishes the sheet as it
+    // is now as an immutable version, see sheet_version.h. Only the blocks
+    // changed since the previous version are copied. Returns the version.
+    std::shared_ptr<const SheetVersion> PublishVersion();
+    // The last published version, nullptr before the first one. Unlike the
+    // rest of the sheet, it may be called by any thread while another one
+    // changes the sheet.
+    std::shared_ptr<const SheetVersion> GetPublishedVersion() const;
+
+    // Memory the cells take their contents from. Freed blocks are reused by
+    // the next cells set, and all of it is released at once with the sheet.
+    std::pmr::memory_resource& GetCellMemory() const;
+
+    // The work done since the sheet was created or ResetStats() was called,
+    // counted when the build enables it (see sheet_stats.h), and the size
+    // of the dependency graph.
+    SheetStats GetStats() const;
+    void ResetStats();
+    // Writes GetStats() as a line to output after every period changes of
+    // the sheet, a SetCells() or a committed batch counting as one change;
+    // nullptr stops it. Does nothing unless the stats are enabled.
+    void SetStatsDump(std::ostream* output, std::size_t period = 1);
+    // Where the cells count their work.
+    SheetCounters& GetCounters() const;
+
+    // The memory the sheet holds, see memory_usage.h, measured by walking
+    // the cells. A hibernated sheet holds just its snapshot.
+    SheetMemoryUsage GetMemoryUsage() const;
+
+    // Frees the cells, the graph and the rest of the contents, keeping them
+    // as a snapshot in memory, see snapshot.h. The next call reading or
+    // changing the cells, on whichever thread, loads them back as they
+    // were, computed values included. The pointers GetCell() returned
+    // become invalid. Recalculate() wakes the sheet only if it had formulas
+    // to compute.
+    void Hibernate();
+    bool IsHibernated() const;
+private:
+    friend class Workbook;
+
+    // The packed key itself: distinct for every cell, so no two cells share
+    // a bucket by their hash alone, and consecutive down a column, so the
+    // cells of a column filled down land in neighbouring buckets.
     struct KeyHash {
         std::size_t operator()(const Position& pos) const {
-            return static_cast<std::size_t>(pos.row) +
-                   100'000 * static_cast<std::size_t>(pos.col);
+            return pos.ToKey();
         }
     };
 
@@ -58,17 +190,281 @@ private:
         }
     };
 
+    // text is nullopt when the cell is cleared
+    struct CellUpdate {
+        Position pos;
+        std::optional<std::string> text;
+    };
+
+    using NewCells = std::unordered_map<Position, std::optional<Cell>, KeyHash, KeyEqual>;
+
+    // Where a structural edit moves the cells: count rows or columns
+    // inserted before first, or deleted from first on.
+    class Shift {
+    public:
+        enum class Axis {
+            Rows,
+            Cols,
+        };
+
+        Shift(Axis axis, int first, int count, bool deletes);
+
+        // the part of the sheet which moves or goes away
+        Range GetMovedArea() const;
+        bool IsDeleted(Position pos) const;
+        // Position::NONE if pos is deleted or pushed out of the sheet
+        Position Map(Position pos) const;
+        // invalid if every cell of range is deleted or pushed out
+        Range Map(Range range) const;
+        // whether some cells of range are deleted
+        bool Cuts(Range range) const;
+
+        // the ASTs rewritten by an edit, by the AST they are rewritten from;
+        // for MoveExternalReferences(), cells and ranges are the offsets of
+        // the references to other sheets
+        struct RewrittenAST {
+            std::vector<Position> cells;
+            std::vector<Range> ranges;
+            Position external_offset;
+            std::shared_ptr<const FormulaAST> ast;
+        };
+        using RewrittenASTs = std::unordered_map<std::shared_ptr<const FormulaAST>, std::vector<RewrittenAST>>;
+
+        // The formula rewritten for the new place of its cell and of the
+        // cells it refers to. keeps_value is set to whether its value stays
+        // the same, that is whether none of its inputs is deleted. Copies of
+        // a formula moved alike get one AST through rewritten.
+        std::unique_ptr<FormulaInterface> MoveFormula(const FormulaInterface& formula,
+                                                      RewrittenASTs& rewritten, bool& keeps_value) const;
+        // The formula of another sheet with its references to the edited
+        // sheet, named sheet, rewritten for the new places of the cells.
+        std::unique_ptr<FormulaInterface> MoveExternalReferences(const FormulaInterface& formula,
+                                                                 std::string_view sheet,
+                                                                 RewrittenASTs& rewritten) const;
+
+    private:
+        int MapIndex(int index) const;
+        int GetIndex(Position pos) const;
+
+        Axis axis_;
+        int first_;
+        int count_;
+        bool deletes_;
+        int size_;  // of the sheet along axis_
+    };
+
+    void ApplyUpdates(std::vector<CellUpdate> updates);
+    void ApplyShift(const Shift& shift);
+    void MoveCells(const Shift& shift, const std::vector<Position>& moved);
+    void ReplaceCell(Position pos, std::optional<Cell> new_cell);
+    void FinishUpdate(const std::vector<Position>& positions);
+    void FinishChange();
+    void CheckCircularDependency(const NewCells& new_cells) const;
+    void CheckCircularDependency(Position pos, const Cell& cell) const;
+    void UpdateOrder(Position pos, const Cell& cell);
+    void AddDependencies(Position pos, const Cell& cell);
+    // returns the references left with no dependent
+    std::vector<Position> RemoveDependencies(Position pos, const Cell& cell);
+    void ReleaseUnreferenced(Position pos);
+    bool HasDependentCells(Position pos) const;
+    void MakeEmptyDependentCells(const Cell& cell);
+    void InvalidateCache(const std::vector<Position>& positions);
+
+    // the snapshot format, see snapshot.cpp; ReadSnapshot() fills an empty
+    // sheet and data is aligned to 8 bytes
+    void WriteSnapshot(std::ostream& out) const;
+    void ReadSnapshot(const char* data, std::size_t size);
+    // leaves the sheet empty, with the settings and versions kept
+    void ClearContents();
+
+    // called first by everything reading or changing the cells
+    void WakeIfHibernated() const {
+        if (!accessed_.load(std::memory_order_relaxed)) {
+            accessed_.store(true, std::memory_order_relaxed);
+        }
+        if (hibernated_.load(std::memory_order_acquire)) {
+            Wake();
+        }
+    }
+    void Wake() const;
+
+    // the workbook side, see workbook.h
+    void AttachTo(Workbook& workbook, std::string name);
+    void Detach();
+    // the cell of text, with the references naming this sheet made ordinary ones
+    Cell MakeCell(std::string text, Position pos) const;
+    // nullptr if the formula does not name this sheet
+    std::unique_ptr<FormulaInterface> MakeReferencesLocal(const FormulaInterface& formula) const;
+    // Throws CircularDependencyException if the cells, nullptr for a
+    // cleared one, would close a cycle through other sheets.
+    void CheckWorkbookCycle(const std::vector<std::pair<Position, const Cell*>>& new_cells) const;
+    template <typename F>
+    void ForEachWorkbookDependent(Position pos, F&& f) const;
+    // false if the sheet stays hibernated, having nothing to compute
+    bool WakeToRecalculate();
+    // Computes the formulas of sheets referring to each other, every one
+    // after its inputs in all of them.
+    static void RecalculateTogether(const std::vector<Sheet*>& sheets);
+    // invalidates the formulas at positions whose inputs in another sheet changed
+    void InvalidateFormulas(const std::vector<Position>& positions);
+    // rewrites the formulas at positions for a structural edit of the sheet
+    // named sheet they refer to, and invalidates them
+    void MoveExternalReferences(std::string_view sheet, const Shift& shift, std::vector<Position> positions);
+    void MarkChanged(Position pos);
+    template <typename F>
+    void ForEachDependent(Position pos, F&& f) const;
+    void AddStaleInputs(const std::vector<Range>& ranges, std::vector<Position>& inputs) const;
+    template <typename F>
+    void ForEachStaleInput(std::vector<Position> cells, const std::vector<Range>& ranges, F&& f) const;
+    // keeps the background computations away from the cells while it lives,
+    // those of the sheets of the workbook depending on this one as well
+    std::vector<std::unique_lock<std::mutex>> PauseAsyncRecalc();
+    std::unique_lock<std::mutex> PauseOwnAsyncRecalc();
+    ThreadPool& GetThreadPool();
+    template <typename F>
+    void Print(std::ostream& output, F&& printer) const;
+    // the formulas depending on the inputs which the outputs depend on,
+    // every one after its inputs
+    std::vector<Position> GetScenarioCone(const std::vector<Position>& inputs,
+                                          const std::vector<Position>& outputs) const;
+
+    // Counts the printable cells in every row and column. A two-level
+    // bitmap of the rows and columns with cells finds the last of them with
+    // a few word operations, so every call takes constant time.
+    class PrintableArea {
+    public:
+        void AddPosition(Position pos);
+        void AddPositions(const std::vector<Position>& positions);
+        void RemovePosition(Position pos);
+        Size GetSize() const;
+        // forgets every position and frees the counts
+        void Clear();
+        std::size_t GetMemoryUsage() const;
+    private:
+        class AxisCounts {
+        public:
+            explicit AxisCounts(int size);
+            void Add(int index);
+            void Remove(int index);
+            // one past the last index with a non-zero count
+            int GetEnd() const;
+            void Clear();
+            std::size_t GetMemoryUsage() const;
+        private:
+            using Word = std::uint64_t;
+            static constexpr int WORD_BITS = 64;
+
+            const int size_;
+            // allocated by the first Add()
+            std::vector<int> counts_;
+            std::vector<Word> used_;        // bit i: counts_[i] != 0
+            std::vector<Word> used_words_;  // bit w: used_[w] != 0
+        };
+
+        AxisCounts rows_{Position::MAX_ROWS};
+        AxisCounts cols_{Position::MAX_COLS};
+    };
+
+    // the sheet as the formulas of one scenario see it, see scenario.cpp
+    class ScenarioSheet;
+
+    // Computes the values asked with RequestValue() one cell at a time on its
+    // own thread, holding the mutex while computing and publishing a value.
+    // The thread changing the sheet takes the mutex around changing the
+    // cells, and the computations let it go at the next cell and plan their
+    // remaining work again.
+    class AsyncRecalc {
+    public:
+        explicit AsyncRecalc(const Sheet& sheet);
+        ~AsyncRecalc();
+
+        std::shared_future<CellInterface::Value> Request(Position pos);
+        std::unique_lock<std::mutex> Pause();
+
+    private:
+        void Compute(Position pos, std::promise<CellInterface::Value>& promise);
+
+        const Sheet& sheet_;
+        std::mutex cells_mutex_;
+        std::atomic<bool> pause_requested_{false};
+        std::atomic<bool> stopping_{false};
+        std::mutex pending_mutex_;
+        std::unordered_map<Position, std::shared_future<CellInterface::Value>, KeyHash, KeyEqual> pending_;
+        // declared last to be joined before the rest is destroyed
+        ThreadPool pool_{1};
+    };
+
     class Node {
     public:
         using DependentCells = std::unordered_set<Position, KeyHash, KeyEqual>;
+        using Order = std::int64_t;
+
+        explicit Node(Order order);
         void AddDependent(Position pos);
         void RemoveDependent(Position pos);
         const DependentCells& GetDependent() const;
+
+        // Rank of the cell in a topological order of the graph: every cell
+        // has a lower order than the cells depending on it.
+        Order GetOrder() const;
+        void SetOrder(Order order);
     private:
         DependentCells dependent_cells_;
+        Order order_;
     };
 
-    std::unordered_map<Position, std::unique_ptr<Cell>, KeyHash, KeyEqual> sheet_;
+    // the highest order among the inputs of the cell which are in the graph
+    Node::Order GetLastInputOrder(const Cell& cell) const;
+
+    // declared first to outlive every cell; cells are only created and
+    // destroyed by the thread changing the sheet, or the one waking it
+    CountingMemoryResource cell_memory_blocks_;
+    mutable std::pmr::unsynchronized_pool_resource cell_memory_{&cell_memory_blocks_};
+    TiledStorage<Cell, KeyHash, KeyEqual> sheet_;
     std::unordered_map<Position, Node, KeyHash, KeyEqual> dependency_graph_;
+    // range references are not expanded into per-cell edges
+    RangeIndex range_dependencies_;
+    // cells first referenced go to the front of the order, new formulas to
+    // its back
+    Node::Order front_order_ = -1;
+    Node::Order back_order_ = 0;
     PrintableArea area_;
+    // the empty cells stored only because formulas refer to them
+    std::unordered_set<Position, KeyHash, KeyEqual> placeholders_;
+    RecalcMode recalc_mode_ = RecalcMode::Lazy;
+    // holds every formula not computed since it was set or invalidated,
+    // and possibly some computed since
+    std::unordered_set<Position, KeyHash, KeyEqual> dirty_;
+    std::size_t recalc_threads_ = 0;
+    std::unique_ptr<ThreadPool> thread_pool_;
+    std::optional<std::vector<CellUpdate>> batch_;
+    mutable SheetCounters counters_;
+    std::ostream* stats_dump_ = nullptr;
+    std::size_t stats_dump_period_ = 1;
+    std::size_t changes_since_dump_ = 0;
+    // the blocks with cells changed since last_version_, tracked only once
+    // a version is published
+    std::unordered_set<Position, KeyHash, KeyEqual> changed_blocks_;
+    std::shared_ptr<const SheetVersion> last_version_;
+    // the same version, accessed only through std::atomic_load() and
+    // std::atomic_store() as readers take it concurrently
+    std::shared_ptr<const SheetVersion> published_version_;
+    // created by the first RequestValue() needing computation
+    std::unique_ptr<AsyncRecalc> async_recalc_;
+    // set while the sheet is in a workbook
+    Workbook* workbook_ = nullptr;
+    std::string name_;
+
+    struct Hibernation {
+        // 8-byte words keep the tables of the snapshot aligned
+        std::unique_ptr<std::uint64_t[]> snapshot;
+        std::size_t size = 0;
+        bool computed = false;  // no formula was left to compute
+    };
+    // set while hibernated_ is; both change under wake_mutex_
+    std::unique_ptr<Hibernation> hibernation_;
+    mutable std::mutex wake_mutex_;
+    mutable std::atomic<bool> hibernated_{false};
+    // set by every access, cleared by Workbook::TrimMemory()
+    mutable std::atomic<bool> accessed_{false};
 };
@@ -0,0 +1,42 @@
+#include "sheet_stats.h"
+
+void SheetCounters::Reset() {
+#ifdef SPREADSHEET_ENABLE_STATS
+    for (auto& value : values_) {
+        value.store(0, std::memory_order_relaxed);
+    }
+#endif
+}
+
+void SheetCounters::Fill([[maybe_unused]] SheetStats& stats) const {
+#ifdef SPREADSHEET_ENABLE_STATS
+    auto get = [this](Counter counter) {
+        return values_[counter].load(std::memory_order_relaxed);
+    };
+    stats.formula_parses = get(FormulaParses);
+    stats.parse_time = std::chrono::nanoseconds(get(ParseNanoseconds));
+    stats.evaluations = get(Evaluations);
+    stats.evaluation_time = std::chrono::nanoseconds(get(EvaluationNanoseconds));
+    stats.cache_hits = get(CacheHits);
+    stats.cache_misses = get(CacheMisses);
+    stats.invalidations = get(Invalidations);
+    stats.invalidated_cells = get(InvalidatedCells);
+    stats.cycle_checks = get(CycleChecks);
+    stats.cycle_check_visits = get(CycleCheckVisits);
+#endif
+}
+
+std::ostream& operator<<(std::ostream& output, const SheetStats& stats) {
+    return output << "parses=" << stats.formula_parses
+                  << " parse_ns=" << stats.parse_time.count()
+                  << " evaluations=" << stats.evaluations
+                  << " evaluation_ns=" << stats.evaluation_time.count()
+                  << " cache_hits=" << stats.cache_hits
+                  << " cache_misses=" << stats.cache_misses
+                  << " invalidations=" << stats.invalidations
+                  << " invalidated_cells=" << stats.invalidated_cells
+                  << " cycle_checks=" << stats.cycle_checks
+                  << " cycle_check_visits=" << stats.cycle_check_visits
+                  << " graph_nodes=" << stats.graph_nodes
+                  << " graph_edges=" << stats.graph_edges;
+}
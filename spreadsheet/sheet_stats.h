@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// Work counters of a sheet. They are kept only when the build defines
+// SPREADSHEET_ENABLE_STATS; otherwise SheetCounters holds nothing, its
+// calls are empty and inline away, and Sheet::GetStats() reports just the
+// size of the dependency graph.
+#ifdef SPREADSHEET_ENABLE_STATS
+inline constexpr bool STATS_ENABLED = true;
+#else
+inline constexpr bool STATS_ENABLED = false;
+#endif
+
+struct SheetStats {
+    std::uint64_t formula_parses = 0;
+    std::chrono::nanoseconds parse_time{0};
+    std::uint64_t evaluations = 0;  // formulas computed
+    std::chrono::nanoseconds evaluation_time{0};
+    std::uint64_t cache_hits = 0;  // formula values read from the cache
+    std::uint64_t cache_misses = 0;
+    std::uint64_t invalidations = 0;      // changes invalidating dependent cells
+    std::uint64_t invalidated_cells = 0;  // cells invalidated by all of them
+    std::uint64_t cycle_checks = 0;
+    std::uint64_t cycle_check_visits = 0;  // cells visited by all of them
+
+    std::size_t graph_nodes = 0;  // cells in the dependency graph
+    std::size_t graph_edges = 0;  // references to single cells
+};
+
+// One line of "name=value" pairs.
+std::ostream& operator<<(std::ostream& output, const SheetStats& stats);
+
+class SheetCounters {
+public:
+    enum Counter {
+        FormulaParses,
+        ParseNanoseconds,
+        Evaluations,
+        EvaluationNanoseconds,
+        CacheHits,
+        CacheMisses,
+        Invalidations,
+        InvalidatedCells,
+        CycleChecks,
+        CycleCheckVisits,
+        COUNTER_COUNT,
+    };
+
+    // Adds the time from its construction to its destruction to a counter.
+    class Timer;
+
+    void Add([[maybe_unused]] Counter counter, [[maybe_unused]] std::uint64_t amount = 1) {
+#ifdef SPREADSHEET_ENABLE_STATS
+        // relaxed: the counters order nothing, and are read as a whole
+        // only between changes of the sheet
+        values_[counter].fetch_add(amount, std::memory_order_relaxed);
+#endif
+    }
+
+    void Reset();
+    // sets the counted fields of stats
+    void Fill(SheetStats& stats) const;
+
+private:
+#ifdef SPREADSHEET_ENABLE_STATS
+    std::array<std::atomic<std::uint64_t>, COUNTER_COUNT> values_{};
+#endif
+};
+
+class SheetCounters::Timer {
+public:
+#ifdef SPREADSHEET_ENABLE_STATS
+    Timer(SheetCounters& counters, Counter counter)
+        : counters_(counters)
+        , counter_(counter)
+        , start_(std::chrono::steady_clock::now()) {
+    }
+
+    ~Timer() {
+        const auto elapsed = std::chrono::steady_clock::now() - start_;
+        counters_.Add(counter_, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+private:
+    SheetCounters& counters_;
+    const Counter counter_;
+    const std::chrono::steady_clock::time_point start_;
+#else
+    Timer(SheetCounters&, Counter) {
+    }
+#endif
+};
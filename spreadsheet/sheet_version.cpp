@@ -0,0 +1,161 @@
+#include "sheet_version.h"
+
+#include "buffered_writer.h"
+#include "cell.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+
+// -- FrozenCell --
+
+SheetVersion::FrozenCell::FrozenCell(const Cell& cell)
+    : value_(cell.GetValue())
+    , number_(cell.GetNumber()) {
+    if (const FormulaInterface* formula = cell.GetFormula()) {
+        // the AST is immutable and shared, only the small formula is new
+        formula_ = MakeFormula(formula->GetAST(), formula->GetOrigin());
+    } else {
+        text_ = cell.GetText();
+    }
+}
+
+CellInterface::Value SheetVersion::FrozenCell::GetValue() const {
+    return value_;
+}
+
+std::string SheetVersion::FrozenCell::GetText() const {
+    if (formula_) {
+        return FORMULA_SIGN + formula_->GetExpression();
+    }
+    return text_;
+}
+
+std::vector<Position> SheetVersion::FrozenCell::GetReferencedCells() const {
+    return formula_ ? formula_->GetReferencedCells() : std::vector<Position>{};
+}
+
+std::vector<Range> SheetVersion::FrozenCell::GetReferencedRanges() const {
+    return formula_ ? formula_->GetReferencedRanges() : std::vector<Range>{};
+}
+
+std::optional<double> SheetVersion::FrozenCell::GetNumber() const {
+    return number_;
+}
+
+bool SheetVersion::FrozenCell::IsEmpty() const {
+    return !formula_ && text_.empty();
+}
+
+// -- SheetVersion --
+
+Position SheetVersion::GetBlockPosition(Position pos) {
+    return {pos.row / BLOCK_ROWS, pos.col / BLOCK_COLS};
+}
+
+std::shared_ptr<const SheetVersion::Block> SheetVersion::MakeBlock(
+    const std::vector<std::pair<Position, const Cell*>>& cells) {
+    auto block = std::make_shared<Block>();
+    block->cells.reserve(cells.size());
+    for (const auto& [pos, cell] : cells) {
+        assert(block->cells.empty() || block->cells.back().first < pos);
+        block->cells.emplace_back(pos, *cell);
+        ++block->row_begin[pos.row % BLOCK_ROWS + 1];
+    }
+    for (int row = 0; row < BLOCK_ROWS; ++row) {
+        block->row_begin[row + 1] += block->row_begin[row];
+    }
+    return block;
+}
+
+SheetVersion::SheetVersion(const SheetVersion* previous, const std::vector<BlockChange>& changes, Size size)
+    : number_(previous ? previous->number_ + 1 : 1)
+    , size_(size) {
+    // merges the changes into the previous list, both sorted
+    static const decltype(blocks_) NO_BLOCKS;
+    const auto& old_blocks = previous ? previous->blocks_ : NO_BLOCKS;
+    blocks_.reserve(old_blocks.size() + changes.size());
+    auto old_block = old_blocks.begin();
+    for (const auto& [pos, block] : changes) {
+        for (; old_block != old_blocks.end() && old_block->first < pos; ++old_block) {
+            blocks_.push_back(*old_block);
+        }
+        if (old_block != old_blocks.end() && old_block->first == pos) {
+            ++old_block;
+        }
+        if (block) {
+            blocks_.emplace_back(pos, block);
+        }
+    }
+    std::copy(old_block, old_blocks.end(), std::back_inserter(blocks_));
+}
+
+std::uint64_t SheetVersion::GetNumber() const {
+    return number_;
+}
+
+const CellInterface* SheetVersion::GetCell(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position in GetCell()");
+    }
+    const Position block_pos = GetBlockPosition(pos);
+    auto block = std::lower_bound(blocks_.begin(), blocks_.end(), block_pos,
+                                  [](const auto& entry, Position p) {
+                                      return entry.first < p;
+                                  });
+    if (block == blocks_.end() || !(block->first == block_pos)) {
+        return nullptr;
+    }
+    const auto& cells = block->second->cells;
+    const auto& row_begin = block->second->row_begin;
+    const auto first = cells.begin() + row_begin[pos.row % BLOCK_ROWS];
+    const auto last = cells.begin() + row_begin[pos.row % BLOCK_ROWS + 1];
+    auto cell = std::lower_bound(first, last, pos, [](const auto& entry, Position p) {
+        return entry.first < p;
+    });
+    return cell != last && cell->first == pos ? &cell->second : nullptr;
+}
+
+Size SheetVersion::GetPrintableSize() const {
+    return size_;
+}
+
+void SheetVersion::PrintValues(std::ostream& output) const {
+    Print(output, [](BufferedWriter& writer, const FrozenCell& cell) {
+        WriteValue(writer, cell.GetValue());
+    });
+}
+
+void SheetVersion::PrintTexts(std::ostream& output) const {
+    Print(output, [](BufferedWriter& writer, const FrozenCell& cell) {
+        writer.Write(cell.GetText());
+    });
+}
+
+// Goes through the blocks a band of BLOCK_ROWS rows at a time, taking each
+// row from every block of the band in turn.
+template <typename F>
+void SheetVersion::Print(std::ostream& output, F&& printer) const {
+    BufferedWriter writer(output);
+    GridPrinter grid(writer, size_);
+    for (auto band = blocks_.begin(); band != blocks_.end();) {
+        const auto band_end = std::find_if(band, blocks_.end(), [&band](const auto& entry) {
+            return entry.first.row != band->first.row;
+        });
+        for (int row = 0; row < BLOCK_ROWS; ++row) {
+            for (auto it = band; it != band_end; ++it) {
+                const Block& block = *it->second;
+                for (int i = block.row_begin[row]; i < block.row_begin[row + 1]; ++i) {
+                    const auto& [pos, cell] = block.cells[i];
+                    if (pos.row < size_.rows && pos.col < size_.cols && !cell.IsEmpty()) {
+                        grid.MoveTo(pos);
+                        printer(writer, cell);
+                    }
+                }
+            }
+        }
+        band = band_end;
+    }
+    grid.Finish();
+    writer.Flush();
+}
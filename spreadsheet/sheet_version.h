@@ -0,0 +1,88 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "formula.h"
+
+class Cell;
+
+// An immutable view of a sheet as it was at Sheet::PublishVersion(), with
+// every formula computed. Nothing in a version is written after it is
+// published, so any number of threads may read it while the sheet goes on
+// changing, and it may outlive the sheet.
+//
+// The cells are copied into blocks of BLOCK_ROWS x BLOCK_COLS which are
+// shared between versions: publishing copies only the blocks where cells
+// changed since the previous version, plus the list of blocks. The blocks
+// are allocated from the heap rather than the cell memory of the sheet,
+// because the reader releasing the last reference to a block can be any
+// thread.
+class SheetVersion {
+public:
+    static constexpr int BLOCK_ROWS = 16;
+    static constexpr int BLOCK_COLS = 16;
+
+    // Starts from 1 and grows by one with every version of the sheet.
+    std::uint64_t GetNumber() const;
+
+    // Like Sheet::GetCell() at the time of publishing.
+    const CellInterface* GetCell(Position pos) const;
+    Size GetPrintableSize() const;
+    void PrintValues(std::ostream& output) const;
+    void PrintTexts(std::ostream& output) const;
+
+private:
+    friend class Sheet;
+
+    class FrozenCell : public CellInterface {
+    public:
+        explicit FrozenCell(const Cell& cell);
+
+        Value GetValue() const override;
+        std::string GetText() const override;
+        std::vector<Position> GetReferencedCells() const override;
+        std::vector<Range> GetReferencedRanges() const override;
+        std::optional<double> GetNumber() const override;
+
+        bool IsEmpty() const;
+
+    private:
+        std::shared_ptr<const FormulaInterface> formula_;  // nullptr unless a formula
+        std::string text_;                                 // of the other cells
+        Value value_;
+        std::optional<double> number_;
+    };
+
+    struct Block {
+        // the cells in row r of the block are cells[row_begin[r]] up to
+        // cells[row_begin[r + 1]], sorted by column
+        std::array<std::uint16_t, BLOCK_ROWS + 1> row_begin{};
+        std::vector<std::pair<Position, FrozenCell>> cells;
+    };
+
+    // a block position with the block to put there, nullptr if it is gone
+    using BlockChange = std::pair<Position, std::shared_ptr<const Block>>;
+
+    static Position GetBlockPosition(Position pos);
+    // cells must be sorted and lie in the block
+    static std::shared_ptr<const Block> MakeBlock(const std::vector<std::pair<Position, const Cell*>>& cells);
+
+    // changes must be sorted by block position
+    SheetVersion(const SheetVersion* previous, const std::vector<BlockChange>& changes, Size size);
+
+    template <typename F>
+    void Print(std::ostream& output, F&& printer) const;
+
+    std::uint64_t number_;
+    Size size_;
+    // sorted by block position, row-major
+    std::vector<std::pair<Position, std::shared_ptr<const Block>>> blocks_;
+};
@@ -0,0 +1,810 @@
+#include "snapshot.h"
+
+#include "FormulaAST.h"
+#include "cell.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// -- File format --
+
+constexpr char MAGIC[8] = {'S', 'P', 'S', 'N', 'A', 'P', '\0', '\0'};
+// version 1 had no placeholders, its empty cells are read as set ones, and
+// versions before 3 had no references to other sheets
+constexpr std::uint32_t VERSION = 3;
+constexpr std::uint32_t OLDEST_VERSION = 1;
+constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+constexpr std::size_t ALIGNMENT = 8;
+
+struct Table {
+    std::uint64_t offset;
+    std::uint64_t count;
+};
+
+struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    Table cells;
+    Table formulas;
+    Table instructions;
+    Table references;
+    Table ranges;
+    Table strings;
+    Table nodes;
+    Table dependents;
+    std::int64_t front_order;
+    std::int64_t back_order;
+};
+
+// follows the header since version 3
+struct HeaderExtension {
+    Table externals;  // one per formula
+    Table sheet_names;
+    Table external_cells;
+    Table external_ranges;
+};
+
+enum class CellKind : std::uint8_t {
+    Empty,
+    Text,
+    Number,
+    Formula,
+    Placeholder,  // an empty cell kept for the formulas referring to it
+};
+
+enum class CacheKind : std::uint8_t {
+    None,
+    Number,
+    Error,
+};
+
+struct CellRecord {
+    std::int32_t row;
+    std::int32_t col;
+    CellKind kind;
+    CacheKind cache;
+    std::uint8_t error;  // FormulaError::Category of an Error cache
+    std::uint8_t padding;
+    std::uint32_t text_size;  // Text, Number
+    std::uint64_t index;      // Text, Number: offset in strings, Formula: in formulas
+    double number;            // Number: the value, Formula: a Number cache
+};
+
+struct FormulaRecord {
+    std::uint64_t first_instruction;
+    std::uint64_t first_reference;
+    std::uint64_t first_range;
+    std::uint32_t instruction_count;
+    std::uint32_t reference_count;
+    std::uint32_t range_count;
+    std::uint32_t padding;
+};
+
+struct InstructionRecord {
+    std::uint8_t op;
+    std::uint8_t padding[7];
+    std::uint64_t operand;  // the bits of a number, an index or a function
+};
+
+// the references are relative to the formula's cell and can be negative
+struct PositionRecord {
+    std::int32_t row;
+    std::int32_t col;
+};
+
+struct RangeRecord {
+    PositionRecord first;
+    PositionRecord last;
+};
+
+// the references of a formula to other sheets
+struct ExternalsRecord {
+    std::uint64_t first_sheet_name;
+    std::uint64_t first_cell;
+    std::uint64_t first_range;
+    std::uint32_t sheet_name_count;
+    std::uint32_t cell_count;
+    std::uint32_t range_count;
+    std::uint32_t padding;
+};
+
+// a name in the strings table
+struct NameRecord {
+    std::uint64_t offset;
+    std::uint64_t size;
+};
+
+// sheet is the index of the name among those of the formula
+struct ExternalCellRecord {
+    std::uint32_t sheet;
+    PositionRecord cell;
+};
+
+struct ExternalRangeRecord {
+    std::uint32_t sheet;
+    RangeRecord range;
+};
+
+struct NodeRecord {
+    PositionRecord pos;
+    std::int64_t order;
+    std::uint64_t first_dependent;
+    std::uint64_t dependent_count;
+};
+
+static_assert(sizeof(Header) == 160);
+static_assert(sizeof(CellRecord) == 32);
+static_assert(sizeof(FormulaRecord) == 40);
+static_assert(sizeof(InstructionRecord) == 16);
+static_assert(sizeof(NodeRecord) == 32);
+static_assert(sizeof(HeaderExtension) == 64);
+static_assert(sizeof(ExternalsRecord) == 40);
+static_assert(sizeof(ExternalCellRecord) == 12);
+static_assert(sizeof(ExternalRangeRecord) == 20);
+
+PositionRecord ToRecord(Position pos) {
+    return {pos.row, pos.col};
+}
+
+Position FromRecord(PositionRecord record) {
+    return {record.row, record.col};
+}
+
+InstructionRecord ToRecord(const ASTImpl::Instruction& instruction) {
+    using ASTImpl::Instruction;
+    InstructionRecord record{};
+    record.op = static_cast<std::uint8_t>(instruction.op);
+    switch (instruction.op) {
+    case Instruction::OpCode::PushNumber:
+        std::memcpy(&record.operand, &instruction.number, sizeof(double));
+        break;
+    case Instruction::OpCode::LoadCell:
+    case Instruction::OpCode::AccumulateRange:
+    case Instruction::OpCode::LoadExternalCell:
+    case Instruction::OpCode::AccumulateExternalRange:
+        record.operand = instruction.index;
+        break;
+    case Instruction::OpCode::BeginAggregate:
+    case Instruction::OpCode::EndAggregate:
+        record.operand = static_cast<std::uint64_t>(instruction.function);
+        break;
+    default:
+        break;
+    }
+    return record;
+}
+
+[[noreturn]] void Fail(const std::string& message) {
+    throw SnapshotException("Invalid snapshot: " + message);
+}
+
+// Rebuilds a program checking that it is one the compiler could emit: the
+// operands are in range and every instruction finds its inputs on the
+// stack, which Execute() relies on.
+ASTImpl::Program ReadProgram(const InstructionRecord* records, std::size_t count,
+                             std::size_t reference_count, std::size_t range_count,
+                             const ExternalReferences& externals) {
+    using ASTImpl::Instruction;
+    ASTImpl::Program program(count);
+    std::size_t depth = 0;
+    std::size_t open_calls = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        auto& instruction = program[i];
+        instruction.op = static_cast<Instruction::OpCode>(records[i].op);
+        const std::uint64_t operand = records[i].operand;
+        switch (instruction.op) {
+        case Instruction::OpCode::PushNumber:
+            std::memcpy(&instruction.number, &operand, sizeof(double));
+            ++depth;
+            break;
+        case Instruction::OpCode::LoadCell:
+        case Instruction::OpCode::LoadExternalCell: {
+            const bool external = instruction.op == Instruction::OpCode::LoadExternalCell;
+            if (operand >= (external ? externals.cells.size() : reference_count)) {
+                Fail("reference out of range");
+            }
+            instruction.index = static_cast<std::uint32_t>(operand);
+            ++depth;
+            break;
+        }
+        case Instruction::OpCode::Add:
+        case Instruction::OpCode::Subtract:
+        case Instruction::OpCode::Multiply:
+        case Instruction::OpCode::Divide:
+            if (depth < 2) {
+                Fail("stack underflow");
+            }
+            --depth;
+            break;
+        case Instruction::OpCode::UnaryPlus:
+        case Instruction::OpCode::UnaryMinus:
+            if (depth < 1) {
+                Fail("stack underflow");
+            }
+            break;
+        case Instruction::OpCode::BeginAggregate:
+        case Instruction::OpCode::EndAggregate:
+            if (operand > static_cast<std::uint64_t>(AggregateFunction::Count)) {
+                Fail("unknown function");
+            }
+            instruction.function = static_cast<AggregateFunction>(operand);
+            if (instruction.op == Instruction::OpCode::BeginAggregate) {
+                ++open_calls;
+            } else if (open_calls-- == 0) {
+                Fail("unbalanced function call");
+            } else {
+                ++depth;
+            }
+            break;
+        case Instruction::OpCode::Accumulate:
+            if (open_calls == 0 || depth < 1) {
+                Fail("stray argument");
+            }
+            --depth;
+            break;
+        case Instruction::OpCode::AccumulateRange:
+        case Instruction::OpCode::AccumulateExternalRange: {
+            const bool external = instruction.op == Instruction::OpCode::AccumulateExternalRange;
+            if (open_calls == 0 || operand >= (external ? externals.ranges.size() : range_count)) {
+                Fail("stray range");
+            }
+            instruction.index = static_cast<std::uint32_t>(operand);
+            break;
+        }
+        default:
+            Fail("unknown instruction");
+        }
+    }
+    if (depth != 1 || open_calls != 0) {
+        Fail("incomplete program");
+    }
+    return program;
+}
+
+// -- Memory mapping --
+
+// The bytes of a snapshot, aligned to ALIGNMENT.
+class SnapshotView {
+public:
+    SnapshotView(const char* data, std::size_t size)
+        : data_(data)
+        , size_(size) {
+    }
+
+    // the records of the table, checked to lie within the snapshot
+    template <typename T>
+    const T* GetTable(const Table& table) const {
+        static_assert(std::is_trivially_copyable_v<T> && alignof(T) <= ALIGNMENT);
+        if (table.offset % ALIGNMENT != 0 || table.offset > size_ ||
+            table.count > (size_ - table.offset) / sizeof(T)) {
+            Fail("table out of the file");
+        }
+        return reinterpret_cast<const T*>(data_ + table.offset);
+    }
+
+    std::size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    const char* data_;
+    std::size_t size_;
+};
+
+// The contents of a file, mapped read-only where the platform allows and
+// read into memory otherwise.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+#ifndef _WIN32
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw SnapshotException("Cannot open snapshot " + path);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            throw SnapshotException("Cannot read snapshot " + path);
+        }
+        size_ = static_cast<std::size_t>(info.st_size);
+        void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw SnapshotException("Cannot map snapshot " + path);
+        }
+        data_ = static_cast<const char*>(data);
+#else
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) {
+            throw SnapshotException("Cannot open snapshot " + path);
+        }
+        size_ = static_cast<std::size_t>(in.tellg());
+        // allocated as 8-byte words to keep the tables aligned
+        buffer_ = std::make_unique<std::uint64_t[]>((size_ + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t));
+        in.seekg(0);
+        if (!in.read(reinterpret_cast<char*>(buffer_.get()), static_cast<std::streamsize>(size_))) {
+            throw SnapshotException("Cannot read snapshot " + path);
+        }
+        data_ = reinterpret_cast<const char*>(buffer_.get());
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifndef _WIN32
+        ::munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+
+    const char* GetData() const {
+        return data_;
+    }
+
+    std::size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+#ifdef _WIN32
+    std::unique_ptr<std::uint64_t[]> buffer_;
+#endif
+};
+
+// -- Writing --
+
+class SnapshotWriter {
+public:
+    // out is binary and empty
+    explicit SnapshotWriter(std::ostream& out)
+        : out_(out) {
+        // the header is written last, over this space
+        const Header placeholder{};
+        const HeaderExtension extension_placeholder{};
+        out_.write(reinterpret_cast<const char*>(&placeholder), sizeof(placeholder));
+        out_.write(reinterpret_cast<const char*>(&extension_placeholder), sizeof(extension_placeholder));
+    }
+
+    // writes the records at the current end of the file
+    template <typename T>
+    Table Write(const std::vector<T>& records) {
+        return Write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(T),
+                     records.size());
+    }
+
+    Table Write(std::string_view bytes) {
+        return Write(bytes.data(), bytes.size(), bytes.size());
+    }
+
+    void Finish(const Header& header, const HeaderExtension& extension) {
+        out_.seekp(0);
+        out_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out_.write(reinterpret_cast<const char*>(&extension), sizeof(extension));
+        out_.flush();
+        if (!out_) {
+            throw SnapshotException("Cannot write snapshot");
+        }
+    }
+
+private:
+    Table Write(const char* data, std::size_t size, std::size_t count) {
+        static const char zeros[ALIGNMENT] = {};
+        out_.write(zeros, static_cast<std::streamsize>((ALIGNMENT - end_ % ALIGNMENT) % ALIGNMENT));
+        end_ = (end_ + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        const Table table{end_, count};
+        out_.write(data, static_cast<std::streamsize>(size));
+        end_ += size;
+        return table;
+    }
+
+    std::ostream& out_;
+    std::uint64_t end_ = sizeof(Header) + sizeof(HeaderExtension);
+};
+
+}  // namespace
+
+// -- Sheet --
+
+void Sheet::SaveSnapshot(const std::string& path) const {
+    WakeIfHibernated();
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw SnapshotException("Cannot create snapshot " + path);
+    }
+    WriteSnapshot(out);
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(const std::string& path) {
+    const MappedFile file(path);
+    auto sheet = std::make_unique<Sheet>();
+    sheet->ReadSnapshot(file.GetData(), file.GetSize());
+    return sheet;
+}
+
+void Sheet::WriteSnapshot(std::ostream& out) const {
+    std::vector<CellRecord> cells;
+    std::vector<FormulaRecord> formulas;
+    std::vector<InstructionRecord> instructions;
+    std::vector<PositionRecord> references;
+    std::vector<RangeRecord> ranges;
+    std::vector<ExternalsRecord> externals;
+    std::vector<NameRecord> sheet_names;
+    std::vector<ExternalCellRecord> external_cells;
+    std::vector<ExternalRangeRecord> external_ranges;
+    std::string strings;
+    std::unordered_map<const FormulaAST*, std::uint64_t> formula_index;
+
+    sheet_.ForEachOrdered([&](Position pos, const Cell& cell) {
+        CellRecord record{};
+        record.row = pos.row;
+        record.col = pos.col;
+        if (const FormulaInterface* formula = cell.GetFormula()) {
+            record.kind = CellKind::Formula;
+            const auto ast = formula->GetAST();
+            auto [it, inserted] = formula_index.try_emplace(ast.get(), formulas.size());
+            if (inserted) {
+                FormulaRecord program{};
+                program.first_instruction = instructions.size();
+                program.first_reference = references.size();
+                program.first_range = ranges.size();
+                program.instruction_count = static_cast<std::uint32_t>(ast->GetProgram().size());
+                program.reference_count = static_cast<std::uint32_t>(ast->GetCells().size());
+                program.range_count = static_cast<std::uint32_t>(ast->GetRanges().size());
+                formulas.push_back(program);
+                for (const auto& instruction : ast->GetProgram()) {
+                    instructions.push_back(ToRecord(instruction));
+                }
+                for (const auto& offset : ast->GetCells()) {
+                    references.push_back(ToRecord(offset));
+                }
+                for (const auto& offset : ast->GetRanges()) {
+                    ranges.push_back({ToRecord(offset.first), ToRecord(offset.last)});
+                }
+                const auto& refs = ast->GetExternals();
+                externals.push_back({sheet_names.size(), external_cells.size(), external_ranges.size(),
+                                     static_cast<std::uint32_t>(refs.sheets.size()),
+                                     static_cast<std::uint32_t>(refs.cells.size()),
+                                     static_cast<std::uint32_t>(refs.ranges.size()), 0});
+                for (const auto& name : refs.sheets) {
+                    sheet_names.push_back({strings.size(), name.size()});
+                    strings += name;
+                }
+                for (const auto& ref : refs.cells) {
+                    external_cells.push_back({ref.sheet, ToRecord(ref.cell)});
+                }
+                for (const auto& ref : refs.ranges) {
+                    external_ranges.push_back({ref.sheet, {ToRecord(ref.range.first), ToRecord(ref.range.last)}});
+                }
+            }
+            record.index = it->second;
+            if (const auto cache = cell.GetCachedValue()) {
+                if (const double* number = std::get_if<double>(&*cache)) {
+                    record.cache = CacheKind::Number;
+                    record.number = *number;
+                } else {
+                    record.cache = CacheKind::Error;
+                    record.error = static_cast<std::uint8_t>(std::get<FormulaError>(*cache).GetCategory());
+                }
+            }
+        } else if (placeholders_.count(pos) != 0) {
+            record.kind = CellKind::Placeholder;
+        } else if (!cell.IsEmpty()) {
+            const std::string text = cell.GetText();
+            const auto number = cell.GetNumber();
+            record.kind = number ? CellKind::Number : CellKind::Text;
+            record.number = number.value_or(0);
+            record.text_size = static_cast<std::uint32_t>(text.size());
+            record.index = strings.size();
+            strings += text;
+        }
+        cells.push_back(record);
+    });
+
+    std::vector<Position> node_positions;
+    node_positions.reserve(dependency_graph_.size());
+    for (const auto& [pos, node] : dependency_graph_) {
+        node_positions.push_back(pos);
+    }
+    std::sort(node_positions.begin(), node_positions.end());
+    std::vector<NodeRecord> nodes;
+    std::vector<PositionRecord> dependents;
+    for (const auto& pos : node_positions) {
+        const Node& node = dependency_graph_.at(pos);
+        nodes.push_back({ToRecord(pos), node.GetOrder(), dependents.size(), node.GetDependent().size()});
+        for (const auto& dependent : node.GetDependent()) {
+            dependents.push_back(ToRecord(dependent));
+        }
+    }
+
+    SnapshotWriter writer(out);
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.cells = writer.Write(cells);
+    header.formulas = writer.Write(formulas);
+    header.instructions = writer.Write(instructions);
+    header.references = writer.Write(references);
+    header.ranges = writer.Write(ranges);
+    header.strings = writer.Write(strings);
+    header.nodes = writer.Write(nodes);
+    header.dependents = writer.Write(dependents);
+    header.front_order = front_order_;
+    header.back_order = back_order_;
+    HeaderExtension extension{};
+    extension.externals = writer.Write(externals);
+    extension.sheet_names = writer.Write(sheet_names);
+    extension.external_cells = writer.Write(external_cells);
+    extension.external_ranges = writer.Write(external_ranges);
+    writer.Finish(header, extension);
+}
+
+void Sheet::ReadSnapshot(const char* data, std::size_t size) {
+    const SnapshotView file(data, size);
+    if (file.GetSize() < sizeof(Header)) {
+        Fail("no header");
+    }
+    const Header& header = *file.GetTable<Header>({0, 1});
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version < OLDEST_VERSION ||
+        header.version > VERSION) {
+        Fail("not a snapshot of this version");
+    }
+    if (header.byte_order != BYTE_ORDER_MARK) {
+        Fail("written with another byte order");
+    }
+
+    const auto* formula_records = file.GetTable<FormulaRecord>(header.formulas);
+    const auto* instruction_records = file.GetTable<InstructionRecord>(header.instructions);
+    const auto* reference_records = file.GetTable<PositionRecord>(header.references);
+    const auto* range_records = file.GetTable<RangeRecord>(header.ranges);
+    auto in_table = [](std::uint64_t first, std::uint64_t count, const Table& table) {
+        return first <= table.count && count <= table.count - first;
+    };
+    // empty before version 3
+    HeaderExtension extension{};
+    if (header.version >= 3) {
+        extension = *file.GetTable<HeaderExtension>({sizeof(Header), 1});
+        if (extension.externals.count != header.formulas.count) {
+            Fail("formulas without their references to other sheets");
+        }
+    }
+    const auto* externals_records = file.GetTable<ExternalsRecord>(extension.externals);
+    const auto* name_records = file.GetTable<NameRecord>(extension.sheet_names);
+    const auto* external_cell_records = file.GetTable<ExternalCellRecord>(extension.external_cells);
+    const auto* external_range_records = file.GetTable<ExternalRangeRecord>(extension.external_ranges);
+    const auto* strings = file.GetTable<char>(header.strings);
+
+    std::vector<std::shared_ptr<const FormulaAST>> asts;
+    asts.reserve(header.formulas.count);
+    for (std::uint64_t i = 0; i < header.formulas.count; ++i) {
+        const FormulaRecord& record = formula_records[i];
+        if (!in_table(record.first_instruction, record.instruction_count, header.instructions) ||
+            !in_table(record.first_reference, record.reference_count, header.references) ||
+            !in_table(record.first_range, record.range_count, header.ranges)) {
+            Fail("formula out of its tables");
+        }
+        std::vector<Position> references;
+        references.reserve(record.reference_count);
+        for (std::uint32_t j = 0; j < record.reference_count; ++j) {
+            references.push_back(FromRecord(reference_records[record.first_reference + j]));
+        }
+        std::vector<Range> ranges;
+        ranges.reserve(record.range_count);
+        for (std::uint32_t j = 0; j < record.range_count; ++j) {
+            const RangeRecord& range = range_records[record.first_range + j];
+            ranges.push_back({FromRecord(range.first), FromRecord(range.last)});
+        }
+        ExternalReferences externals;
+        if (extension.externals.count != 0) {
+            const ExternalsRecord& refs = externals_records[i];
+            if (!in_table(refs.first_sheet_name, refs.sheet_name_count, extension.sheet_names) ||
+                !in_table(refs.first_cell, refs.cell_count, extension.external_cells) ||
+                !in_table(refs.first_range, refs.range_count, extension.external_ranges)) {
+                Fail("formula out of its tables");
+            }
+            for (std::uint32_t j = 0; j < refs.sheet_name_count; ++j) {
+                const NameRecord& name = name_records[refs.first_sheet_name + j];
+                if (name.size == 0 || !in_table(name.offset, name.size, header.strings)) {
+                    Fail("sheet name out of the strings");
+                }
+                externals.sheets.emplace_back(strings + name.offset, name.size);
+            }
+            for (std::uint32_t j = 0; j < refs.cell_count; ++j) {
+                const ExternalCellRecord& ref = external_cell_records[refs.first_cell + j];
+                if (ref.sheet >= refs.sheet_name_count) {
+                    Fail("unknown sheet");
+                }
+                externals.cells.push_back({ref.sheet, FromRecord(ref.cell)});
+            }
+            for (std::uint32_t j = 0; j < refs.range_count; ++j) {
+                const ExternalRangeRecord& ref = external_range_records[refs.first_range + j];
+                if (ref.sheet >= refs.sheet_name_count) {
+                    Fail("unknown sheet");
+                }
+                externals.ranges.push_back({ref.sheet, {FromRecord(ref.range.first), FromRecord(ref.range.last)}});
+            }
+        }
+        auto program = ReadProgram(instruction_records + record.first_instruction,
+                                   record.instruction_count, references.size(), ranges.size(), externals);
+        asts.push_back(std::make_shared<const FormulaAST>(std::move(program), std::move(references),
+                                                           std::move(ranges), std::move(externals)));
+    }
+
+    const auto* cell_records = file.GetTable<CellRecord>(header.cells);
+    std::optional<Position> previous;
+    std::vector<Position> printable;
+    std::vector<Position> formulas;
+    for (std::uint64_t i = 0; i < header.cells.count; ++i) {
+        const CellRecord& record = cell_records[i];
+        const Position pos{record.row, record.col};
+        if (!pos.IsValid() || (previous && !(*previous < pos))) {
+            Fail("cells out of order");
+        }
+        previous = pos;
+
+        switch (record.kind) {
+        case CellKind::Empty:
+            sheet_.Emplace(pos);
+            break;
+        case CellKind::Placeholder:
+            sheet_.Emplace(pos);
+            placeholders_.insert(pos);
+            break;
+        case CellKind::Text:
+        case CellKind::Number: {
+            if (record.text_size == 0 || !in_table(record.index, record.text_size, header.strings)) {
+                Fail("text out of the strings");
+            }
+            std::optional<double> number;
+            if (record.kind == CellKind::Number) {
+                number = record.number;
+            }
+            sheet_.Emplace(pos, *this, std::string(strings + record.index, record.text_size), number);
+            printable.push_back(pos);
+            break;
+        }
+        case CellKind::Formula: {
+            if (record.index >= asts.size()) {
+                Fail("unknown formula");
+            }
+            std::optional<FormulaInterface::Value> cache;
+            if (record.cache == CacheKind::Number) {
+                cache = record.number;
+            } else if (record.cache == CacheKind::Error) {
+                if (record.error > static_cast<std::uint8_t>(FormulaError::Category::Div0)) {
+                    Fail("unknown error");
+                }
+                cache = FormulaError(static_cast<FormulaError::Category>(record.error));
+            }
+            const auto& ast = asts[record.index];
+            // the offsets read are any int, so they are added without overflow
+            auto to_absolute = [pos](Position offset) {
+                const std::int64_t row = std::int64_t{offset.row} + pos.row;
+                const std::int64_t col = std::int64_t{offset.col} + pos.col;
+                if (row < 0 || row >= Position::MAX_ROWS || col < 0 || col >= Position::MAX_COLS) {
+                    return Position::NONE;
+                }
+                return Position{static_cast<int>(row), static_cast<int>(col)};
+            };
+            // references to deleted cells are kept as #REF!
+            for (const auto& offset : ast->GetCells()) {
+                if (!(offset == FormulaAST::DELETED_REFERENCE) && !to_absolute(offset).IsValid()) {
+                    Fail("reference out of the sheet");
+                }
+            }
+            for (const auto& offset : ast->GetRanges()) {
+                if (offset == FormulaAST::DELETED_RANGE) {
+                    continue;
+                }
+                const Range range{to_absolute(offset.first), to_absolute(offset.last)};
+                if (!range.IsValid()) {
+                    Fail("range out of the sheet");
+                }
+                range_dependencies_.Add(range, pos);
+            }
+            for (const auto& ref : ast->GetExternals().cells) {
+                if (!(ref.cell == FormulaAST::DELETED_REFERENCE) && !to_absolute(ref.cell).IsValid()) {
+                    Fail("reference out of the sheet");
+                }
+            }
+            for (const auto& ref : ast->GetExternals().ranges) {
+                if (!(ref.range == FormulaAST::DELETED_RANGE) &&
+                    !Range{to_absolute(ref.range.first), to_absolute(ref.range.last)}.IsValid()) {
+                    Fail("range out of the sheet");
+                }
+            }
+            if (!cache) {
+                // invalid cells are expected to be dirty, see InvalidateCache()
+                dirty_.insert(pos);
+            }
+            sheet_.Emplace(pos, *this, MakeFormula(ast, pos), std::move(cache));
+            printable.push_back(pos);
+            formulas.push_back(pos);
+            break;
+        }
+        default:
+            Fail("unknown cell kind");
+        }
+    }
+    area_.AddPositions(printable);
+
+    const auto* node_records = file.GetTable<NodeRecord>(header.nodes);
+    const auto* dependent_records = file.GetTable<PositionRecord>(header.dependents);
+    for (std::uint64_t i = 0; i < header.nodes.count; ++i) {
+        const NodeRecord& record = node_records[i];
+        if (!FromRecord(record.pos).IsValid() ||
+            !in_table(record.first_dependent, record.dependent_count, header.dependents)) {
+            Fail("node out of its tables");
+        }
+        if (record.order <= header.front_order || record.order >= header.back_order) {
+            Fail("node out of the order");
+        }
+        auto [node, inserted] = dependency_graph_.emplace(FromRecord(record.pos), Node(record.order));
+        if (!inserted) {
+            Fail("duplicate node");
+        }
+        for (std::uint64_t j = 0; j < record.dependent_count; ++j) {
+            const Position dependent = FromRecord(dependent_records[record.first_dependent + j]);
+            if (!dependent.IsValid()) {
+                Fail("dependent out of the sheet");
+            }
+            node->second.AddDependent(dependent);
+        }
+    }
+    front_order_ = header.front_order;
+    back_order_ = header.back_order;
+
+    // the graph is checked rather than trusted: its edges have to be the
+    // references of the formulas, and each formula has to come after its
+    // inputs in the order
+    std::size_t edges = 0;
+    for (const auto& [pos, node] : dependency_graph_) {
+        edges += node.GetDependent().size();
+    }
+    for (const Position pos : formulas) {
+        const Cell& cell = *sheet_.Find(pos);
+        auto references = cell.GetReferencedCells();
+        std::sort(references.begin(), references.end());
+        references.erase(std::unique(references.begin(), references.end()), references.end());
+        for (const Position p : references) {
+            auto input = dependency_graph_.find(p);
+            if (input == dependency_graph_.end() || input->second.GetDependent().count(pos) == 0) {
+                Fail("reference missing from the graph");
+            }
+        }
+        edges -= references.size();
+        if (references.empty() && cell.GetReferencedRanges().empty()) {
+            continue;
+        }
+        auto node = dependency_graph_.find(pos);
+        if (node == dependency_graph_.end() || node->second.GetOrder() <= GetLastInputOrder(cell)) {
+            Fail("formula ordered before its inputs");
+        }
+    }
+    if (edges != 0) {
+        Fail("dependent without a reference");
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdexcept>
+
+// Binary snapshot of a sheet, written by Sheet::SaveSnapshot() and opened
+// by Sheet::LoadSnapshot().
+//
+// The file is a header followed by flat tables, each aligned to 8 bytes:
+// * cells: the stored cells sorted by position, each with its text, number
+//   or formula and the computed value of the formula;
+// * formulas: one entry per distinct compiled program, that is per group of
+//   cells sharing an AST, pointing into the instruction, reference and
+//   range tables;
+// * externals: the references of each program to other sheets of a
+//   workbook, with the names of the sheets;
+// * strings: the texts of the text cells and the sheet names back to back;
+// * nodes and dependents: the dependency graph with the topological order.
+//
+// The file is mapped into memory and the tables are read in place, texts
+// are copied into the cells straight from the mapping. Loading parses no
+// formula, checks no cycles and computes nothing: the programs, the graph
+// and the computed values are taken as saved, so a load is a single pass
+// over the tables. Numbers are stored in the byte order of the machine,
+// and a file written on a machine with another order is rejected.
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
@@ -1,12 +1,13 @@
 #include <algorithm>
 #include <cassert>
-#include <cctype>
+#include <charconv>
+#include <cmath>
 #include <sstream>
+#include <tuple>
 
 #include "common.h"
 
 const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
 const int MAX_POS_LETTER_COUNT = 3;
 
 const Position Position::NONE = {-1, -1};
@@ -24,58 +25,128 @@ bool Position::IsValid() const {
 }
 
 std::string Position::ToString() const {
+    char buffer[MAX_STRING_LENGTH];
+    return std::string(buffer, ToChars(buffer));
+}
+
+char* Position::ToChars(char* out) const {
     if (!IsValid()) {
-        return "";
+        return out;
     }
-
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
+    char* const end = out + MAX_STRING_LENGTH;
+    // the columns with one letter come first, then the 26 * 26 with two
+    constexpr int TWO_LETTERS = LETTERS;
+    constexpr int THREE_LETTERS = LETTERS + LETTERS * LETTERS;
+    static_assert(MAX_COLS <= THREE_LETTERS + LETTERS * LETTERS * LETTERS, "a column takes at most three letters");
+    if (col < TWO_LETTERS) {
+        *out++ = static_cast<char>('A' + col);
+    } else if (col < THREE_LETTERS) {
+        const int c = col - TWO_LETTERS;
+        *out++ = static_cast<char>('A' + c / LETTERS);
+        *out++ = static_cast<char>('A' + c % LETTERS);
+    } else {
+        const int c = col - THREE_LETTERS;
+        *out++ = static_cast<char>('A' + c / (LETTERS * LETTERS));
+        *out++ = static_cast<char>('A' + c / LETTERS % LETTERS);
+        *out++ = static_cast<char>('A' + c % LETTERS);
     }
-
-    result += std::to_string(row + 1);
-
-    return result;
+    return std::to_chars(out, end, row + 1).ptr;
 }
 
+// A single pass over the text: up to three capital letters, then digits
+// only. Leading zeros are allowed, and the row stops growing once it is
+// past the sheet, so no text can overflow it.
 Position Position::FromString(std::string_view str) {
-    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
-    });
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
-
-    if (letters.empty() || digits.empty()) {
-        return Position::NONE;
+    const char* it = str.data();
+    const char* const end = it + str.size();
+    const char* const letters_end = it + std::min<std::size_t>(str.size(), MAX_POS_LETTER_COUNT);
+    int col = 0;
+    for (; it != letters_end && static_cast<unsigned>(*it - 'A') < static_cast<unsigned>(LETTERS); ++it) {
+        col = col * LETTERS + (*it - 'A' + 1);
     }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
+    if (it == str.data() || it == end) {
         return Position::NONE;
     }
-
-    if (!std::isdigit(digits[0])) {
-        return Position::NONE;
+    int row = 0;
+    for (; it != end; ++it) {
+        const unsigned digit = static_cast<unsigned>(*it - '0');
+        if (digit > 9) {
+            return Position::NONE;
+        }
+        row = std::min(row * 10 + static_cast<int>(digit), MAX_ROWS + 1);
     }
+    const Position pos{row - 1, col - 1};
+    return pos.IsValid() ? pos : Position::NONE;
+}
 
-    int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
-        return Position::NONE;
+bool Size::operator==(Size rhs) const {
+    return cols == rhs.cols && rows == rhs.rows;
+}
+
+bool Range::operator==(Range rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::operator<(Range rhs) const {
+    return std::tie(first.row, first.col, last.row, last.col) <
+           std::tie(rhs.first.row, rhs.first.col, rhs.last.row, rhs.last.col);
+}
+
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return first.row <= pos.row && pos.row <= last.row &&
+           first.col <= pos.col && pos.col <= last.col;
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return "";
     }
+    return first.ToString() + ':' + last.ToString();
+}
 
-    int col = 0;
-    for (char ch : letters) {
-        col *= LETTERS;
-        col += ch - 'A' + 1;
+Range Range::FromCorners(Position a, Position b) {
+    return {{std::min(a.row, b.row), std::min(a.col, b.col)},
+            {std::max(a.row, b.row), std::max(a.col, b.col)}};
+}
+
+std::optional<double> CellInterface::GetNumber() const {
+    const auto value = GetValue();
+    if (std::holds_alternative<double>(value)) {
+        const double result = std::get<double>(value);
+        return std::isfinite(result) ? std::optional(result) : std::nullopt;
+    }
+    if (std::holds_alternative<std::string>(value)) {
+        const auto& value_str = std::get<std::string>(value);
+        double result;
+        std::istringstream value_in{value_str};
+        if (!value_str.empty() && value_in >> result && value_in.eof()) {
+            return result;
+        }
     }
+    return std::nullopt;
+}
 
-    return {row - 1, col - 1};
+void SheetInterface::ForEachCell(
+    Range range, const std::function<void(Position, const CellInterface&)>& action) const {
+    // no non-empty cell lies outside of the printable area
+    const Size size = GetPrintableSize();
+    const int last_row = std::min(range.last.row, size.rows - 1);
+    const int last_col = std::min(range.last.col, size.cols - 1);
+    for (int row = range.first.row; row <= last_row; ++row) {
+        for (int col = range.first.col; col <= last_col; ++col) {
+            if (const CellInterface* cell = GetCell({row, col})) {
+                action({row, col}, *cell);
+            }
+        }
+    }
 }
 
-bool Size::operator==(Size rhs) const {
-    return cols == rhs.cols && rows == rhs.rows;
+const SheetInterface* SheetInterface::FindSheet(std::string_view) const {
+    return nullptr;
 }
 
 FormulaError::FormulaError(Category category) : category_(category) {}
@@ -0,0 +1,122 @@
+#include "thread_pool.h"
+
+#include <cassert>
+#include <utility>
+
+namespace {
+
+// the pool and the index of the worker running on the current thread
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local std::size_t current_worker = 0;
+
+}  // namespace
+
+ThreadPool::ThreadPool(std::size_t thread_count) {
+    assert(thread_count > 0);
+    workers_.reserve(thread_count);
+    for (std::size_t i = 0; i < thread_count; ++i) {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+    threads_.reserve(thread_count);
+    for (std::size_t i = 0; i < thread_count; ++i) {
+        threads_.emplace_back([this, i] { Run(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(sleep_mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void ThreadPool::Submit(Task task) {
+    const std::size_t index = current_pool == this
+                                  ? current_worker
+                                  : next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+    unfinished_.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard lock(workers_[index]->mutex);
+        workers_[index]->tasks.push_back(std::move(task));
+    }
+    queued_.fetch_add(1, std::memory_order_release);
+    {
+        // pairs with the predicate check in Run() so the wake-up is not lost
+        std::lock_guard lock(sleep_mutex_);
+    }
+    wake_.notify_one();
+}
+
+void ThreadPool::Wait() {
+    std::unique_lock lock(sleep_mutex_);
+    idle_.wait(lock, [this] {
+        return unfinished_.load(std::memory_order_acquire) == 0;
+    });
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+std::size_t ThreadPool::GetThreadCount() const {
+    return threads_.size();
+}
+
+void ThreadPool::Run(std::size_t index) {
+    current_pool = this;
+    current_worker = index;
+    Task task;
+    for (;;) {
+        if (TryPop(index, task)) {
+            try {
+                task();
+            } catch (...) {
+                // the other tasks still run, Wait() throws once they are done
+                std::lock_guard lock(sleep_mutex_);
+                if (!error_) {
+                    error_ = std::current_exception();
+                }
+            }
+            task = nullptr;
+            if (unfinished_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                std::lock_guard lock(sleep_mutex_);
+                idle_.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock lock(sleep_mutex_);
+        wake_.wait(lock, [this] {
+            return stop_ || queued_.load(std::memory_order_acquire) > 0;
+        });
+        if (stop_ && queued_.load(std::memory_order_acquire) == 0) {
+            return;
+        }
+    }
+}
+
+bool ThreadPool::TryPop(std::size_t index, Task& task) {
+    {
+        auto& own = *workers_[index];
+        std::lock_guard lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    for (std::size_t i = 1; i < workers_.size(); ++i) {
+        auto& victim = *workers_[(index + i) % workers_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool.
+//
+// Every worker owns a task deque. Tasks submitted from a worker go to the
+// back of its own deque and are taken from there again (LIFO keeps the data
+// the task was spawned from hot); idle workers steal from the front of the
+// other deques. Tasks submitted from outside are spread round-robin.
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(std::size_t thread_count);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+
+    void Submit(Task task);
+
+    // Blocks until every submitted task, including the ones submitted by
+    // other tasks meanwhile, is finished. Then rethrows the first exception
+    // a task has thrown since the last Wait(), if any.
+    void Wait();
+
+    std::size_t GetThreadCount() const;
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void Run(std::size_t index);
+    bool TryPop(std::size_t index, Task& task);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    std::exception_ptr error_;  // guarded by sleep_mutex_
+
+    std::atomic<std::size_t> queued_{0};      // tasks sitting in the deques
+    std::atomic<std::size_t> unfinished_{0};  // tasks submitted but not finished
+    std::atomic<std::size_t> next_worker_{0};
+    bool stop_ = false;
+};
@@ -0,0 +1,269 @@
+#include "tsv.h"
+
+#include "buffered_writer.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+using Batch = std::vector<std::pair<Position, std::string>>;
+
+// the characters a field cannot hold as they are, and their escapes
+constexpr std::string_view ESCAPED = "\t\n\r\\";
+constexpr std::string_view ESCAPES = "tnr\\";
+
+// the field with the escapes of WriteTsvField() undone
+std::string Unescape(std::string_view field) {
+    std::string text;
+    text.reserve(field.size());
+    for (auto backslash = field.find('\\'); backslash != std::string_view::npos; backslash = field.find('\\')) {
+        text.append(field.substr(0, backslash));
+        const auto escape = backslash + 1 < field.size() ? ESCAPES.find(field[backslash + 1])
+                                                         : std::string_view::npos;
+        if (escape == std::string_view::npos) {
+            text += '\\';
+            field.remove_prefix(backslash + 1);
+        } else {
+            text += ESCAPED[escape];
+            field.remove_prefix(backslash + 2);
+        }
+    }
+    text.append(field);
+    return text;
+}
+
+// Splits the input into fields in place: a chunk is read into the buffer
+// and its complete lines are cut with memchr, the unfinished last line is
+// moved to the front before the next chunk is read after it. The only
+// string made per field is the one handed to the sheet, which stays in its
+// small buffer for short texts.
+class TsvReader {
+public:
+    TsvReader(std::istream& input, Position origin, std::size_t chunk_size)
+        : input_(input)
+        , origin_(origin)
+        , buffer_(std::max<std::size_t>(chunk_size, 1)) {
+    }
+
+    // Appends the fields of the next lines to batch until it has at least
+    // max_cells of them. Returns false once the input is over and nothing
+    // was added.
+    bool Read(Batch& batch, std::size_t max_cells) {
+        const std::size_t initial_size = batch.size();
+        while (batch.size() - initial_size < max_cells) {
+            const char* begin = buffer_.data() + begin_;
+            const auto* newline = static_cast<const char*>(std::memchr(begin, '\n', end_ - begin_));
+            if (newline) {
+                ReadLine({begin, static_cast<std::size_t>(newline - begin)}, batch);
+                begin_ += newline - begin + 1;
+            } else if (!eof_) {
+                FillBuffer();
+            } else if (begin_ != end_) {
+                ReadLine({begin, end_ - begin_}, batch);
+                begin_ = end_;
+            } else {
+                break;
+            }
+        }
+        return batch.size() != initial_size;
+    }
+
+private:
+    void ReadLine(std::string_view line, Batch& batch) {
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        int col = 0;
+        while (true) {
+            const auto tab = line.find('\t');
+            const auto field = line.substr(0, tab);
+            if (!field.empty()) {
+                const Position pos{origin_.row + row_, origin_.col + col};
+                if (field.find('\\') == std::string_view::npos) {
+                    batch.emplace_back(pos, std::string(field));
+                } else {
+                    batch.emplace_back(pos, Unescape(field));
+                }
+            }
+            if (tab == std::string_view::npos) {
+                break;
+            }
+            line.remove_prefix(tab + 1);
+            ++col;
+        }
+        ++row_;
+    }
+
+    void FillBuffer() {
+        // a line longer than the buffer makes it grow
+        if (begin_ == 0 && end_ == buffer_.size()) {
+            buffer_.resize(buffer_.size() * 2);
+        }
+        std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+        input_.read(buffer_.data() + end_, buffer_.size() - end_);
+        end_ += static_cast<std::size_t>(input_.gcount());
+        if (input_.bad()) {
+            throw std::ios_base::failure("ImportTsv(): failed to read the input");
+        }
+        eof_ = !input_;
+    }
+
+    std::istream& input_;
+    const Position origin_;
+    int row_ = 0;
+    std::vector<char> buffer_;
+    std::size_t begin_ = 0;  // the part of the buffer not split yet
+    std::size_t end_ = 0;
+    bool eof_ = false;
+};
+
+// Passes batches from the reading thread to the inserting one. Holds a few
+// batches at most, so the reader stays only a little ahead of the sheet and
+// the input is never held in memory whole.
+class BatchQueue {
+public:
+    explicit BatchQueue(std::size_t capacity)
+        : capacity_(capacity) {
+    }
+
+    // Returns false if the consumer has stopped and the batch is dropped.
+    bool Push(Batch batch) {
+        std::unique_lock lock(mutex_);
+        not_full_.wait(lock, [this] {
+            return batches_.size() < capacity_ || cancelled_;
+        });
+        if (cancelled_) {
+            return false;
+        }
+        batches_.push_back(std::move(batch));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Returns false once the producer has finished and all is taken.
+    bool Pop(Batch& batch) {
+        std::unique_lock lock(mutex_);
+        not_empty_.wait(lock, [this] {
+            return !batches_.empty() || finished_;
+        });
+        if (batches_.empty()) {
+            return false;
+        }
+        batch = std::move(batches_.front());
+        batches_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void Finish(std::exception_ptr error) {
+        std::lock_guard lock(mutex_);
+        finished_ = true;
+        error_ = std::move(error);
+        not_empty_.notify_one();
+    }
+
+    void Cancel() {
+        std::lock_guard lock(mutex_);
+        cancelled_ = true;
+        batches_.clear();
+        not_full_.notify_one();
+    }
+
+    std::exception_ptr GetError() const {
+        std::lock_guard lock(mutex_);
+        return error_;
+    }
+
+private:
+    const std::size_t capacity_;
+    mutable std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<Batch> batches_;
+    bool finished_ = false;
+    bool cancelled_ = false;
+    std::exception_ptr error_;
+};
+
+constexpr std::size_t QUEUE_CAPACITY = 4;
+
+}  // namespace
+
+std::size_t ImportTsv(std::istream& input, Sheet& sheet, const TsvImportOptions& options) {
+    TsvReader reader(input, options.origin, options.chunk_size);
+    const std::size_t batch_size = std::max<std::size_t>(options.batch_size, 1);
+    std::size_t count = 0;
+
+    if (!options.pipelined) {
+        Batch batch;
+        while (reader.Read(batch, batch_size)) {
+            count += batch.size();
+            sheet.SetCells(std::move(batch));
+            batch.clear();
+        }
+        return count;
+    }
+
+    BatchQueue queue(QUEUE_CAPACITY);
+    std::thread reader_thread([&reader, &queue, batch_size] {
+        try {
+            Batch batch;
+            while (reader.Read(batch, batch_size) && queue.Push(std::move(batch))) {
+                batch = Batch();
+            }
+            queue.Finish(nullptr);
+        } catch (...) {
+            queue.Finish(std::current_exception());
+        }
+    });
+
+    try {
+        Batch batch;
+        while (queue.Pop(batch)) {
+            count += batch.size();
+            sheet.SetCells(std::move(batch));
+        }
+    } catch (...) {
+        queue.Cancel();
+        reader_thread.join();
+        throw;
+    }
+    reader_thread.join();
+    if (auto error = queue.GetError()) {
+        std::rethrow_exception(error);
+    }
+    return count;
+}
+
+void ExportTsv(const Sheet& sheet, std::ostream& output, TsvContent content) {
+    // both print the occupied cells in row order through a buffered writer
+    if (content == TsvContent::Values) {
+        sheet.PrintValues(output);
+    } else {
+        sheet.PrintEscapedTexts(output);
+    }
+}
+
+void WriteTsvField(BufferedWriter& writer, std::string_view text) {
+    for (auto special = text.find_first_of(ESCAPED); special != std::string_view::npos;
+         special = text.find_first_of(ESCAPED)) {
+        writer.Write(text.substr(0, special));
+        writer.Write('\\');
+        writer.Write(ESCAPES[ESCAPED.find(text[special])]);
+        text.remove_prefix(special + 1);
+    }
+    writer.Write(text);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <string_view>
+
+class BufferedWriter;
+class Sheet;
+
+// Bulk import and export of sheets as tab-separated text: one line per row,
+// one field per column, the fields holding the texts SetCell() takes. In a
+// field, \t, \n and \r stand for a tab, a newline and a carriage return
+// and \\ for a backslash; any other backslash is taken as it is.
+
+struct TsvImportOptions {
+    Position origin = {0, 0};            // where the first field of the first line goes
+    std::size_t batch_size = 1 << 16;    // cells passed to one SetCells() call
+    std::size_t chunk_size = 1 << 20;    // bytes read from the stream at a time
+    // split the input on a separate thread while the sheet takes the
+    // previous batches
+    bool pipelined = true;
+};
+
+// Reads the stream in chunks and sets its non-empty fields, unescaped, in
+// batches of SetCells(), so each batch is checked for cycles and
+// invalidated once. Empty fields leave their cells as they are; "\r\n" line
+// ends are accepted. Returns the number of cells set. If a batch throws,
+// the exception is passed on and the batches before it stay applied, and
+// so does a failure to read the stream.
+std::size_t ImportTsv(std::istream& input, Sheet& sheet, const TsvImportOptions& options = {});
+
+enum class TsvContent {
+    Values,
+    Texts,  // escaped, what ImportTsv() reads back into the same sheet
+};
+
+// Streams the printable area row by row without collecting it first. The
+// values are printed as PrintValues() does, unescaped.
+void ExportTsv(const Sheet& sheet, std::ostream& output, TsvContent content = TsvContent::Values);
+
+// Writes text as a field, with the tabs, newlines, carriage returns and
+// backslashes in it escaped.
+void WriteTsvField(BufferedWriter& writer, std::string_view text);
@@ -0,0 +1,391 @@
+#include "workbook.h"
+
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include "sheet.h"
+
+namespace {
+
+constexpr Range WHOLE_SHEET{{0, 0}, {Position::MAX_ROWS - 1, Position::MAX_COLS - 1}};
+
+}  // namespace
+
+Workbook::Workbook() = default;
+
+Workbook::~Workbook() {
+    // the background computations of a sheet may read the others
+    for (auto& [name, sheet] : sheets_) {
+        sheet->async_recalc_.reset();
+    }
+}
+
+Sheet& Workbook::AddSheet(std::string name) {
+    return Insert(std::move(name), std::make_unique<Sheet>());
+}
+
+Sheet& Workbook::LoadSheet(std::string name, const std::string& path) {
+    Sheet& sheet = Insert(std::move(name), Sheet::LoadSnapshot(path));
+    TrimMemory();
+    return sheet;
+}
+
+Sheet& Workbook::Insert(std::string name, std::unique_ptr<Sheet> sheet) {
+    if (name.empty()) {
+        throw std::invalid_argument("A sheet needs a name");
+    }
+    if (sheets_.count(name) != 0) {
+        throw std::invalid_argument("Sheet " + name + " already exists");
+    }
+    const auto pause = PauseAll();
+    sheet->AttachTo(*this, name); // Can throw CircularDependencyException
+    Sheet& added = *sheet;
+    sheets_.emplace(name, std::move(sheet));
+    // the references to it were #REF! so far
+    InvalidateDependents(name, WHOLE_SHEET);
+    return added;
+}
+
+void Workbook::RemoveSheet(std::string_view name) {
+    auto it = sheets_.find(name);
+    if (it == sheets_.end()) {
+        return;
+    }
+    // stopped before the pause, which would keep it from finishing its cell
+    it->second->async_recalc_.reset();
+    const auto pause = PauseAll();
+    it->second->Detach();
+    const std::string removed = it->first;
+    sheets_.erase(it);
+    InvalidateDependents(removed, WHOLE_SHEET);
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) {
+    auto it = sheets_.find(name);
+    return it != sheets_.end() ? it->second.get() : nullptr;
+}
+
+const Sheet* Workbook::GetSheet(std::string_view name) const {
+    return const_cast<Workbook*>(this)->GetSheet(name);
+}
+
+std::vector<std::string> Workbook::GetSheetNames() const {
+    std::vector<std::string> names;
+    names.reserve(sheets_.size());
+    for (const auto& [name, sheet] : sheets_) {
+        names.push_back(name);
+    }
+    return names;
+}
+
+// -- Recalculation --
+
+void Workbook::Recalculate() {
+    // the sheets each sheet refers to, directly or not; there are few sheets
+    std::unordered_map<Sheet*, std::vector<Sheet*>> dependents;
+    for (const auto& [target, sources] : links_) {
+        if (Sheet* referenced = GetSheet(target)) {
+            for (const auto& [source, links] : sources) {
+                dependents[referenced].push_back(sheets_.at(source).get());
+            }
+        }
+    }
+    std::unordered_map<Sheet*, std::set<Sheet*>> reached;
+    for (const auto& [name, sheet] : sheets_) {
+        auto& sheet_reached = reached[sheet.get()];
+        std::vector<Sheet*> stack{sheet.get()};
+        while (!stack.empty()) {
+            Sheet* current = stack.back();
+            stack.pop_back();
+            for (Sheet* dependent : dependents[current]) {
+                if (sheet_reached.insert(dependent).second) {
+                    stack.push_back(dependent);
+                }
+            }
+        }
+    }
+
+    // the sheets referring to each other make one group, computed cell by
+    // cell, see Sheet::RecalculateTogether()
+    std::vector<std::vector<Sheet*>> groups;
+    std::unordered_map<Sheet*, std::size_t> group_of;
+    for (const auto& [name, sheet] : sheets_) {
+        if (group_of.count(sheet.get()) != 0) {
+            continue;
+        }
+        group_of[sheet.get()] = groups.size();
+        std::vector<Sheet*> group{sheet.get()};
+        for (Sheet* other : reached[sheet.get()]) {
+            if (other != sheet.get() && reached[other].count(sheet.get()) != 0) {
+                group_of[other] = groups.size();
+                group.push_back(other);
+            }
+        }
+        groups.push_back(std::move(group));
+    }
+
+    // Kahn's algorithm over the groups: a group is computed once the groups
+    // it refers to are, and each level of ready groups takes one pass
+    std::vector<std::size_t> pending_inputs(groups.size(), 0);
+    std::vector<std::set<std::size_t>> group_dependents(groups.size());
+    for (const auto& [sheet, sheet_dependents] : dependents) {
+        for (Sheet* dependent : sheet_dependents) {
+            const std::size_t from = group_of.at(sheet);
+            const std::size_t to = group_of.at(dependent);
+            if (from != to && group_dependents[from].insert(to).second) {
+                ++pending_inputs[to];
+            }
+        }
+    }
+    std::vector<std::size_t> ready;
+    for (std::size_t group = 0; group < groups.size(); ++group) {
+        if (pending_inputs[group] == 0) {
+            ready.push_back(group);
+        }
+    }
+
+    auto compute = [&groups](std::size_t group) {
+        if (groups[group].size() == 1) {
+            groups[group].front()->Recalculate();
+        } else {
+            Sheet::RecalculateTogether(groups[group]);
+        }
+    };
+    while (!ready.empty()) {
+        if (ready.size() == 1) {
+            compute(ready.front());
+        } else {
+            ThreadPool& pool = GetThreadPool();
+            for (std::size_t group : ready) {
+                pool.Submit([&compute, group] { compute(group); });
+            }
+            pool.Wait();
+        }
+        std::vector<std::size_t> next;
+        for (std::size_t group : ready) {
+            for (std::size_t dependent : group_dependents[group]) {
+                if (--pending_inputs[dependent] == 0) {
+                    next.push_back(dependent);
+                }
+            }
+        }
+        ready = std::move(next);
+    }
+    TrimMemory();
+}
+
+void Workbook::SetRecalcThreads(std::size_t count) {
+    recalc_threads_ = count;
+    thread_pool_.reset();
+}
+
+void Workbook::SetMemoryBudget(std::size_t bytes) {
+    memory_budget_ = bytes;
+}
+
+std::size_t Workbook::GetMemoryBudget() const {
+    return memory_budget_;
+}
+
+SheetMemoryUsage Workbook::GetMemoryUsage() const {
+    SheetMemoryUsage usage;
+    for (const auto& [name, sheet] : sheets_) {
+        usage += sheet->GetMemoryUsage();
+    }
+    return usage;
+}
+
+// A clock-like second chance: a sheet read or changed since the previous
+// trim is hibernated only when the cold ones do not free enough.
+void Workbook::TrimMemory() {
+    if (memory_budget_ == 0) {
+        return;
+    }
+    struct Candidate {
+        bool accessed;
+        std::size_t bytes;
+        Sheet* sheet;
+    };
+    std::vector<Candidate> candidates;
+    std::size_t total = 0;
+    for (const auto& [name, sheet] : sheets_) {
+        const std::size_t bytes = sheet->GetMemoryUsage().GetTotal();
+        total += bytes;
+        const bool accessed = sheet->accessed_.exchange(false, std::memory_order_relaxed);
+        if (!sheet->IsHibernated()) {
+            candidates.push_back({accessed, bytes, sheet.get()});
+        }
+    }
+    if (total <= memory_budget_) {
+        return;
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate& lhs, const Candidate& rhs) {
+        return lhs.accessed != rhs.accessed ? !lhs.accessed : lhs.bytes > rhs.bytes;
+    });
+    for (const auto& candidate : candidates) {
+        if (total <= memory_budget_) {
+            break;
+        }
+        candidate.sheet->Hibernate();
+        total = total - candidate.bytes + candidate.sheet->GetMemoryUsage().GetTotal();
+    }
+}
+
+ThreadPool& Workbook::GetThreadPool() {
+    if (!thread_pool_) {
+        const std::size_t count = recalc_threads_ != 0
+                                      ? recalc_threads_
+                                      : std::max(1u, std::thread::hardware_concurrency());
+        thread_pool_ = std::make_unique<ThreadPool>(count);
+    }
+    return *thread_pool_;
+}
+
+// -- Links --
+
+void Workbook::AddLinks(const Sheet& sheet, Position pos, const std::vector<ExternalReference>& references) {
+    for (const auto& reference : references) {
+        auto& links = links_[reference.sheet][sheet.name_];
+        links.references.Add(reference.range, pos);
+        ++links.count;
+    }
+}
+
+void Workbook::RemoveLinks(const Sheet& sheet, Position pos, const std::vector<ExternalReference>& references) {
+    for (const auto& reference : references) {
+        auto target = links_.find(reference.sheet);
+        auto source = target->second.find(sheet.name_);
+        source->second.references.Remove(reference.range, pos);
+        if (--source->second.count == 0) {
+            target->second.erase(source);
+            if (target->second.empty()) {
+                links_.erase(target);
+            }
+        }
+    }
+}
+
+bool Workbook::HasDependents(std::string_view name) const {
+    return links_.count(name) != 0;
+}
+
+bool Workbook::RefersToOtherSheets(std::string_view name) const {
+    for (const auto& [target, sources] : links_) {
+        if (sources.count(name) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The formulas invalidated pass the change on through here again, which
+// for sheets referring to each other would recurse as deep as the chain of
+// formulas between them: the nested calls queue their cells instead.
+void Workbook::InvalidateDependents(std::string_view name, const std::vector<Position>& positions) {
+    if (!HasDependents(name)) {
+        return;
+    }
+    pending_invalidations_.emplace_back(std::string(name), positions);
+    if (invalidating_) {
+        return;
+    }
+    invalidating_ = true;
+    try {
+        while (!pending_invalidations_.empty()) {
+            const auto [sheet, cells] = std::move(pending_invalidations_.back());
+            pending_invalidations_.pop_back();
+            auto target = links_.find(sheet);
+            if (target == links_.end()) {
+                continue;
+            }
+            for (const auto& [source, links] : target->second) {
+                std::vector<Position> formulas;
+                for (const auto& pos : cells) {
+                    links.references.ForEachContaining(pos, [&formulas](Position p) {
+                        formulas.push_back(p);
+                    });
+                }
+                if (!formulas.empty()) {
+                    sheets_.at(source)->InvalidateFormulas(formulas);
+                }
+            }
+        }
+    } catch (...) {
+        pending_invalidations_.clear();
+        invalidating_ = false;
+        throw;
+    }
+    invalidating_ = false;
+}
+
+void Workbook::InvalidateDependents(std::string_view name, Range area) {
+    for (const auto& [sheet, formulas] : GetDependentFormulas(name, area)) {
+        sheet->InvalidateFormulas(formulas);
+    }
+}
+
+std::vector<std::pair<Sheet*, std::vector<Position>>> Workbook::GetDependentFormulas(std::string_view name,
+                                                                                     Range area) {
+    std::vector<std::pair<Sheet*, std::vector<Position>>> result;
+    auto target = links_.find(name);
+    if (target == links_.end()) {
+        return result;
+    }
+    for (const auto& [source, links] : target->second) {
+        std::vector<Position> formulas;
+        links.references.ForEachIntersecting(area, [&formulas](Position p) {
+            formulas.push_back(p);
+        });
+        if (!formulas.empty()) {
+            result.emplace_back(sheets_.at(source).get(), std::move(formulas));
+        }
+    }
+    return result;
+}
+
+std::vector<Sheet*> Workbook::GetDependentSheets(std::string_view name) {
+    std::vector<Sheet*> result;
+    std::set<std::string_view> visited{name};
+    std::vector<std::string_view> stack{name};
+    while (!stack.empty()) {
+        auto target = links_.find(stack.back());
+        stack.pop_back();
+        if (target == links_.end()) {
+            continue;
+        }
+        for (const auto& [source, links] : target->second) {
+            if (visited.insert(source).second) {
+                stack.push_back(source);
+                result.push_back(sheets_.at(source).get());
+            }
+        }
+    }
+    return result;
+}
+
+std::vector<std::unique_lock<std::mutex>> Workbook::PauseDependents(std::string_view name) {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    if (!HasDependents(name)) {
+        return locks;
+    }
+    for (Sheet* sheet : GetDependentSheets(name)) {
+        if (auto lock = sheet->PauseOwnAsyncRecalc()) {
+            locks.push_back(std::move(lock));
+        }
+    }
+    return locks;
+}
+
+std::vector<std::unique_lock<std::mutex>> Workbook::PauseAll() {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (auto& [name, sheet] : sheets_) {
+        if (auto lock = sheet->PauseOwnAsyncRecalc()) {
+            locks.push_back(std::move(lock));
+        }
+    }
+    return locks;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "formula.h"
+#include "memory_usage.h"
+#include "range_index.h"
+#include "thread_pool.h"
+
+class Sheet;
+
+// Named sheets whose formulas refer to each other's cells, as in Sheet1!A1
+// or 'Other sheet'!A1:B2.
+//
+// Every sheet keeps its own dependency graph, and the workbook links the
+// formulas to the cells of the other sheets they refer to: a change of a
+// cell invalidates the formulas of other sheets over it as it does the
+// ones of its own sheet. The formulas must not form a cycle, which is
+// looked for cell by cell across the sheets: sheets may refer to each
+// other, and such sheets are then computed together, every formula after
+// its inputs. A reference naming the formula's own sheet, as in Sheet1!A1
+// in Sheet1, is an ordinary one and prints without the name.
+//
+// A change computes right away, in RecalcMode::Eager, only the formulas of
+// its own sheet: the formulas of other sheets it invalidates wait for
+// Recalculate() or for their first read.
+//
+// References go by name: a reference to a sheet which is not in the
+// workbook is #REF! until a sheet of that name is added. Sheets are added,
+// loaded from snapshots and removed one at a time, without touching the
+// cells of the others beyond the formulas referring to them.
+//
+// Under a memory budget, the workbook hibernates the sheets going unused
+// (see Sheet::Hibernate()), which load back on their next access.
+class Workbook {
+public:
+    Workbook();
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+    ~Workbook();
+
+    // Adds an empty sheet. Throws std::invalid_argument if the name is
+    // empty or taken.
+    Sheet& AddSheet(std::string name);
+    // Adds the sheet saved to a snapshot by Sheet::SaveSnapshot(). Besides
+    // the errors of AddSheet() and Sheet::LoadSnapshot(), throws
+    // CircularDependencyException if its formulas would close a cycle of
+    // formulas, leaving the workbook unchanged.
+    Sheet& LoadSheet(std::string name, const std::string& path);
+    // Does nothing if there is no such sheet.
+    void RemoveSheet(std::string_view name);
+
+    // nullptr if there is no such sheet
+    Sheet* GetSheet(std::string_view name);
+    const Sheet* GetSheet(std::string_view name) const;
+    // sorted
+    std::vector<std::string> GetSheetNames() const;
+
+    // Computes every formula of every sheet not computed yet. A sheet goes
+    // after the sheets it refers to, the sheets referring to each other
+    // together, and the sheets ready at the same time are computed in
+    // parallel.
+    void Recalculate();
+    // Number of threads computing sheets at once, all cores by default.
+    void SetRecalcThreads(std::size_t count);
+
+    // The bytes the sheets may hold, 0 for no limit, which is the default.
+    // Enforced by TrimMemory(), so the sheets may exceed it in between.
+    void SetMemoryBudget(std::size_t bytes);
+    std::size_t GetMemoryBudget() const;
+    // the sum over the sheets
+    SheetMemoryUsage GetMemoryUsage() const;
+    // Hibernates sheets until their memory is within the budget: first the
+    // ones not accessed since the previous call, then the others, the
+    // largest first in both groups. LoadSheet() and Recalculate() call it.
+    // Measuring the sheets walks their cells, see Sheet::GetMemoryUsage().
+    void TrimMemory();
+
+private:
+    friend class Sheet;
+
+    // the formulas of one sheet referring to the cells of another, a
+    // referenced cell being kept as a one-cell range
+    struct Links {
+        RangeIndex references;
+        std::size_t count = 0;
+    };
+    // by the name of the referring sheet
+    using SheetLinks = std::map<std::string, Links, std::less<>>;
+
+    Sheet& Insert(std::string name, std::unique_ptr<Sheet> sheet);
+
+    // called by the sheets for their formulas
+    void AddLinks(const Sheet& sheet, Position pos, const std::vector<ExternalReference>& references);
+    void RemoveLinks(const Sheet& sheet, Position pos, const std::vector<ExternalReference>& references);
+    bool HasDependents(std::string_view name) const;
+    bool RefersToOtherSheets(std::string_view name) const;
+    // invalidates the formulas of other sheets over the cells of the sheet
+    void InvalidateDependents(std::string_view name, const std::vector<Position>& positions);
+    void InvalidateDependents(std::string_view name, Range area);
+    // the formulas of each other sheet over the cells of the sheet name in
+    // area, possibly repeated
+    std::vector<std::pair<Sheet*, std::vector<Position>>> GetDependentFormulas(std::string_view name, Range area);
+    // the sheets with formulas depending on the sheet name, directly or not
+    std::vector<Sheet*> GetDependentSheets(std::string_view name);
+    // keeps the background computations of the sheets depending on the
+    // sheet name away from their cells while they live
+    std::vector<std::unique_lock<std::mutex>> PauseDependents(std::string_view name);
+    // the same for every sheet, as sheets come and go
+    std::vector<std::unique_lock<std::mutex>> PauseAll();
+    ThreadPool& GetThreadPool();
+
+    std::map<std::string, std::unique_ptr<Sheet>, std::less<>> sheets_;
+    // by the name of the referenced sheet, which may not be in the workbook
+    std::map<std::string, SheetLinks, std::less<>> links_;
+    std::size_t recalc_threads_ = 0;
+    std::unique_ptr<ThreadPool> thread_pool_;
+    std::size_t memory_budget_ = 0;
+    // the cells of the sheets whose dependents are left to invalidate, see
+    // InvalidateDependents()
+    std::vector<std::pair<std::string, std::vector<Position>>> pending_invalidations_;
+    bool invalidating_ = false;
+};